@@ -38,6 +38,7 @@
 #include <algorithm>
 #include "MeshTransport.h"
 #include "VertexFilter.h"
+#include "WorkerPool.h"
 
 #define SUBSAMPS 7
 
@@ -52,10 +53,10 @@ CyberScan::get_current_kdtree()
     return kdtree[iTree];
 
   regLevelData* level = getCurrentRegLevel();
-// STL Update
-  kdtree[iTree] = CreateKDindtree(level->pnts->begin(),
-				  level->nrms->begin(),
-				  level->pnts->size());
+  kdtree[iTree] = CreateKDindtree(&(*level->pnts)[0],
+				  &(*level->nrms)[0],
+				  level->pnts->size(),
+				  get_name().c_str(), iTree, !bDirty);
 
   return kdtree[iTree];
 }
@@ -375,6 +376,116 @@ CyberScan::closest_point(const Pnt3 &p, const Pnt3 &n,
 }
 
 
+void
+CyberScan::closest_points(const Pnt3 *p, const Pnt3 *n, int count,
+			  Pnt3 *cp, Pnt3 *cn, bool *found,
+			  float thr, bool bdry_ok, float eps)
+{
+  KDindtree* tree = get_current_kdtree();
+  if (!tree) {
+    fill(found, found+count, false);
+    return;
+  }
+
+  regLevelData* level = getCurrentRegLevel();
+  const Pnt3  *pnts = &(*level->pnts)[0];
+  const short *nrms = &(*level->nrms)[0];
+  const char  *bdry = bdry_ok ? NULL : &(*level->bdry)[0];
+
+  WorkerPool::global().parallel_for(count, 256, [&](int b, int e) {
+    for (int i = b; i < e; i++) {
+      int   ind;
+      float d = thr;
+      found[i] = tree->search(pnts, nrms, p[i], n[i], ind, d, eps);
+      if (!found[i]) continue;
+      if (bdry && bdry[ind]) {
+	// disallow closest points that are on the mesh boundary
+	found[i] = false;
+	continue;
+      }
+      cp[i] = pnts[ind];
+      const short *sp = &nrms[ind*3];
+      cn[i].set(sp[0]/32767.0,
+		sp[1]/32767.0,
+		sp[2]/32767.0);
+    }
+  });
+}
+
+
+// Back project the queries into each sweep's frames with the
+// scanner model, and look at the data within window samples
+// (of the current resolution) of where they land.
+bool
+CyberScan::projective_points(const Pnt3 *p, const Pnt3 *n, int count,
+			     Pnt3 *cp, Pnt3 *cn, bool *found,
+			     float thr, bool bdry_ok, int window)
+{
+  int iRes = current_resolution_index();
+  regLevelData* level = getCurrentRegLevel();
+  fill(found, found+count, false);
+  if (!level->pnts->size())
+    return true;
+
+  const Pnt3  *pnts = &(*level->pnts)[0];
+  const short *nrms = &(*level->nrms)[0];
+  const char  *bdry = bdry_ok ? NULL : &(*level->bdry)[0];
+
+  // samples of level iRes are on every step/2:th frame and
+  // every step:th column
+  int step  = 1 << iRes;
+  int rstep = max(1, step/2);
+  int cstep = iRes ? step : 1;
+  float thr2 = thr * thr;
+
+  vector<float> d2(count, thr2);
+  int offset = 0;
+  for (int is = 0; is < sweeps.size(); is++) {
+    CyberSweep *sw = sweeps[is];
+    const vector<int> &toLevel = sw->unsampled_to_sampled(iRes);
+    Xform<float> xfi = sw->getXform(); xfi.fast_invert();
+
+    WorkerPool::global().parallel_for(count, 256, [&](int b, int e) {
+      for (int i = b; i < e; i++) {
+	Pnt3 sp, bp;
+	xfi.apply(p[i], sp);
+	if (!sw->sd.xf.back_project(sp, bp))
+	  continue;
+	int row, col;
+	sw->sd.find_cell(bp[0], bp[1], row, col);
+	row = int(floor(float(row) / rstep + .5)) * rstep;
+	col = int(floor(float(col) / cstep + .5)) * cstep;
+
+	for (int r = row - window*rstep; r <= row + window*rstep; r += rstep) {
+	  for (int c = col - window*cstep; c <= col + window*cstep; c += cstep) {
+	    int raw = sw->sd.data_index(r, c);
+	    if (raw < 0) continue;
+	    int k = toLevel[raw];
+	    if (k < 0) continue;
+	    k += offset;
+	    float l = dist2(pnts[k], p[i]);
+	    if (l >= d2[i]) continue;
+	    const short *sn = &nrms[3*k];
+	    if (n[i][0]*sn[0] + n[i][1]*sn[1] + n[i][2]*sn[2]
+		<= NRM_45_DEG) continue;
+	    d2[i] = l;
+	    // disallow closest points that are on the mesh boundary
+	    found[i] = !(bdry && bdry[k]);
+	    cp[i] = pnts[k];
+	    cn[i].set(sn[0]/32767.0,
+		      sn[1]/32767.0,
+		      sn[2]/32767.0);
+	  }
+	}
+      }
+    });
+
+    offset += sw->levels[iRes]->pnts.size();
+  }
+  return true;
+}
+
+
 void
 CyberScan::computeBBox ()
 {
@@ -1334,6 +1445,25 @@ CyberSweep::filtered_copy(const VertexFilter &filter)
 }
 
 
+const vector<int>&
+CyberSweep::unsampled_to_sampled (int iRes)
+{
+  levelData* level = levels[iRes];
+  if (level->map_unsampled_to_sampled.size())
+    return level->map_unsampled_to_sampled;
+
+  // level 0 uses all the valid data
+  sd.valid_point_index(level->map_unsampled_to_sampled);
+  if (iRes) {
+    vector<int> &map = level->map_unsampled_to_sampled;
+    fill(map.begin(), map.end(), -1);
+    for (int i = 0; i < level->map_sampled_to_unsampled.size(); i++)
+      map[level->map_sampled_to_unsampled[i]] = i;
+  }
+  return level->map_unsampled_to_sampled;
+}
+
+
 bool
 CyberSweep::closest_point(const Pnt3 &p, const Pnt3 &n,
 			  Pnt3 &cp, Pnt3 &cn,
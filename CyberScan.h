@@ -113,6 +113,14 @@ public:
   bool closest_point(const Pnt3 &p, const Pnt3 &n,
 		     Pnt3 &cp, Pnt3 &cn,
 		     float thr = 1e33, bool bdry_ok = 0);
+  void closest_points(const Pnt3 *p, const Pnt3 *n, int count,
+		      Pnt3 *cp, Pnt3 *cn, bool *found,
+		      float thr = 1e33, bool bdry_ok = 0,
+		      float eps = 0);
+  bool projective_points(const Pnt3 *p, const Pnt3 *n, int count,
+			 Pnt3 *cp, Pnt3 *cn, bool *found,
+			 float thr = 1e33, bool bdry_ok = 0,
+			 int window = 2);
 
   void computeBBox();
   void flipNormals();
@@ -169,6 +177,10 @@ struct levelData {
   // data to the unsampled (raw) data
   // for level 0 this vector is empty (the mapping is identity)
   vector<int>    map_sampled_to_unsampled;
+
+  // and the other way (-1 for data that isn't used), built
+  // when needed for the projective search
+  vector<int>    map_unsampled_to_sampled;
 };
 
 
@@ -216,6 +228,9 @@ private:
   vector<KDindtree*> kdtree;
   KDindtree*         get_current_kdtree (void);
 
+  // for the projective search
+  const vector<int>& unsampled_to_sampled (int iRes);
+
 public:
   void subsample_points(float rate, vector<Pnt3> &p,
 			vector<Pnt3> &n);
@@ -413,9 +413,6 @@ CyberXform::axis_project(short y, short z)
 }
 
 
-static double axis_proj_pos;
-static double scan_angle;
-
 // return the scr,y,z raw coordinates that would have
 // exactly scanned p_in
 // return false if the point is not within the viewing frustum
@@ -423,7 +420,7 @@ static double scan_angle;
 //  but not on the side)
 bool
 CyberXform::back_project(const Pnt3 &p_in, Pnt3 &p_out,
-			 bool check_frustum)
+			 bool check_frustum, double *angle) const
 {
   // the sequence of events:
   // * remove the transformation from horizontal translation
@@ -447,9 +444,9 @@ CyberXform::back_project(const Pnt3 &p_in, Pnt3 &p_out,
   scanaxis_to_horz.apply_inv(p_in, p);
 
   // * project the point p onto the scan axis (call that pa)
-  axis_proj_pos = ((p[0]-ax0[0])*axdir[0] +
-		   (p[1]-ax0[1])*axdir[1] +
-		   (p[2]-ax0[2])*axdir[2]);
+  double axis_proj_pos = ((p[0]-ax0[0])*axdir[0] +
+			  (p[1]-ax0[1])*axdir[1] +
+			  (p[2]-ax0[2])*axdir[2]);
   // within frustum?
   if (check_frustum &&
       (axis_proj_pos < axislimit_min ||
@@ -499,12 +496,13 @@ CyberXform::back_project(const Pnt3 &p_in, Pnt3 &p_out,
   p[2] =(toYZ[2]*rp[0]+toYZ[6]*rp[1]+toYZ[10]*rp[2]+toYZ[14])*tmp;
 
   // get the screw
-  scan_angle = acos((alpha * (r[0]*q[0]+r[1]*q[1]+r[2]*q[2]) +
-		     beta *  (r[0]*s[0]+r[1]*s[1]+r[2]*s[2]))/r2);
+  double scan_angle = acos((alpha * (r[0]*q[0]+r[1]*q[1]+r[2]*q[2]) +
+			    beta *  (r[0]*s[0]+r[1]*s[1]+r[2]*s[2]))/r2);
   // try to deal with slightly negative angles
   if (scan_angle > .75 * M_PI) scan_angle -= M_PI;
 
   p[0] = ANGLE_TO_SCREW(scan_angle);
+  if (angle) *angle = scan_angle;
   return true;
 }
 
@@ -527,9 +525,9 @@ CyberXform::sphere_status(const Pnt3 &ctr, float radius,
   Pnt3 p;
   scanaxis_to_horz.apply_inv(ctr, p);
 
-  axis_proj_pos = ((p[0]-ax0[0])*axdir[0] +
-		   (p[1]-ax0[1])*axdir[1] +
-		   (p[2]-ax0[2])*axdir[2]);
+  double axis_proj_pos = ((p[0]-ax0[0])*axdir[0] +
+			  (p[1]-ax0[1])*axdir[1] +
+			  (p[2]-ax0[2])*axdir[2]);
 
   // check whether in viewing frustum
   if (axis_proj_pos < ax_min - radius ||
@@ -566,7 +564,8 @@ CyberXform::sphere_status(const Pnt3 &ctr, float radius,
   }
 
   Pnt3 bp;
-  back_project(ctr, bp, false);
+  double scan_angle;
+  back_project(ctr, bp, false, &scan_angle);
   // how much can we rotate laser plane and still hit sphere?
   // BUGBUG: not accurate at all...
 
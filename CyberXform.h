@@ -91,8 +91,12 @@ public:
 
   float axis_project(short y, short z);
 
+  // returns the screw, y, z raw coordinates in p_out (and the
+  // scan angle if asked); doesn't change the object, so can be
+  // called from several threads at once
   bool back_project(const Pnt3 &p_in, Pnt3 &p_out,
-		    bool  check_frustum = true);
+		    bool  check_frustum = true,
+		    double *angle = NULL) const;
 
   int  sphere_status(const Pnt3 &ctr, float r,
 		     float &screw,
@@ -25,6 +25,8 @@
 #include "plvScene.h"
 #include "MeshTransport.h"
 #include "VertexFilter.h"
+#include "WorkerPool.h"
+#include "Random.h"
 
 #ifdef WIN32
 #  define random rand
@@ -35,6 +37,9 @@
 #define DEFAULT_CYRA_TESS_DEPTH 80;
 float CyraTessDepth = DEFAULT_CYRA_TESS_DEPTH;
 
+// Neighbours used for the normals of isolated vertices
+#define CYRA_NORMAL_NBORS 8
+
 // Default to filtering on...
 #define DEFAULT_CYRA_FILTER_SPIKES TRUE;
 bool CyraFilterSpikes = DEFAULT_CYRA_FILTER_SPIKES;
@@ -133,8 +138,11 @@ CyraResLevel::CyraResLevel(void) {
   isDirty_cache = true;
   cachedPoints.clear();
   cachedNorms.clear();
-  cachedBoundary.clear();
+  cachedVert.clear();
   kdtree = NULL;
+  kdCacheRes = 0;
+  projDirty = true;
+  projSlack = 0;
 
 }
 
@@ -313,12 +321,9 @@ CyraResLevel::colorMesh(vector<uchar>   &colors,
 
   case RigidScan::colorBoundary:
     {
-      create_kdtree();  // BUGBUG, this is a little heavyhanded approach
-      colors.reserve (colorsize * cachedBoundary.size());
-// STL Update
-      vector<bool>::iterator end = cachedBoundary.end();
-      for (vector<bool>::iterator c = cachedBoundary.begin(); c < end; c++)
-	pushConf (colors, colorsize, (uchar)(*c ? 0 : 255));
+      colors.reserve (colorsize * num_vertices());
+      FOR_EACH_VERT(pushConf(colors, colorsize,
+			     (uchar)(is_boundary(vx, vy) ? 0 : 255)));
     }
     break;
 
@@ -918,6 +923,42 @@ CyraResLevel::CalcNormals(void)
       }
     }
   }
+
+  // Vertices with no triangles around them got no normal
+  // above; fit a plane to their nearest neighbours in space
+  // (no farther than the tesselation would reach) instead.
+  vector<int>  lonely;
+  vector<Pnt3> pts;
+  pts.reserve(points.size());
+  for (int i = 0; i < points.size(); i++) {
+    const CyraSample &s = points[i];
+    if (s.confidence <= 0) continue;
+    if (!s.nrm[0] && !s.nrm[1] && !s.nrm[2]) lonely.push_back(i);
+    pts.push_back(s.vtx);
+  }
+  if (lonely.size() == 0 || pts.size() < 3) return;
+
+  const int K = CYRA_NORMAL_NBORS;
+  int nq = lonely.size();
+  vector<Pnt3> q(nq);
+  for (int i = 0; i < nq; i++) q[i] = points[lonely[i]].vtx;
+  vector<int> nbors(nq * K), nFound(nq);
+  KDindtree *tree = CreateKDindtree (&pts[0], NULL, pts.size());
+  tree->knn_search(&q[0], nq, K, &nbors[0], &nFound[0], NULL,
+		   CyraTessDepth);
+  delete tree;
+
+  for (int i = 0; i < nq; i++) {
+    if (!fit_plane_normal(&pts[0], &nbors[i*K], nFound[i], norm))
+      continue;
+    // face the scanner
+    if (dot(norm, origin - q[i]) < 0) norm *= -1;
+    norm *= 32767;
+    CyraSample &s = points[lonely[i]];
+    s.nrm[0] = norm[0];
+    s.nrm[1] = norm[1];
+    s.nrm[2] = norm[2];
+  }
 }
 
 
@@ -1171,8 +1212,35 @@ CyraResLevel::filter_inplace(const VertexFilter& filter)
   zero.confidence = 0;
   zero.intensity  = 0;
 
+  // The live cached points are the valid vertices in
+  // FOR_EACH_VERT order; if they (and the kdtree) are current,
+  // collect the ones clipped away, so they can be kept
+  // instead of rebuilt
+  bool keepCache = (kdtree != NULL && !isDirty_cache);
+  vector<int> removed;
+  int slot = 0;
+
   // Filter the vertices
-  FOR_EACH_VERT(*v = (filter.accept(v->vtx) && ++numpoints)? *v : zero);
+  int nVerts = width * height;
+  for (int vindex = 0; vindex < nVerts; vindex++) {
+    CyraSample *v = &points[vindex];
+    if (v->confidence <= 0) continue;
+    if (keepCache) {
+      // skip the points clipped earlier
+      while (cachedVert[slot] < 0) slot++;
+      assert(cachedVert[slot] == vindex);
+    }
+    if (filter.accept(v->vtx)) {
+      numpoints++;
+    } else {
+      *v = zero;
+      if (keepCache) {
+	removed.push_back(slot);
+	cachedVert[slot] = -1;
+      }
+    }
+    if (keepCache) slot++;
+  }
 
   // Copy the triangles
   for (int xx=0; xx < width-1; xx++) {
@@ -1224,7 +1292,35 @@ CyraResLevel::filter_inplace(const VertexFilter& filter)
     }
   }
 
-  isDirty_cache = true;
+  if (keepCache && numpoints > 0) {
+    // the kdtree just marks the removed points dead, they stay
+    // in the cached arrays until a quarter of them is dead
+    if (removed.size())
+      kdtree->remove(&cachedPoints[0], &removed[0], removed.size());
+    if (kdtree->wants_compact()) {
+      vector<int> newIndex(cachedVert.size());
+      int k = 0;
+      for (int i = 0; i < cachedVert.size(); i++) {
+	if (cachedVert[i] < 0) {
+	  newIndex[i] = -1;
+	  continue;
+	}
+	newIndex[i] = k;
+	cachedPoints[k] = cachedPoints[i];
+	cachedVert[k] = cachedVert[i];
+	for (int j = 0; j < 3; j++)
+	  cachedNorms[3*k+j] = cachedNorms[3*i+j];
+	k++;
+      }
+      cachedPoints.resize(k);
+      cachedNorms.resize(3*k);
+      cachedVert.resize(k);
+      kdtree->renumber(&newIndex[0]);
+    }
+  } else {
+    isDirty_cache = true;
+  }
+  projDirty = true;
   return true;
 }
 
@@ -1239,36 +1335,45 @@ CyraResLevel::create_kdtree(void)
   if (kdtree) delete kdtree;
   cachedPoints.clear();
   cachedNorms.clear();
-  cachedBoundary.clear();
+  cachedVert.clear();
 
-  // re-assemble cachedPoints, norms, boundary
+  // re-assemble cachedPoints, norms, vertex indices
   cachedPoints.reserve(num_vertices());
   cachedNorms.reserve(num_vertices() * 3);
-  cachedBoundary.reserve(num_vertices());
+  cachedVert.reserve(num_vertices());
   FOR_EACH_VERT(cachedPoints.push_back(v->vtx));
   FOR_EACH_VERT(cachedNorms.insert (cachedNorms.end(), v->nrm, v->nrm + 3));
-  FOR_EACH_VERT(cachedBoundary.push_back
-		((bool) (vx == 0 || vx == width-1 ||
-			 vy == 0 || vy == height-1 ||
-			 (tri(vx-1,vy-1) != TESS14 &&
-			  tri(vx-1,vy-1) != TESS23 &&
-			  tri(vx-1,vy-1) != TESS4) ||
-			 (tri(vx-1,vy) != TESS14 &&
-			  tri(vx-1,vy) != TESS23 &&
-			  tri(vx-1,vy) != TESS3) ||
-			 (tri(vx,vy-1) != TESS14 &&
-			  tri(vx,vy-1) != TESS23 &&
-			  tri(vx,vy-1) != TESS2) ||
-			 (tri(vx,vy) != TESS14 &&
-			  tri(vx,vy) != TESS23 &&
-			  tri(vx,vy) != TESS1))));
-
-  kdtree = CreateKDindtree (cachedPoints.begin(), cachedNorms.begin(),
-			    cachedPoints.size());
+  FOR_EACH_VERT(cachedVert.push_back(vindex));
+
+  kdtree = CreateKDindtree (&cachedPoints[0], &cachedNorms[0],
+			    cachedPoints.size(),
+			    kdCacheFile.empty() ? NULL : kdCacheFile.c_str(),
+			    kdCacheRes);
 
   isDirty_cache = false;
 }
 
+// a vertex is on the boundary unless all four squares around
+// it have a triangle that uses it
+bool
+CyraResLevel::is_boundary(int vx, int vy) const
+{
+  return (vx == 0 || vx == width-1 ||
+	  vy == 0 || vy == height-1 ||
+	  (tri(vx-1,vy-1) != TESS14 &&
+	   tri(vx-1,vy-1) != TESS23 &&
+	   tri(vx-1,vy-1) != TESS4) ||
+	  (tri(vx-1,vy) != TESS14 &&
+	   tri(vx-1,vy) != TESS23 &&
+	   tri(vx-1,vy) != TESS3) ||
+	  (tri(vx,vy-1) != TESS14 &&
+	   tri(vx,vy-1) != TESS23 &&
+	   tri(vx,vy-1) != TESS2) ||
+	  (tri(vx,vy) != TESS14 &&
+	   tri(vx,vy) != TESS23 &&
+	   tri(vx,vy) != TESS1));
+}
+
 // for ICP...
 void
 CyraResLevel::subsample_points(float rate, vector<Pnt3> &p, vector<Pnt3> &n)
@@ -1283,8 +1388,9 @@ CyraResLevel::subsample_points(float rate, vector<Pnt3> &p, vector<Pnt3> &n)
 
   int num = totalNum;
   int end = nv;
+  RandomStream &rnd = RandomStream::current();
   for (int i = 0; i < end; i++) {
-    if (random()%nv < num) {
+    if (rnd(nv) < num) {
       p.push_back(points[i].vtx);    // save point
       pushNormalAsPnt3 (n, points[i].nrm, 0);
       num--;
@@ -1309,7 +1415,7 @@ CyraResLevel::closest_point(const Pnt3 &p, const Pnt3 &n,
   if (ans) {
     if (!bdry_ok) {
       // disallow closest points that are on the mesh boundary
-      if (cachedBoundary[ind]) return 0;
+      if (is_boundary(cachedVert[ind])) return 0;
     }
     cp = cachedPoints[ind];
     short *sp = &cachedNorms[ind*3];
@@ -1320,3 +1426,210 @@ CyraResLevel::closest_point(const Pnt3 &p, const Pnt3 &n,
   return ans;
 }
 
+//////////////////////////////////////////////////////////////////////
+// projective search
+//////////////////////////////////////////////////////////////////////
+
+// Fit the model that takes a direction from the origin to its
+// grid column and row.  The viewing direction is the mean of
+// the sample directions, the azimuth is measured towards the
+// direction in which the column number grows.  projSlack is
+// the worst error of the fit over the samples; if that's more
+// than a few cells (or there's no grid) the model is not used.
+void
+CyraResLevel::prepare_projection(void)
+{
+  if (!projDirty) return;
+  projDirty = false;
+  projSlack = -1;
+
+  // viewing direction, and the direction of growing columns
+  Pnt3 w(0,0,0), u(0,0,0);
+  int x, y;
+  for (x = 0; x < width; x++) {
+    for (y = 0; y < height; y++) {
+      const CyraSample &s = point(x,y);
+      if (s.confidence <= 0) continue;
+      Pnt3 d = s.vtx - origin;
+      if (d.norm2() == 0) continue;
+      d.normalize();
+      w += d;
+      if (x+1 < width && point(x+1,y).confidence > 0) {
+	Pnt3 d1 = point(x+1,y).vtx - origin;
+	if (d1.norm2() == 0) continue;
+	u += d1.normalize() - d;
+      }
+    }
+  }
+  if (w.norm2() == 0) return;
+  projW = w.normalize();
+  u -= projW * dot(u, projW);
+  if (u.norm2() == 0) return;
+  projU = u.normalize();
+  projV = cross(projW, projU);
+
+  // least squares fit of col and row to (az, el, 1)
+  double M[3][3] = {{0,0,0},{0,0,0},{0,0,0}};
+  double bc[3] = {0,0,0}, br[3] = {0,0,0};
+  int n = 0;
+  projA[0] = 1; projA[1] = 0; projA[2] = 0;
+  projA[3] = 0; projA[4] = 1; projA[5] = 0;
+  for (x = 0; x < width; x++) {
+    for (y = 0; y < height; y++) {
+      const CyraSample &s = point(x,y);
+      if (s.confidence <= 0) continue;
+      float az, el;
+      if (!project(s.vtx, az, el)) continue;
+      double a[3] = { az, el, 1 };
+      for (int i = 0; i < 3; i++) {
+	for (int j = 0; j < 3; j++) M[i][j] += a[i]*a[j];
+	bc[i] += a[i]*x;
+	br[i] += a[i]*y;
+      }
+      n++;
+    }
+  }
+
+  // Cramer's rule
+  double det =
+    M[0][0]*(M[1][1]*M[2][2]-M[1][2]*M[2][1]) -
+    M[0][1]*(M[1][0]*M[2][2]-M[1][2]*M[2][0]) +
+    M[0][2]*(M[1][0]*M[2][1]-M[1][1]*M[2][0]);
+  if (n < 3 || fabs(det) < 1e-12 * n * n * n) return;
+  for (int k = 0; k < 3; k++) {
+    double Mc[3][3], Mr[3][3];
+    for (int i = 0; i < 3; i++) {
+      for (int j = 0; j < 3; j++) {
+	Mc[i][j] = (j == k) ? bc[i] : M[i][j];
+	Mr[i][j] = (j == k) ? br[i] : M[i][j];
+      }
+    }
+    projA[k] =
+      (Mc[0][0]*(Mc[1][1]*Mc[2][2]-Mc[1][2]*Mc[2][1]) -
+       Mc[0][1]*(Mc[1][0]*Mc[2][2]-Mc[1][2]*Mc[2][0]) +
+       Mc[0][2]*(Mc[1][0]*Mc[2][1]-Mc[1][1]*Mc[2][0])) / det;
+    projA[3+k] =
+      (Mr[0][0]*(Mr[1][1]*Mr[2][2]-Mr[1][2]*Mr[2][1]) -
+       Mr[0][1]*(Mr[1][0]*Mr[2][2]-Mr[1][2]*Mr[2][0]) +
+       Mr[0][2]*(Mr[1][0]*Mr[2][1]-Mr[1][1]*Mr[2][0])) / det;
+  }
+
+  // how far off can the prediction be?
+  float err = 0;
+  for (x = 0; x < width; x++) {
+    for (y = 0; y < height; y++) {
+      const CyraSample &s = point(x,y);
+      if (s.confidence <= 0) continue;
+      float col, row;
+      if (!project(s.vtx, col, row)) continue;
+      err = max(err, max(float(fabs(col - x)), float(fabs(row - y))));
+    }
+  }
+  if (err > 8) {
+    cerr << "Cyra grid doesn't fit the scanner model (off by "
+	 << err << " samples), no projective search." << endl;
+    return;
+  }
+  projSlack = (int)ceil(err);
+}
+
+
+// Where does p fall in the grid (col, row)?  Before the fit is
+// done, returns the azimuth and elevation instead.
+// False if p is behind the scanner.
+bool
+CyraResLevel::project(const Pnt3 &p, float &col, float &row) const
+{
+  Pnt3 d = p - origin;
+  float dw = dot(d, projW);
+  if (dw <= 0) return false;
+  float du = dot(d, projU);
+  float az = atan2(du, dw);
+  float el = atan2(dot(d, projV), sqrtf(du*du + dw*dw));
+  col = projA[0]*az + projA[1]*el + projA[2];
+  row = projA[3]*az + projA[4]*el + projA[5];
+  return true;
+}
+
+
+bool
+CyraResLevel::projective_points(const Pnt3 *p, const Pnt3 *n, int count,
+				Pnt3 *cp, Pnt3 *cn, bool *found,
+				float thr, bool bdry_ok, int window)
+{
+  prepare_projection();
+  if (projSlack < 0) return false;
+
+  int   win = window + projSlack;
+  float thr2 = thr * thr;
+
+  WorkerPool::global().parallel_for(count, 256, [&](int b, int e) {
+    for (int i = b; i < e; i++) {
+      found[i] = false;
+      float col, row;
+      if (!project(p[i], col, row)) continue;
+      if (col < -win-1 || col > width+win || row < -win-1 || row > height+win)
+	continue;
+      int c = (int)floor(col + .5), r = (int)floor(row + .5);
+      int x0 = max(0, c - win), x1 = min(width-1,  c + win);
+      int y0 = max(0, r - win), y1 = min(height-1, r + win);
+
+      const Pnt3 &q = p[i], &qn = n[i];
+      float d2 = thr2;
+      int   bx = -1, by = -1;
+      for (int x = x0; x <= x1; x++) {
+	for (int y = y0; y <= y1; y++) {
+	  const CyraSample &s = point(x,y);
+	  if (s.confidence <= 0) continue;
+	  float l = dist2(s.vtx, q);
+	  if (l >= d2) continue;
+	  if (qn[0]*s.nrm[0] + qn[1]*s.nrm[1] + qn[2]*s.nrm[2]
+	      <= NRM_45_DEG) continue;
+	  d2 = l; bx = x; by = y;
+	}
+      }
+      if (bx < 0) continue;
+      // disallow closest points that are on the mesh boundary
+      if (!bdry_ok && is_boundary(bx, by)) continue;
+
+      const CyraSample &s = point(bx,by);
+      cp[i] = s.vtx;
+      cn[i].set(s.nrm[0]/32767.0,
+		s.nrm[1]/32767.0,
+		s.nrm[2]/32767.0);
+      found[i] = true;
+    }
+  });
+  return true;
+}
+
+
+void
+CyraResLevel::closest_points(const Pnt3 *p, const Pnt3 *n, int count,
+			     Pnt3 *cp, Pnt3 *cn, bool *found,
+			     float thr, bool bdry_ok, float eps)
+{
+  create_kdtree();
+  const Pnt3  *pnts = &cachedPoints[0];
+  const short *nrms = &cachedNorms[0];
+
+  WorkerPool::global().parallel_for(count, 256, [&](int b, int e) {
+    for (int i = b; i < e; i++) {
+      int   ind;
+      float d = thr;
+      found[i] = kdtree->search(pnts, nrms, p[i], n[i], ind, d, eps);
+      if (!found[i]) continue;
+      // disallow closest points that are on the mesh boundary
+      if (!bdry_ok && is_boundary(cachedVert[ind])) {
+	found[i] = false;
+	continue;
+      }
+      cp[i] = pnts[ind];
+      const short *sp = &nrms[ind*3];
+      cn[i].set(sp[0]/32767.0,
+		sp[1]/32767.0,
+		sp[2]/32767.0);
+    }
+  });
+}
+
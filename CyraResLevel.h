@@ -102,8 +102,19 @@ class CyraResLevel {
   bool               isDirty_cache;  // Have contents of memory changed?
   vector<Pnt3>       cachedPoints;    // Contiguous array of valid points
   vector<short>      cachedNorms;     // Contiguous array of valid norms
-  vector<bool>       cachedBoundary;  // Contiguous array of valid boundary flags
+  vector<int>        cachedVert;      // their vindex, -1 once clipped
   KDindtree          *kdtree;        // kdtree points into cachedPoints
+  crope              kdCacheFile;    // file the points came from, if any
+  int                kdCacheRes;     // and which resolution of it
+
+  // projective search: the scanner sweeps an angular grid from
+  // origin, so the column and row of a direction are (nearly)
+  // an affine function of its azimuth and elevation about the
+  // mean viewing direction projW
+  bool               projDirty;
+  Pnt3               projU, projV, projW;
+  float              projA[6];      // (az,el) -> (col,row)
+  int                projSlack;     // worst misprediction, in cells
 
 
 public:
@@ -138,10 +149,25 @@ public:
 
   // for ICP...
   void create_kdtree(void);
+  // let create_kdtree cache the tree next to the file this
+  // level was read (or subsampled) from
+  void set_kdtree_cache(const crope &fname, int res)
+    { kdCacheFile = fname; kdCacheRes = res; }
   void subsample_points(float rate, vector<Pnt3> &p, vector<Pnt3> &n);
   bool closest_point(const Pnt3 &p, const Pnt3 &n,
 		     Pnt3 &cp, Pnt3 &cn,
 		     float thr = 1e33, bool bdry_ok = 0);
+  void closest_points(const Pnt3 *p, const Pnt3 *n, int count,
+		      Pnt3 *cp, Pnt3 *cn, bool *found,
+		      float thr = 1e33, bool bdry_ok = 0,
+		      float eps = 0);
+  // look only at the samples within window (plus projSlack)
+  // cells of where p projects to in the grid; false if the
+  // grid doesn't fit the scanner model
+  bool projective_points(const Pnt3 *p, const Pnt3 *n, int count,
+			 Pnt3 *cp, Pnt3 *cn, bool *found,
+			 float thr = 1e33, bool bdry_ok = 0,
+			 int window = 2);
 
 friend class CyraScan;
 
@@ -149,6 +175,11 @@ friend class CyraScan;
 private:
   // Helper functions
   void CalcNormals(void);
+  bool is_boundary(int vx, int vy) const;
+  bool is_boundary(int vindex) const
+    { return is_boundary(vindex / height, vindex % height); }
+  void prepare_projection(void);
+  bool project(const Pnt3 &p, float &col, float &row) const;
   bool PointFilter(CyraResLevel &original, int m, int n);
   bool Mean50Filter(CyraResLevel &original, int m, int n);
 
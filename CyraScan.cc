@@ -20,7 +20,7 @@
 #include "KDindtree.h"
 #include "ColorUtils.h"
 #include "plvScene.h"
-#include "KDtritree.h"
+#include "TriBVH.h"
 #include "Timer.h"
 #include "MeshTransport.h"
 
@@ -30,7 +30,7 @@
 //////////////////////////////////////////////////////////////////////
 
 CyraScan::CyraScan(void)
-  : triKD(NULL), triKD_mesh(NULL)
+  : triBVH(NULL)
 {
   // Clear arrays
   levels.clear();
@@ -39,8 +39,7 @@ CyraScan::CyraScan(void)
 
 CyraScan::~CyraScan ()
 {
-  delete triKD;
-  delete triKD_mesh;
+  delete triBVH;
   /*
     <Writing stuff deleted>
     delete kdtree;
@@ -136,6 +135,7 @@ CyraScan::ReadPts(const crope &inname)
   CyraResLevel *level = new CyraResLevel();
   if (level->ReadPts(inname)) {
     levels.push_back(*level);
+    levels.back().set_kdtree_cache(inname, 0);
   } else {
     return false;
   }
@@ -188,6 +188,7 @@ CyraScan::load_resolution (int iRes)
 
   //delete levels[iRes];
   levels[iRes] = *sublevel;
+  levels[iRes].set_kdtree_cache(resolutions[iRes].filename, iRes);
   resolutions[iRes].in_memory = true;
   resolutions[iRes].abs_resolution = sublevel->num_tris();
   computeBBox();
@@ -247,6 +248,8 @@ CyraScan::filter_inplace(const VertexFilter& filter)
     CyraResLevel *level = &levels[i];
     level->filter_inplace(filter);
   }
+  delete triBVH;
+  triBVH = NULL;
   // BUGBUG update_res_ctrl();
   // Need to update the number of tris and stuff,
   computeBBox();
@@ -308,6 +311,34 @@ CyraScan::closest_point(const Pnt3 &p, const Pnt3 &n,
   return res.closest_point(p, n, cp, cn, thr, bdry_ok);
 }
 
+void
+CyraScan::closest_points(const Pnt3 *p, const Pnt3 *n, int count,
+			 Pnt3 *cp, Pnt3 *cn, bool *found,
+			 float thr, bool bdry_ok, float eps)
+{
+  CyraResLevel& res = levels[curr_res];
+  res.closest_points(p, n, count, cp, cn, found, thr, bdry_ok, eps);
+}
+
+bool
+CyraScan::projective_points(const Pnt3 *p, const Pnt3 *n, int count,
+			    Pnt3 *cp, Pnt3 *cn, bool *found,
+			    float thr, bool bdry_ok, int window)
+{
+  CyraResLevel& res = levels[curr_res];
+  return res.projective_points(p, n, count, cp, cn, found,
+			       thr, bdry_ok, window);
+}
+
+
+void
+CyraScan::prepare_search(int iRes)
+{
+  if (iRes < 0 || iRes >= levels.size() || !resolutions[iRes].in_memory)
+    return;
+  levels[iRes].create_kdtree();
+}
+
 
 
 
@@ -315,41 +346,38 @@ CyraScan::closest_point(const Pnt3 &p, const Pnt3 &n,
 // for volumetric processing
 ////////////////////////////////////////
 
+void
+CyraScan::build_tri_bvh()
+{
+  if (triBVH != NULL) return;
+
+  // the BVH keeps its own copy of the triangles
+  cout << "Obtaining geometry for triangle BVH..." << endl;
+  MeshTransport* mt = levels[0].mesh (true, false, RigidScan::colorNone, 0);
+  if (mt->tri_inds.size() && mt->tri_inds[0]->size())
+    triBVH = create_TriBVH(&(*mt->vtx[0])[0],
+			   &(*mt->tri_inds[0])[0],
+			   mt->tri_inds[0]->size());
+  delete mt;
+}
+
+
 float
 CyraScan::closest_point_on_mesh (const Pnt3 &p, Pnt3 &cl_pnt,
 				 OccSt &status_p)
 {
-  static Pnt3  prev_point(1e33, 1e33, 1e33);
-
-  if (triKD == NULL) {
-    // create the triangle spheretree for finding the distance to the mesh
-    cout << "Obtaining geometry for KDtritree..." << flush;
-    triKD_mesh = levels[0].mesh (true, false, RigidScan::colorNone, 0);
-    cout << "building tree..." << flush;
-    triKD = create_KDtritree(triKD_mesh->vtx[0]->begin(),
-			     triKD_mesh->tri_inds[0]->begin(),
-			     triKD_mesh->tri_inds[0]->size());
-    cout << "done." << endl;
-  }
+  build_tri_bvh();
+  status_p = INDETERMINATE;
+  if (triBVH == NULL) return 0.0;
 
+  // the occlusion status is decided along the line of sight
   OccSt st;
-  closest_along_line_of_sight(p, cl_pnt, st);
-  float d   = dist2(p, cl_pnt);
-  float dp2 = dist2(prev_point, p);
-  if (d > dp2) {
-    d = dp2;
-    cl_pnt = prev_point;
-  }
-  d = sqrtf(d);
-  triKD->search(triKD_mesh->vtx[0]->begin(),
-		triKD_mesh->tri_inds[0]->begin(),
-		p, cl_pnt, d);
-  prev_point = cl_pnt;
-
-  // just a simple, hacky test for occlusion status
-  // assume that the camera center is at origin
-  //if (p.norm2() < cl_pnt.norm2()) status_p = OUTSIDE;
-  //else                            status_p = INSIDE;
+  Pnt3  los;
+  closest_along_line_of_sight(p, los, st);
+
+  float d = 1e33;
+  if (!triBVH->closest_point(p, cl_pnt, d))
+    return 0.0;
   status_p = st;
 
   return 1.0;
@@ -363,118 +391,24 @@ float
 CyraScan::closest_along_line_of_sight(const Pnt3 &p, Pnt3 &cp,
 				      OccSt &status_p)
 {
-  build_vrip_accelerators();
-  CyraResLevel& res = levels[0];
-
+  build_tri_bvh();
   status_p = INDETERMINATE;
-  // lookup given los direction in ray bins
-  Pnt3 dir = p; dir.normalize();
-  if (dir[0] < minx || dir[0] > maxx) {
-    //cout << "out of bounds x" << endl;
+  if (triBVH == NULL) return 0.0;
+
+  // the scanner is at the origin, find where the ray through
+  // p hits the mesh closest to p
+  float r = p.norm();
+  if (r == 0) return 0.0;
+  Pnt3 dir = p;
+  dir /= r;
+  float t = 1e33;
+  if (!triBVH->closest_along_line(p, dir, t))
     return 0.0;
-  }
-  if (dir[1] < miny || dir[1] > maxy) {
-    //cout << "out of bounds y" << endl;
-    return 0.0;
-  }
-
-  int binx = (dir[0] - minx) * binw;
-  int biny = (dir[1] - miny) * binh;
-
-  if (!bins[biny][binx].size()) {
-    if (binx > 1)
-      binx--;
-    else
-      if (biny > 1)
-	biny--;
-      else
-	return 0.0;
-
-    if (!bins[biny][binx].size())
-      return 0.0;
-  }
-
-  // have a valid bin
-  int ofs = bins[biny][binx].back();
-  if (!pntmag[ofs])
-    return 0.0;
-
-  int x = ofs / res.height;
-  int y = ofs % res.height;
-  Pnt3& pd = pntdir[ofs];
-  int l, r, t, b;
-  if (dir[0] < pd[0]) {
-    l = x - 1; // needs help
-    while (pntdir [l * res.height + y][0] > dir[0]) {
-      if (--l < 0)
-	return 0.0;
-    }
-    r = l + 1;
-  } else {
-    r = x + 1; // needs help
-    while (pntdir [r * res.height + y][0] < dir[0]) {
-      if (++r >= res.width)
-	return 0.0;
-    }
-    l = r - 1;
-  }
-  if (dir[1] < pd[1]) {
-    b = y - 1; // needs help
-    while (pntdir [l * res.height + b][1] > dir[1]) {
-      if (--b < 0)
-	return 0.0;
-    }
-    t = b + 1;
-  } else {
-    t = y + 1; // needs help
-    while (pntdir [l * res.height + t][1] < dir[1]) {
-      if (++t >= res.height)
-	return 0.0;
-    }
-    b = t - 1;
-  }
-
-  int ofss[4] = { t + l*res.height, t + r*res.height,
-		  b + l*res.height, b + r*res.height };
-  for (int ii = 0; ii < 4; ii++) {
-    if (ofss[ii] < 0 || ofss[ii] >= pntdir.size() || !pntmag[ofss[ii]])
-      return 0.0;
-  }
-
-  //SHOW (x); SHOW (y);
-  //SHOW (l); SHOW (r); SHOW (t); SHOW (b);
-
-  // bilerp across (l, b), (r, b), (l, t), (r, t)
-  Pnt3& p00 = res.points[b + l*res.height].vtx;
-  Pnt3& p01 = res.points[t + l*res.height].vtx;
-  Pnt3& p10 = res.points[b + r*res.height].vtx;
-  Pnt3& p11 = res.points[t + r*res.height].vtx;
-
-  Pnt3& n00 = pntdir[b + l*res.height];
-  Pnt3& n01 = pntdir[t + l*res.height];
-  Pnt3& n10 = pntdir[b + r*res.height];
-  Pnt3& n11 = pntdir[t + r*res.height];
-
-  float ix = (n11[0] - n01[0]);
-  ix = (dir[0] - n01[0]) / ix;
-
-  float iyl = (n01[1] - n00[1]);
-  iyl = (dir[1] - n00[1]) / iyl;
-
-  float iyr = (n11[1] - n10[1]);
-  iyr = (dir[1] - n10[1]) / iyr;
-
-  Pnt3 L,R;
-  L.lerp(iyl, p01, p00);
-  R.lerp(iyr, p11, p10);
-  cp.lerp(ix, R, L);
-
-  //SHOW (ix); SHOW (iyl); SHOW (iyr);
-  //SHOW (L); SHOW (R); SHOW (cp);
+  cp = p + dir * t;
 
-  float ind  = p.norm2();
-  float outd = cp.norm2();
-  if (ind < outd)
+  // p is in front of the surface if the surface is farther
+  // from the scanner
+  if (t > 0)
     status_p = OUTSIDE;
   else
     status_p = INSIDE;
@@ -16,7 +16,7 @@
 #include "RigidScan.h"
 #include "CyraResLevel.h"
 
-class KDtritree;
+class TriBVH;
 
 
 //////////////////////////////////////////////////////////////////////
@@ -63,6 +63,15 @@ public:
   bool closest_point(const Pnt3 &p, const Pnt3 &n,
 		     Pnt3 &cp, Pnt3 &cn,
 		     float thr = 1e33, bool bdry_ok = 0);
+  void closest_points(const Pnt3 *p, const Pnt3 *n, int count,
+		      Pnt3 *cp, Pnt3 *cn, bool *found,
+		      float thr = 1e33, bool bdry_ok = 0,
+		      float eps = 0);
+  bool projective_points(const Pnt3 *p, const Pnt3 *n, int count,
+			 Pnt3 *cp, Pnt3 *cn, bool *found,
+			 float thr = 1e33, bool bdry_ok = 0,
+			 int window = 2);
+  void prepare_search(int iRes);
 
   // for volumetric processing
   virtual float
@@ -77,8 +86,8 @@ public:
 private:
   vector<CyraResLevel> levels;
 
-  KDtritree   *triKD;
-  MeshTransport* triKD_mesh;
+  TriBVH      *triBVH;   // over levels[0], for the vrip queries
+  void build_tri_bvh();
 
   void build_vrip_accelerators();
   vector<Pnt3> pntdir;  // normalized point values for vripping
@@ -23,11 +23,13 @@
 #include "plvScene.h"
 #include "plvDraw.h"
 #include "KDindtree.h"
+#include "TriBVH.h"
 #include "ColorUtils.h"
 #include "TriMeshUtils.h"
 #include "FileNameUtils.h"
 #include "MeshTransport.h"
 #include "VertexFilter.h"
+#include "WorkerPool.h"
 
 
 GenericScan::GenericScan ()
@@ -67,6 +69,16 @@ GenericScan::~GenericScan ()
     kdtree.pop_back();
   }
 
+  while (kdSource.size()) {
+    delete kdSource.back();
+    kdSource.pop_back();
+  }
+
+  while (triBVH.size()) {
+    delete triBVH.back();
+    triBVH.pop_back();
+  }
+
   delete myRangeGrid;
 }
 
@@ -235,6 +247,15 @@ GenericScan::subsample_points(float rate, vector<Pnt3> &p,
 }
 
 
+void
+GenericScan::subsample_normal_space(float rate, vector<Pnt3> &p,
+				    vector<Pnt3> &n)
+{
+  // each resolution's Mesh keeps its own bucket index
+  currentMesh()->subsample_normal_space(rate, p, n);
+}
+
+
 bool
 GenericScan::read (const crope &fname)
 {
@@ -512,8 +533,12 @@ GenericScan::delete_resolution (int nPolys)
   }
 
   delete meshes[iRes];
+  delete_search_trees (iRes);
 // STL Update
   meshes.erase (meshes.begin() + iRes);
+  kdtree.erase (kdtree.begin() + iRes);
+  kdSource.erase (kdSource.begin() + iRes);
+  triBVH.erase (triBVH.begin() + iRes);
   resolutions.erase (resolutions.begin() + iRes);
 
   select_coarser();
@@ -545,6 +570,8 @@ GenericScan::insertMesh(Mesh *m, const crope& filename,
 // STL Update
   meshes.insert (meshes.begin() + iPos, m);
   kdtree.insert (kdtree.begin() + iPos, NULL);
+  kdSource.insert (kdSource.begin() + iPos, NULL);
+  triBVH.insert (triBVH.begin() + iPos, NULL);
 }
 
 
@@ -614,6 +641,7 @@ GenericScan::release_resolution (int nPolys)
 
   delete meshes[iRes];
   meshes[iRes] = new Mesh;
+  delete_search_trees (iRes);
   resolutions[iRes].in_memory = false;
   return true;
 }
@@ -641,15 +669,94 @@ GenericScan::get_current_kdtree()
     return kdtree[iTree];
 
   Mesh* mesh = currentMesh();
-// STL Update
-  kdtree[iTree] = CreateKDindtree(mesh->vtx.begin(),
-				  mesh->nrm.begin(),
-				  mesh->vtx.size());
+  // the resolution's file name is relative to the set
+  // directory; don't write a cache for edited meshes
+  pushd();
+  kdtree[iTree] = CreateKDindtree(&mesh->vtx[0],
+				  &mesh->nrm[0],
+				  mesh->vtx.size(),
+				  resolutions[iTree].filename.c_str(),
+				  iTree, !bDirty);
+  popd();
 
   return kdtree[iTree];
 }
 
 
+void
+GenericScan::prepare_search(int iRes)
+{
+  if (iRes < 0 || iRes >= kdtree.size() || kdtree[iRes] != NULL ||
+      !resolutions[iRes].in_memory)
+    return;
+
+  // as get_current_kdtree(), but with the full name of the
+  // cache file instead of a pushd(): the working directory is
+  // shared by all threads
+  Mesh* mesh = meshes[iRes];
+  crope file = resolutions[iRes].filename;
+  if (file.size() && file[0] != '/' && !setdir.empty())
+    file = setdir + crope("/") + file;
+  kdtree[iRes] = CreateKDindtree(&mesh->vtx[0],
+				 &mesh->nrm[0],
+				 mesh->vtx.size(),
+				 file.c_str(), iRes, !bDirty);
+}
+
+
+TriBVH*
+GenericScan::get_current_tribvh()
+{
+  int iTree = current_resolution_index();
+  assert (iTree < triBVH.size());
+  if (triBVH[iTree] != NULL)
+    return triBVH[iTree];
+
+  Mesh* mesh = currentMesh();
+  vector<int>& tris = mesh->getTris();
+  if (tris.size())
+    triBVH[iTree] = create_TriBVH(&mesh->vtx[0], &tris[0], tris.size());
+
+  return triBVH[iTree];
+}
+
+
+void
+GenericScan::delete_search_trees (int iRes)
+{
+  delete kdtree[iRes];
+  kdtree[iRes] = NULL;
+  delete kdSource[iRes];
+  kdSource[iRes] = NULL;
+  delete triBVH[iRes];
+  triBVH[iRes] = NULL;
+}
+
+
+// the arrays the current kdtree searches: the mesh's, or the
+// ones it kept across clipping; the boundary flags only if
+// bdry isn't NULL
+void
+GenericScan::search_arrays(const Pnt3 *&vtx, const short *&nrm,
+			   const char **bdry)
+{
+  KDsource* src = kdSource[current_resolution_index()];
+  if (src) {
+    vtx = &src->vtx[0];
+    nrm = &src->nrm[0];
+    if (bdry) *bdry = &src->bdry[0];
+  } else {
+    Mesh* mesh = currentMesh();
+    vtx = &mesh->vtx[0];
+    nrm = &mesh->nrm[0];
+    if (bdry) {
+      mesh->mark_boundary_verts();
+      *bdry = &mesh->bdry[0];
+    }
+  }
+}
+
+
 bool
 GenericScan::closest_point(const Pnt3 &p, const Pnt3 &n,
 			   Pnt3 &cp, Pnt3 &cn,
@@ -660,17 +767,18 @@ GenericScan::closest_point(const Pnt3 &p, const Pnt3 &n,
     return false;
 
   int ind, ans;
-  Mesh* mesh = currentMesh();
-// STL Update
-  ans = tree->search(&*(mesh->vtx.begin()), &*(mesh->nrm.begin()), p, n, ind, thr);
+  const Pnt3  *vtx;
+  const short *nrm;
+  const char  *bdry = NULL;
+  search_arrays(vtx, nrm, bdry_ok ? NULL : &bdry);
+  ans = tree->search(vtx, nrm, p, n, ind, thr);
   if (ans) {
     if (bdry_ok == 0) {
       // disallow closest points that are on the mesh boundary
-      mesh->mark_boundary_verts();
-      if (mesh->bdry[ind]) return 0;
+      if (bdry[ind]) return 0;
     }
-    cp = mesh->vtx[ind];
-    short *sp = &mesh->nrm[ind*3];
+    cp = vtx[ind];
+    const short *sp = &nrm[ind*3];
     cn.set(sp[0]/32767.0,
 	   sp[1]/32767.0,
 	   sp[2]/32767.0);
@@ -679,6 +787,71 @@ GenericScan::closest_point(const Pnt3 &p, const Pnt3 &n,
 }
 
 
+void
+GenericScan::closest_points(const Pnt3 *p, const Pnt3 *n, int count,
+			    Pnt3 *cp, Pnt3 *cn, bool *found,
+			    float thr, bool bdry_ok, float eps)
+{
+  KDindtree* tree = get_current_kdtree();
+  if (!tree) {
+    fill(found, found+count, false);
+    return;
+  }
+
+  // build everything that closest_point() would build lazily,
+  // the workers below only read
+  const Pnt3  *vtx;
+  const short *nrm;
+  const char  *bdry = NULL;
+  search_arrays(vtx, nrm, bdry_ok ? NULL : &bdry);
+
+  WorkerPool::global().parallel_for(count, 256, [&](int b, int e) {
+    for (int i = b; i < e; i++) {
+      int   ind;
+      float d = thr;
+      found[i] = tree->search(vtx, nrm, p[i], n[i], ind, d, eps);
+      if (!found[i]) continue;
+      if (bdry && bdry[ind]) {
+	found[i] = false;
+	continue;
+      }
+      cp[i] = vtx[ind];
+      const short *sp = &nrm[ind*3];
+      cn[i].set(sp[0]/32767.0,
+		sp[1]/32767.0,
+		sp[2]/32767.0);
+    }
+  });
+}
+
+
+float
+GenericScan::closest_point_on_mesh(const Pnt3 &p, Pnt3 &cl_pnt,
+				   OccSt &status_p)
+{
+  return closest_point_on_bvh(get_current_tribvh(), p, cl_pnt, status_p);
+}
+
+
+float
+GenericScan::closest_along_line_of_sight(const Pnt3 &p, Pnt3 &cp,
+					 OccSt &status_p)
+{
+  // nothing is known about where the scanner was, so use
+  // the closest point instead
+  return closest_point_on_mesh(p, cp, status_p);
+}
+
+
+float
+GenericScan::closest_along_line(const Pnt3 &p, const Pnt3 &dir,
+				Pnt3 &cp, OccSt &status_p)
+{
+  return closest_along_line_on_bvh(get_current_tribvh(), p, dir,
+				   cp, status_p);
+}
+
+
 crope
 GenericScan::getInfo (void)
 {
@@ -929,13 +1102,19 @@ GenericScan::filter_inplace(const VertexFilter &filter)
       }
     }
 
-    // copy and reindex the surviving faces
+    // copy and reindex the surviving faces; the vertices left
+    // of the others are on the boundary now
     count = 0;
+    vector<int> exposed;
     newMesh->tris.reserve (triCount * 3);
     for (int i = 0; i < oldMesh->tris.size(); i += 3) {
-      if (newIndices[oldMesh->tris[i  ]] >= 0 &&
-	  newIndices[oldMesh->tris[i+1]] >= 0 &&
-	  newIndices[oldMesh->tris[i+2]] >= 0) {
+      if (newIndices[oldMesh->tris[i]] < 0 ||
+	  newIndices[oldMesh->tris[i+1]] < 0 ||
+	  newIndices[oldMesh->tris[i+2]] < 0) {
+	for (int j = 0; j < 3; j++)
+	  if (newIndices[oldMesh->tris[i+j]] >= 0)
+	    exposed.push_back(oldMesh->tris[i+j]);
+      } else {
 	// newIndices holds renumbered vertices
 	newMesh->copyTriFrom (oldMesh, i/3, count/3);
 	newMesh->tris[count  ] = newIndices[oldMesh->tris[i  ]];
@@ -957,14 +1136,60 @@ GenericScan::filter_inplace(const VertexFilter &filter)
     newMesh->bNeedsSave = true;
     newMesh->computeBBox();
 
+    // the kdtree just forgets the removed vertices (cheaper
+    // than a rebuild when little was clipped) and keeps
+    // searching the arrays it was built from, the triangle
+    // hierarchy has to go
+    KDindtree* tree = kdtree[iRes];
+    KDsource*  src  = kdSource[iRes];
+    kdtree[iRes]   = NULL;
+    kdSource[iRes] = NULL;
+    delete_search_trees (iRes);
+    if (tree) {
+      if (!src) {
+	src = new KDsource;
+	oldMesh->mark_boundary_verts();
+	src->vtx.swap (oldMesh->vtx);
+	src->nrm.swap (oldMesh->nrm);
+	src->bdry.swap (oldMesh->bdry);
+      }
+      vector<int> removed;
+      vector<int> slot (newMesh->vtx.size());
+      int nOld = newIndices.size();
+      for (int i = 0; i < nOld; i++) {
+	int k = src->slot.size() ? src->slot[i] : i;
+	if (newIndices[i] < 0) removed.push_back(k);
+	else                   slot[newIndices[i]] = k;
+      }
+      for (int i = 0; i < exposed.size(); i++) {
+	int v = exposed[i];
+	src->bdry[src->slot.size() ? src->slot[v] : v] = 1;
+      }
+      if (removed.size())
+	tree->remove (&src->vtx[0], &removed[0], removed.size());
+      src->slot.swap (slot);
+
+      if (tree->num_points() == 0) {
+	delete tree;
+	delete src;
+      } else if (tree->wants_compact()) {
+	// back to the mesh's own arrays
+	vector<int> newIndex (src->vtx.size(), -1);
+	for (int i = 0; i < src->slot.size(); i++)
+	  newIndex[src->slot[i]] = i;
+	tree->renumber (&newIndex[0]);
+	delete src;
+	kdtree[iRes] = tree;
+      } else {
+	kdtree[iRes]   = tree;
+	kdSource[iRes] = src;
+      }
+    }
+
     // and insert it in place of original
     delete oldMesh;
     meshes[iRes] = newMesh;
     resolutions[iRes].abs_resolution = newMesh->num_tris();
-
-    // nuke any kdtree for this resolution
-    delete kdtree[iRes];
-    kdtree[iRes] = NULL;
   }
 
   // done!
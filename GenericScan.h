@@ -19,19 +19,37 @@
 #include "Mesh.h"
 
 class KDindtree;
+class TriBVH;
 class RangeGrid;
 
 class GenericScan : public RigidScan {
 private:
 
+  // A kdtree kept across clipping still searches the arrays
+  // it was built from, the clipped vertices left in (dead in
+  // the tree): the old mesh's, moved here by filter_inplace.
+  // slot has where each vertex of the current mesh is in them.
+  struct KDsource {
+    vector<Pnt3>  vtx;
+    vector<short> nrm;
+    vector<char>  bdry;
+    vector<int>   slot;
+  };
+
   vector<Mesh*> meshes;
   vector<KDindtree *> kdtree;
+  vector<KDsource *>  kdSource;   // NULL: the tree indexes the mesh
+  vector<TriBVH *>    triBVH;
   bool bDirty;
   bool bNameSet;
 
   RangeGrid* myRangeGrid;
 
   KDindtree* get_current_kdtree(void);
+  void       search_arrays(const Pnt3 *&vtx, const short *&nrm,
+			   const char **bdry);
+  TriBVH*    get_current_tribvh(void);
+  void       delete_search_trees(int iRes);
 
   void insertMesh(Mesh *m, const crope& filename,
 		  bool bLoaded = true, bool bAlwaysLoad = true,
@@ -64,6 +82,8 @@ public:
   int  num_vertices(void);
   void subsample_points(float rate, vector<Pnt3> &p,
 			vector<Pnt3> &n);
+  void subsample_normal_space(float rate, vector<Pnt3> &p,
+			      vector<Pnt3> &n);
 
   void PrintVoxelInfo();  // added display voxel feature.  See
   // GenericScan.cc for documentation - leslie
@@ -75,6 +95,22 @@ public:
   bool closest_point(const Pnt3 &p, const Pnt3 &n,
 		     Pnt3 &cp, Pnt3 &cn,
 		     float thr = 1e33, bool bdry_ok = 0);
+  void closest_points(const Pnt3 *p, const Pnt3 *n, int count,
+		      Pnt3 *cp, Pnt3 *cn, bool *found,
+		      float thr = 1e33, bool bdry_ok = 0,
+		      float eps = 0);
+  void prepare_search(int iRes);
+
+  // for volumetric processing
+  virtual float
+  closest_point_on_mesh(const Pnt3 &p, Pnt3 &cl_pnt, OccSt &status_p);
+  virtual float
+  closest_along_line_of_sight(const Pnt3 &p, Pnt3 &cp,
+			      OccSt &status_p);
+  virtual float
+  closest_along_line(const Pnt3 &p, const Pnt3 &dir,
+		     Pnt3 &cp, OccSt &status_p);
+
   void computeBBox();
   void flipNormals();
   crope getInfo (void);
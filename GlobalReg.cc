@@ -29,11 +29,15 @@
 #include "CyberScan.h"
 #include "GroupScan.h"
 #include "TclCmdUtils.h"
+#include "KDindtree.h"
+#include "PoseGraph.h"
+#include "PairDB.h"
+#include "WorkerPool.h"
+#include "RegistrationStatistics.h"
 #include <math.h>
 
 // TODO: make these sliders in globalreg window
 #define VB_SIZE (100.0)
-#define NOT_FOUND (-1)
 #define THRESHOLD (700) // THIS SHOULD BE MUCH LARGER probably
 
 #if defined(WIN32) || defined(i386)
@@ -308,6 +312,9 @@ GlobalReg::mapEntry::stats(void)
   int n = ptsa.size();
   Pnt3 first, second, nrm;
   maxErr = avgErr = rmsErr = 0.0;
+  vector<Pnt3> pa, pb;
+  ptsa.unpack(pa);
+  ptsb.unpack(pb);
 
   Xform<float> actual_rel_xf = xf_b;
   actual_rel_xf.fast_invert();
@@ -315,8 +322,8 @@ GlobalReg::mapEntry::stats(void)
 
   for (int j=0; j<n; j++) {
     // calculate the point wise distances
-    first  = ptsa[j];
-    second = ptsa[j];
+    first  = pa[j];
+    second = pa[j];
     actual_rel_xf (first);
     rel_xf (second);
 
@@ -327,8 +334,8 @@ GlobalReg::mapEntry::stats(void)
   }
   for (int j=0; j<n; j++) {
     // calculate the point wise distances
-    first  = ptsb[j];
-    second = ptsb[j];
+    first  = pb[j];
+    second = pb[j];
     actual_rel_xf.apply_inv(first,first);
     rel_xf.apply_inv(second,second);
 
@@ -477,9 +484,59 @@ int GetGRVersion (char* magic)
 }
 
 
-// try writing the mapEntry data into a single file
+// add (or replace) the pair in the pair database
 void
-GlobalReg::mapEntry::export_to_file(const std::string &gr_dir)
+GlobalReg::mapEntry::export_to_file(const std::string &gr_dir,
+				    PairDBWriter *out)
+{
+  const char *name1 = GetTbObjName(xfa);
+  const char *name2 = GetTbObjName(xfb);
+  if (!name1 || !name2) {
+    cerr << "Couldn't get names, not saving global"
+	 << " data" << endl;
+    return;
+  }
+
+  cout << "Writing correspondences between " << name1
+       << " and " << name2 << " ... ";
+
+  time (&modifyDate);
+  vector<Pnt3> pa, pb;
+  ptsa.unpack(pa);
+  ptsb.unpack(pb);
+  PairDB::Pair p;
+  p.name[0] = name1;           p.name[1] = name2;
+  p.pts[0]  = pa.size() ? &pa[0] : NULL;
+  p.pts[1]  = pb.size() ? &pb[0] : NULL;
+  p.n       = ptsa.size();
+  p.rel_xf  = (float*)rel_xf;
+  p.pw_point_rmsErr = pw_point_rmsErr;
+  p.pw_plane_rmsErr = pw_plane_rmsErr;
+  p.manual  = manually_aligned;
+  p.quality = quality_grade;
+  p.mtime   = modifyDate;
+
+  if (out) {
+    if (!out->put(p))
+      return;
+  } else {
+    PairDBWriter db;
+    std::string path = gr_dir + "/" PAIRDB_NAME;
+    if (!db.open(path.c_str()) || !db.put(p) || !db.close())
+      return;
+  }
+  cout << "success." << endl;
+
+  // the raw CyberScan data only goes to .gr files
+  if (GetTclGlobalBool ("writeGRsRaw") &&
+      (dynamic_cast<CyberScan*> (xfa) || dynamic_cast<CyberScan*> (xfb)))
+    export_gr_file(gr_dir);
+}
+
+
+// write the mapEntry data into a .gr file of its own
+void
+GlobalReg::mapEntry::export_gr_file(const std::string &gr_dir)
 {
   // figure out the filename
   const char *name1 = GetTbObjName(xfa);
@@ -525,16 +582,19 @@ GlobalReg::mapEntry::export_to_file(const std::string &gr_dir)
   //SHOW(name2);
   //SHOW(dynamic_cast<CyberScan*> (xfa));
   //SHOW(dynamic_cast<GroupScan*> (xfa));
+  vector<Pnt3> pa, pb;
+  ptsa.unpack(pa);
+  ptsb.unpack(pb);
   if (flip) {
-    write_points(out, ptsb, xfb);
-    write_points(out, ptsa, xfa);
+    write_points(out, pb, xfb);
+    write_points(out, pa, xfa);
     Xform<float> tmp_xf = rel_xf;
     tmp_xf.fast_invert();
     for (int i=0; i<16; i++)
         WriteFloat(*((float*)tmp_xf + i), out);
   } else {
-    write_points(out, ptsa, xfa);
-    write_points(out, ptsb, xfb);
+    write_points(out, pa, xfa);
+    write_points(out, pb, xfb);
     for (int i=0; i<16; i++)
       WriteFloat(*((float*)rel_xf + i), out);
   }
@@ -625,7 +685,7 @@ GlobalReg::get_pts(TbObj *x, vector<Pnt3> &P, vector<Pnt3> &Q,
 
     TbObj *datap, *dataq;
     XF_F  dataxf = data->rel_xf;
-    vector<Pnt3> *pp;//, *qq;
+    const PackedPts *pp;//, *qq;
     if (x == data->xfa) {
       datap = data->xfa; dataq = data->xfb;
       pp = &data->ptsa;//  qq = &data->ptsb;
@@ -639,12 +699,12 @@ GlobalReg::get_pts(TbObj *x, vector<Pnt3> &P, vector<Pnt3> &Q,
       continue;
 
     int ind = P.size();
-    P.insert(P.end(), pp->begin(), pp->end());
+    pp->unpack(P);
 #if 1
     // Q becomes "where P's points should be in Q's coords"
     for (int i=0; i<pp->size(); i++) {
       //Pnt3 p = data->ptsa[i];
-      Pnt3 p = (*pp)[i];
+      Pnt3 p = P[ind+i];
       dataxf(p);
       Q.push_back(p);
     }
@@ -671,7 +731,7 @@ GlobalReg::get_pts_within_group(TbObj *x,
 
     TbObj *datap, *dataq;
     XF_F  dataxf = data->rel_xf;
-    vector<Pnt3> *pp;//, *qq;
+    const PackedPts *pp;//, *qq;
     if (x == data->xfa) {
       datap = data->xfa; dataq = data->xfb;
       pp = &data->ptsa;//  qq = &data->ptsb;
@@ -684,12 +744,12 @@ GlobalReg::get_pts_within_group(TbObj *x,
     if (CONTAINS(group, dataq)) {
       // copy the points (in local coordinates)
       int ind = P.size();
-      P.insert(P.end(), pp->begin(), pp->end());
+      pp->unpack(P);
 
 #if 1
       // Q becomes "where P's points should be in Q's coords"
       for (int i=0; i<pp->size(); i++) {
-	Pnt3 p = (*pp)[i];
+	Pnt3 p = P[ind+i];
 	dataxf(p);
 	Q.push_back(p);
       }
@@ -773,11 +833,12 @@ GlobalReg::dump(void)
     SHOW(data);
     SHOW(data->xfa);
     SHOW(data->xfb);
-    vector<Pnt3> &ptsa = data->ptsa;
+    vector<Pnt3> ptsa, ptsb;
+    data->ptsa.unpack(ptsa);
+    data->ptsb.unpack(ptsb);
     cout << "-" << endl;
     copy(ptsa.begin(), ptsa.end(),
 	 ostream_iterator<Pnt3>(cout, "\n"));
-    vector<Pnt3> &ptsb = data->ptsb;
     cout << "-" << endl;
     copy(ptsb.begin(), ptsb.end(),
 	 ostream_iterator<Pnt3>(cout, "\n"));
@@ -890,21 +951,34 @@ GlobalReg::align_one_to_others (TbObj* one, TbObj* two)
 {
 */
 
-// part covered by psuedo-code in the paper
 void
 GlobalReg::align_group(const vector<TbObj*> &group)
 {
-  vector<Pnt3> P,Q;
-  int          i;
-
   assert (group.size() > 1);
 
   vector<XF_F> old_xf(group.size());
-  for (i=0; i<group.size(); i++) {
+  for (int i=0; i<group.size(); i++) {
     old_xf[i] = group[i]->getXform();
     group[i]->save_for_undo();
   }
 
+  relax_group(group);
+
+  // align the new points with the old points in order
+  // to minimize the motion of the whole group
+
+  move_back(group, old_xf);
+  evaluate(group);
+}
+
+
+// part covered by psuedo-code in the paper
+void
+GlobalReg::relax_group(const vector<TbObj*> &group)
+{
+  vector<Pnt3> P,Q;
+  int          i;
+
   // new algorithm
   //
   // for each member of the group, calculate the number
@@ -1069,12 +1143,247 @@ GlobalReg::align_group(const vector<TbObj*> &group)
       break;
     }
   }
+}
+
+
+// add the pairs of an entry, in both directions (as get_pts
+// does): ptsa and where rel_xf takes them in b, and ptsb and
+// where the inverse takes them in a
+static void
+add_pairs(PoseGraph &pg, GlobalReg::mapEntry *data, int a, int b)
+{
+  vector<Pnt3> P, Q;
+  Xform<float> xf = data->rel_xf;
+  if (data->ptsa.size()) {
+    data->ptsa.unpack(P);
+    Q = P;
+    for_each(Q.begin(), Q.end(), xf);
+    pg.add_pairs(a, b, &P[0], &Q[0], Q.size());
+  }
+  if (data->ptsb.size()) {
+    P.clear();
+    data->ptsb.unpack(P);
+    Q = P;
+    xf.fast_invert();
+    for_each(Q.begin(), Q.end(), xf);
+    pg.add_pairs(b, a, &P[0], &Q[0], Q.size());
+  }
+}
+
+
+// one connected group for the pose graph solver
+struct PoseJob {
+  vector<TbObj*> scan;     // the ones that move come first
+  int            nFree;
+  bool           whole;    // all of the group moves
+  PoseGraph     *pg;
+  double         rms0;
+  int            iters;
+};
+
+
+// All the scans of each group at once, see PoseGraph.h.  The
+// groups are independent, so they are solved in parallel.
+//
+// In the incremental mode only the dirty scans and their
+// partners move, from where they are now; the partners of
+// those are held fixed, and the rest of the group is left
+// out.  Otherwise (or if that is all of the group anyway) the
+// whole group moves, except for the scan with the most links.
+void
+GlobalReg::solve_groups(const vector< vector<TbObj*> > &groups)
+{
+  typedef unordered_map<TbObj*,int> Index;
+  vector<PoseJob> job(groups.size());
+  int i;
+
+  // set up on this thread (the map isn't touched elsewhere)
+  for (int k = 0; k < groups.size(); k++) {
+    const vector<TbObj*> &group = groups[k];
+    PoseJob &j = job[k];
+
+    Index moving;
+    for (i=0; i<group.size(); i++) {
+      if (!incremental ||
+	  dirty_scans.find(group[i]) != dirty_scans.end()) {
+	moving.insert(Index::value_type(group[i], 0));
+	if (!incremental) continue;
+	FOR_MATCHING_KEYS(group[i], data) {
+	  TbObj *other = (data->xfa == group[i]) ? data->xfb : data->xfa;
+	  moving.insert(Index::value_type(other, 0));
+	} END_FOR_KEYS;
+      }
+    }
+    j.whole = (moving.size() == group.size());
+    if (j.whole) {
+      j.scan = group;
+    } else {
+      for (i=0; i<group.size(); i++)
+	if (moving.count(group[i])) j.scan.push_back(group[i]);
+    }
+    j.nFree = j.scan.size();
+
+    // the fixed boundary
+    Index ind;
+    for (i=0; i<j.nFree; i++)
+      ind.insert(Index::value_type(j.scan[i], i));
+    for (i=0; i<j.nFree && !j.whole; i++) {
+      FOR_MATCHING_KEYS(j.scan[i], data) {
+	TbObj *other = (data->xfa == j.scan[i]) ? data->xfb : data->xfa;
+	if (ind.insert(Index::value_type(other, j.scan.size())).second)
+	  j.scan.push_back(other);
+      } END_FOR_KEYS;
+    }
+
+    j.pg = new PoseGraph(j.scan.size());
+    PoseGraph &pg = *j.pg;
+    int seed = 0, seed_links = 0;
+    for (i=0; i<j.scan.size(); i++) {
+      pg.set_pose(i, j.scan[i]->getXform());
+      if (i >= j.nFree) {
+	pg.fix(i);
+	continue;
+      }
+      int links = 0;
+      FOR_MATCHING_KEYS(j.scan[i], data) {
+	links++;
+	// each entry once: from xfa, or from the moving end
+	TbObj *other = (data->xfa == j.scan[i]) ? data->xfb : data->xfa;
+	int o = ind[other];
+	if (o < j.nFree && j.scan[i] == data->xfb) continue;
+	if (j.scan[i] == data->xfa) add_pairs(pg, data, i, o);
+	else                        add_pairs(pg, data, o, i);
+      } END_FOR_KEYS;
+      if (links > seed_links) {
+	seed_links = links;
+	seed       = i;
+      }
+    }
+    if (j.whole) pg.fix(seed);
+    j.rms0  = pg.rms();
+    j.iters = 0;
+
+    for (i=0; i<j.nFree; i++)
+      j.scan[i]->save_for_undo();
+  }
+
+  // solve; this thread keeps the progress bar and watches
+  // for the user bailing out
+  atomic<int>  nDone(0);
+  atomic<bool> bBail(false);
+  WorkerPool &pool = WorkerPool::global();
+  TaskGroup tasks(pool);
+  for (int k = 0; k < job.size(); k++) {
+    PoseJob *j = &job[k];
+    tasks.run([this, j, &nDone, &bBail]() {
+      j->iters = j->pg->solve(ftol, 100, [&](int, double) {
+	return !bBail;
+      });
+      nDone++;
+    });
+  }
+  Progress progress (job.size(), "Global alignment");
+  int shown = 0;
+  while (nDone < job.size()) {
+    if (!pool.run_pending())
+      this_thread::sleep_for(chrono::milliseconds(20));
+    if (!bBail && BailDetector::bail()) {
+      cerr << "global alignment cancelled." << endl;
+      bBail = true;
+    }
+    int done = nDone;
+    if (done > shown) {
+      if (!progress.update(done)) bBail = true;
+      shown = done;
+    }
+  }
+  tasks.wait();
 
-  // align the new points with the old points in order
-  // to minimize the motion of the whole group
+  // and move the scans
+  for (int k = 0; k < job.size(); k++) {
+    PoseJob &j = job[k];
+    cout << "Group of " << groups[k].size() << " scans, "
+	 << j.nFree << " moving: RMS distance " << j.rms0
+	 << " -> " << j.pg->rms() << " in " << j.iters
+	 << " iterations" << endl;
 
-  move_back(group, old_xf);
-  evaluate(group);
+    vector<XF_F> old_xf(j.nFree);
+    for (i=0; i<j.nFree; i++) {
+      old_xf[i] = j.scan[i]->getXform();
+      j.scan[i]->setXform(j.pg->get_pose(i), false);
+    }
+    delete j.pg;
+
+    if (j.whole) {
+      // align the new points with the old points in order
+      // to minimize the motion of the whole group
+      move_back(j.scan, old_xf);
+      evaluate(j.scan);
+    } else {
+      // the fixed scans keep the group in place
+      for (i=0; i<j.nFree; i++) {
+	FOR_MATCHING_KEYS(j.scan[i], data) {
+	  data->stats();
+	} END_FOR_KEYS;
+      }
+    }
+  }
+}
+
+
+// RMS distance of all the pairs (each entry has its own
+// rmsErr from stats())
+float
+GlobalReg::rms_error(void)
+{
+  double sumSq = 0;
+  int    cnt   = 0;
+  FOR_MAP_ENTRIES(key, data) {
+    if (key == data->xfb) continue;
+    data->stats();
+    int n  = data->ptsa.size() + data->ptsb.size();
+    cnt   += n;
+    sumSq += n * data->rmsErr * data->rmsErr;
+  } END_FOR_MAP;
+  return cnt ? sqrt(sumSq / cnt) : 0;
+}
+
+
+std::string
+GlobalReg::benchmark(float _ftol)
+{
+  static const char *name[2] = { "relax", "posegraph" };
+  Solver which[2] = { solver_relax, solver_posegraph };
+
+  // the solvers save the scans for undo; keep the user's history
+  TbObj::UndoHold hold;
+
+  vector<TbObj*> scan(all_scans.begin(), all_scans.end());
+  vector<XF_F>   xf(scan.size());
+  for (int i=0; i<scan.size(); i++) xf[i] = scan[i]->getXform();
+  HS    dirty   = dirty_scans;
+  int   oldSolver = solver;
+  float start   = rms_error();
+
+  char buf[200];
+  sprintf(buf, "start: rms %g\n", start);
+  std::string report = buf;
+
+  for (int k = 0; k < 2; k++) {
+    solver      = which[k];
+    dirty_scans = dirty;
+    double t = ICPStats::now();
+    align(_ftol);
+    t = ICPStats::now() - t;
+    sprintf(buf, "%s: %.3f s, rms %g\n", name[k], t, rms_error());
+    report += buf;
+
+    for (int i=0; i<scan.size(); i++) scan[i]->setXform(xf[i], false);
+  }
+  solver      = oldSolver;
+  dirty_scans = dirty;
+  rms_error();   // the entries' stats back to the start
+  return report;
 }
 
 
@@ -1100,67 +1409,29 @@ GlobalReg::getPairError(TbObj *a, TbObj *b,
 }
 
 
-// later overwrites the first
-// also if detect that both auto and manual versions
-// exist, unlink the auto version
-// or if two versions of the same link exist, delete
-// the older one
-GlobalReg::mapEntry*
-GlobalReg::import(const std::string &fname, bool manual)
+// the mesh names from a .gr file name
+static void
+gr_file_names(const std::string &fname, std::string name[2])
 {
-  cout << "import " << fname.c_str() << endl;
-
   // TODO: the below (I guess just the rfind) expects / as path separator,
   // and can't deal with \, so we need to either teach it or replace \ for /
   // to make this work on Windows.
-
-  // get the mesh names
-  std::string name[2];
   int tmp1 = fname.rfind("/");
   if (tmp1) tmp1++; // skip /
   int tmp2 = fname.find(GR_MESHNAMES_SEP);
   name[0].assign(fname, tmp1, tmp2-tmp1);
   tmp2 += strlen(GR_MESHNAMES_SEP); // skip ::: or whatever the separator is
   name[1].assign(fname, tmp2, fname.size()-tmp2-3);
+}
 
-  // get the TbObj pointers
-  TbObj* tbobj[2];
-  for (int is = 0; is < 2; is++) {
-    DisplayableMesh *dm = FindMeshDisplayInfo(name[is].c_str());
-    if (dm) {
-      // the mesh is in memory
-      tbobj[is] = dm->getMeshData();
-    } else {
-      // the mesh is not in memory; need to proxy
-      tbobj[is] = createProxyScanNamed (name[is].c_str());
-      if (!tbobj[is]) {
-	//cerr << "  ignoring correspondence "
-	//     << fname.c_str() << endl;
-	return NULL;
-      }
-    }
-  }
-
-  FOR_MATCHING_KEYS(tbobj[0], data) {
-    if ((data->xfa == tbobj[0] && data->xfb == tbobj[1]) ||
-	(data->xfb == tbobj[0] && data->xfa == tbobj[1])) {
-      // this mapentry exists!
-      if (manual && data->manually_aligned == false) {
-	// the previous entry was an autoICP entry, delete
-	cerr << "Warning: there seem to be several entries "
-	     << endl << "involving meshes " << name[0].c_str()
-	     << " and " << name[1].c_str() << endl;
-	cerr << "Deleting autoICP *.gr entry" << endl;
-	unlink_gr_files(data->xfa, data->xfb, true);
-	// continue to read over this entry
-	break;
-      } else {
-	// don't read this entry
-	return NULL;
-      }
-    }
-  } END_FOR_KEYS;
 
+// read what export_gr_file wrote (or older versions of it)
+static bool
+read_gr_file(const std::string &fname,
+	     vector<Pnt3> &ap, vector<Pnt3> &bp, float rel_xf[16],
+	     float &pw_point_rmsErr, float &pw_plane_rmsErr,
+	     int &quality, bool &manual)
+{
 #ifdef WIN32
   ifstream in(fname.c_str(), ios::binary);
 #else
@@ -1169,12 +1440,9 @@ GlobalReg::import(const std::string &fname, bool manual)
   if (!in) {
     cerr << "Couldn't open file " << fname.c_str()
 	 << " for reading" << endl;
-    return NULL;
+    return false;
   }
 
-  vector<Pnt3> ap, bp;
-  float rel_xf[16];
-  float pw_point_rmsErr, pw_plane_rmsErr;
   char version[4];
   in.read(version, 4);
   int cPnt;
@@ -1230,15 +1498,15 @@ GlobalReg::import(const std::string &fname, bool manual)
 	 << " does not have the correct signature" << endl;
     cerr << "It may have been created with an out-of-date "
 	 << "version of scanalyze" << endl;
-    return NULL;
+    return false;
   }
 
   for (int i=0; i<16; i++)
-    (*((float *)rel_xf + i)) = ReadFloat(in);
+    rel_xf[i] = ReadFloat(in);
   pw_point_rmsErr = ReadFloat(in);
   pw_plane_rmsErr = ReadFloat(in);
 
-  int quality = mapEntry::qual_Unknown;
+  quality = GlobalReg::mapEntry::qual_Unknown;
   if (iVersion == 4) {
     // version 4 fields: quality, manually_aligned
     // yeah, manual is passed in to this function, but that seems a
@@ -1249,16 +1517,178 @@ GlobalReg::import(const std::string &fname, bool manual)
 
   }
 
-  // create and insert mapEntry
-  mapEntry* entry = addPair(tbobj[0], tbobj[1], ap, bp,
-			    pw_point_rmsErr, pw_plane_rmsErr,
-			    rel_xf, manual, 1000000, false, quality);
+  return !in.fail() && ap.size() == bp.size();
+}
 
-  // and grab its modification time from file
-  struct stat fileinfo;
-  stat (fname.c_str(), &fileinfo);
-  entry->modifyDate = fileinfo.st_mtime;
-  return entry;
+
+// Call fn(i) for i in [0,n) on the thread pool.  The progress
+// bar and the bail check talk to Tcl, so they're only used
+// from the calling thread, which helps with the work in
+// between.  Returns false (with some of fn not done) if
+// cancelled.
+static bool
+for_each_pair(int n, const char *title,
+	      const function<void(int)> &fn)
+{
+  atomic<int>  nDone(0);
+  atomic<bool> bBail(false);
+  WorkerPool &pool = WorkerPool::global();
+  TaskGroup group(pool);
+  const int grain = 16;
+  for (int b = 0; b < n; b += grain) {
+    int e = min(n, b + grain);
+    group.run([&, b, e]() {
+      for (int i = b; i < e && !bBail; i++)
+	fn(i);
+      nDone += e - b;
+    });
+  }
+
+  Progress progress (n, title);
+  int shown = 0;
+  while (nDone < n) {
+    if (!pool.run_pending())
+      this_thread::sleep_for(chrono::milliseconds(20));
+    int done = nDone;
+    if (done > shown) {
+      if (!progress.update(done) || BailDetector::bail())
+	bBail = true;
+      shown = done;
+    }
+  }
+  group.wait();
+  return !bBail;
+}
+
+
+// the scan of that name, a proxy if it's not loaded
+static TbObj*
+find_scan(const char *name)
+{
+  DisplayableMesh *dm = FindMeshDisplayInfo(name);
+  if (dm) {
+    // the mesh is in memory
+    return dm->getMeshData();
+  }
+  // the mesh is not in memory; need to proxy
+  return createProxyScanNamed (name);
+}
+
+
+// a mapEntry from a pair database record; only reads the
+// scans' transforms, so it can be done in parallel
+static GlobalReg::mapEntry*
+make_entry(const PairDB::Pair &p, TbObj *a, TbObj *b)
+{
+  GlobalReg::mapEntry *me =
+    new GlobalReg::mapEntry(a, b, p.pts[0], p.pts[1], p.n,
+			    p.rel_xf, 1000000);
+  me->manually_aligned = p.manual;
+  me->quality_grade    = p.quality;
+  me->pw_point_rmsErr  = p.pw_point_rmsErr;
+  me->pw_plane_rmsErr  = p.pw_plane_rmsErr;
+  me->modifyDate       = p.mtime;
+  me->stats();
+  return me;
+}
+
+
+// Put an imported entry in the map.  Later overwrites the
+// first, unless the first was manually aligned and the later
+// not; returns false if the entry wasn't used.
+bool
+GlobalReg::import(mapEntry *entry)
+{
+  FOR_MATCHING_KEYS(entry->xfa, data) {
+    if ((data->xfa == entry->xfa && data->xfb == entry->xfb) ||
+	(data->xfb == entry->xfa && data->xfa == entry->xfb)) {
+      // this mapentry exists!
+      if (entry->manually_aligned && data->manually_aligned == false) {
+	// the previous entry was an autoICP entry, replace
+	cerr << "Warning: there seem to be several entries "
+	     << endl << "involving meshes " << nameFromTbObj(entry->xfa)
+	     << " and " << nameFromTbObj(entry->xfb) << endl;
+	cerr << "Replacing autoICP entry" << endl;
+	break;
+      } else {
+	// don't read this entry
+	return false;
+      }
+    }
+  } END_FOR_KEYS;
+
+  insert(entry);
+  if (cyber_raw_name) entry->export_cyber_raw(cyber_raw_name);
+  return true;
+}
+
+
+// Copy the pairs in the .gr files of gr_dir (manual) and
+// gr_dir/auto into the pair database, replacing what it has
+// for the same scans; returns the number of pairs copied.
+// The scans don't need to be loaded.
+int
+GlobalReg::convert_gr_files(void)
+{
+  std::string db = gr_dir + "/" PAIRDB_NAME;
+  std::string autoDir = gr_dir + "/auto";
+
+  cout << "Converting *.gr files into " << db.c_str()
+       << "..." << flush;
+
+  // the auto ones first, so that the manual ones win
+  struct GrFile {
+    std::string  path, name[2];
+    vector<Pnt3> ap, bp;
+    float        rel_xf[16];
+    PairDB::Pair p;
+    bool         ok;
+  };
+  vector<GrFile> gr;
+  for (int pass = 0; pass < 2; pass++) {
+    for (DirEntries de(pass ? gr_dir : autoDir, ".gr");
+	 !de.done(); de.next()) {
+      gr.push_back(GrFile());
+      gr.back().path     = de.path();
+      gr.back().p.manual = (pass == 1);
+    }
+  }
+
+  // reading and decoding the files is done in parallel...
+  int n = gr.size();
+  bool done = for_each_pair(n, "Converting pairs", [&](int i) {
+    GrFile &f = gr[i];
+    PairDB::Pair &p = f.p;
+    gr_file_names(f.path, f.name);
+    f.ok = read_gr_file(f.path, f.ap, f.bp, f.rel_xf,
+			p.pw_point_rmsErr, p.pw_plane_rmsErr,
+			p.quality, p.manual);
+    struct stat fileinfo;
+    stat (f.path.c_str(), &fileinfo);
+    p.name[0] = f.name[0].c_str();
+    p.name[1] = f.name[1].c_str();
+    p.pts[0]  = f.ap.size() ? &f.ap[0] : NULL;
+    p.pts[1]  = f.bp.size() ? &f.bp[0] : NULL;
+    p.n       = f.ap.size();
+    p.rel_xf  = f.rel_xf;
+    p.mtime   = fileinfo.st_mtime;
+  });
+
+  // ... and the writing in order, only if all of it was read
+  int cnt = 0;
+  PairDBWriter out;
+  if (done && n && out.open(db.c_str())) {
+    for (int i = 0; i < n; i++) {
+      if (gr[i].ok && out.put(gr[i].p)) cnt++;
+      // free as we go
+      vector<Pnt3>().swap(gr[i].ap);
+      vector<Pnt3>().swap(gr[i].bp);
+    }
+    out.close();
+  }
+
+  cout << " " << cnt << " pairs, done." << endl;
+  return cnt;
 }
 
 
@@ -1289,11 +1719,50 @@ GlobalReg::unlink_gr_files(TbObj *a, TbObj *b, bool only_auto)
     unlink_gr_file(gr_dir, name1, name2);
     unlink_gr_file(gr_dir, name2, name1);
   }
+
+  if (saver) {
+    saver->drop(name1.c_str(), name2.c_str(), only_auto);
+    return;
+  }
+  PairDBWriter db;
+  std::string path = gr_dir + "/" PAIRDB_NAME;
+  if (db.open(path.c_str())) {
+    db.drop(name1.c_str(), name2.c_str(), only_auto);
+    db.close();
+  }
+}
+
+
+void
+GlobalReg::begin_saving(void)
+{
+  if (nSaving++ > 0)
+    return;
+  saver = new PairDBWriter;
+  std::string path = gr_dir + "/" PAIRDB_NAME;
+  if (!saver->open(path.c_str())) {
+    // save pair by pair then
+    delete saver;
+    saver = NULL;
+  }
+}
+
+
+void
+GlobalReg::end_saving(void)
+{
+  if (nSaving == 0 || --nSaving > 0)
+    return;
+  if (saver && !saver->close())
+    cerr << "Couldn't finish writing the pair database" << endl;
+  delete saver;
+  saver = NULL;
 }
 
 
 GlobalReg::GlobalReg(void)
-  : initial_import_done(false)
+  : solver(solver_posegraph), incremental(false),
+    saver(NULL), nSaving(0), initial_import_done(false)
 {
 
   //
@@ -1331,6 +1800,11 @@ GlobalReg::GlobalReg(void)
 
 GlobalReg::~GlobalReg(void)
 {
+  if (saver) {
+    saver->close();
+    delete saver;
+  }
+
   // delete the mapEntries
   // recall they are there twice, delete only once!
   FOR_MAP_ENTRIES(key, data) {
@@ -1363,28 +1837,76 @@ GlobalReg::initial_import(void)
 void
 GlobalReg::perform_import(void)
 {
-  cerr << "Importing *.gr... " << flush;
+  std::string db = gr_dir + "/" PAIRDB_NAME;
+
+  // the first time, bring the pairs over from the *.gr files
+  struct stat fileinfo;
+  if (stat (db.c_str(), &fileinfo) != 0)
+    convert_gr_files();
+
+  cerr << "Importing " << db.c_str() << "... " << flush;
 
   int nTotal = 0, nYes = 0;
   int nTotalAuto = 0, nYesAuto = 0;
-  for (DirEntries de_auto(gr_auto_dir, ".gr");
-       !de_auto.done(); de_auto.next()) {
-    ++nTotalAuto;
-    if (import(de_auto.path()))
-      ++nYesAuto;
-  }
-
   int nQuality = mapEntry::qual_Good + 1;
   assert (nQuality == 4);
   int quality_bucket[4] = {0};
   mapEntry* entry;
-  for (DirEntries de(gr_dir, ".gr"); !de.done(); de.next()) {
-    ++nTotal;
-    if (entry = import(de.path(),true)) {
-      ++nYes;
-      ++quality_bucket[entry->getQuality()];
+  bool wasteful = false;
+
+  PairDB pdb;
+  if (pdb.open(db.c_str())) {
+    int n = pdb.size();
+    vector<PairDB::Pair> rec(n);
+    vector<TbObj*>       scan(2*n);
+
+    // finding the scans (and making proxies) goes through Tcl,
+    // so it's done here, once per name
+    typedef unordered_map<std::string,TbObj*> NameMap;
+    NameMap byName;
+    for (int i = 0; i < n; i++) {
+      pdb.get(i, rec[i]);
+      for (int is = 0; is < 2; is++) {
+	NameMap::iterator it = byName.find(rec[i].name[is]);
+	if (it == byName.end())
+	  it = byName.insert(NameMap::value_type(rec[i].name[is],
+						 find_scan(rec[i].name[is]))).first;
+	scan[2*i+is] = it->second;
+      }
     }
+
+    // the entries (copying the points, computing the errors)
+    // are made on the thread pool...
+    vector<mapEntry*> made(n, (mapEntry*)NULL);
+    if (!for_each_pair(n, "Importing pairs", [&](int i) {
+	  if (scan[2*i] && scan[2*i+1])
+	    made[i] = make_entry(rec[i], scan[2*i], scan[2*i+1]);
+	}))
+      cerr << "Warning: cancelled; not all pairs imported." << endl;
+
+    // ... and put in the map here, in the file's order
+    for (int i = 0; i < n; i++) {
+      entry = made[i];
+      if (entry && !import(entry)) {
+	delete entry;
+	entry = NULL;
+      }
+      if (rec[i].manual) {
+	++nTotal;
+	if (entry) {
+	  ++nYes;
+	  ++quality_bucket[entry->getQuality()];
+	}
+      } else {
+	++nTotalAuto;
+	if (entry) ++nYesAuto;
+      }
+    }
+    // mostly replaced records?
+    wasteful = 2 * pdb.live_bytes() < pdb.file_bytes();
+    pdb.close();
   }
+  if (wasteful) PairDB::compact(db.c_str());
 
   cerr << "imported " << nYesAuto << " / " << nTotalAuto << " auto; "
        << nYes << " / " << nTotal << " manual."
@@ -1394,7 +1916,40 @@ GlobalReg::perform_import(void)
     cerr << quality_bucket[i];
     if (i < nQuality - 1) cerr << " / ";
   }
-  cerr << endl << "done." << endl;
+  cerr << endl;
+
+  // the points are kept in 16 bit fixed point
+  long  bytes  = 0;
+  float maxErr = 0;
+  FOR_MAP_ENTRIES(key, data) {
+    if (key == data->xfb) continue;
+    bytes += data->ptsa.bytes() + data->ptsb.bytes();
+    maxErr = max(maxErr, max(data->ptsa.max_error(),
+			     data->ptsb.max_error()));
+  } END_FOR_MAP;
+  cerr << "Pairs take " << bytes / (1 << 20) << " MB, points to within "
+       << maxErr << endl;
+  cerr << "done." << endl;
+}
+
+
+// put the entry in the map, in place of a previous one for
+// the same scans
+void
+GlobalReg::insert(mapEntry *me)
+{
+  TbObj *a = me->xfa, *b = me->xfb;
+  // delete previous instance (the saved one is replaced by
+  // export_to_file)
+  deletePair(a,b, false);
+  // add it twice
+  hmm.insert(HMM::value_type(a,me));
+  hmm.insert(HMM::value_type(b,me));
+  // add to set
+  all_scans.insert(a);
+  all_scans.insert(b);
+  dirty_scans.insert(a);
+  dirty_scans.insert(b);
 }
 
 
@@ -1408,8 +1963,6 @@ GlobalReg::addPair(TbObj *a, TbObj *b,
 		   bool save, int saveQual)
 {
   assert(ap.size() == bp.size());
-  // delete previous instance
-  deletePair(a,b, save);
   // create a mapEntry
   mapEntry *me = new mapEntry(a,b,ap,bp,rel_xf,max_pairs);
   me->manually_aligned = manually_aligned;
@@ -1417,19 +1970,12 @@ GlobalReg::addPair(TbObj *a, TbObj *b,
   calcPairwiseRmsErr(ap,nrma,bp,nrmb,rel_xf,
 		     me->pw_point_rmsErr,
 		     me->pw_plane_rmsErr);
-  // add it twice
-  hmm.insert(HMM::value_type(a,me));
-  hmm.insert(HMM::value_type(b,me));
-  // add to set
-  all_scans.insert(a);
-  all_scans.insert(b);
-  dirty_scans.insert(a);
-  dirty_scans.insert(b);
+  insert(me);
 
   // Compute errors, results stored
   me->stats();
 
-  if (save) me->export_to_file(gr_dir);
+  if (save) me->export_to_file(gr_dir, saver);
   if (cyber_raw_name) me->export_cyber_raw(cyber_raw_name);
 
   return me;
@@ -1448,27 +1994,18 @@ GlobalReg::addPair(TbObj *a, TbObj *b,
 		   bool save, int saveQual)
 {
   assert(ap.size() == bp.size());
-  // delete previous instance
-  deletePair(a,b, save);
   // create a mapEntry
   mapEntry *me = new mapEntry(a,b,ap,bp,rel_xf,max_pairs);
   me->manually_aligned = manually_aligned;
   me->quality_grade = saveQual;
   me->pw_point_rmsErr = pw_point_rmsErr;
   me->pw_plane_rmsErr = pw_plane_rmsErr;
-  // add it twice
-  hmm.insert(HMM::value_type(a,me));
-  hmm.insert(HMM::value_type(b,me));
-  // add to set
-  all_scans.insert(a);
-  all_scans.insert(b);
-  dirty_scans.insert(a);
-  dirty_scans.insert(b);
+  insert(me);
 
   // Compute errors, results stored
   me->stats();
 
-  if (save) me->export_to_file(gr_dir);
+  if (save) me->export_to_file(gr_dir, saver);
   if (cyber_raw_name) me->export_cyber_raw(cyber_raw_name);
 
   return me;
@@ -1481,7 +2018,7 @@ GlobalReg::markPairQuality (TbObj *a, TbObj* b, int saveQual)
   FOR_MATCHING_KEYS(a, data) {
     if (data->xfa == b || data->xfb == b) {
       data->quality_grade = saveQual;
-      data->export_to_file(gr_dir);
+      data->export_to_file(gr_dir, saver);
       return true;
     }
   } END_FOR_KEYS;
@@ -1805,6 +2342,56 @@ GlobalReg::dump_connected_groups (void)
   cout << "(" << nGroups << ") total" << endl;
 }
 
+// align the connected groups of scans (in the incremental
+// mode only the ones with dirty scans)
+void
+GlobalReg::align_groups(void)
+{
+  // create a vector of the TbObj pointers
+  vector<TbObj*> scan;
+  unordered_map<TbObj*,int> ind;
+  for (ITS is = all_scans.begin(); is!=all_scans.end(); is++) {
+    ind[*is] = scan.size();
+    scan.push_back(*is);
+  }
+
+  // find the connected components
+  ConnComp cc(scan.size());
+  FOR_MAP_ENTRIES(key, data) {
+    if (key == data->xfb) continue;
+    cc.connect(ind[data->xfa], ind[data->xfb]);
+  } END_FOR_MAP;
+  vector<int> g;
+  vector< vector<TbObj*> > groups;
+  while (cc.get_next_group(g)) {
+    if (g.size() < 2) continue;
+    bool dirty = !incremental;
+    for (int i=0; i<g.size() && !dirty; i++)
+      dirty = (dirty_scans.find(scan[g[i]]) != dirty_scans.end());
+    if (!dirty) continue;
+    groups.push_back(vector<TbObj*>());
+    for (int i=0; i<g.size(); i++)
+      groups.back().push_back(scan[g[i]]);
+  }
+  if (incremental)
+    cout << groups.size() << " group(s) with changed scans" << endl;
+
+  if (solver == solver_posegraph) {
+    if (groups.size()) solve_groups(groups);
+  } else {
+    // for each connected component, align
+    for (int k=0; k<groups.size(); k++) {
+      align_group(groups[k]);
+      if (BailDetector::bail()) {
+	cerr << "global alignment cancelled." << endl;
+	break;
+      }
+    }
+  }
+  dirty_scans.erase(dirty_scans.begin(), dirty_scans.end());
+}
+
+
 // the old version of align (no area-normalization)
 void
 GlobalReg::align(float _ftol,
@@ -1818,36 +2405,7 @@ GlobalReg::align(float _ftol,
 
   } else {
     // align scans in connected groups
-
-    // create a vector of the TbObj pointers
-    vector<TbObj*> scan;
-    for (ITS is = all_scans.begin(); is!=all_scans.end(); is++) {
-      scan.push_back(*is);
-    }
-
-    // find the connected components
-    ConnComp cc(scan.size());
-    FOR_MAP_ENTRIES(key, data) {
-      if (key == data->xfb) continue;
-      cc.connect(scan_idx(data->xfa, scan),
-		 scan_idx(data->xfb, scan));
-    } END_FOR_MAP;
-    // for each connected component, align
-    vector<int> g;
-    vector<TbObj*> group;
-    while (cc.get_next_group(g)) {
-      if (g.size() > 1) {
-	group.clear();
-	for (int i=0; i<g.size(); i++)
-	  group.push_back(scan[g[i]]);
-	align_group(group);
-      }
-      if (BailDetector::bail()) {
-	cerr << "global alignment cancelled." << endl;
-	break;
-      }
-    }
-    dirty_scans.erase(dirty_scans.begin(), dirty_scans.end());
+    align_groups();
   }
 }
 
@@ -1870,53 +2428,22 @@ GlobalReg::align(float _ftol, Bbox worldBbox,
 
   } else {
     // align scans in connected groups
-
-    // create a vector of the TbObj pointers
-    vector<TbObj*> scan;
-    for (ITS is = all_scans.begin(); is!=all_scans.end(); is++) {
-      scan.push_back(*is);
-    }
-
-    // find the connected components
-    ConnComp cc(scan.size());
-    FOR_MAP_ENTRIES(key, data) {
-      if (key == data->xfb) continue;
-      cc.connect(scan_idx(data->xfa, scan),
-		 scan_idx(data->xfb, scan));
-    } END_FOR_MAP;
-    // for each connected component, align
-    vector<int> g;
-    vector<TbObj*> group;
-    while (cc.get_next_group(g)) {
-      if (g.size() > 1) {
-	group.clear();
-	for (int i=0; i<g.size(); i++)
-	  group.push_back(scan[g[i]]);
-	align_group(group);
-      }
-      if (BailDetector::bail()) {
-	cerr << "global alignment cancelled." << endl;
-	break;
-      }
-    }
-    dirty_scans.erase(dirty_scans.begin(), dirty_scans.end());
+    align_groups();
   }
 
 }
 
-// normalize_samples goes through the map entries and throws
-// out points based on a bucket structure that keeps track of
-// how many points are already in the unit volume to which
-// the new points belong.  only the set stored in scanToMoveTo
-// in align(...) should be normalized in this way.
+// normalize_samples thins out the pairs of the scans in
+// scanToMoveTo (all of them if NULL) so that no part of the
+// world holds many more than THRESHOLD points per VB_SIZE
+// cube: the neighbours of each point within VB_SIZE/2 are
+// counted with a kd-tree over all the points, and a point in
+// too dense a neighbourhood is kept with the probability that
+// brings the neighbourhood down to the allowed density.
+// only the set stored in scanToMoveTo in align(...) should be
+// normalized in this way.
 void GlobalReg::normalize_samples(Bbox worldBbox, TbObj *scanToMoveTo)
 {
-  VolumeBucket *vb;
-
-  cerr << "initializing buckets...";
-  int numBuckets = init_vol_buckets(&vb, worldBbox, scanToMoveTo,
-				    VB_SIZE);
-  cerr << "done" << endl;
   vector<TbObj*> scans; // vectorized version of scanToMoveTo
 
   // check to see if we're aligning with one scan or all scans
@@ -1929,169 +2456,54 @@ void GlobalReg::normalize_samples(Bbox worldBbox, TbObj *scanToMoveTo)
     }
   }
 
-  // iterating thru our scan vector, interate thru the map to
-  // find matching keys to the current scan we're considering
-  // for each point in ptsa (don't check ptsb because corresponds),
-  // - find which bucket it belongs to
-  // - check that bucket.
-  // - if too full, delete points from a and b
-  // - otherwise, throw the new points in the bucket
-
-  int bucketInd;
-
-  cerr << "iterating through points..." << scans.size() << " scans"
-       << endl;
+  // the pairs involving those scans (each entry is found
+  // under both of its scans), and the ptsa points in world
+  // coordinates (ptsb corresponds)
+  vector<mapEntry*> entries;
   for (int i = 0; i < scans.size(); i++) {
-    // data is a mapEntry
     FOR_MATCHING_KEYS(scans[i], data) {
-      vector<Pnt3>::iterator ip, ip2;
-      ip = data->ptsa.begin();
-      ip2 = data->ptsb.begin();
-      for (int j = 0; j < data->ptsa.size(); j++) {
-	assert(ip != data->ptsa.end());
-	assert(ip2 != data->ptsb.end());
-	// changed
-	Pnt3 temp(data->ptsa[j]);
-
-	scans[i]->xformPnt(temp);
-	cerr << "pt: " << temp[0] << " " << temp[1] << " "
-	     << temp[2];
-	bucketInd = find_bucket(temp, vb, VB_SIZE, numBuckets);
-	if (bucketInd == NOT_FOUND) {
-	  temp.set((data->ptsb[j])[0],
-		   (data->ptsb[j])[1], (data->ptsb[j])[2]);
-	  scans[i]->xformPnt(temp);
-	  bucketInd = find_bucket(temp, vb, VB_SIZE, numBuckets);
-	  assert(bucketInd != NOT_FOUND);
-	}
-	//if (should_delete_point(data->ptsa[j], vb, bucketInd)) {
-	if (vb[bucketInd].points.size() > THRESHOLD) {
-
-	  data->ptsa.erase(ip);
-	  data->ptsb.erase(ip2);
-	  cerr << "...throwing out" << endl;
-
-	} else {
-
-	  vb[bucketInd].points.push_back(temp);
-	  //vb[bucketInd].points.push_back(data->ptsa[j]);
-	  //vb[bucketInd].points.push_back(data->ptsb[j]);
-	  cerr << "...keeping" << endl;
-	}
-
-	ip++; ip2++;
-      } // for j
+      if (!CONTAINS(entries, data))
+	entries.push_back(data);
     } END_FOR_KEYS;
-  } // for i
-
-  cerr << "done" << endl;
-  free(vb);
-
-}
-
-// linear time vector delete
-// int k = 0;
-// 	  for (vector<Pnt3>::iterator ip = data->ptsa.begin();
-// 	       ip != data->ptsa.end(); ip++) {
-// 	    cerr << "looping a..., k = " << k << ", j = "
-// 		 << j << endl;
-// 	    if (k == j) {
-// 	      data->ptsa.erase(ip); break;
-// 	    }
-// 	    k++;
-// 	  }
-// 	  k = 0;
-// 	  for (vector<Pnt3>::iterator ip2 = data->ptsb.begin();
-// 	       ip2 != data->ptsb.end(); ip2++) {
-// 	    cerr << "looping b..., k = " << k << ", j = "
-// 		 << j << endl;
-// 	    if (k == j) {
-// 	      data->ptsb.erase(ip2); break;
-// 	    }
-// 	    k++;
-// 	  }
-
-bool GlobalReg::should_delete_point(Pnt3 pt, VolumeBucket *vb,
-				    int bucketInd)
-{
-  if (vb[bucketInd].points.size() > THRESHOLD) return (true);
-
-  // put poisson disk jitter here - efficient way to do this?
-  // if we go thru all the points in the bucket, it will be
-  // very slow...
-
-  return (false);
-}
-
-// figure out how large the space is
-// divide to make some number of buckets
-// store all the min and max vars for those buckets
-int GlobalReg::init_vol_buckets(VolumeBucket **vb,
-				Bbox worldBbox,
-				TbObj *scanToMoveTo, float bucket_side)
-{
-  Pnt3 min;
-  Bbox bbox; // bbox around all the scans in scanToMoveTo
-
-  if (scanToMoveTo) {
-    bbox.add(scanToMoveTo->worldBbox());
-  } else { // sTMT == NULL means use all
-    for (ITS is = all_scans.begin(); is != all_scans.end(); is++) {
-      TbObj *key = *is;
-      bbox.add(key->worldBbox());
-    }
   }
 
-  min.set(bbox.min()[0], bbox.min()[1], bbox.min()[2]);
-  Pnt3 dim = bbox.max() - min;
-  dim /= bucket_side;
-  Pnt3 xincr(bucket_side, 0, 0);
-  Pnt3 yincr(0, bucket_side, 0);
-  Pnt3 zincr(0, 0, bucket_side);
-
-  int numBuckets = ceil(dim[0]) * ceil(dim[1]) * ceil(dim[2]);
-  cerr << "Initializing " << numBuckets << " buckets...";
-  *vb = new VolumeBucket[numBuckets];
-  assert(*vb);
-  Pnt3 vol_size(bucket_side, bucket_side, bucket_side);
-  Pnt3 max;
-  int cnt = 0;
-
-  for (int i = 0; i < ceil(dim[0]); i++) {
-
-    for (int j = 0; j < ceil(dim[1]); j++) {
-
-      for (int k = 0; k < ceil(dim[2]); k++) {
-
-	max = min + vol_size;
-
-	((*vb)[cnt]).volume = Bbox(min, max);
-	min += zincr;
-	cnt++;
-      }
-      min.set(min[0], min[1], bbox.min()[2]);
-      min += yincr;
-    }
-    min.set(min[0], bbox.min()[1], min[2]);
-    min += xincr;
+  vector<Pnt3> pts;
+  for (int i = 0; i < entries.size(); i++) {
+    mapEntry *data = entries[i];
+    int k = pts.size();
+    data->ptsa.unpack(pts);
+    for (int j = k; j < pts.size(); j++)
+      data->xfa->xformPnt(pts[j]);
   }
-  assert(cnt == numBuckets);
-  return (numBuckets);
-}
+  if (pts.size() == 0) return;
 
-// TODO: optimize so runs in constant time
-// (currently linear time)
-int GlobalReg::find_bucket(Pnt3 pt, VolumeBucket *vb,
-			   float bucket_side, int numBuckets)
-{
-  for (int i = 0; i < numBuckets; i++) {
-    if (!vb[i].volume.outside(pt)) {
-      return (i);
+  KDindtree *tree = CreateKDindtree(&pts[0], NULL, pts.size());
+  vector<int> first, nbors;
+  cout << "Normalizing pair density... " << flush;
+  tree->radius_search(&pts[0], pts.size(), .5 * VB_SIZE, first, nbors);
+  delete tree;
+
+  // the ball covers pi/6 of the cube
+  float allowed = THRESHOLD * M_PI / 6;
+  Random rnd;
+  int k = 0, nKept = 0;
+  for (int i = 0; i < entries.size(); i++) {
+    mapEntry *data = entries[i];
+    int n = data->ptsa.size(), end = 0;
+    for (int j = 0; j < n; j++, k++) {
+      int cnt = first[k+1] - first[k];
+      if (cnt > allowed && rnd() >= allowed / cnt)
+	continue;   // throw out
+      data->ptsa.move(end, j);
+      data->ptsb.move(end, j);
+      end++;
     }
+    data->ptsa.resize(end);
+    data->ptsb.resize(end);
+    nKept += end;
   }
-
-  return (NOT_FOUND);
-  //return (1);
+  cout << "kept " << nKept << " of " << pts.size() << " points."
+       << endl;
 }
 
 std::string
@@ -22,6 +22,8 @@
 #include "absorient.h"
 #include "TbObj.h"
 #include "Bbox.h"
+#include "PairDB.h"
+#include "PackedPts.h"
 
 class GlobalReg {
 private:
@@ -29,10 +31,14 @@ private:
   typedef Xform<float> XF_F;
 
   float         ftol;
+  int           solver;   // how the groups are aligned, see Solver
+  bool          incremental;  // only touch groups with dirty scans
 
   std::string   gr_dir;
   std::string   gr_auto_dir;
   char          *cyber_raw_name;
+  PairDBWriter  *saver;       // see begin_saving()
+  int            nSaving;
 
   //
   // definitions for a hash_multimap
@@ -47,7 +53,7 @@ private:
 
   public:
     TbObj   *xfa, *xfb;         // current transforms
-    vector<Pnt3> ptsa, ptsb;    // points in world coordinates
+    PackedPts    ptsa, ptsb;    // points in the scans' coordinates
     Xform<float> rel_xf;
     float   maxErr;  // point-to-point errors after globalreg
     float   avgErr;
@@ -63,15 +69,34 @@ private:
 	     const vector<Pnt3> &a, const vector<Pnt3> &b,
 	     Xform<float> rxf,
 	     int max_pairs = 0)
-      : xfa(xa), xfb(xb), ptsa(a), ptsb(b),
-      manually_aligned(false), rel_xf(rxf)
+      : xfa(xa), xfb(xb), manually_aligned(false), rel_xf(rxf)
       {
-	if (ptsa.size() > max_pairs) {
+	set_pts(a.size() ? &a[0] : NULL, b.size() ? &b[0] : NULL,
+		a.size(), max_pairs);
+      }
+    // same from n pairs in arrays
+    mapEntry(TbObj *xa, TbObj *xb,
+	     const Pnt3 *a, const Pnt3 *b, int n,
+	     Xform<float> rxf,
+	     int max_pairs = 0)
+      : xfa(xa), xfb(xb), manually_aligned(false), rel_xf(rxf)
+      {
+	set_pts(a, b, n, max_pairs);
+      }
+    // keep a random max_pairs of the pairs (all if 0), packed
+    void set_pts(const Pnt3 *a, const Pnt3 *b, int n, int max_pairs)
+      {
+	if (max_pairs && n > max_pairs) {
 	  // too many pairs, remove some
-	  int n_left  = ptsa.size();
+	  vector<Pnt3> ta(a, a+n), tb(b, b+n);
+	  int n_left  = n;
 	  int end     = n_left;
 	  int allowed = max_pairs;
-	  Random rnd;
+	  // a stream of its own, keyed by the pairs, so the
+	  // thinning doesn't depend on what was done before
+	  RandomStream rnd(RandomStream::data_key(a, sizeof(Pnt3),
+				RandomStream::data_key(b, sizeof(Pnt3),
+						       n_left)));
 	  while (n_left && allowed) {
 	    if (rnd() < float(allowed) / float(n_left)) {
 	      // keep
@@ -79,16 +104,15 @@ private:
 	    } else {
 	      // don't keep
 	      n_left--;  end--;
-	      ptsa[n_left] = ptsa[end];
-	      ptsb[n_left] = ptsb[end];
+	      ta[n_left] = ta[end];
+	      tb[n_left] = tb[end];
 	    }
 	  }
-	  if (max_pairs) {
-	    // clean the vectors
-// STL Update
-	    ptsa.erase(ptsa.begin() + (max_pairs), ptsa.end());
-	    ptsb.erase(ptsb.begin() + (max_pairs), ptsb.end());
-	  }
+	  ptsa.pack(&ta[0], max_pairs);
+	  ptsb.pack(&tb[0], max_pairs);
+	} else {
+	  ptsa.pack(a, n);
+	  ptsb.pack(b, n);
 	}
 	//cout << "constructing " << int(this) << endl;
 	time (&modifyDate);
@@ -98,14 +122,6 @@ private:
 	//cout << "destructing " << int(this) << endl;
       }
 
-    const Pnt3 *pts(TbObj *x)
-      {
-	if (x == xfa) return &ptsa[0];
-	if (x == xfb) return &ptsb[0];
-	assert(0);
-	return NULL;
-      }
-
     int getQuality (void)
       {
 	if (quality_grade > qual_Good) return qual_Good;
@@ -116,8 +132,12 @@ private:
     // return max distant, count, and sum of distants
     void stats(void);
 
-    // try writing the mapEntry data into a single file
-    void export_to_file(const std::string &gr_dir);
+    // add the pair to the pair database in gr_dir, through
+    // out if it's given
+    void export_to_file(const std::string &gr_dir,
+			PairDBWriter *out = NULL);
+    // or write it into a .gr file of its own
+    void export_gr_file(const std::string &gr_dir);
     // try writing the mapEntry data into a single file
     // for CyberScans, raw data
     void export_cyber_raw(const char *fname);
@@ -150,26 +170,6 @@ private:
   // The set is cleaned after align_group().
   HS  dirty_scans;
 
-  // a volume bucket is defines a space in the bbox of the
-  // collection of scans which we'll throw points into
-  // in order to area-normalize the number of points
-  // considered in the alignment
-  typedef struct {
-
-    vector<Pnt3> points;
-    Bbox volume;
-
-  } VolumeBucket;
-
-  // helpers to normalize_points
-  bool should_delete_point(Pnt3 pt, VolumeBucket *vb,
-			   int bucketInd);
-  int init_vol_buckets(VolumeBucket **vb,
-		       Bbox worldBbox,
-		       TbObj *scanToMoveTo,
-		       float bucket_side = 1.0);
-  int find_bucket(Pnt3 pt, VolumeBucket *vb,
-		  float bucket_side, int numBuckets);
   void  get_pts(TbObj *x, vector<Pnt3> &P, vector<Pnt3> &Q,
 		TbObj* partner = NULL);
   void  get_pts_within_group(TbObj *x,
@@ -185,6 +185,10 @@ private:
   Xform<float> compute_xform(vector<Pnt3> &P, vector<Pnt3> &Q);
   void align_one_to_others(TbObj* one, TbObj* two = NULL);
   void align_group(const vector<TbObj*> &group);
+  void relax_group(const vector<TbObj*> &group);
+  void solve_groups(const vector< vector<TbObj*> > &groups);
+  void align_groups(void);
+  float rms_error(void);
   bool getPairError(TbObj* a, TbObj* b,
 		    float &pointError,
 		    float &planeError,
@@ -192,7 +196,8 @@ private:
 		    bool  &manual);
 
   bool initial_import_done;
-  mapEntry* import(const std::string &fname, bool manual = false);
+  bool import(mapEntry *entry);
+  void insert(mapEntry *entry);
 
   void unlink_gr_files(TbObj *a, TbObj *b, bool only_auto = false);
 
@@ -204,6 +209,14 @@ public:
 
   void initial_import(void);
   void perform_import(void);
+  // copy the pairs from the old *.gr files into the pair
+  // database (see PairDB.h)
+  int  convert_gr_files(void);
+  // Pairs saved between these two go through one writer of
+  // the pair database, which writes its index once at the end
+  // instead of after every pair.  Calls can be nested.
+  void begin_saving(void);
+  void end_saving(void);
   // manipulate pairs
   mapEntry* addPair(TbObj *a, TbObj *b,
 		    const vector<Pnt3> &ap, const vector<Pnt3> &nrma,
@@ -252,6 +265,34 @@ public:
 
    void normalize_samples(Bbox worldBbox, TbObj *scanToMoveTo);
 
+  // How a connected group of scans is aligned: either moving
+  // one scan at a time to its neighbours until nothing moves
+  // much (the original method), or all of them at once with
+  // a sparse least squares solver (see PoseGraph.h).
+  enum Solver { solver_relax, solver_posegraph };
+  void setSolver(Solver s) { solver = s; }
+  Solver getSolver(void)   { return (Solver)solver; }
+
+  // In the incremental mode align() only works on the groups
+  // that have dirty scans (that got new pairs since the last
+  // time), and with the pose graph solver only moves the
+  // dirty scans and their partners.
+  void setIncremental(bool on) { incremental = on; }
+  bool getIncremental(void)    { return incremental; }
+
+  // Run align(ftol) with each solver, and report the time taken
+  // and the resulting RMS pair distance; the scans are put
+  // back where they were afterwards.
+  std::string benchmark(float ftol);
+
+  // Align nScans made up scans on a grid, with pairwise
+  // alignments off by up to noise, and report the time taken
+  // and the error against the true poses (GlobalRegBench.cc).
+  // Doesn't touch the scene or the pairs of this object.
+  static std::string synthetic_benchmark(int nScans, float overlap,
+					 float noise, float ftol,
+					 Solver solver);
+
   // status and debugging info
   bool pairRegistered(TbObj *a, TbObj *b,
 		      bool &manual,
@@ -0,0 +1,151 @@
+//############################################################
+//
+// GlobalRegBench.cc
+//
+// Timing and accuracy of the global registration on made up
+// data: synthetic scans on a grid, each overlapping its eight
+// neighbours, with pairs whose pairwise alignments have a
+// known amount of error.  Reached from Tcl with
+// 'plv_globalreg synthbench'.
+//
+//############################################################
+
+#include <iostream>
+#include <stdio.h>
+#include <math.h>
+#include "GlobalReg.h"
+#include "ScanFactory.h"
+#include "RigidScan.h"
+#include "absorient.h"
+#include "Random.h"
+#include "RegistrationStatistics.h"
+
+
+#define BENCH_SIZE   100     // half the side of a scan's cube
+#define BENCH_PAIRS  200     // pairs per overlapping scan pair
+
+
+// a small random rigid motion: rotation up to angle radians,
+// translation up to dist
+static Xform<float>
+jiggle(RandomStream &rs, float angle, float dist)
+{
+  Xform<float> xf;
+  xf.rot(angle * (2 * rs() - 1), rs() - .5, rs() - .5, rs() - .5 + 1e-3);
+  xf.translate(dist * (2 * rs() - 1), dist * (2 * rs() - 1),
+	       dist * (2 * rs() - 1));
+  return xf;
+}
+
+
+// corners of the scans' cubes, where the scans are and where
+// they should be, for measuring how far off the scans are
+static void
+corners(const vector<RigidScan*> &scan, const vector<Xform<float> > *xf,
+	vector<Pnt3> &pts)
+{
+  pts.clear();
+  for (int i = 0; i < scan.size(); i++) {
+    for (int c = 0; c < 8; c++) {
+      Pnt3 p((c & 1) ? BENCH_SIZE : -BENCH_SIZE,
+	     (c & 2) ? BENCH_SIZE : -BENCH_SIZE,
+	     (c & 4) ? BENCH_SIZE : -BENCH_SIZE);
+      if (xf) (*xf)[i](p);
+      else    scan[i]->xformPnt(p);
+      pts.push_back(p);
+    }
+  }
+}
+
+
+// Make nScans scans on a square grid; neighbours overlap by
+// the fraction overlap of a scan's side.  Each pairwise
+// alignment is off by up to noise (in scan units, and noise
+// / BENCH_SIZE radians).  The scans start off by up to ten
+// times that.  Then align them and tell how long it took and
+// how far they ended from the truth (after taking out the
+// motion of the whole set, which the pairs don't fix).
+std::string
+GlobalReg::synthetic_benchmark(int nScans, float overlap, float noise,
+			       float ftol, Solver solver)
+{
+  // align() saves the scans for undo; keep the user's history
+  TbObj::UndoHold hold;
+
+  RandomStream rs(RandomStream::name_key("synthbench", nScans));
+  int side = int(ceil(sqrt((double)nScans)));
+  float spacing = 2 * BENCH_SIZE * (1 - overlap);
+
+  vector<RigidScan*>    scan(nScans);
+  vector<Xform<float> > truth(nScans);
+  for (int i = 0; i < nScans; i++) {
+    scan[i] = CreateScanFromThinAir(BENCH_SIZE);
+    Xform<float> xf;
+    xf.rot(.1 * (2 * rs() - 1), 0, 0, 1);
+    xf.translate((i % side) * spacing, (i / side) * spacing, 0);
+    truth[i] = xf;
+    if (i) xf = jiggle(rs, 10 * noise / BENCH_SIZE, 10 * noise) * xf;
+    scan[i]->setXform(xf, false);
+  }
+
+  GlobalReg gr;
+  gr.setSolver(solver);
+  int nEntries = 0;
+  vector<Pnt3> ap(BENCH_PAIRS), bp(BENCH_PAIRS);
+  for (int a = 0; a < nScans; a++) {
+    for (int b = a+1; b < nScans; b++) {
+      int dx = b % side - a % side, dy = b / side - a / side;
+      if (abs(dx) > 1 || dy > 1) continue;
+
+      // points in the middle of the overlap, in each scan's
+      // coordinates
+      Xform<float> ia = truth[a], ib = truth[b];
+      ia.fast_invert();
+      ib.fast_invert();
+      Pnt3 ctr = .5 * (Pnt3(a % side, a / side, 0) +
+		       Pnt3(b % side, b / side, 0)) * spacing;
+      float ext = BENCH_SIZE * overlap;
+      for (int k = 0; k < BENCH_PAIRS; k++) {
+	Pnt3 w = ctr + Pnt3(ext * (2 * rs() - 1), ext * (2 * rs() - 1),
+			    BENCH_SIZE * (2 * rs() - 1));
+	ap[k] = w;  ia(ap[k]);
+	bp[k] = w;  ib(bp[k]);
+      }
+      // what the pairwise alignment found: truth, a bit off
+      Xform<float> rel = jiggle(rs, noise / BENCH_SIZE, noise) * ib
+	* truth[a];
+      gr.addPair(scan[a], scan[b], ap, bp, noise, noise, rel,
+		 false, BENCH_PAIRS, false);
+      nEntries++;
+    }
+  }
+
+  float start = gr.rms_error();
+  double t = ICPStats::now();
+  gr.align(ftol);
+  t = ICPStats::now() - t;
+  float end = gr.rms_error();
+
+  // take out the motion of the whole set, then the RMS
+  // distance of the cube corners from where they should be
+  vector<Pnt3> P, Q;
+  corners(scan, NULL, P);
+  corners(scan, &truth, Q);
+  Xform<float> xf = gr.compute_xform(P, Q);
+  double sumSq = 0;
+  for (int i = 0; i < P.size(); i++) {
+    xf(P[i]);
+    sumSq += dist2(P[i], Q[i]);
+  }
+  float poseErr = sqrt(sumSq / P.size());
+
+  for (int i = 0; i < nScans; i++)
+    delete scan[i];
+
+  char buf[300];
+  sprintf(buf, "%d scans, %d pairs, %s: %.3f s, rms %g -> %g,"
+	  " pose error %g\n", nScans, nEntries,
+	  solver == solver_relax ? "relax" : "posegraph",
+	  t, start, end, poseErr);
+  return buf;
+}
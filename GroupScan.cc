@@ -5,6 +5,7 @@
 #include "GroupScan.h"
 #include "MeshTransport.h"
 #include "DisplayMesh.h"
+#include "WorkerPool.h"
 
 
 // STL Update
@@ -450,6 +451,67 @@ GroupScan::closest_point(const Pnt3 &p, const Pnt3 &n,
 }
 
 
+void
+GroupScan::closest_points(const Pnt3 *p, const Pnt3 *n, int count,
+			  Pnt3 *cl_pnt, Pnt3 *cl_nrm, bool *found,
+			  float thr, bool bdry_ok, float eps)
+{
+  // same as closest_point(), but one child at a time for the
+  // whole batch; each child splits its query across the pool
+  vector<Pnt3>  mp(count), mn(count), cp(count), cn(count);
+  vector<float> closest(count, 1e33);
+  vector<RigidScan*> winner(count, (RigidScan*)NULL);
+  bool *ok = new bool[count];
+  WorkerPool& pool = WorkerPool::global();
+
+  fill(found, found+count, false);
+
+  FOR_EACH_CHILD (it) {
+    RigidScan* rs = (*it)->getMeshData();
+    Xform<float> xf = rs->getXform();
+    Xform<float> xfn = xf;
+    xfn.removeTranslation();
+
+    pool.parallel_for(count, 1024, [&](int b, int e) {
+      for (int i = b; i < e; i++) {
+	mp[i] = p[i]; mp[i].invxform (xf);
+	mn[i] = n[i]; mn[i].invxform (xfn);
+      }
+    });
+
+    rs->closest_points (&mp[0], &mn[0], count, &cp[0], &cn[0], ok,
+			thr, bdry_ok, eps);
+
+    pool.parallel_for(count, 1024, [&](int b, int e) {
+      for (int i = b; i < e; i++) {
+	if (!ok[i]) continue;
+	found[i] = true;
+	float dist = (mp[i]-cp[i]).norm2();
+	if (dist < closest[i]) {
+	  winner[i] = rs;
+	  cl_pnt[i] = cp[i];
+	  cl_nrm[i] = cn[i];
+	  closest[i] = dist;
+	}
+      }
+    });
+  }
+  delete[] ok;
+
+  // the output is still in the coordinate system of the winning subscan
+  pool.parallel_for(count, 1024, [&](int b, int e) {
+    for (int i = b; i < e; i++) {
+      if (!found[i]) continue;
+      assert (winner[i] != NULL);
+      Xform<float> xf = winner[i]->getXform();
+      xf (cl_pnt[i]);
+      xf.removeTranslation();
+      xf (cl_nrm[i]);
+    }
+  });
+}
+
+
 bool
 GroupScan::write_metadata (MetaData data)
 {
@@ -52,6 +52,11 @@ class GroupScan: public RigidScan
   closest_point(const Pnt3 &p, const Pnt3 &n,
 		Pnt3 &cl_pnt, Pnt3 &cl_nrm,
 		float thr = 1e33, bool bdry_ok = 0);
+  virtual void
+  closest_points(const Pnt3 *p, const Pnt3 *n, int count,
+		 Pnt3 *cl_pnt, Pnt3 *cl_nrm, bool *found,
+		 float thr = 1e33, bool bdry_ok = 0,
+		 float eps = 0);
 
   // need to support:
   // read, write
@@ -24,6 +24,8 @@
 #include "Xform.h"
 #include "Pnt3.h"
 #include "GlobalReg.h"
+#include "RegistrationStatistics.h"
+#include "WorkerPool.h"
 
 #include "DrawObj.h"
 extern DrawObjects draw_other_things;
@@ -34,6 +36,21 @@ template <class T>
 class ICP : public DrawObj {
     public:
         bool allow_bdry;
+        // if > 0, the early iterations of align() and auto_align()
+        // use approximate closest points, at most (1+approx_eps)
+        // times farther than the true ones; see eps_schedule()
+        float approx_eps;
+        // find the pairs by projecting into the other scan's
+        // range grid rather than by searching the whole scan,
+        // for the scans that support it (see
+        // RigidScan::projective_points)
+        bool projective;
+        // print what's going on (off when many pairs are aligned
+        // at once, see SczAutoRegisterCmd)
+        bool verbose;
+        // per-iteration timings and errors of the last run, if
+        // stats.enabled
+        ICPStats stats;
     private:
         T            P, Q;
         Xform<float> xfP, xfQ; // xfP is changed, xfQ stays constant
@@ -42,43 +59,65 @@ class ICP : public DrawObj {
         vector<Pnt3> pP, pQ, nP, nQ; // stored in world coords
         int firstend;
 
-        Median<double> med;
+        // Scratch space reused from iteration to iteration, so
+        // that after the first few iterations nothing is allocated
+        // per iteration: the squared pair distances for culling
+        // (and a copy to select the percentile from), and the
+        // query and answer arrays of find_pairs_from()
+        vector<float> cullD, cullSel;
+        vector<Pnt3>  qwp, qwn, qlp, qln, qcp, qcn;
+        bool         *qfound;
+        int           qfoundSize;
+
+        // time spent in the current iteration so far, for stats
+        double tSample, tPairs, tCull;
+        float  cullThr;
 
         // return culling threshold
         float cull_pairs(int  p, // percentage to cull, [0,100]
                 bool cull = true)
         {
-            if (p == 0) return 1.e33;
+            double t = ICPStats::now();
+            cullThr = _cull_pairs(p, cull);
+            tCull += ICPStats::now() - t;
+            return cullThr;
+        }
 
-            med.set_percentage((100-p)/100.0); med.clear();
+        float _cull_pairs(int p, bool cull)
+        {
             int n = pP.size();
-            vector<double> d(n);
+            if (p == 0 || n == 0) return 1.e33;
 
-            int i;
-            for (i=0; i<n; i++) {
-                med += d[i] = dist2(pP[i],pQ[i]);
-            }
-            double thr = med.find();
+            cullD.resize(n);
+            for (int i=0; i<n; i++)
+                cullD[i] = dist2(pP[i],pQ[i]);
+
+            // the (100-p)th percentile, the same element as
+            // Median picks; nth_element is linear on average
+            cullSel = cullD;
+            int k = int((100-p)/100.0 * (n-.5));
+            nth_element(cullSel.begin(), cullSel.begin()+k, cullSel.end());
+            float thr = cullSel[k];
 
             if (cull) {
-                i=0;
-                int k = 0;
-                for (int j=0; j<pP.size(); j++) {
-                    if (d[j] <= thr) {
+                // compact the pairs in one pass
+                int i = 0, drop = 0;
+                for (int j=0; j<n; j++) {
+                    if (cullD[j] <= thr) {
                         // keep
-                        pP[i] = pP[j]; pQ[i] = pQ[j];
-                        nP[i] = nP[j]; nQ[i] = nQ[j];
+                        if (i != j) {
+                            pP[i] = pP[j]; pQ[i] = pQ[j];
+                            nP[i] = nP[j]; nQ[i] = nQ[j];
+                        }
                         i++;
                     } else {
-                        if (j < firstend) k++;
+                        if (j < firstend) drop++;
                     }
                 }
-                // STL Update
-                pP.erase(pP.begin()+i, pP.end());
-                pQ.erase(pQ.begin()+i, pQ.end());
-                nP.erase(nP.begin()+i, nP.end());
-                nQ.erase(nQ.begin()+i, nQ.end());
-                firstend -= k;
+                // shrinking keeps the capacity
+                pP.resize(i); pQ.resize(i);
+                nP.resize(i); nQ.resize(i);
+                firstend -= drop;
             }
             return sqrtf(thr);
         }
@@ -122,62 +161,113 @@ class ICP : public DrawObj {
         }
 
 
-        void find_pairs(float thr)
+        // point-to-plane in one pass over the pairs (see
+        // point_to_plane()), with optional robust weights; the
+        // second step on the same pairs is only taken if the
+        // first one rotated more than half a degree, below that
+        // the linearization is already accurate
+        float P2P_align(RobustWeight robust)
+        {
+            double q[7];
+            for (int j=0; j<2; j++) {
+                point_to_plane(&pP[0], &pQ[0], &nQ[0], pP.size(), q,
+                        robust);
+
+                // apply the motion to the current transformation
+                xfP.addQuaternion(q, 7);
+
+                Xform<float> _xf;
+                _xf.addQuaternion (q, 7);
+                for_each(pP.begin(), pP.end(), _xf);
+
+                // q[0] is the cosine of half the rotation angle
+                if (fabs(q[0]) > cos(.25 * M_PI / 180)) break;
+            }
+            return RMS_point_to_point_error();
+        }
+
+
+        // query the points ss (normals ssn, local coords of the scan
+        // with xfS) against the scan Tgt (with xfT); the queries are
+        // handed over in a single batch so that the scan can answer
+        // them in parallel
+        void find_pairs_from(const Xform<float> &xfS,
+                const vector<Pnt3> &ss, const vector<Pnt3> &ssn,
+                T Tgt, const Xform<float> &xfT,
+                float thr, float eps,
+                vector<Pnt3> &pS, vector<Pnt3> &nS,
+                vector<Pnt3> &pT, vector<Pnt3> &nT)
+        {
+            int n = ss.size();
+            if (n == 0) return;
+            qwp.resize(n); qwn.resize(n); qlp.resize(n);
+            qln.resize(n); qcp.resize(n); qcn.resize(n);
+            if (qfoundSize < n) {
+                delete[] qfound;
+                qfound = new bool[qfoundSize = n];
+            }
+            Pnt3 *wp = &qwp[0], *wn = &qwn[0], *lp = &qlp[0];
+            Pnt3 *ln = &qln[0], *cp = &qcp[0], *cn = &qcn[0];
+            bool *found = qfound;
+
+            Xform<float> xfi = xfT; xfi.fast_invert();
+            for (int i=0; i<n; i++) {
+                // point to other mesh's coords
+                xfS.apply(ss[i], wp[i]); xfS.apply_nrm(ssn[i], wn[i]); // world
+                xfi.apply(wp[i], lp[i]); xfi.apply_nrm(wn[i], ln[i]); // local in T
+            }
+
+            if (!projective ||
+                    !Tgt->projective_points(&lp[0], &ln[0], n,
+                        &cp[0], &cn[0], found, thr, allow_bdry))
+                Tgt->closest_points(&lp[0], &ln[0], n, &cp[0], &cn[0], found,
+                        thr, allow_bdry, eps);
+
+            for (int i=0; i<n; i++) {
+                if (!found[i]) continue;
+                // store world coords
+                // point
+                pS.push_back(wp[i]);
+                xfT(cp[i]); pT.push_back(cp[i]);
+                // normal
+                nS.push_back(wn[i]);
+                nT.push_back(Pnt3()); xfT.apply_nrm(cn[i], nT.back());
+            }
+        }
+
+
+        void find_pairs(float thr, float eps = 0)
         {
+            double t = ICPStats::now();
             pP.clear(); pQ.clear(); nP.clear(); nQ.clear();
             int n = ssP.size() + ssQ.size();
 
-            cout << "Finding ~" << n << " points there... " << flush;
+            if (verbose)
+                cout << "Finding ~" << n << " points there... " << flush;
 
             pP.reserve(n); pQ.reserve(n); nP.reserve(n); nQ.reserve(n);
             // for each selected point, find the closest point
-            Pnt3 wp,wn,lp,ln,cp,cn;
-            n = ssP.size();
             // first, from P to Q
-            Xform<float> xfi = xfQ; xfi.fast_invert();
-            for (int i=0; i<n; i++) {
-                // point to other mesh's coords
-                xfP.apply(ssP[i], wp); xfP.apply_nrm(ssPn[i], wn); // world
-                xfi.apply(wp, lp);     xfi.apply_nrm(wn, ln); // local in Q
-                if (Q->closest_point(lp, ln, cp, cn, thr, allow_bdry)) {
-                    // store world coords
-                    // point
-                    pP.push_back(wp);
-                    xfQ(cp); pQ.push_back(cp);
-                    // normal
-                    nP.push_back(wn);
-                    nQ.push_back(Pnt3()); xfQ.apply_nrm(cn, nQ.back());
-                }
-            }
+            find_pairs_from(xfP, ssP, ssPn, Q, xfQ, thr, eps, pP, nP, pQ, nQ);
 
-            cout << "(" << pP.size() << "), and back... " << flush;
+            if (verbose)
+                cout << "(" << pP.size() << "), and back... " << flush;
 
             firstend = pP.size();
             // then, from Q to P
-            xfi = xfP; xfi.fast_invert();
-            n = ssQ.size();
-            for (int i=0; i<n; i++) {
-                // point to other mesh's coords
-                xfQ.apply(ssQ[i], wp); xfQ.apply_nrm(ssQn[i], wn); // world
-                xfi.apply(wp, lp);     xfi.apply_nrm(wn, ln); // local in P
-                if (P->closest_point(lp, ln, cp, cn, thr, allow_bdry)) {
-                    // store world coords
-                    // point
-                    pQ.push_back(wp);
-                    xfP(cp); pP.push_back(cp);
-                    // normal
-                    nQ.push_back(wn);
-                    nP.push_back(Pnt3()); xfP.apply_nrm(cn, nP.back());
-                }
-            }
+            find_pairs_from(xfQ, ssQ, ssQn, P, xfP, thr, eps, pQ, nQ, pP, nP);
 
-            cout << "(" << pP.size() - firstend << "): done." << endl;
+            if (verbose)
+                cout << "(" << pP.size() - firstend << "): done." << endl;
+            tPairs += ICPStats::now() - t;
         }
 
 
     public:
 
-        ICP(void) : allow_bdry(0), firstend(0)
+        ICP(void) : allow_bdry(0), approx_eps(0), projective(0),
+            verbose(1), firstend(0), qfound(NULL), qfoundSize(0),
+            tSample(0), tPairs(0), tCull(0), cullThr(1.e33)
     {
         draw_other_things.add(this);
     }
@@ -185,6 +275,7 @@ class ICP : public DrawObj {
         ~ICP(void)
         {
             draw_other_things.remove(this);
+            delete[] qfound;
         }
 
         void set(T p, T q)
@@ -194,6 +285,18 @@ class ICP : public DrawObj {
             xfQ = Q->getXform();
         }
 
+        // epsilon for the approximate closest point search on
+        // iteration i of n: starts at approx_eps, falls linearly
+        // to zero at the halfway point, and the second half of
+        // the iterations is exact
+        float eps_schedule(int i, int n)
+        {
+            if (approx_eps <= 0 || n <= 1) return 0;
+            float half = .5 * n;
+            if (i >= half) return 0;
+            return approx_eps * (half - i) / half;
+        }
+
         float RMS_point_to_point_error(void)
         {
             float len = 0;
@@ -202,95 +305,95 @@ class ICP : public DrawObj {
             return sqrtf(len/n);
         }
 
+        float RMS_point_to_plane_error(void)
+        {
+            float len = 0;
+            int n = pP.size();
+            if (n == 0) return 0;
+            for (int i=0; i<n; i++) {
+                float d = dot(pP[i]-pQ[i], nQ[i]);
+                len += d*d;
+            }
+            return sqrtf(len/n);
+        }
+
 
-        void sort_into_buckets(const vector<Pnt3> &n,
-                vector< vector<int> > &normbuckets)
+        // one alignment step with the current pairs, method as
+        // for align()
+        float optimize(int method)
         {
-            const int Q = 4;
-            const float Qsqrt1_2 = 2.8284f;
-            normbuckets.resize(3*Q*Q);
-            for (int i=0; i < n.size(); i++) {
-                const float *N = &n[i][0];
-                float ax = fabs(N[0]), ay = fabs(N[1]), az = fabs(N[2]);
-                int A;
-                float u, v;
-                if (ax > ay) {
-                    if (ax > az) {
-                        A = 0;  u = (N[0] > 0) ? N[1] : -N[1];  v = (N[0] > 0) ? N[2] : -N[2];
-                    } else {
-                        A = 2;  u = (N[2] > 0) ? N[0] : -N[0];  v = (N[2] > 0) ? N[1] : -N[1];
-                    }
-                } else {
-                    if (ay > az) {
-                        A = 1;  u = (N[1] > 0) ? N[2] : -N[2];  v = (N[1] > 0) ? N[0] : -N[0];
-                    } else {
-                        A = 2;  u = (N[2] > 0) ? N[0] : -N[0];  v = (N[2] > 0) ? N[1] : -N[1];
-                    }
-                }
-                int U = int(u * Qsqrt1_2) + (Q/2);
-                int V = int(v * Qsqrt1_2) + (Q/2);
-                normbuckets[((A * Q) + U) * Q + V].push_back(i);
+            double t = ICPStats::now();
+            float err;
+            switch (method) {
+            case 0:  err = CM_align();                 break;
+            case 1:  err = Horn_align();               break;
+            case 2:  err = P2P_align(robustNone);      break;
+            case 3:  err = P2P_align(robustHuber);     break;
+            default: err = P2P_align(robustTukey);     break;
+            }
+            record_iter(ICPStats::now() - t, err);
+            return err;
+        }
+
+        // an iteration ended with a solve that took tSolve and left
+        // the RMS point-to-point error rmsPoint
+        void record_iter(double tSolve, float rmsPoint)
+        {
+            if (stats.enabled) {
+                ICPIterStats s;
+                s.iter     = stats.iters.size();
+                s.level    = P->current_resolution().abs_resolution;
+                s.tSample  = tSample;
+                s.tPairs   = tPairs;
+                s.tCull    = tCull;
+                s.tSolve   = tSolve;
+                s.nPairs   = pP.size();
+                s.cullThr  = cullThr;
+                s.rmsPoint = rmsPoint;
+                s.rmsPlane = RMS_point_to_plane_error();
+                stats.iters.push_back(s);
             }
-            for (int bucket=0; bucket < normbuckets.size(); bucket++)
-                random_shuffle(normbuckets[bucket].begin(), normbuckets[bucket].end());
+            tSample = tPairs = tCull = 0;
+            cullThr = 1.e33;
+        }
+
+        void start_stats(void)
+        {
+            stats.clear();
+            tSample = tPairs = tCull = 0;
+            cullThr = 1.e33;
+        }
+
+        // subsample the scan S at rate, either at random or, with
+        // normspace, trying to be somewhat uniform in the space of
+        // normals (local coords)
+        void sample(T S, float rate, bool normspace,
+                vector<Pnt3> &ss, vector<Pnt3> &ssn)
+        {
+            double t = ICPStats::now();
+            if (normspace)
+                S->subsample_normal_space(rate, ss, ssn);
+            else
+                S->subsample_points(rate, ss, ssn);
+            tSample += ICPStats::now() - t;
         }
 
         float align(float    sample_rate,
                 bool     normspace_sample,
                 int      n_iter,
                 int      culling_percentage,
-                int      method, // 0 plane (CM), 1 point (Horn)
+                int      method, // 0 plane (CM), 1 point (Horn),
+                                 // 2 plane (P2P_align), 3 and 4
+                                 // same with Huber/Tukey weights
                 int      thr_kind, // 0 relative, 1 absolute
                 float    thr_value)
         {
-            float avgError;
+            float avgError = 0;
+            start_stats();
 
             // Subsample both meshes
-            if (normspace_sample) {
-                // Sampling that tries to be somewhat uniform in the space of normals
-                vector<Pnt3> tmpverts, tmpnorms;
-                vector< vector<int> > normbuckets;
-                tmpverts.reserve(max(P->num_vertices(), Q->num_vertices()));
-                tmpnorms.reserve(max(P->num_vertices(), Q->num_vertices()));
-
-                // Sample P
-                P->subsample_points(1.0, tmpverts, tmpnorms);
-                sort_into_buckets(tmpnorms, normbuckets);
-                int ndesired = int(ceil(sample_rate * tmpverts.size()));
-                ssP.clear();  ssPn.clear();
-                while (ssP.size() < ndesired) {
-                    for (int i=0; i < normbuckets.size(); i++) {
-                        if (!normbuckets[i].empty()) {
-                            int ind = normbuckets[i].back();
-                            ssP.push_back(tmpverts[ind]);
-                            ssPn.push_back(tmpnorms[ind]);
-                            normbuckets[i].pop_back();
-                        }
-                    }
-                }
-
-                tmpverts.clear(); tmpnorms.clear(); normbuckets.clear();
-
-                // Sample Q
-                Q->subsample_points(1.0, tmpverts, tmpnorms);
-                sort_into_buckets(tmpnorms, normbuckets);
-                ndesired = int(ceil(sample_rate * tmpverts.size()));
-                ssQ.clear();  ssQn.clear();
-                while (ssQ.size() < ndesired) {
-                    for (int i=0; i < normbuckets.size(); i++) {
-                        if (!normbuckets[i].empty()) {
-                            int ind = normbuckets[i].back();
-                            ssQ.push_back(tmpverts[ind]);
-                            ssQn.push_back(tmpnorms[ind]);
-                            normbuckets[i].pop_back();
-                        }
-                    }
-                }
-            } else {
-                // Good ol' random sampling
-                P->subsample_points(sample_rate, ssP, ssPn);
-                Q->subsample_points(sample_rate, ssQ, ssQn);
-            }
+            sample(P, sample_rate, normspace_sample, ssP, ssPn);
+            sample(Q, sample_rate, normspace_sample, ssQ, ssQn);
 
             if (thr_kind == 0) {
                 // relative threshold: change to absolute
@@ -311,7 +414,7 @@ class ICP : public DrawObj {
             for (int i=0; i<n_iter; i++) {
                 // find the point pairs going from set P to Q and
                 // vice versa (all pts in world coords)
-                find_pairs(thr_value);
+                find_pairs(thr_value, eps_schedule(i, n_iter));
 
                 cull_pairs(culling_percentage);
 
@@ -320,12 +423,103 @@ class ICP : public DrawObj {
                     break;
                 }
 
-                if (method) avgError = Horn_align();
-                else        avgError = CM_align();
+                float prevError = avgError;
+                avgError = optimize(method);
                 cout << avgError << endl;
+
+                // the one-pass solvers also stop once the error
+                // no longer changes
+                if (method >= 2 && i > 0 &&
+                        fabs(prevError - avgError) < 1e-3 * prevError)
+                    break;
+            }
+            P->setXform(xfP);
+
+            return avgError;
+        }
+
+        // Coarse to fine: start from the coarsest resolutions of
+        // both scans, iterate on a level until the error changes by
+        // less than rms_change (relative) or for at most n_iter
+        // iterations, then move both scans one level finer, until
+        // the finest levels are done.  The kd-trees of the next
+        // level are built in the background while the current one
+        // is iterated on.  Nothing is redrawn in between, and the
+        // scans are left at the resolutions they were at.
+        // Other arguments as for align().
+        float align_multires(float sample_rate,
+                bool  normspace_sample,
+                int   n_iter,
+                int   culling_percentage,
+                int   method,
+                int   thr_kind,
+                float thr_value,
+                float rms_change = .01)
+        {
+            start_stats();
+            int resP = P->current_resolution().abs_resolution;
+            int resQ = Q->current_resolution().abs_resolution;
+            P->select_coarsest();
+            Q->select_coarsest();
+
+            if (thr_kind == 0) {
+                // relative threshold: change to absolute
+                float diag = P->localBbox().diag();
+                float tmp  = Q->localBbox().diag();
+                if (tmp < diag) diag = tmp;
+                thr_value *= diag;
+            }
+
+            float avgError = 0;
+            for (;;) {
+                // get the next finer levels ready
+                int nextP = P->current_resolution_index() - 1;
+                int nextQ = Q->current_resolution_index() - 1;
+                TaskGroup prefetch;
+                if (nextP >= 0 && P->load_resolution(nextP)) {
+                    T S = P;
+                    prefetch.run([=]() { S->prepare_search(nextP); });
+                }
+                if (nextQ >= 0 && Q->load_resolution(nextQ)) {
+                    T S = Q;
+                    prefetch.run([=]() { S->prepare_search(nextQ); });
+                }
+
+                if (verbose)
+                    cout << "ICP at "
+                         << P->current_resolution().abs_resolution
+                         << " / " << Q->current_resolution().abs_resolution
+                         << endl;
+                sample(P, sample_rate, normspace_sample, ssP, ssPn);
+                sample(Q, sample_rate, normspace_sample, ssQ, ssQn);
+
+                float prevError = 0;
+                for (int i=0; i<n_iter; i++) {
+                    find_pairs(thr_value);
+                    cull_pairs(culling_percentage);
+                    if (pP.size() == 0) {
+                        cerr << "Couldn't find a single point pair!" << endl;
+                        break;
+                    }
+                    avgError = optimize(method);
+                    cout << avgError << endl;
+                    if (i > 0 &&
+                            fabs(prevError - avgError) < rms_change * prevError)
+                        break;
+                    prevError = avgError;
+                }
+
+                // the searches must not switch to a level whose
+                // trees are still being built
+                prefetch.wait();
+                bool finer = P->select_finer();
+                if (Q->select_finer()) finer = true;
+                if (!finer) break;
             }
             P->setXform(xfP);
 
+            P->select_by_count(resP);
+            Q->select_by_count(resQ);
             return avgError;
         }
 
@@ -383,6 +577,7 @@ class ICP : public DrawObj {
             // Sample rate is set to 10% or to get around 500 subsampled points,
             // whichever is greater
             // We'll use 100% for the last round
+            start_stats();
             float Psample_rate = min(max(500.0f / P->num_vertices(), 0.1f), 1.0f);
             float Qsample_rate = min(max(500.0f / Q->num_vertices(), 0.1f), 1.0f);
 
@@ -409,65 +604,22 @@ class ICP : public DrawObj {
             if (tmp < thr_value) thr_value = tmp;
             thr_value *= .2;
 
-            if (normspace_sample)
+            if (normspace_sample && verbose)
                 cerr << endl << "Using normal-space sampling..." << endl;
 
             // now register 4 rounds with diminishing
             // cull percentage and threshold
             for (int i=0; i<4; i++) {
 
-                if (normspace_sample) {
-                    // Sampling that tries to be somewhat uniform in the space of normals
-                    vector<Pnt3> tmpverts, tmpnorms;
-                    vector< vector<int> > normbuckets;
-                    tmpverts.reserve(max(P->num_vertices(), Q->num_vertices()));
-                    tmpnorms.reserve(max(P->num_vertices(), Q->num_vertices()));
-
-                    // Sample P
-                    P->subsample_points(1.0, tmpverts, tmpnorms);
-                    sort_into_buckets(tmpnorms, normbuckets);
-                    int ndesired = int(ceil(Psample_rate * tmpverts.size()));
-                    ssP.clear();  ssPn.clear();
-                    while (ssP.size() < ndesired) {
-                        for (int i=0; i < normbuckets.size(); i++) {
-                            if (!normbuckets[i].empty()) {
-                                int ind = normbuckets[i].back();
-                                ssP.push_back(tmpverts[ind]);
-                                ssPn.push_back(tmpnorms[ind]);
-                                normbuckets[i].pop_back();
-                            }
-                        }
-                    }
-
-                    tmpverts.clear(); tmpnorms.clear(); normbuckets.clear();
-
-                    // Sample Q
-                    Q->subsample_points(1.0, tmpverts, tmpnorms);
-                    sort_into_buckets(tmpnorms, normbuckets);
-                    ndesired = int(ceil(Qsample_rate * tmpverts.size()));
-                    ssQ.clear();  ssQn.clear();
-                    while (ssQ.size() < ndesired) {
-                        for (int i=0; i < normbuckets.size(); i++) {
-                            if (!normbuckets[i].empty()) {
-                                int ind = normbuckets[i].back();
-                                ssQ.push_back(tmpverts[ind]);
-                                ssQn.push_back(tmpnorms[ind]);
-                                normbuckets[i].pop_back();
-                            }
-                        }
-                    }
-
-                } else {
-                    // random sampling
-                    P->subsample_points(Psample_rate, ssP, ssPn);
-                    Q->subsample_points(Qsample_rate, ssQ, ssQn);
-                }
+                sample(P, Psample_rate, normspace_sample, ssP, ssPn);
+                sample(Q, Qsample_rate, normspace_sample, ssQ, ssQn);
                 // the interpolation doesn't intentionally go all the way
                 // (which would require a 5th round)
-                find_pairs(((4-i)*thr_value+i*final_abs_thresh)/5.0);
+                find_pairs(((4-i)*thr_value+i*final_abs_thresh)/5.0,
+                        eps_schedule(i, 8));
                 if (too_few_pairs()) return false;
                 cull_pairs(((4-i)*20+i*1)/5.0);
-                CM_align();
+                optimize(0);
             }
 
             // Now do sets of three iterations as long as the
@@ -484,58 +636,15 @@ class ICP : public DrawObj {
                 xfPg = xfP;
 
                 // subsample both meshes
-                if (normspace_sample) {
-                    // Sampling that tries to be somewhat uniform in the space of normals
-                    vector<Pnt3> tmpverts, tmpnorms;
-                    vector< vector<int> > normbuckets;
-                    tmpverts.reserve(max(P->num_vertices(), Q->num_vertices()));
-                    tmpnorms.reserve(max(P->num_vertices(), Q->num_vertices()));
-
-                    // Sample P
-                    P->subsample_points(1.0, tmpverts, tmpnorms);
-                    sort_into_buckets(tmpnorms, normbuckets);
-                    int ndesired = int(ceil(Psample_rate * tmpverts.size()));
-                    ssP.clear();  ssPn.clear();
-                    while (ssP.size() < ndesired) {
-                        for (int i=0; i < normbuckets.size(); i++) {
-                            if (!normbuckets[i].empty()) {
-                                int ind = normbuckets[i].back();
-                                ssP.push_back(tmpverts[ind]);
-                                ssPn.push_back(tmpnorms[ind]);
-                                normbuckets[i].pop_back();
-                            }
-                        }
-                    }
-
-                    tmpverts.clear(); tmpnorms.clear(); normbuckets.clear();
-
-                    // Sample Q
-                    Q->subsample_points(1.0, tmpverts, tmpnorms);
-                    sort_into_buckets(tmpnorms, normbuckets);
-                    ndesired = int(ceil(Qsample_rate * tmpverts.size()));
-                    ssQ.clear();  ssQn.clear();
-                    while (ssQ.size() < ndesired) {
-                        for (int i=0; i < normbuckets.size(); i++) {
-                            if (!normbuckets[i].empty()) {
-                                int ind = normbuckets[i].back();
-                                ssQ.push_back(tmpverts[ind]);
-                                ssQn.push_back(tmpnorms[ind]);
-                                normbuckets[i].pop_back();
-                            }
-                        }
-                    }
-
-                } else {
-                    P->subsample_points(Psample_rate, ssP, ssPn);
-                    Q->subsample_points(Qsample_rate, ssQ, ssQn);
-                }
+                sample(P, Psample_rate, normspace_sample, ssP, ssPn);
+                sample(Q, Qsample_rate, normspace_sample, ssQ, ssQn);
                 // do two rounds, calculate errors
                 curr_error = 0.0;
                 for (int i=0; i<2; i++) {
                     find_pairs(final_abs_thresh);
                     cull_pairs(1);
                     if (too_few_pairs()) return false;
-                    curr_error += CM_align();
+                    curr_error += optimize(0);
                 }
 
             } while (curr_error < .9999 * prev_error);
@@ -547,13 +656,13 @@ class ICP : public DrawObj {
             }
 
             // once more, with no subsampling
-            cout << "last round...";
-            P->subsample_points(1.0, ssP, ssPn);
-            Q->subsample_points(1.0, ssQ, ssQn);
+            if (verbose) cout << "last round...";
+            sample(P, 1.0, false, ssP, ssPn);
+            sample(Q, 1.0, false, ssQ, ssQn);
             find_pairs(final_abs_thresh);
             cull_pairs(1);
-            CM_align();
-            cout << "done" << endl;
+            optimize(0);
+            if (verbose) cout << "done" << endl;
 
             if (max_motion < FLT_MAX) {
                 // see how much the subsampled points in P would move
@@ -637,6 +746,8 @@ class AutoICP {
         GlobalReg*   regall;
         bool         bRegallPrivate;
         vector<Pnt3> pP, nP, pQ, nQ;
+        T            lastA, lastB;
+        Xform<float> rel_xf;
 
         float        final_abs_threshold;
         float        max_motion;
@@ -665,22 +776,36 @@ class AutoICP {
         }
 
         bool add_pair(T a, T b, int max_pairs = 0, bool nss = false)
+        {
+            bool success = align_pair(a, b, nss);
+            if (success)
+                store_pair(max_pairs);
+            return success;
+        }
+
+        // The two halves of add_pair().  align_pair() only reads
+        // the scans, so several AutoICPs can align pairs at the
+        // same time (once the scans' search structures exist);
+        // store_pair() hands the pairs of the last successful
+        // align_pair() to the GlobalReg, one caller at a time.
+        bool align_pair(T a, T b, bool nss = false)
         {
             icp.set (a, b);
-            Xform<float> rel_xf;
-            bool success = icp.auto_align(pP, nP, pQ, nQ,
+            lastA = a; lastB = b;
+            return icp.auto_align(pP, nP, pQ, nQ,
                     rel_xf,
                     final_abs_threshold,
                     FLT_MAX, nss);
+        }
 
-            if (success) {
-                regall->addPair (a, b, pP, nP, pQ, nQ,
-                        rel_xf, false, max_pairs);
-            }
-
-            return success;
+        void store_pair(int max_pairs = 0)
+        {
+            regall->addPair (lastA, lastB, pP, nP, pQ, nQ,
+                    rel_xf, false, max_pairs);
         }
 
+        void set_verbose(bool v) { icp.verbose = v; }
+
         void operator()(void)
         {
             regall->align (1.e-3);
@@ -6,16 +6,24 @@
 
 #include <iostream>
 #include <cassert>
+#include <stdlib.h>
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <float.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifndef WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
 #include "KDindtree.h"
 #include "Bbox.h"
 #include "defines.h"
+#include "WorkerPool.h"
 
-#define MEDIAN_SPLIT 0
-
-#if MEDIAN_SPLIT
-#include "Median.h"
-static Median<float> med;
-#endif
 
 // factory
 KDindtree*
@@ -71,6 +79,40 @@ CreateKDindtree (const vector<Pnt3>::iterator pts, const vector<short>::iterator
 }
 
 
+// factory with a sidecar cache file
+KDindtree*
+CreateKDindtree (const Pnt3* pts, const short* nrms, int nPts,
+		 const char* srcFile, int res, bool save)
+{
+  if (!nPts)
+    return NULL;
+  if (srcFile == NULL || *srcFile == 0 ||
+      getenv("SCANALYZE_NO_KDCACHE") != NULL)
+    return CreateKDindtree(pts, nrms, nPts);
+
+  KDindtree::CacheKey key;
+  if (!KDindtree::cache_key(srcFile, res, pts, nrms, nPts, key))
+    return CreateKDindtree(pts, nrms, nPts);
+
+  char cacheFile[PATH_MAX + 32];
+  sprintf(cacheFile, "%.*s.%d.kdt", PATH_MAX, srcFile, res);
+
+  KDindtree* kdtree = KDindtree::load(cacheFile, key);
+  if (kdtree) {
+    cout << "Loaded kdtree (" << nPts << " points) from "
+	 << cacheFile << endl;
+    return kdtree;
+  }
+
+  kdtree = CreateKDindtree(pts, nrms, nPts);
+  // not being able to write the cache (read-only directory,
+  // full disk) is not an error, we just rebuild next time
+  if (kdtree && save)
+    kdtree->save(cacheFile, key);
+  return kdtree;
+}
+
+
 
 static Pnt3
 GetNormalAsPnt3 (const short* nrms, int ofs)
@@ -82,48 +124,6 @@ GetNormalAsPnt3 (const short* nrms, int ofs)
 }
 
 
-static int
-divisionsort(const Pnt3 *data, int *p, int n,
-	     int dim, float med)
-{
-  // move values <= med to left, the rest to right
-  int left = 0, right = n-1;
-  while (1) {
-    while (data[p[left]][dim] <= med && right > left) left++;
-    while (data[p[right]][dim] > med && right > left) right--;
-    int tmp = p[left];  // swap
-    p[left] = p[right]; p[right] = tmp;
-    if (left == right) {
-      if (data[p[right]][dim] <= med) right++;
-      break;
-    }
-    left++;
-  }
-  return right;
-}
-
-// STL Update
-static int
-divisionsort(const vector<Pnt3>::iterator data, int *p, int n,
-	     int dim, float med)
-{
-  // move values <= med to left, the rest to right
-  int left = 0, right = n-1;
-  while (1) {
-    while (data[p[left]][dim] <= med && right > left) left++;
-    while (data[p[right]][dim] > med && right > left) right--;
-    int tmp = p[left];  // swap
-    p[left] = p[right]; p[right] = tmp;
-    if (left == right) {
-      if (data[p[right]][dim] <= med) right++;
-      break;
-    }
-    left++;
-  }
-  return right;
-}
-
-
 void
 merge_normal_cones(const Pnt3 &n1, float th1,
 		   const Pnt3 &n2, float th2,
@@ -155,376 +155,1217 @@ merge_normal_cones(const Pnt3 &n1, float th1,
 }
 
 
+KDindtree::KDindtree(void)
+  : nodes(NULL), nNodes(0), px(NULL), py(NULL), pz(NULL),
+    nx(NULL), ny(NULL), nz(NULL), element(NULL), nPts(0),
+    nDead(0), hasNormals(false), mapAddr(NULL), mapLen(0)
+{
+}
+
+
 KDindtree::KDindtree(const Pnt3 *pts, const short *nrms,
 		     int *ind, int n, int first)
-: Nhere(0), element(NULL)
+  : mapAddr(NULL), mapLen(0)
+{
+  build(pts, nrms, ind, n);
+}
+
+// STL Update
+KDindtree::KDindtree(const vector<Pnt3>::iterator pts, const vector<short>::iterator nrms,
+		     int *ind, int n, int first)
+  : mapAddr(NULL), mapLen(0)
+{
+  build(&*pts, &*nrms, ind, n);
+}
+
+
+KDindtree::~KDindtree(void)
+{
+#ifndef WIN32
+  if (mapAddr) munmap(mapAddr, mapLen);
+#endif
+}
+
+
+// Building the tree
+//
+// The points are first copied into an array of KDbuildPnt,
+// and the splitting shuffles those around, so the partitioning
+// works on contiguous data instead of going through ind[].
+// Each inner node splits its points at the median of the
+// longest dimension of their bounding box (nth_element, linear
+// in the number of points).
+//
+// Above a size cutoff the two halves of a node are built as
+// independent parts by the worker pool; below it a part is
+// built serially in breadth-first order.  At the end the parts
+// are stitched into the one node array, keeping the invariants
+// that the two children of a node are adjacent and that every
+// child comes after its parent.
+
+#define KD_BUCKET_SIZE      16
+#define KD_PARALLEL_CUTOFF  32768
+
+struct KDbuildPnt {
+  float x[3];
+  int   i;
+};
+
+struct KDbuildPart {
+  // if child[0] is set, nodes[0] is the part's root alone and
+  // its children are the child parts; otherwise nodes is the
+  // whole subtree, nodes[0] is its root, and node.first for
+  // inner nodes indexes into nodes
+  vector<KDindnode> nodes;
+  float             theta;     // normal cone of the root
+  KDbuildPart      *child[2];
+
+  KDbuildPart(void) : theta(0) { child[0] = child[1] = NULL; }
+  ~KDbuildPart(void) { delete child[0]; delete child[1]; }
+};
+
+
+struct KDbuildCmp {
+  int d;
+  KDbuildCmp(int dim) : d(dim) {}
+  bool operator()(const KDbuildPnt &a, const KDbuildPnt &b) const
+    { return a.x[d] < b.x[d]; }
+};
+
+
+// bounds and split of the node with points w[0..cnt), returns
+// the size of the left half, or 0 if the node is a leaf
+static int
+split_node(KDbuildPnt *w, int begin, int cnt, KDindnode &nd)
 {
-  int i;
+  KDbuildPnt *p = w + begin;
+  nd.min.set(p[0].x);
+  nd.max.set(p[0].x);
+  for (int i = 1; i < cnt; i++) {
+    for (int j = 0; j < 3; j++) {
+      if (p[i].x[j] < nd.min[j]) nd.min[j] = p[i].x[j];
+      if (p[i].x[j] > nd.max[j]) nd.max[j] = p[i].x[j];
+    }
+  }
+
   // find the dimension of maximum range
-  min = max = pts[ind[0]];
-  int *end = ind+n;
-  for (int *ip=ind+1; ip<end; ip++) {
-    const Pnt3 &p = pts[*ip];
-    min.set_min(p);
-    max.set_max(p);
-  }
-  float dist = max[0] - min[0];
-  m_d = 0;
+  float dist = nd.max[0] - nd.min[0];
+  nd.m_d = 0;
   float tmp;
-  if ((tmp = max[1]-min[1]) > dist) {
-    m_d = 1; dist = tmp;
-  }
-  if ((tmp = max[2]-min[2]) > dist) {
-    m_d = 2; dist = tmp;
-  }
-
-  if (dist == 0.0) n = 1; // a single point several times
-
-  if (n > 16) {
-#if MEDIAN_SPLIT
-#define DATA(i) (pts[ind[i]])[m_d]
-    // find the median within that dimension
-    med.clear();
-    for (i=0; i<n; i++) med += DATA(i);
-    m_p = med.find();
-    int right = divisionsort(pts, ind, n, m_d, m_p);
-    if (right == n) {
-      // the median is also the largest, need new "median"
-      // find the next largest item for that
-      float nm = -9.e33;
-      for (i=0; i<n; i++) {
-	if (DATA(i) != m_p && DATA(i) > nm) nm = DATA(i);
-      }
-      right = divisionsort(pts, ind, n, m_d, (m_p=nm));
-    }
-    assert(right != 0 && right != n);
-#undef DATA
-#else
-    m_p = .5*(max[m_d]+min[m_d]);
-    int right = divisionsort(pts, ind, n, m_d, m_p);
-    assert(right != 0 && right != n);
-#endif
-    // recurse
-    child[0] = new KDindtree(pts, nrms, ind, right, 0);
-    child[1] = new KDindtree(pts, nrms, &ind[right], n-right, 0);
-  } else {
+  if ((tmp = nd.max[1]-nd.min[1]) > dist) {
+    nd.m_d = 1; dist = tmp;
+  }
+  if ((tmp = nd.max[2]-nd.min[2]) > dist) {
+    nd.m_d = 2; dist = tmp;
+  }
+
+  nd.m_p = 0;
+
+  // a single point several times can't be split: keep all the
+  // copies in one leaf, however many
+  if (cnt <= KD_BUCKET_SIZE || dist == 0.0) {
     // store data here
-    Nhere = n;
-    element = new int[n];
-    for (i=0; i<n; i++) element[i] = ind[i];
-    child[0] = child[1] = NULL;
+    nd.first = begin;
+    nd.Nhere = cnt;
+    return 0;
   }
 
-#if MEDIAN_SPLIT
-  if (first) med.zap(); // release memory after the tree's done
-#endif
+  // left half <= m_p <= right half
+  int mid = cnt / 2;
+  nth_element(p, p + mid, p + cnt, KDbuildCmp(nd.m_d));
+  nd.m_p   = p[mid].x[nd.m_d];
+  nd.Nhere = 0;
+  return mid;
+}
+
+
+// normal cone of a leaf
+static void
+leaf_cone(const short *nrms, const KDbuildPnt *w,
+	  KDindnode &nd, float &theta)
+{
+  nd.normal = GetNormalAsPnt3(nrms, w[nd.first].i);
+  theta = 0.0;
+  for (int i = 1; i < nd.Nhere; i++) {
+    merge_normal_cones(nd.normal, theta,
+		       GetNormalAsPnt3(nrms, w[nd.first+i].i), 0,
+		       nd.normal, theta);
+  }
+}
+
+
+static void
+set_cone_cos(KDindnode &nd, float theta)
+{
+  float tmp = theta + M_PI * .25;
+  if (tmp > M_PI) nd.cos_th_p_pi_over_4 = -1.0;
+  else            nd.cos_th_p_pi_over_4 = cos(tmp);
+}
+
+
+static void
+build_serial(const short *nrms, KDbuildPnt *w,
+	     int begin, int n, KDbuildPart &part)
+{
+  struct pending { int node, begin, n; };
+  vector<pending> queue;
+  queue.reserve(2*(n/8+1));
+  vector<KDindnode> &nodes = part.nodes;
+  nodes.reserve(2*(n/8+1));
+
+  nodes.push_back(KDindnode());
+  pending root = { 0, begin, n };
+  queue.push_back(root);
+
+  for (int head = 0; head < queue.size(); head++) {
+    pending   pn = queue[head];
+    KDindnode nd;
+    int right = split_node(w, pn.begin, pn.n, nd);
+    if (right) {
+      nd.first = nodes.size();
+      nodes.push_back(KDindnode());
+      nodes.push_back(KDindnode());
+      pending c0 = { nd.first,   pn.begin,       right };
+      pending c1 = { nd.first+1, pn.begin+right, pn.n-right };
+      queue.push_back(c0);
+      queue.push_back(c1);
+    }
+    nodes[pn.node] = nd;
+  }
 
   if (nrms == NULL) return;
 
-  // now figure out bounds for the normals
-  if (Nhere) {
-    // a terminal node
-    normal = GetNormalAsPnt3(nrms, element[0]);
-    theta  = 0.0;
-    for (i=1; i<Nhere; i++) {
-      merge_normal_cones(normal, theta,
-			 GetNormalAsPnt3(nrms, element[i]), 0,
-			 normal, theta);
+  // now figure out bounds for the normals, children
+  // always come after their parents
+  vector<float> theta(nodes.size());
+  for (int k = nodes.size()-1; k >= 0; k--) {
+    KDindnode &nd = nodes[k];
+    if (nd.Nhere) {
+      // a terminal node
+      leaf_cone(nrms, w, nd, theta[k]);
+    } else {
+      // a non-terminal node
+      merge_normal_cones(nodes[nd.first].normal, theta[nd.first],
+			 nodes[nd.first+1].normal, theta[nd.first+1],
+			 nd.normal, theta[k]);
     }
-  } else {
-    // a non-terminal node
-    merge_normal_cones(child[0]->normal, child[0]->theta,
-		       child[1]->normal, child[1]->theta,
-		       normal, theta);
+    set_cone_cos(nd, theta[k]);
   }
-  tmp = theta + M_PI * .25;
-  if (tmp > M_PI) cos_th_p_pi_over_4 = -1.0;
-  else            cos_th_p_pi_over_4 = cos(tmp);
+  part.theta = theta[0];
 }
 
-// STL Update
-KDindtree::KDindtree(const vector<Pnt3>::iterator pts, const vector<short>::iterator nrms,
-		     int *ind, int n, int first)
-: Nhere(0), element(NULL)
+
+static KDbuildPart*
+build_part(const short *nrms, KDbuildPnt *w,
+	   int begin, int n, int cutoff)
 {
-  int i;
-  // find the dimension of maximum range
-  min = max = pts[ind[0]];
-  int *end = ind+n;
-  for (int *ip=ind+1; ip<end; ip++) {
-    const Pnt3 &p = pts[*ip];
-    min.set_min(p);
-    max.set_max(p);
-  }
-  float dist = max[0] - min[0];
-  m_d = 0;
-  float tmp;
-  if ((tmp = max[1]-min[1]) > dist) {
-    m_d = 1; dist = tmp;
-  }
-  if ((tmp = max[2]-min[2]) > dist) {
-    m_d = 2; dist = tmp;
-  }
-
-  if (dist == 0.0) n = 1; // a single point several times
-
-  if (n > 16) {
-#if MEDIAN_SPLIT
-#define DATA(i) (pts[ind[i]])[m_d]
-    // find the median within that dimension
-    med.clear();
-    for (i=0; i<n; i++) med += DATA(i);
-    m_p = med.find();
-    int right = divisionsort(pts, ind, n, m_d, m_p);
-    if (right == n) {
-      // the median is also the largest, need new "median"
-      // find the next largest item for that
-      float nm = -9.e33;
-      for (i=0; i<n; i++) {
-	if (DATA(i) != m_p && DATA(i) > nm) nm = DATA(i);
-      }
-      right = divisionsort(pts, ind, n, m_d, (m_p=nm));
+  KDbuildPart *part = new KDbuildPart;
+  if (n <= cutoff) {
+    build_serial(nrms, w, begin, n, *part);
+    return part;
+  }
+
+  KDindnode nd;
+  int right = split_node(w, begin, n, nd);
+  if (right) {
+    // the left half goes to the pool, the right one is done
+    // here; the wait helps with other parts meanwhile
+    TaskGroup tg;
+    tg.run([=]() {
+      part->child[0] = build_part(nrms, w, begin, right, cutoff);
+    });
+    part->child[1] = build_part(nrms, w, begin+right, n-right, cutoff);
+    tg.wait();
+  }
+
+  if (nrms) {
+    if (nd.Nhere) {
+      leaf_cone(nrms, w, nd, part->theta);
+    } else {
+      merge_normal_cones(part->child[0]->nodes[0].normal,
+			 part->child[0]->theta,
+			 part->child[1]->nodes[0].normal,
+			 part->child[1]->theta,
+			 nd.normal, part->theta);
     }
-    assert(right != 0 && right != n);
-#undef DATA
-#else
-    m_p = .5*(max[m_d]+min[m_d]);
-    int right = divisionsort(pts, ind, n, m_d, m_p);
-    assert(right != 0 && right != n);
-#endif
-    // recurse
-    child[0] = new KDindtree(pts, nrms, ind, right, 0);
-    child[1] = new KDindtree(pts, nrms, &ind[right], n-right, 0);
-  } else {
-    // store data here
-    Nhere = n;
-    element = new int[n];
-    for (i=0; i<n; i++) element[i] = ind[i];
-    child[0] = child[1] = NULL;
+    set_cone_cos(nd, part->theta);
   }
+  part->nodes.push_back(nd);
+  return part;
+}
 
-#if MEDIAN_SPLIT
-  if (first) med.zap(); // release memory after the tree's done
-#endif
 
-// STL Update
-// WARNING: Not sure how to check for this..
-//  if (nrms == NULL) return;
+// ind is a temporary array (of length n) that contains
+// indices to pts and nrms; on return it holds the indices in
+// bucket order
+void
+KDindtree::build(const Pnt3 *pts, const short *nrms,
+		 int *ind, int n)
+{
+  WorkerPool &pool = WorkerPool::global();
+  int cutoff = (pool.num_threads() > 1) ? KD_PARALLEL_CUTOFF : n;
+
+  vector<KDbuildPnt> work(n);
+  KDbuildPnt *w = &work[0];
+  pool.parallel_for(n, 65536, [=](int b, int e) {
+    for (int i = b; i < e; i++) {
+      const Pnt3 &p = pts[ind[i]];
+      w[i].x[0] = p[0]; w[i].x[1] = p[1]; w[i].x[2] = p[2];
+      w[i].i = ind[i];
+    }
+  });
+
+  KDbuildPart *root = build_part(nrms, w, 0, n, cutoff);
+
+  // stitch the parts together: the parts above the cutoff
+  // are laid out breadth first, each part below it is copied
+  // in as a block with its child links shifted
+  nodeBuf.clear();
+  nodeBuf.push_back(KDindnode());
+  vector< pair<KDbuildPart*, int> > queue;
+  queue.push_back(make_pair(root, 0));
+  for (int head = 0; head < queue.size(); head++) {
+    KDbuildPart *part = queue[head].first;
+    int          slot = queue[head].second;
+    if (part->child[0]) {
+      KDindnode nd = part->nodes[0];
+      nd.first = nodeBuf.size();
+      nodeBuf[slot] = nd;
+      nodeBuf.push_back(KDindnode());
+      nodeBuf.push_back(KDindnode());
+      queue.push_back(make_pair(part->child[0], nd.first));
+      queue.push_back(make_pair(part->child[1], nd.first+1));
+    } else {
+      // nodes[1..] go to the end, so node k lands at k+shift
+      int shift = nodeBuf.size() - 1;
+      vector<KDindnode> &nodes = part->nodes;
+      for (int k = 0; k < nodes.size(); k++)
+	if (!nodes[k].Nhere) nodes[k].first += shift;
+      nodeBuf[slot] = nodes[0];
+      nodeBuf.insert(nodeBuf.end(), nodes.begin()+1, nodes.end());
+    }
+  }
+  delete root;
+
+  // copy the points into the leaf buckets
+  hasNormals = (nrms != NULL);
+  pxBuf.resize(n); pyBuf.resize(n); pzBuf.resize(n);
+  elementBuf.resize(n);
+  if (hasNormals) {
+    nxBuf.resize(n); nyBuf.resize(n); nzBuf.resize(n);
+  }
+  pool.parallel_for(n, 65536, [&](int b, int e) {
+    for (int i = b; i < e; i++) {
+      pxBuf[i] = w[i].x[0];
+      pyBuf[i] = w[i].x[1];
+      pzBuf[i] = w[i].x[2];
+      elementBuf[i] = ind[i] = w[i].i;
+      if (hasNormals) {
+	const short *sp = &nrms[w[i].i*3];
+	nxBuf[i] = sp[0]; nyBuf[i] = sp[1]; nzBuf[i] = sp[2];
+      }
+    }
+  });
 
-  // now figure out bounds for the normals
-  if (Nhere) {
-    // a terminal node
-// STL Update
-    normal = GetNormalAsPnt3(&*nrms, element[0]);
-    theta  = 0.0;
-    for (i=1; i<Nhere; i++) {
-// STL Update
-      merge_normal_cones(normal, theta,
-			 GetNormalAsPnt3(&*nrms, element[i]), 0,
-			 normal, theta);
+  if (!hasNormals) {
+    // a cone with a full opening never rejects a subtree
+    for (int i=0; i<nodeBuf.size(); i++) {
+      nodeBuf[i].normal.set(0,0,1);
+      nodeBuf[i].cos_th_p_pi_over_4 = -1.0;
     }
-  } else {
-    // a non-terminal node
-    merge_normal_cones(child[0]->normal, child[0]->theta,
-		       child[1]->normal, child[1]->theta,
-		       normal, theta);
   }
-  tmp = theta + M_PI * .25;
-  if (tmp > M_PI) cos_th_p_pi_over_4 = -1.0;
-  else            cos_th_p_pi_over_4 = cos(tmp);
+  use_buffers();
 }
 
 
-KDindtree::~KDindtree(void)
+void
+KDindtree::use_buffers(void)
 {
-  delete[] element;
-  delete child[0];
-  delete child[1];
+  nodes   = &nodeBuf[0];
+  nNodes  = nodeBuf.size();
+  nPts    = elementBuf.size();
+  nDead   = 0;
+  px      = &pxBuf[0];
+  py      = &pyBuf[0];
+  pz      = &pzBuf[0];
+  element = &elementBuf[0];
+  if (hasNormals) {
+    nx = &nxBuf[0]; ny = &nyBuf[0]; nz = &nzBuf[0];
+  } else {
+    nx = ny = nz = NULL;
+  }
 }
 
 
-int
-KDindtree::_search(const Pnt3 *pts, const short *nrms,
-		   const Pnt3 &p, const Pnt3 &n,
-		   int &ind, float &d) const
+//////////////////////////////////////////////////////////////
+// Leaf scanning
+//
+// Most of a query's time goes to the brute-force distance
+// (and normal) tests over the points of a leaf bucket.
+// The kernels below test a bucket of cnt points starting at
+// x,y,z (nx,ny,nz) against p (n), update d2 if a closer
+// compatible point is found, and return the offset of that
+// point within the bucket (or -1).
+// The x86 versions test 8 (AVX2) or 4 (SSE4.1) candidates at
+// a time; the one to use is picked at startup from what the
+// CPU supports.  Lanes that pass are resolved in order, so all
+// versions return the same point as the scalar loop.
+//////////////////////////////////////////////////////////////
+
+static int
+leaf_scan_scalar(const float *x, const float *y, const float *z,
+		 const short *nx, const short *ny, const short *nz,
+		 int cnt, const float *p, const float *n, float &d2)
 {
-  assert(this);
+  int best = -1;
+  for (int k = 0; k < cnt; k++) {
+    float dx = x[k]-p[0], dy = y[k]-p[1], dz = z[k]-p[2];
+    float l = dx*dx + dy*dy + dz*dz;
+    if (l < d2) {
+      if (nx == NULL ||
+	  n[0]*nx[k] + n[1]*ny[k] + n[2]*nz[k] > NRM_45_DEG) {
+	// normals also within 45 deg
+	d2 = l; best = k;
+      }
+    }
+  }
+  return best;
+}
 
-  if (dot(n, normal) < cos_th_p_pi_over_4)
-    return 0;
 
-  if (Nhere) { // terminal node
-    float l, d2 = d*d;
-    bool  need_sqrt = false;
-    int *el  = element;
-    int *end = el+Nhere;
-    for (; el<end; el++) {
-      l = dist2(pts[*el], p);
-      if (l < d2) {
-	const short *sp = &nrms[(*el)*3];
-	// 32767/sqrt(2)==23169.77
-	if (n[0]*sp[0] + n[1]*sp[1] + n[2]*sp[2] > 23169.77) {
-	  // normals also within 45 deg
-	  d2=l; ind = *el;
-	  need_sqrt = true;
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define KD_X86_SIMD 1
+#include <immintrin.h>
+
+// copy the candidates k..cnt-1 to the front of width-wide
+// buffers; the rest are zeroed, and masked out by the caller
+static inline void
+pad_bucket(const float *x, const float *y, const float *z,
+	   const short *nx, const short *ny, const short *nz,
+	   int k, int cnt, int width,
+	   float *bx, float *by, float *bz,
+	   short *bnx, short *bny, short *bnz)
+{
+  for (int j = 0; j < width; j++, k++) {
+    bool in = (k < cnt);
+    bx[j] = in ? x[k] : 0;
+    by[j] = in ? y[k] : 0;
+    bz[j] = in ? z[k] : 0;
+    if (nx) {
+      bnx[j] = in ? nx[k] : 0;
+      bny[j] = in ? ny[k] : 0;
+      bnz[j] = in ? nz[k] : 0;
+    }
+  }
+}
+
+__attribute__((target("avx2"))) static int
+leaf_scan_avx2(const float *x, const float *y, const float *z,
+	       const short *nx, const short *ny, const short *nz,
+	       int cnt, const float *p, const float *n, float &d2)
+{
+  __m256 P0 = _mm256_set1_ps(p[0]);
+  __m256 P1 = _mm256_set1_ps(p[1]);
+  __m256 P2 = _mm256_set1_ps(p[2]);
+  float bx[8], by[8], bz[8];
+  short bnx[8], bny[8], bnz[8];
+  int best = -1;
+  int k = 0;
+  for (; k < cnt; k += 8) {
+    const float *X = x+k, *Y = y+k, *Z = z+k;
+    const short *NX = nx, *NY = ny, *NZ = nz;
+    if (nx) { NX += k; NY += k; NZ += k; }
+    int valid = 0xff;
+    if (cnt-k < 8) {
+      // pad the last few candidates and mask them out,
+      // instead of mixing in scalar code
+      valid = (1 << (cnt-k)) - 1;
+      pad_bucket(x, y, z, nx, ny, nz, k, cnt, 8,
+		 bx, by, bz, bnx, bny, bnz);
+      X = bx; Y = by; Z = bz; NX = bnx; NY = bny; NZ = bnz;
+    }
+    __m256 dx = _mm256_sub_ps(_mm256_loadu_ps(X), P0);
+    __m256 dy = _mm256_sub_ps(_mm256_loadu_ps(Y), P1);
+    __m256 dz = _mm256_sub_ps(_mm256_loadu_ps(Z), P2);
+    __m256 l  = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx,dx),
+					    _mm256_mul_ps(dy,dy)),
+			      _mm256_mul_ps(dz,dz));
+    __m256 ok = _mm256_cmp_ps(l, _mm256_set1_ps(d2), _CMP_LT_OQ);
+    if (!(_mm256_movemask_ps(ok) & valid)) continue;
+    if (nx) {
+      __m256 fx = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(
+		    _mm_loadu_si128((const __m128i*)NX)));
+      __m256 fy = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(
+		    _mm_loadu_si128((const __m128i*)NY)));
+      __m256 fz = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(
+		    _mm_loadu_si128((const __m128i*)NZ)));
+      __m256 dn = _mm256_add_ps(
+	_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(n[0]), fx),
+		      _mm256_mul_ps(_mm256_set1_ps(n[1]), fy)),
+	_mm256_mul_ps(_mm256_set1_ps(n[2]), fz));
+      ok = _mm256_and_ps(ok, _mm256_cmp_ps(dn, _mm256_set1_ps(NRM_45_DEG),
+					   _CMP_GT_OQ));
+    }
+    int m = _mm256_movemask_ps(ok) & valid;
+    if (m) {
+      float lv[8];
+      _mm256_storeu_ps(lv, l);
+      for (int j = 0; j < 8; j++) {
+	if (((m >> j) & 1) && lv[j] < d2) {
+	  d2 = lv[j]; best = k+j;
 	}
       }
     }
-    if (need_sqrt) d = sqrtf(d2);
-    return ball_within_bounds(p,d,min,max);
   }
+  return best;
+}
 
-  if (p[m_d] <= m_p) { // the point is left from partition
-    if (child[0]->_search(pts,nrms,p,n,ind,d))
-      return 1;
-    if (bounds_overlap_ball(p,d,child[1]->min,max)) {
-      if (child[1]->_search(pts,nrms,p,n,ind,d))
-	return 1;
+
+__attribute__((target("sse4.1"))) static int
+leaf_scan_sse4(const float *x, const float *y, const float *z,
+	       const short *nx, const short *ny, const short *nz,
+	       int cnt, const float *p, const float *n, float &d2)
+{
+  __m128 P0 = _mm_set1_ps(p[0]);
+  __m128 P1 = _mm_set1_ps(p[1]);
+  __m128 P2 = _mm_set1_ps(p[2]);
+  float bx[8], by[8], bz[8];
+  short bnx[8], bny[8], bnz[8];
+  int best = -1;
+  int k = 0;
+  for (; k < cnt; k += 4) {
+    const float *X = x+k, *Y = y+k, *Z = z+k;
+    const short *NX = nx, *NY = ny, *NZ = nz;
+    if (nx) { NX += k; NY += k; NZ += k; }
+    int valid = 0xf;
+    if (cnt-k < 4) {
+      // pad the last few candidates and mask them out,
+      // instead of mixing in scalar code
+      valid = (1 << (cnt-k)) - 1;
+      pad_bucket(x, y, z, nx, ny, nz, k, cnt, 4,
+		 bx, by, bz, bnx, bny, bnz);
+      X = bx; Y = by; Z = bz; NX = bnx; NY = bny; NZ = bnz;
     }
-  } else {             // the point is right from partition
-    if (child[1]->_search(pts,nrms,p,n,ind,d))
-      return 1;
-    if (bounds_overlap_ball(p,d,min,child[0]->max)) {
-      if (child[0]->_search(pts,nrms,p,n,ind,d))
-	return 1;
+    __m128 dx = _mm_sub_ps(_mm_loadu_ps(X), P0);
+    __m128 dy = _mm_sub_ps(_mm_loadu_ps(Y), P1);
+    __m128 dz = _mm_sub_ps(_mm_loadu_ps(Z), P2);
+    __m128 l  = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx,dx),
+				      _mm_mul_ps(dy,dy)),
+			   _mm_mul_ps(dz,dz));
+    __m128 ok = _mm_cmplt_ps(l, _mm_set1_ps(d2));
+    if (!(_mm_movemask_ps(ok) & valid)) continue;
+    if (nx) {
+      __m128 fx = _mm_cvtepi32_ps(_mm_cvtepi16_epi32(
+		    _mm_loadl_epi64((const __m128i*)NX)));
+      __m128 fy = _mm_cvtepi32_ps(_mm_cvtepi16_epi32(
+		    _mm_loadl_epi64((const __m128i*)NY)));
+      __m128 fz = _mm_cvtepi32_ps(_mm_cvtepi16_epi32(
+		    _mm_loadl_epi64((const __m128i*)NZ)));
+      __m128 dn = _mm_add_ps(
+	_mm_add_ps(_mm_mul_ps(_mm_set1_ps(n[0]), fx),
+		   _mm_mul_ps(_mm_set1_ps(n[1]), fy)),
+	_mm_mul_ps(_mm_set1_ps(n[2]), fz));
+      ok = _mm_and_ps(ok, _mm_cmpgt_ps(dn, _mm_set1_ps(NRM_45_DEG)));
+    }
+    int m = _mm_movemask_ps(ok) & valid;
+    if (m) {
+      float lv[4];
+      _mm_storeu_ps(lv, l);
+      for (int j = 0; j < 4; j++) {
+	if (((m >> j) & 1) && lv[j] < d2) {
+	  d2 = lv[j]; best = k+j;
+	}
+      }
     }
   }
+  return best;
+}
+#endif
+
 
-  return ball_within_bounds(p,d,min,max);
+typedef int (*LeafScanFn)(const float *, const float *, const float *,
+			  const short *, const short *, const short *,
+			  int, const float *, const float *, float &);
+
+static LeafScanFn
+pick_leaf_scan(void)
+{
+#ifdef KD_X86_SIMD
+  // SCANALYZE_NO_SIMD forces the scalar loop (for comparisons)
+  if (getenv("SCANALYZE_NO_SIMD")) return leaf_scan_scalar;
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))   return leaf_scan_avx2;
+  if (__builtin_cpu_supports("sse4.1")) return leaf_scan_sse4;
+#endif
+  return leaf_scan_scalar;
 }
 
+static LeafScanFn leaf_scan = pick_leaf_scan();
+
 
 int
-KDindtree::_search(const Pnt3 *pts, const Pnt3 &p,
-		   int &ind, float &d) const
-{
-  assert(this);
-
-  if (Nhere) { // terminal node
-    float l, d2 = d*d;
-    bool  need_sqrt = false;
-    int *el  = element;
-    int *end = el+Nhere;
-    for (; el<end; el++) {
-      l = dist2(pts[*el], p);
-      if (l < d2) {
-	d2=l; ind = *el;
-	need_sqrt = true;
-      }
+KDindtree::_search(int node, const Pnt3 &p, const Pnt3 &n,
+		   int &ind, float &d, float shrink) const
+{
+  const KDindnode &nd = nodes[node];
+
+  if (dot(n, nd.normal) < nd.cos_th_p_pi_over_4)
+    return 0;
+
+  if (nd.Nhere) { // terminal node
+    float d2 = d*d;
+    int   f  = nd.first;
+    int   k;
+    if (hasNormals)
+      k = leaf_scan(&px[f], &py[f], &pz[f], &nx[f], &ny[f], &nz[f],
+		    nd.Nhere, &p[0], &n[0], d2);
+    else
+      k = leaf_scan(&px[f], &py[f], &pz[f], NULL, NULL, NULL,
+		    nd.Nhere, &p[0], NULL, d2);
+    if (k >= 0) {
+      ind = element[f+k];
+      d = sqrtf(d2);
     }
-    if (need_sqrt) d = sqrtf(d2);
-    return ball_within_bounds(p,d,min,max);
+    return ball_within_bounds(p,d*shrink,nd.min,nd.max);
   }
 
-  if (p[m_d] <= m_p) { // the point is left from partition
-    if (child[0]->_search(pts,p,ind,d))
+  int c0 = nd.first, c1 = nd.first+1;
+  if (p[nd.m_d] > nd.m_p) swap(c0, c1); // the point is right from partition
+  if (_search(c0,p,n,ind,d,shrink))
+    return 1;
+  if (bounds_overlap_ball(p,d*shrink,nodes[c1].min,nodes[c1].max)) {
+    if (_search(c1,p,n,ind,d,shrink))
       return 1;
-    if (bounds_overlap_ball(p,d,child[1]->min,max)) {
-      if (child[1]->_search(pts,p,ind,d))
-	return 1;
+  }
+
+  return ball_within_bounds(p,d*shrink,nd.min,nd.max);
+}
+
+
+int
+KDindtree::_search(int node, const Pnt3 &p,
+		   int &ind, float &d, float shrink) const
+{
+  const KDindnode &nd = nodes[node];
+
+  if (nd.Nhere) { // terminal node
+    float d2 = d*d;
+    int   f  = nd.first;
+    int   k  = leaf_scan(&px[f], &py[f], &pz[f], NULL, NULL, NULL,
+			 nd.Nhere, &p[0], NULL, d2);
+    if (k >= 0) {
+      ind = element[f+k];
+      d = sqrtf(d2);
     }
-  } else {             // the point is right from partition
-    if (child[1]->_search(pts,p,ind,d))
+    return ball_within_bounds(p,d*shrink,nd.min,nd.max);
+  }
+
+  int c0 = nd.first, c1 = nd.first+1;
+  if (p[nd.m_d] > nd.m_p) swap(c0, c1); // the point is right from partition
+  if (_search(c0,p,ind,d,shrink))
+    return 1;
+  if (bounds_overlap_ball(p,d*shrink,nodes[c1].min,nodes[c1].max)) {
+    if (_search(c1,p,ind,d,shrink))
       return 1;
-    if (bounds_overlap_ball(p,d,min,child[0]->max)) {
-      if (child[0]->_search(pts,p,ind,d))
-	return 1;
-    }
   }
 
-  return ball_within_bounds(p,d,min,max);
+  return ball_within_bounds(p,d*shrink,nd.min,nd.max);
 }
 
 
-// STL Update
-int
-KDindtree::_search(const vector<Pnt3>::iterator pts, const vector<short>::iterator nrms,
-		   const Pnt3 &p, const Pnt3 &n,
-		   int &ind, float &d) const
+
+//////////////////////////////////////////////////////////////
+// Neighbourhood queries
+//
+// Plain depth-first traversals, nearer child first, that skip
+// the subtrees whose boxes are too far away.  The k best
+// so far are kept in a max-heap on the squared distance, so
+// the worst one (the pruning radius) is always on top.
+//////////////////////////////////////////////////////////////
+
+// squared distance from p to the box [min, max]
+static inline float
+box_dist2(const Pnt3 &p, const Pnt3 &min, const Pnt3 &max)
 {
-  assert(this);
+  float d2 = 0;
+  for (int i = 0; i < 3; i++) {
+    float t = 0;
+    if      (p[i] < min[i]) t = min[i] - p[i];
+    else if (p[i] > max[i]) t = p[i] - max[i];
+    d2 += t*t;
+  }
+  return d2;
+}
 
-  if (dot(n, normal) < cos_th_p_pi_over_4)
-    return 0;
+// squared distance from p to the farthest corner of the box
+static inline float
+box_far2(const Pnt3 &p, const Pnt3 &min, const Pnt3 &max)
+{
+  float d2 = 0;
+  for (int i = 0; i < 3; i++) {
+    float t = ::max(p[i] - min[i], max[i] - p[i]);
+    d2 += t*t;
+  }
+  return d2;
+}
 
-  if (Nhere) { // terminal node
-    float l, d2 = d*d;
-    bool  need_sqrt = false;
-    int *el  = element;
-    int *end = el+Nhere;
-    for (; el<end; el++) {
-      l = dist2(pts[*el], p);
-      if (l < d2) {
-	const short *sp = &nrms[(*el)*3];
-	// 32767/sqrt(2)==23169.77
-	if (n[0]*sp[0] + n[1]*sp[1] + n[2]*sp[2] > 23169.77) {
-	  // normals also within 45 deg
-	  d2=l; ind = *el;
-	  need_sqrt = true;
-	}
+// sift the new last element of the max-heap (d2, ind) up
+static inline void
+heap_up(float *d2, int *ind, int n)
+{
+  int i = n-1;
+  while (i > 0) {
+    int parent = (i-1) / 2;
+    if (d2[parent] >= d2[i]) break;
+    swap(d2[parent], d2[i]); swap(ind[parent], ind[i]);
+    i = parent;
+  }
+}
+
+// the root of the max-heap was replaced, sift it down
+static inline void
+heap_down(float *d2, int *ind, int n)
+{
+  int i = 0;
+  for (;;) {
+    int c = 2*i + 1;
+    if (c >= n) break;
+    if (c+1 < n && d2[c+1] > d2[c]) c++;
+    if (d2[i] >= d2[c]) break;
+    swap(d2[c], d2[i]); swap(ind[c], ind[i]);
+    i = c;
+  }
+}
+
+
+void
+KDindtree::_knn(int node, const Pnt3 &p, int k,
+		int *ind, float *d2, int &n, float &worst2) const
+{
+  const KDindnode &nd = nodes[node];
+
+  if (nd.Nhere) { // terminal node
+    int end = nd.first + nd.Nhere;
+    for (int i = nd.first; i < end; i++) {
+      float dx = px[i]-p[0], dy = py[i]-p[1], dz = pz[i]-p[2];
+      float l = dx*dx + dy*dy + dz*dz;
+      if (l >= worst2) continue;
+      if (n < k) {
+	d2[n] = l; ind[n] = i; n++;
+	heap_up(d2, ind, n);
+	if (n == k) worst2 = d2[0];
+      } else {
+	d2[0] = l; ind[0] = i;
+	heap_down(d2, ind, n);
+	worst2 = d2[0];
       }
     }
-    if (need_sqrt) d = sqrtf(d2);
-    return ball_within_bounds(p,d,min,max);
+    return;
   }
 
-  if (p[m_d] <= m_p) { // the point is left from partition
-    if (child[0]->_search(pts,nrms,p,n,ind,d))
-      return 1;
-    if (bounds_overlap_ball(p,d,child[1]->min,max)) {
-      if (child[1]->_search(pts,nrms,p,n,ind,d))
-	return 1;
-    }
-  } else {             // the point is right from partition
-    if (child[1]->_search(pts,nrms,p,n,ind,d))
-      return 1;
-    if (bounds_overlap_ball(p,d,min,child[0]->max)) {
-      if (child[0]->_search(pts,nrms,p,n,ind,d))
-	return 1;
+  int c0 = nd.first, c1 = nd.first+1;
+  if (p[nd.m_d] > nd.m_p) swap(c0, c1); // the point is right from partition
+  if (box_dist2(p, nodes[c0].min, nodes[c0].max) < worst2)
+    _knn(c0, p, k, ind, d2, n, worst2);
+  if (box_dist2(p, nodes[c1].min, nodes[c1].max) < worst2)
+    _knn(c1, p, k, ind, d2, n, worst2);
+}
+
+
+int
+KDindtree::knn_search(const Pnt3 &p, int k, int *ind,
+		      float *d2, float maxd) const
+{
+  if (k <= 0 || nPts == 0) return 0;
+
+  float  buf[64];
+  float *dd = d2 ? d2 : (k <= 64 ? buf : new float[k]);
+  int    n = 0;
+  float  worst2 = maxd * maxd;
+  _knn(0, p, k, ind, dd, n, worst2);
+
+  // heap to sorted order, nearest first
+  for (int m = n; m > 1; m--) {
+    swap(dd[0], dd[m-1]); swap(ind[0], ind[m-1]);
+    heap_down(dd, ind, m-1);
+  }
+  for (int i = 0; i < n; i++)
+    ind[i] = element[ind[i]];
+
+  if (dd != d2 && dd != buf) delete[] dd;
+  return n;
+}
+
+
+void
+KDindtree::_within(int node, const Pnt3 &p, float r2,
+		   vector<int> &ind, vector<float> *d2) const
+{
+  const KDindnode &nd = nodes[node];
+
+  if (nd.Nhere) { // terminal node
+    int end = nd.first + nd.Nhere;
+    for (int i = nd.first; i < end; i++) {
+      float dx = px[i]-p[0], dy = py[i]-p[1], dz = pz[i]-p[2];
+      float l = dx*dx + dy*dy + dz*dz;
+      if (l > r2 || element[i] < 0) continue;
+      ind.push_back(element[i]);
+      if (d2) d2->push_back(l);
     }
+    return;
   }
 
-  return ball_within_bounds(p,d,min,max);
+  for (int c = nd.first; c < nd.first+2; c++) {
+    const KDindnode &ch = nodes[c];
+    if (box_dist2(p, ch.min, ch.max) > r2) continue;
+    if (d2 == NULL && box_far2(p, ch.min, ch.max) <= r2) {
+      // the whole subtree is inside the ball; its points are
+      // contiguous in the buckets
+      int lo = c, hi = c;
+      while (nodes[lo].Nhere == 0) lo = nodes[lo].first;
+      while (nodes[hi].Nhere == 0) hi = nodes[hi].first + 1;
+      const int *e   = &element[nodes[lo].first];
+      const int *end = &element[nodes[hi].first + nodes[hi].Nhere];
+      if (nDead == 0) {
+	ind.insert(ind.end(), e, end);
+      } else {
+	for (; e < end; e++)
+	  if (*e >= 0) ind.push_back(*e);
+      }
+      continue;
+    }
+    _within(c, p, r2, ind, d2);
+  }
 }
 
 
 int
-KDindtree::_search(const vector<Pnt3>::iterator pts, const Pnt3 &p,
-		   int &ind, float &d) const
-{
-  assert(this);
-
-  if (Nhere) { // terminal node
-    float l, d2 = d*d;
-    bool  need_sqrt = false;
-    int *el  = element;
-    int *end = el+Nhere;
-    for (; el<end; el++) {
-      l = dist2(pts[*el], p);
-      if (l < d2) {
-	d2=l; ind = *el;
-	need_sqrt = true;
-      }
+KDindtree::radius_search(const Pnt3 &p, float r, vector<int> &ind,
+			 vector<float> *d2) const
+{
+  if (nPts == 0) return 0;
+  int n = ind.size();
+  _within(0, p, r*r, ind, d2);
+  return ind.size() - n;
+}
+
+
+void
+KDindtree::knn_search(const Pnt3 *p, int count, int k,
+		      int *ind, int *nFound,
+		      float *d2, float maxd) const
+{
+  WorkerPool::global().parallel_for(count, 256, [&](int b, int e) {
+    for (int i = b; i < e; i++)
+      nFound[i] = knn_search(p[i], k, &ind[i*k],
+			     d2 ? &d2[i*k] : NULL, maxd);
+  });
+}
+
+
+void
+KDindtree::radius_search(const Pnt3 *p, int count, float r,
+			 vector<int> &first, vector<int> &ind) const
+{
+  // each block of queries collects its answers separately,
+  // they're concatenated in order at the end
+  const int block = 1024;
+  int nBlocks = (count + block - 1) / block;
+  vector< vector<int> > found(nBlocks);
+  first.resize(count+1);
+
+  WorkerPool::global().parallel_for(nBlocks, 1, [&](int b, int e) {
+    for (int ib = b; ib < e; ib++) {
+      int end = min(count, (ib+1)*block);
+      for (int i = ib*block; i < end; i++)
+	first[i+1] = radius_search(p[i], r, found[ib]);
     }
-    if (need_sqrt) d = sqrtf(d2);
-    return ball_within_bounds(p,d,min,max);
+  });
+
+  first[0] = 0;
+  for (int i = 0; i < count; i++)
+    first[i+1] += first[i];
+  ind.resize(first[count]);
+  int k = 0;
+  for (int ib = 0; ib < nBlocks; ib++) {
+    copy(found[ib].begin(), found[ib].end(), ind.begin() + k);
+    k += found[ib].size();
   }
+}
 
-  if (p[m_d] <= m_p) { // the point is left from partition
-    if (child[0]->_search(pts,p,ind,d))
-      return 1;
-    if (bounds_overlap_ball(p,d,child[1]->min,max)) {
-      if (child[1]->_search(pts,p,ind,d))
-	return 1;
+
+//////////////////////////////////////////////////////////////
+// Removing points
+//
+// A dead point keeps its bucket slot, its element is set to
+// -1 and its coordinates to FLT_MAX: the squared distance to
+// it overflows to infinity, so the leaf scans never accept it
+// and need no extra test (the neighbourhood queries, which
+// may be given an infinite radius, check element as well).
+//////////////////////////////////////////////////////////////
+
+// the bucket slot of the caller's index idx, at p; -1 if it
+// isn't in the tree.  Points equal to a partition value may
+// be on either side, so all children whose box contains p
+// are tried.
+int
+KDindtree::_find(int node, const Pnt3 &p, int idx) const
+{
+  const KDindnode &nd = nodes[node];
+
+  for (int i = 0; i < 3; i++)
+    if (p[i] < nd.min[i] || p[i] > nd.max[i]) return -1;
+
+  if (nd.Nhere) { // terminal node
+    int end = nd.first + nd.Nhere;
+    for (int i = nd.first; i < end; i++)
+      if (element[i] == idx) return i;
+    return -1;
+  }
+
+  int k = _find(nd.first, p, idx);
+  if (k < 0) k = _find(nd.first+1, p, idx);
+  return k;
+}
+
+
+void
+KDindtree::kill(int slot)
+{
+  px[slot] = py[slot] = pz[slot] = FLT_MAX;
+  element[slot] = -1;
+  nDead++;
+}
+
+
+void
+KDindtree::remove(const Pnt3 *pts, const int *ind, int n)
+{
+  if (nPts == 0) return;
+  for (int i = 0; i < n; i++) {
+    int slot = _find(0, pts[ind[i]], ind[i]);
+    if (slot >= 0) kill(slot);
+  }
+}
+
+
+void
+KDindtree::renumber(const int *newIndex)
+{
+  for (int i = 0; i < nPts; i++) {
+    if (element[i] < 0) continue;
+    int k = newIndex[element[i]];
+    if (k < 0) kill(i);
+    else       element[i] = k;
+  }
+  compact();
+}
+
+
+// rebuild from the live points once enough are dead; a tree
+// with nothing left is kept as it is (the owner should drop
+// it, see num_points())
+void
+KDindtree::compact(void)
+{
+  if (!wants_compact() || nDead == nPts)
+    return;
+
+  int n = nPts - nDead;
+  cout << "Compacting kdtree (" << n << " points)..." << flush;
+
+  // gather the live points, numbered 0..n-1 for the build
+  vector<Pnt3>  pts(n);
+  vector<short> nrms(hasNormals ? 3*n : 0);
+  vector<int>   live(n), ind(n);
+  for (int i = 0, k = 0; i < nPts; i++) {
+    if (element[i] < 0) continue;
+    pts[k].set(px[i], py[i], pz[i]);
+    if (hasNormals) {
+      nrms[3*k+0] = nx[i]; nrms[3*k+1] = ny[i]; nrms[3*k+2] = nz[i];
     }
-  } else {             // the point is right from partition
-    if (child[1]->_search(pts,p,ind,d))
-      return 1;
-    if (bounds_overlap_ball(p,d,min,child[0]->max)) {
-      if (child[0]->_search(pts,p,ind,d))
-	return 1;
+    live[k] = element[i];
+    ind[k] = k;
+    k++;
+  }
+
+  build(&pts[0], hasNormals ? &nrms[0] : NULL, &ind[0], n);
+  for (int i = 0; i < n; i++)
+    elementBuf[i] = live[elementBuf[i]];
+
+#ifndef WIN32
+  // the arrays are our own now, not the cache file's
+  if (mapAddr) munmap(mapAddr, mapLen);
+  mapAddr = NULL;
+  mapLen  = 0;
+#endif
+
+  cout << " done." << endl;
+}
+
+
+//////////////////////////////////////////////////////////////
+// Cache files
+//
+// Layout: a fixed size header followed by the node array and
+// the bucket arrays, each starting at a 64 byte boundary, in
+// the machine's native format.  The header records the byte
+// order and the node size, a cache written by a different
+// architecture or build is simply rebuilt.
+//
+// On load the file is mapped privately, the tree's arrays
+// point straight into the mapping; pages are read in only as
+// the searches touch them.
+//////////////////////////////////////////////////////////////
+
+#define KDT_MAGIC     "SCZKDT"
+#define KDT_VERSION   1
+#define KDT_BYTEORDER 0x01020304
+#define KDT_ALIGN     64
+
+struct KDcacheHeader {
+  char      magic[8];
+  int       version;
+  int       byteOrder;
+  int       nodeSize;
+  int       res;
+  int       nPts;
+  int       nNodes;
+  int       hasNormals;
+  int       pad;
+  long long mtime, size;
+  unsigned long long hash;
+  long long offset[8];  // nodes, px, py, pz, nx, ny, nz, element
+};
+
+
+static unsigned long long
+hash_bytes(unsigned long long h, const void *data, size_t len)
+{
+  // FNV-1a over 64 bit words, the tail byte by byte
+  const unsigned long long prime = 1099511628211ULL;
+  const char *c = (const char *)data;
+  size_t i = 0;
+  for (; i + 8 <= len; i += 8) {
+    unsigned long long w;
+    memcpy(&w, c+i, 8);
+    h = (h ^ w) * prime;
+  }
+  for (; i < len; i++)
+    h = (h ^ (unsigned char)c[i]) * prime;
+  return h;
+}
+
+
+bool
+KDindtree::cache_key(const char *srcFile, int res,
+		     const Pnt3 *pts, const short *nrms, int n,
+		     CacheKey &key)
+{
+  struct stat st;
+  if (stat(srcFile, &st) != 0)
+    return false;
+  key.mtime = st.st_mtime;
+  key.size  = st.st_size;
+  key.res   = res;
+  // the file stamp alone doesn't say that the points in memory
+  // are still the ones read from it, so check those too
+  unsigned long long h = 14695981039346656037ULL;
+  h = hash_bytes(h, pts, n * sizeof(Pnt3));
+  if (nrms) h = hash_bytes(h, nrms, n * 3 * sizeof(short));
+  key.hash = h;
+  return true;
+}
+
+
+static long long
+kdt_align(long long o)
+{
+  return (o + KDT_ALIGN - 1) & ~(long long)(KDT_ALIGN - 1);
+}
+
+
+// where the arrays go, returns the total file size
+static long long
+kdt_layout(KDcacheHeader &h)
+{
+  long long len[8] = {
+    (long long)(h.nNodes * sizeof(KDindnode)),
+    (long long)(h.nPts * sizeof(float)),
+    (long long)(h.nPts * sizeof(float)),
+    (long long)(h.nPts * sizeof(float)),
+    h.hasNormals ? (long long)(h.nPts * sizeof(short)) : 0,
+    h.hasNormals ? (long long)(h.nPts * sizeof(short)) : 0,
+    h.hasNormals ? (long long)(h.nPts * sizeof(short)) : 0,
+    (long long)(h.nPts * sizeof(int))
+  };
+  long long o = kdt_align(sizeof(KDcacheHeader));
+  for (int i = 0; i < 8; i++) {
+    h.offset[i] = o;
+    o = kdt_align(o + len[i]);
+  }
+  return o;
+}
+
+
+bool
+KDindtree::save(const char *cacheFile, const CacheKey &key) const
+{
+  KDcacheHeader h;
+  memset(&h, 0, sizeof(h));
+  strcpy(h.magic, KDT_MAGIC);
+  h.version    = KDT_VERSION;
+  h.byteOrder  = KDT_BYTEORDER;
+  h.nodeSize   = sizeof(KDindnode);
+  h.res        = key.res;
+  h.nPts       = nPts;
+  h.nNodes     = nNodes;
+  h.hasNormals = hasNormals;
+  h.mtime      = key.mtime;
+  h.size       = key.size;
+  h.hash       = key.hash;
+  long long total = kdt_layout(h);
+
+  const void *data[8] = { nodes, px, py, pz, nx, ny, nz, element };
+
+  // write to a temporary and rename, so that another session
+  // never maps a half written file
+  char tmpFile[PATH_MAX + 64];
+  sprintf(tmpFile, "%.*s.%d.tmp", PATH_MAX, cacheFile, (int)getpid());
+  FILE *fp = fopen(tmpFile, "wb");
+  if (fp == NULL)
+    return false;
+
+  static const char zeros[KDT_ALIGN] = { 0 };
+  bool ok = (fwrite(&h, sizeof(h), 1, fp) == 1);
+  long long pos = sizeof(h);
+  for (int i = 0; ok && i < 8; i++) {
+    // pad up to the array's offset, then the array, then
+    // pad to the next one
+    ok = fwrite(zeros, 1, h.offset[i] - pos, fp) == h.offset[i] - pos;
+    pos = h.offset[i];
+    size_t n = 0;
+    switch (i) {
+    case 0:  n = nNodes * sizeof(KDindnode); break;
+    case 4: case 5: case 6:
+      n = hasNormals ? nPts * sizeof(short) : 0; break;
+    case 7:  n = nPts * sizeof(int); break;
+    default: n = nPts * sizeof(float); break;
     }
+    if (ok && n) ok = (fwrite(data[i], 1, n, fp) == n);
+    pos += n;
   }
+  if (ok && pos < total)
+    ok = fwrite(zeros, 1, total - pos, fp) == total - pos;
+  if (fclose(fp) != 0) ok = false;
+
+  if (!ok || rename(tmpFile, cacheFile) != 0) {
+    unlink(tmpFile);
+    return false;
+  }
+  return true;
+}
+
+
+KDindtree*
+KDindtree::load(const char *cacheFile, const CacheKey &key)
+{
+  FILE *fp = fopen(cacheFile, "rb");
+  if (fp == NULL)
+    return NULL;
+
+  KDcacheHeader h;
+  bool ok = (fread(&h, sizeof(h), 1, fp) == 1);
+  fseek(fp, 0, SEEK_END);
+  long long fileLen = ftell(fp);
+  if (ok) {
+    KDcacheHeader lay = h;
+    ok = !strncmp(h.magic, KDT_MAGIC, 8) &&
+      h.version    == KDT_VERSION &&
+      h.byteOrder  == KDT_BYTEORDER &&
+      h.nodeSize   == sizeof(KDindnode) &&
+      h.res        == key.res &&
+      h.mtime      == key.mtime &&
+      h.size       == key.size &&
+      h.hash       == key.hash &&
+      h.nPts > 0 && h.nNodes > 0 &&
+      kdt_layout(lay) == fileLen &&
+      !memcmp(lay.offset, h.offset, sizeof(h.offset));
+  }
+  if (!ok) {
+    fclose(fp);
+    return NULL;
+  }
+
+  KDindtree *t = new KDindtree;
+  t->nNodes     = h.nNodes;
+  t->nPts       = h.nPts;
+  t->hasNormals = h.hasNormals;
+
+#ifndef WIN32
+  fclose(fp);
+  // private and writable, so that changes made to the tree
+  // after loading stay in memory and never reach the file
+  int fd = open(cacheFile, O_RDONLY);
+  void *addr = MAP_FAILED;
+  if (fd >= 0) {
+    addr = mmap(NULL, fileLen, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE, fd, 0);
+    close(fd);
+  }
+  if (addr == MAP_FAILED) {
+    delete t;
+    return NULL;
+  }
+  t->mapAddr = addr;
+  t->mapLen  = fileLen;
+
+  char *base = (char *)addr;
+  t->nodes   = (KDindnode *)(base + h.offset[0]);
+  t->px      = (float *)(base + h.offset[1]);
+  t->py      = (float *)(base + h.offset[2]);
+  t->pz      = (float *)(base + h.offset[3]);
+  t->element = (int *)  (base + h.offset[7]);
+  if (h.hasNormals) {
+    t->nx = (short *)(base + h.offset[4]);
+    t->ny = (short *)(base + h.offset[5]);
+    t->nz = (short *)(base + h.offset[6]);
+  }
+#else
+  // no mmap here, read the arrays in
+  t->nodeBuf.resize(h.nNodes);
+  t->pxBuf.resize(h.nPts);
+  t->pyBuf.resize(h.nPts);
+  t->pzBuf.resize(h.nPts);
+  t->elementBuf.resize(h.nPts);
+  if (h.hasNormals) {
+    t->nxBuf.resize(h.nPts);
+    t->nyBuf.resize(h.nPts);
+    t->nzBuf.resize(h.nPts);
+  }
+  void  *dst[8] = { &t->nodeBuf[0], &t->pxBuf[0], &t->pyBuf[0],
+		    &t->pzBuf[0],
+		    h.hasNormals ? &t->nxBuf[0] : NULL,
+		    h.hasNormals ? &t->nyBuf[0] : NULL,
+		    h.hasNormals ? &t->nzBuf[0] : NULL,
+		    &t->elementBuf[0] };
+  size_t len[8] = { h.nNodes * sizeof(KDindnode),
+		    h.nPts * sizeof(float), h.nPts * sizeof(float),
+		    h.nPts * sizeof(float),
+		    h.nPts * sizeof(short), h.nPts * sizeof(short),
+		    h.nPts * sizeof(short), h.nPts * sizeof(int) };
+  for (int i = 0; ok && i < 8; i++) {
+    if (dst[i] == NULL) continue;
+    ok = (fseek(fp, h.offset[i], SEEK_SET) == 0 &&
+	  fread(dst[i], 1, len[i], fp) == len[i]);
+  }
+  fclose(fp);
+  if (!ok) {
+    delete t;
+    return NULL;
+  }
+  t->use_buffers();
+#endif
 
-  return ball_within_bounds(p,d,min,max);
+  return t;
 }
@@ -4,6 +4,19 @@
 // 05/22/96
 // A KD tree which stores only indices to points in a
 // Pointcloud
+//
+// The tree is stored flattened: all nodes live in one array
+// in breadth-first order (the two children of a node are
+// always next to each other), and the points are copied into
+// leaf buckets, so that the points of a leaf are contiguous
+// in separate x, y, z (and normal) arrays.  A query touches
+// only a few cache lines per node instead of chasing
+// pointers all over the heap.
+//
+// Because the arrays are flat, a built tree can be written
+// to a sidecar file next to the scan it was built from and
+// later mapped back in without rebuilding it (see the
+// CreateKDindtree variant that takes a file name).
 //############################################################
 
 #ifndef _KDINDTREE_H_
@@ -11,6 +24,13 @@
 #include "Pnt3.h"
 #include <vector>
 
+// The searches that take a normal only accept points whose
+// normal is within 45 degrees of it: the dot product of the
+// unit query normal and the 16 bit point normal must exceed
+// 32767/sqrt(2).  (Other searches for corresponding points
+// use the same test.)
+#define NRM_45_DEG 23169.77f
+
 // factory:
 class KDindtree* CreateKDindtree (const Pnt3* pts,
 				  const short* nrms,
@@ -21,35 +41,78 @@ class KDindtree* CreateKDindtree (const vector<Pnt3>::iterator pts,
 				  const vector<short>::iterator nrms,
 				  int nPts);
 
+// Same, but first look for a cached tree in a sidecar file
+// "<srcFile>.<res>.kdt".  The cache is used only if it was
+// written for the same version of srcFile (modification time
+// and size), the same resolution, and the same points;
+// otherwise the tree is built and the cache (re)written.
+// srcFile == NULL or the environment variable
+// SCANALYZE_NO_KDCACHE disables the cache; with save == false
+// an existing cache is used but never written (for points
+// that have been changed since they were read).
+class KDindtree* CreateKDindtree (const Pnt3* pts,
+				  const short* nrms,
+				  int nPts,
+				  const char* srcFile, int res,
+				  bool save = true);
 
-class KDindtree {
-private:
 
-  int      m_d;       // discriminator, 0, 1, or 2 (for x,y,z)
-  float    m_p;       // partition
-  Pnt3     min, max;
-  int      Nhere;     // how many in this node
-  KDindtree *child[2];
-  int       *element;
+struct KDindnode {
+  Pnt3     min, max;  // bounds of the points in this subtree
 
   // the center of the cone that contains the normals of the
-  // points in this subtree
-  Pnt3    normal;
-  float   theta;   // the opening angle of that cone
-  float   cos_th_p_pi_over_4;
+  // points in this subtree, and cos of its opening angle + 45 deg
+  Pnt3     normal;
+  float    cos_th_p_pi_over_4;
 
-  int _search(const Pnt3 *pts, const short *nrms,
-	      const Pnt3 &p, const Pnt3 &n,
-		   int &ind, float &d) const;
-  int _search(const Pnt3 *pts, const Pnt3 &p,
-		   int &ind, float &d) const;
+  float    m_p;       // partition
+  int      m_d;       // discriminator, 0, 1, or 2 (for x,y,z)
+  int      first;     // inner node: index of child[0], child[1]
+                      // is first+1; leaf: first point in bucket
+  int      Nhere;     // how many in this leaf, 0 for inner nodes
+};
 
-// STL Update
-  int _search(const vector<Pnt3>::iterator pts, const vector<short>::iterator nrms,
-	      const Pnt3 &p, const Pnt3 &n,
-		   int &ind, float &d) const;
-  int _search(const vector<Pnt3>::iterator pts, const Pnt3 &p,
-		   int &ind, float &d) const;
+
+class KDindtree {
+private:
+
+  KDindnode    *nodes;      // nodes[0] is the root
+  int           nNodes;
+
+  // leaf buckets: the points (and normals) of each leaf
+  // stored contiguously, element maps back to the caller's
+  // indices
+  float        *px, *py, *pz;
+  short        *nx, *ny, *nz;
+  int          *element;
+  int           nPts;
+  int           nDead;      // removed points still in the buckets
+  bool          hasNormals;
+
+  // the arrays above point either into these (a tree built
+  // in memory) or into a mapped cache file
+  vector<KDindnode> nodeBuf;
+  vector<float> pxBuf, pyBuf, pzBuf;
+  vector<short> nxBuf, nyBuf, nzBuf;
+  vector<int>   elementBuf;
+  void         *mapAddr;
+  size_t        mapLen;
+
+  KDindtree(void);
+  void build(const Pnt3 *pts, const short *nrms, int *ind, int n);
+  void use_buffers(void);
+
+  int _search(int node, const Pnt3 &p, const Pnt3 &n,
+	      int &ind, float &d, float shrink) const;
+  int _search(int node, const Pnt3 &p,
+	      int &ind, float &d, float shrink) const;
+  void _knn(int node, const Pnt3 &p, int k,
+	    int *ind, float *d2, int &n, float &worst2) const;
+  void _within(int node, const Pnt3 &p, float r2,
+	       vector<int> &ind, vector<float> *d2) const;
+  int  _find(int node, const Pnt3 &p, int idx) const;
+  void kill(int slot);
+  void compact(void);
 
 public:
 
@@ -57,6 +120,7 @@ public:
   // indices to pts and nrms (it is assumed that same index
   // works for both arrays)
   // ind is modified,
+  // first is not used any more, it's there for old callers
   KDindtree(const Pnt3 *pts, const short *nrms,
 	    int *ind, int n, int first = 1);
 // STL Update
@@ -64,42 +128,113 @@ public:
 	    int *ind, int n, int first = 1);
   ~KDindtree();
 
+  // sidecar cache files; key is checked by load()
+  struct CacheKey {
+    long long mtime, size;  // of the scan file
+    int       res;
+    unsigned long long hash;   // of the points and normals
+  };
+  static bool cache_key(const char *srcFile, int res,
+			const Pnt3 *pts, const short *nrms,
+			int nPts, CacheKey &key);
+  static KDindtree* load(const char *cacheFile,
+			 const CacheKey &key);
+  bool save(const char *cacheFile, const CacheKey &key) const;
+
+  // The searches use the tree's own copies of the points and
+  // normals; pts and nrms have to be the arrays the tree was
+  // built from, and are used only to keep the old interface.
+  //
+  // eps > 0 makes the search approximate: a subtree is skipped
+  // when (1+eps)*(distance to its box) > current best, so the
+  // returned point is at most (1+eps) times farther than the
+  // true closest one.  eps == 0 is the exact search.
+
   // use normals
   int search(const Pnt3 *pts, const short *nrms,
 	     const Pnt3 &p, const Pnt3 &n,
-	     int &ind, float &d) const
+	     int &ind, float &d, float eps = 0) const
     {
       float _d = d;
-      _search(pts, nrms, p, n, ind, d);
+      _search(0, p, n, ind, d, 1.0/(1.0+eps));
       return (d!=_d);
     }
 
   // just find the closest point
   int search(const Pnt3 *pts, const Pnt3 &p,
-	     int &ind, float &d) const
+	     int &ind, float &d, float eps = 0) const
     {
       float _d = d;
-      _search(pts, p, ind, d);
+      _search(0, p, ind, d, 1.0/(1.0+eps));
       return (d!=_d);
     }
 
+  // Neighbourhoods (normals are not looked at); the indices
+  // are the caller's, as for search().
+
+  // The (at most) k points closest to p and within maxd of it,
+  // nearest first.  ind (and d2, the squared distances, if
+  // given) must have room for k.  Returns how many were found.
+  int knn_search(const Pnt3 &p, int k, int *ind,
+		 float *d2 = NULL, float maxd = 1e33) const;
+
+  // All the points within r of p, appended to ind (and d2) in
+  // no particular order.  Returns how many were found.
+  int radius_search(const Pnt3 &p, float r, vector<int> &ind,
+		    vector<float> *d2 = NULL) const;
+
+  // Batched versions of the above, split across the worker
+  // pool.  knn: the answers for p[i] are ind[i*k ...], nFound[i]
+  // of them.  radius: the answers for p[i] are ind[first[i]]
+  // ... ind[first[i+1]-1]; first gets count+1 entries.
+  void knn_search(const Pnt3 *p, int count, int k,
+		  int *ind, int *nFound,
+		  float *d2 = NULL, float maxd = 1e33) const;
+  void radius_search(const Pnt3 *p, int count, float r,
+		     vector<int> &first, vector<int> &ind) const;
+
+  // Removing points without rebuilding the tree.  A removed
+  // point is only marked dead in its bucket (moved far away,
+  // so no search ever finds it).  The boxes and normal cones
+  // of the nodes are not shrunk, they stay conservative.
+  //
+  // The caller keeps its arrays as they are, with the removed
+  // points left in, until wants_compact() says more than a
+  // quarter of the tree is dead; then it compacts its arrays
+  // and calls renumber(), which rebuilds the tree from the
+  // live points it holds.
+
+  // remove the caller's indices ind[0..n); pts is the array
+  // the tree was built from, used to find the points, so the
+  // work is proportional to n
+  void remove(const Pnt3 *pts, const int *ind, int n);
+
+  // the caller's arrays were compacted: point i is now
+  // newIndex[i], or was removed if newIndex[i] < 0
+  void renumber(const int *newIndex);
+
+  bool wants_compact(void) const { return 4*nDead > nPts; }
+
+  // how many live points are left
+  int  num_points(void) const { return nPts - nDead; }
+
 // STL Update
   // use normals
   int search(const vector<Pnt3>::iterator pts, const vector<short>::iterator nrms,
 	     const Pnt3 &p, const Pnt3 &n,
-	     int &ind, float &d) const
+	     int &ind, float &d, float eps = 0) const
     {
       float _d = d;
-      _search(pts, nrms, p, n, ind, d);
+      _search(0, p, n, ind, d, 1.0/(1.0+eps));
       return (d!=_d);
     }
 
   // just find the closest point
   int search(const vector<Pnt3>::iterator pts, const Pnt3 &p,
-	     int &ind, float &d) const
+	     int &ind, float &d, float eps = 0) const
     {
       float _d = d;
-      _search(pts, p, ind, d);
+      _search(0, p, ind, d, 1.0/(1.0+eps));
       return (d!=_d);
     }
 
@@ -192,7 +192,7 @@ KDtritree::~KDtritree(void)
 
 void
 KDtritree::_search(const Pnt3 *pts, const int *inds,
-		   const Pnt3 &p, Pnt3 &cp, float &d2) const
+		   const Pnt3 &p, Pnt3 &cp, float &d2, float shrink2) const
 {
   if (child[0] == NULL) {
     // terminal node, check the triangle and return
@@ -206,25 +206,25 @@ KDtritree::_search(const Pnt3 *pts, const int *inds,
 
   if (p[ind] <= split) {
     // can the left subtree contain anything interesting?
-    if (spheres_intersect(p, child[0]->ctr, d2, child[0]->radius))
-      child[0]->_search(pts, inds, p, cp, d2);
+    if (spheres_intersect(p, child[0]->ctr, d2*shrink2, child[0]->radius))
+      child[0]->_search(pts, inds, p, cp, d2, shrink2);
     // can the right subtree contain anything interesting?
-    if (spheres_intersect(p, child[1]->ctr, d2, child[1]->radius))
-      child[1]->_search(pts, inds, p, cp, d2);
+    if (spheres_intersect(p, child[1]->ctr, d2*shrink2, child[1]->radius))
+      child[1]->_search(pts, inds, p, cp, d2, shrink2);
   } else {
     // can the right subtree contain anything interesting?
-    if (spheres_intersect(p, child[1]->ctr, d2, child[1]->radius))
-      child[1]->_search(pts, inds, p, cp, d2);
+    if (spheres_intersect(p, child[1]->ctr, d2*shrink2, child[1]->radius))
+      child[1]->_search(pts, inds, p, cp, d2, shrink2);
     // can the left subtree contain anything interesting?
-    if (spheres_intersect(p, child[0]->ctr, d2, child[0]->radius))
-      child[0]->_search(pts, inds, p, cp, d2);
+    if (spheres_intersect(p, child[0]->ctr, d2*shrink2, child[0]->radius))
+      child[0]->_search(pts, inds, p, cp, d2, shrink2);
   }
 }
 
 // STL Update
 void
 KDtritree::_search(const vector<Pnt3>::const_iterator pts, const vector<int>::const_iterator inds,
-		   const Pnt3 &p, Pnt3 &cp, float &d2) const
+		   const Pnt3 &p, Pnt3 &cp, float &d2, float shrink2) const
 {
   if (child[0] == NULL) {
     // terminal node, check the triangle and return
@@ -238,18 +238,18 @@ KDtritree::_search(const vector<Pnt3>::const_iterator pts, const vector<int>::co
 
   if (p[ind] <= split) {
     // can the left subtree contain anything interesting?
-    if (spheres_intersect(p, child[0]->ctr, d2, child[0]->radius))
-      child[0]->_search(pts, inds, p, cp, d2);
+    if (spheres_intersect(p, child[0]->ctr, d2*shrink2, child[0]->radius))
+      child[0]->_search(pts, inds, p, cp, d2, shrink2);
     // can the right subtree contain anything interesting?
-    if (spheres_intersect(p, child[1]->ctr, d2, child[1]->radius))
-      child[1]->_search(pts, inds, p, cp, d2);
+    if (spheres_intersect(p, child[1]->ctr, d2*shrink2, child[1]->radius))
+      child[1]->_search(pts, inds, p, cp, d2, shrink2);
   } else {
     // can the right subtree contain anything interesting?
-    if (spheres_intersect(p, child[1]->ctr, d2, child[1]->radius))
-      child[1]->_search(pts, inds, p, cp, d2);
+    if (spheres_intersect(p, child[1]->ctr, d2*shrink2, child[1]->radius))
+      child[1]->_search(pts, inds, p, cp, d2, shrink2);
     // can the left subtree contain anything interesting?
-    if (spheres_intersect(p, child[0]->ctr, d2, child[0]->radius))
-      child[0]->_search(pts, inds, p, cp, d2);
+    if (spheres_intersect(p, child[0]->ctr, d2*shrink2, child[0]->radius))
+      child[0]->_search(pts, inds, p, cp, d2, shrink2);
   }
 }
 
@@ -34,10 +34,10 @@ private:
   void collapse_spheres(void);
 
   void _search(const Pnt3 *pts, const int *inds,
-	       const Pnt3 &p, Pnt3 &cp, float &d2) const;
+	       const Pnt3 &p, Pnt3 &cp, float &d2, float shrink2) const;
 // STL Update
   void _search(const vector<Pnt3>::const_iterator pts, const vector<int>::const_iterator inds,
-	       const Pnt3 &p, Pnt3 &cp, float &d2) const;
+	       const Pnt3 &p, Pnt3 &cp, float &d2, float shrink2) const;
 
 public:
 
@@ -50,11 +50,13 @@ public:
   ~KDtritree();
 
   // just find the closest point
+  // with eps > 0, a subtree is skipped when (1+eps) times the
+  // distance to its bounding sphere exceeds the current best
   bool search(const Pnt3 *pts, const int *inds, const Pnt3 &p,
-	      Pnt3 &cp, float &d) const
+	      Pnt3 &cp, float &d, float eps = 0) const
     {
       float d2 = d*d;
-      _search(pts, inds, p, cp, d2);
+      _search(pts, inds, p, cp, d2, 1.0/((1.0+eps)*(1.0+eps)));
       if (d*d!=d2) {
 	d = sqrtf(d2);
 	return true;
@@ -64,10 +66,10 @@ public:
     }
 // STL Update
   bool search(const vector<Pnt3>::const_iterator pts, const vector<int>::const_iterator inds, const Pnt3 &p,
-	      Pnt3 &cp, float &d) const
+	      Pnt3 &cp, float &d, float eps = 0) const
     {
       float d2 = d*d;
-      _search(pts, inds, p, cp, d2);
+      _search(pts, inds, p, cp, d2, 1.0/((1.0+eps)*(1.0+eps)));
       if (d*d!=d2) {
 	d = sqrtf(d2);
 	return true;
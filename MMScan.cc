@@ -21,9 +21,11 @@
 #include "MeshTransport.h"
 #include "TriMeshUtils.h"
 #include "KDindtree.h"
+#include "TriBVH.h"
 #include "ColorUtils.h"
 #include "Progress.h"
 #include "VertexFilter.h"
+#include "WorkerPool.h"
 
 #include "Random.h"
 #include <stdio.h>
@@ -52,6 +54,10 @@ MMScan::~MMScan()
     delete (kdtree.back());
     kdtree.pop_back();
   }
+  while (triBVH.size()) {
+    delete (triBVH.back());
+    triBVH.pop_back();
+  }
 
   scans.clear();
 }
@@ -1315,7 +1321,7 @@ MMScan::subsample_points(float rate, vector<Pnt3> &p, vector<Pnt3> &n)
 }
 
 MMScan::mergedRegData&
-MMScan::getRegData (void)
+MMScan::getRegData (bool keepKdtree)
 {
   mergedRegData& reg = regData[curr_res];
   if (!isDirty_mem && (reg.vtx.size() > 0)) return reg;
@@ -1325,6 +1331,7 @@ MMScan::getRegData (void)
   reg.vtx.clear(); reg.vtx.reserve(numVerts);
   reg.nrm.clear(); reg.nrm.reserve(numVerts * 3);
   reg.tris.clear(); reg.tris.reserve(num_tris(curr_res) * 3);
+  reg.slot.clear();
 
   // used to reindex triangle vertices in the global array
   int reIndexFactor;
@@ -1343,7 +1350,12 @@ MMScan::getRegData (void)
   }
 
   mark_boundary (reg);
-  delete kdtree[curr_res];
+  if (!keepKdtree) {
+    delete kdtree[curr_res];
+    kdtree[curr_res] = NULL;
+  }
+  delete triBVH[curr_res];
+  triBVH[curr_res] = NULL;
 
   isDirty_mem = false;
   return reg;
@@ -1379,9 +1391,11 @@ MMScan::get_kdtree()
   mergedRegData& reg = getRegData();
 
   delete kdtree[curr_res];
-  kdtree[curr_res] = CreateKDindtree (reg.vtx.begin(),
-				      reg.nrm.begin(),
-				      reg.vtx.size());
+  kdtree[curr_res] = CreateKDindtree (&reg.vtx[0],
+				      &reg.nrm[0],
+				      reg.vtx.size(),
+				      get_name().c_str(), curr_res,
+				      !isDirty_disk);
 
   isDirty_mem = false;
 
@@ -1389,6 +1403,65 @@ MMScan::get_kdtree()
 }
 
 
+TriBVH*
+MMScan::get_tribvh()
+{
+  if ((!isDirty_mem) && (triBVH[curr_res] != NULL))
+    return triBVH[curr_res];
+
+  // mark_boundary() throws away the merged triangles, so
+  // collect them again from the fragments
+  mergedRegData& reg = getRegData();
+  vector<int> tris;
+  tris.reserve(num_tris(curr_res) * 3);
+  int reIndexFactor = 0;
+  for (int i = 0; i < scans.size(); i++) {
+    mmResLevel& res = scans[i].meshes[curr_res];
+    for (int j = 0; j < res.tris.size(); j++) {
+      int k = res.tris[j] + reIndexFactor;
+      tris.push_back(reg.slot.size() ? reg.slot[k] : k);
+    }
+    reIndexFactor += res.vtx.size();
+  }
+
+  delete triBVH[curr_res];
+  triBVH[curr_res] = tris.size() ? create_TriBVH (&reg.vtx[0], &tris[0],
+						   tris.size())
+				 : NULL;
+
+  return triBVH[curr_res];
+}
+
+
+// returns confidence!
+float
+MMScan::closest_point_on_mesh(const Pnt3 &p, Pnt3 &cp,
+			      OccSt &status_p)
+{
+  return closest_point_on_bvh(get_tribvh(), p, cp, status_p);
+}
+
+
+// returns confidence!
+float
+MMScan::closest_along_line_of_sight(const Pnt3 &p, Pnt3 &cp,
+				    OccSt &status_p)
+{
+  // the fragments come from a hand-held scanner, there's no
+  // single viewpoint to look from; use the closest point
+  return closest_point_on_mesh(p, cp, status_p);
+}
+
+
+// returns confidence!
+float
+MMScan::closest_along_line(const Pnt3 &p, const Pnt3 &dir,
+			   Pnt3 &cp, OccSt &status_p)
+{
+  return closest_along_line_on_bvh(get_tribvh(), p, dir, cp, status_p);
+}
+
+
 bool
 MMScan::closest_point(const Pnt3 &p, const Pnt3 &n,
 		      Pnt3 &cp, Pnt3 &cn,
@@ -1405,13 +1478,52 @@ MMScan::closest_point(const Pnt3 &p, const Pnt3 &n,
       if (reg.boundary[ind]) return 0;
     }
     cp = reg.vtx[ind];
-    cn = reg.nrm[ind];
+    short *sp = &reg.nrm[ind*3];
+    cn.set(sp[0]/32767.0,
+	   sp[1]/32767.0,
+	   sp[2]/32767.0);
   }
 
   return ans;
 }
 
 
+void
+MMScan::closest_points(const Pnt3 *p, const Pnt3 *n, int count,
+		       Pnt3 *cp, Pnt3 *cn, bool *found,
+		       float thr, bool bdry_ok, float eps)
+{
+  KDindtree* tree = get_kdtree();
+  mergedRegData& reg = getRegData();
+  if (!tree) {
+    fill(found, found+count, false);
+    return;
+  }
+  const Pnt3  *vtx  = &reg.vtx[0];
+  const short *nrm  = &reg.nrm[0];
+  const char  *bdry = bdry_ok ? NULL : &reg.boundary[0];
+
+  WorkerPool::global().parallel_for(count, 256, [&](int b, int e) {
+    for (int i = b; i < e; i++) {
+      int   ind;
+      float d = thr;
+      found[i] = tree->search(vtx, nrm, p[i], n[i], ind, d, eps);
+      if (!found[i]) continue;
+      if (bdry && bdry[ind]) {
+	// disallow closest points that are on the mesh boundary
+	found[i] = false;
+	continue;
+      }
+      cp[i] = vtx[ind];
+      const short *sp = &nrm[ind*3];
+      cn[i].set(sp[0]/32767.0,
+		sp[1]/32767.0,
+		sp[2]/32767.0);
+    }
+  });
+}
+
+
 void
 MMScan::update_res_ctrl()
 {
@@ -1429,11 +1541,27 @@ MMScan::filter_inplace(const VertexFilter &filter)
   vector<mmScanFrag>::iterator scan;
   bool changedScan = false;
 
+  // if the merged arrays and the kdtree of the full resolution
+  // are current, note where each merged vertex goes, so that
+  // the tree can just forget the clipped ones; the vertices
+  // next to them are on the boundary now
+  KDindtree* tree = NULL;
+  if (curr_res == 0 && !isDirty_mem && kdtree.size())
+    tree = kdtree[0];
+  vector<int> regRemap;
+  int regCount = 0;
+  int regBase  = 0;
+
   // #1: loop through all scans
   for (j = 0; j < scans.size(); j++) {
 // STL Update
     scan = scans.begin() + j;
     cout << "looking at scan #" << j << endl;
+    if (!scan->isVisible && tree) {
+      int n = scan->meshes[0].vtx.size();
+      for (i = 0; i < n; i++)
+	regRemap.push_back(regCount++);
+    }
     if (scan->isVisible) {
       changedScan = false;
       int maxVerts = scan->num_vertices(0);
@@ -1476,6 +1604,14 @@ MMScan::filter_inplace(const VertexFilter &filter)
 	}
       }
 
+      if (tree) {
+	regBase = regRemap.size();
+	for (i = 0; i < maxVerts; i++)
+	  regRemap.push_back(vert_remap[i] < 0 ? -1
+			     : regCount + vert_remap[i]);
+	regCount += count;
+      }
+
       // either ditch the scan if it's now empty, or clip its resolutions
       // if it has been changed at all
 
@@ -1559,6 +1695,13 @@ MMScan::filter_inplace(const VertexFilter &filter)
 	      newTris.push_back(a);
 	      newTris.push_back(b);
 	      newTris.push_back(c);
+	    } else if (tree) {
+	      mergedRegData& reg = regData[0];
+	      for (int m = 0; m < 3; m++) {
+		if (vert_remap[res->tris[i+m]] < 0) continue;
+		int k = regBase + res->tris[i+m];
+		reg.boundary[reg.slot.size() ? reg.slot[k] : k] = 1;
+	      }
 	    }
 	  }
 
@@ -1573,6 +1716,40 @@ MMScan::filter_inplace(const VertexFilter &filter)
   isDirty_disk = true;
   // important that we rebuild indices
   calcIndices();
+
+  if (tree) {
+    // the tree forgets the clipped points, the merged arrays
+    // keep them until a quarter of the tree is dead
+    mergedRegData& reg = regData[0];
+    int nMerged = reg.slot.size() ? reg.slot.size() : reg.vtx.size();
+    if (regRemap.size() != nMerged)
+      return true;    // get_kdtree() starts over
+
+    vector<int> removed, slot(regCount);
+    for (i = 0; i < nMerged; i++) {
+      int k = reg.slot.size() ? reg.slot[i] : i;
+      if (regRemap[i] < 0) removed.push_back(k);
+      else                 slot[regRemap[i]] = k;
+    }
+    if (removed.size())
+      tree->remove(&reg.vtx[0], &removed[0], removed.size());
+
+    if (tree->num_points() == 0) {
+      // nothing left, get_kdtree() starts over
+    } else if (tree->wants_compact()) {
+      // redo the merged arrays now, around the kept tree
+      vector<int> newIndex(reg.vtx.size(), -1);
+      for (i = 0; i < regCount; i++)
+	newIndex[slot[i]] = i;
+      tree->renumber(&newIndex[0]);
+      getRegData(true);
+    } else {
+      reg.slot.swap(slot);
+      delete triBVH[0];
+      triBVH[0] = NULL;
+      isDirty_mem = false;
+    }
+  }
   return true;
 }
 
@@ -2532,6 +2709,7 @@ MMScan::read(const crope &fname)
   for (int iss = 0; iss < SUBSAMPS; iss++) {
     insert_resolution (ntris / (1 << (2*iss)), fname, false, false);
     kdtree.push_back (NULL);
+    triBVH.push_back (NULL);
     regData.push_back(mergedRegData());
     if (iss > 0) {
       for (int ifrag = 0; ifrag < scans.size(); ifrag++)
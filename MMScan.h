@@ -21,6 +21,7 @@
 #include "ResolutionCtrl.h"
 
 class KDindtree;
+class TriBVH;
 
 class MMScan : public RigidScan {
 
@@ -159,6 +160,18 @@ typedef uchar vec3uc[3];
   bool closest_point(const Pnt3 &p, const Pnt3 &n,
 		     Pnt3 &cp, Pnt3 &cn,
 		     float thr = 1e33, bool bdry_ok = 0);
+  void closest_points(const Pnt3 *p, const Pnt3 *n, int count,
+		      Pnt3 *cp, Pnt3 *cn, bool *found,
+		      float thr = 1e33, bool bdry_ok = 0,
+		      float eps = 0);
+
+  // for volumetric processing
+  float closest_point_on_mesh(const Pnt3 &p, Pnt3 &cp,
+			      OccSt &status_p);
+  float closest_along_line_of_sight(const Pnt3 &p, Pnt3 &cp,
+				    OccSt &status_p);
+  float closest_along_line(const Pnt3 &p, const Pnt3 &dir,
+			   Pnt3 &cp, OccSt &status_p);
 
   bool load_resolution (int iRes);
   int create_resolution_absolute(int budget = 0,
@@ -238,10 +251,15 @@ private:
     vector<short> nrm;
     vector<int>   tris;
     vector<char>  boundary;
+    // after clipping the arrays above keep the clipped points
+    // (dead in the kdtree); slot has where each vertex of the
+    // fragments is in them.  Empty when they match one to one.
+    vector<int>   slot;
   };
 
   vector<mergedRegData> regData;
   vector<KDindtree*>    kdtree;
+  vector<TriBVH*>       triBVH;
 
   bool haveScanDir;
 
@@ -262,9 +280,12 @@ private:
   void calcIndices(void);
   void calcScanDir(void);
   void calcConfidence(void);
-  mergedRegData& getRegData (void);
+  // keepKdtree: the kdtree of this resolution has been updated
+  // to match the new arrays already (see filter_inplace)
+  mergedRegData& getRegData (bool keepKdtree = false);
   void mark_boundary (mergedRegData& reg);
   KDindtree* get_kdtree(void);
+  TriBVH* get_tribvh(void);
   bool stripeCompare(int strNum, mmScanFrag *scan);
   void setMTColor (MeshTransport* mt, int iScan, bool perVertex,
 		   ColorSource source, int colorSize);
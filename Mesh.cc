@@ -5,15 +5,18 @@
 #include <vector>
 #include <assert.h>
 #include <math.h>
+#include <mutex>
 
 #include "Mesh.h"
 #include "ply++.h"
+#include "PlyMap.h"
 #include "Timer.h"
 #include "Random.h"
 #include "plvGlobals.h"
 #include "TriMeshUtils.h"
 #include "Progress.h"
 #include "plvScene.h"
+#include "WorkerPool.h"
 
 
 #if 0
@@ -81,6 +84,7 @@ Mesh::initNormals(int useArea)
     else
       getVertexNormals(vtx, tris, false, nrm, useArea);
     hasVertNormals = true;
+    nsIndex.clear();
   }
 }
 
@@ -96,6 +100,7 @@ Mesh::flipNormals()
   int n = nrm.size();
   for (int i = 0; i < n; i++)
     nrm[i] = -nrm[i];
+  nsIndex.clear();
 
   bNeedsSave = TRUE;
 }
@@ -509,6 +514,14 @@ Mesh::readPlyFile(const char *filename)
   face_prop_from_voxel_y.offset = offsetof(PlyFace, fromVoxelY);
   face_prop_from_voxel_z.offset = offsetof(PlyFace, fromVoxelZ);
 
+  // binary files in the usual layouts go straight from a
+  // mapping of the file
+  {
+    PlyMap map;
+    if (map.open(filename) && readPlyMap(map, filename))
+      return 1;
+  }
+
   PlyFile ply;
   if (ply.open_for_reading((char*)filename, &nelems, &elist) == 0)
     return 0;
@@ -707,41 +720,211 @@ Mesh::readPlyFile(const char *filename)
 
       ply.get_property (elem_name, tstrips_props);
       ply.get_element ((void*)&info);
-      tstrips.reserve (info.nverts);
-      Progress progress (info.nverts, "%s: read t-strips", filename);
-
-      int lastend = 0;
-      for (int iv = 0; iv < info.nverts; iv++) {
-	if ((iv & progress_update) == progress_update)
-	  progress.update (iv);
-
-	int vert = info.vertData[iv];
-	bool ok = (vert >= 0 && vert < vtx.size())
-	  || (vert == -1 && lastend >= 3);
-
-	if (ok) {
-	  // middle of strip
-	  tstrips.push_back (vert);
-	  if (vert == -1)
-	    lastend = 0;
-	  else
-	    ++lastend;
-	} else {
-	  cerr << "\n\nRed alert: invalid index " << vert
-	       << " in tstrip (index = " << iv
-	       << ", valid range=0.." << vtx.size() - 1
-	       << ")\n" << endl;
-	  // remove last strip
-	  if (lastend) {
-	    while (--lastend)
-	      tstrips.pop_back();
-	  }
+      addTstrips (info.vertData, info.nverts, filename);
+    }
+  }
+
+  return 1;
+}
+
+
+// The t-strips of a file, leaving out strips with bad indices.
+void
+Mesh::addTstrips(const int *verts, int n, const char *filename)
+{
+  tstrips.reserve (n);
+  Progress progress (n, "%s: read t-strips", filename);
+
+  int lastend = 0;
+  for (int iv = 0; iv < n; iv++) {
+    if ((iv & progress_update) == progress_update)
+      progress.update (iv);
+
+    int vert = verts[iv];
+    bool ok = (vert >= 0 && vert < vtx.size())
+      || (vert == -1 && lastend >= 3);
+
+    if (ok) {
+      // middle of strip
+      tstrips.push_back (vert);
+      if (vert == -1)
+	lastend = 0;
+      else
+	++lastend;
+    } else {
+      cerr << "\n\nRed alert: invalid index " << vert
+	   << " in tstrip (index = " << iv
+	   << ", valid range=0.." << vtx.size() - 1
+	   << ")\n" << endl;
+      // remove last strip
+      if (lastend) {
+	while (--lastend)
+	  tstrips.pop_back();
+      }
+    }
+  }
+}
+
+
+// pieces of vertices and faces read at a time
+static const int read_piece = 0x10000;
+
+// fn(begin, end) over pieces of [0, n) on the thread pool,
+// with this (the Tk) thread keeping up the progress bar
+static void
+read_in_pieces(int n, const char *what, const char *filename,
+	       const function<void(int,int)> &fn)
+{
+  atomic<int> nDone(0);
+  WorkerPool &pool = WorkerPool::global();
+  TaskGroup group(pool);
+  for (int b = 0; b < n; b += read_piece) {
+    int e = min (n, b + read_piece);
+    group.run([&, b, e]() {
+      fn(b, e);
+      nDone += e - b;
+    });
+  }
+
+  Progress progress (n, what, filename);
+  while (nDone < n) {
+    if (!pool.run_pending())
+      this_thread::sleep_for(chrono::milliseconds(20));
+    progress.update (nDone);
+  }
+  group.wait();
+}
+
+
+// Files whose vertices are x y z (with optional normals,
+// confidence and colors) and whose faces are plain lists of
+// ints, straight from the mapped file: binary files a whole
+// array at a time, ASCII files parsed in pieces on the thread
+// pool.  Returns false, with nothing read, if the file has
+// anything else that readPlyFile() would use (texture,
+// voxels, other binary types); then PlyFile does it.
+bool
+Mesh::readPlyMap(const PlyMap &map, const char *filename)
+{
+  for (int i = 0; i < map.obj_info().size(); i++) {
+    if (strstr(map.obj_info()[i].c_str(), "texture_file"))
+      return false;
+  }
+
+  const PlyMap::Elem *ve = map.find("vertex");
+  const PlyMap::Elem *fe = map.find("face");
+  const PlyMap::Elem *te = map.find("tristrips");
+  if (ve == NULL || !map.can_split(ve))
+    return false;
+
+  // in ASCII files any number will do
+  bool any = map.ascii();
+  const PlyMap::Prop *fp[7] = { PlyMap::find(ve, "x"),
+				PlyMap::find(ve, "y"),
+				PlyMap::find(ve, "z"),
+				PlyMap::find(ve, "nx"),
+				PlyMap::find(ve, "ny"),
+				PlyMap::find(ve, "nz"),
+				PlyMap::find(ve, "confidence") };
+  const PlyMap::Prop *col[3] = { PlyMap::find(ve, "diffuse_red"),
+				 PlyMap::find(ve, "diffuse_green"),
+				 PlyMap::find(ve, "diffuse_blue") };
+  bool hasNormals = fp[3] && fp[4] && fp[5];
+  bool hasConf    = fp[6] != NULL;
+  bool hasColors  = col[0] && col[1] && col[2];
+  if (!hasNormals && hasConf)
+    fp[3] = fp[6];
+  int  nf = 3 + 3 * hasNormals + hasConf;
+  for (int k = 0; k < nf; k++) {
+    if (!fp[k] || fp[k]->countType || (!any && fp[k]->type != PLY_FLOAT))
+      return false;
+  }
+  for (int k = 0; k < 3 && hasColors; k++) {
+    if (col[k]->countType || (!any && col[k]->type != PLY_UCHAR))
+      return false;
+  }
+  if (fe && (fe->props.size() != 1 || fe->props[0].countType == 0 ||
+	     (!any && fe->props[0].type != PLY_INT &&
+	      fe->props[0].type != PLY_UINT)))
+    return false;
+  if (te && te->num == 1 &&
+      (te->props.size() != 1 || te->props[0].countType == 0 ||
+       (!any && te->props[0].type != PLY_INT &&
+	te->props[0].type != PLY_UINT)))
+    return false;
+
+  int nv = ve->num;
+  vtx.resize (nv);
+  if (hasNormals) {
+    hasVertNormals = 1;
+    nrm.resize (nv * 3);
+  }
+  if (hasConf)
+    vertConfidence = new float[nv];
+  if (hasColors)
+    vertMatDiff = new vec3uc[nv];
+
+  read_in_pieces (nv, "%s: read vertices", filename, [&](int b, int e) {
+    if (nf == 3) {
+      map.get_floats (ve, fp, 3, b, e, (float *)&vtx[b]);
+    } else {
+      vector<float> buf (nf * (e - b));
+      map.get_floats (ve, fp, nf, b, e, &buf[0]);
+      const float *f = &buf[0];
+      for (int i = b; i < e; i++, f += nf) {
+	vtx[i].set (f[0], f[1], f[2]);
+	if (hasNormals) {
+	  // as pushNormalAsShorts()
+	  nrm[3*i]   = f[3] * 32767;
+	  nrm[3*i+1] = f[4] * 32767;
+	  nrm[3*i+2] = f[5] * 32767;
 	}
+	if (hasConf)
+	  vertConfidence[i] = f[nf-1];
+      }
+    }
+    if (hasColors)
+      map.get_uchars (ve, col, 3, b, e, vertMatDiff[b]);
+  });
+
+  if (fe) {
+    printf("No voxel information stored...\n");
+    assert(tris.size() == 0);
+    int nBad = 0;
+    if (map.can_split(fe)) {
+      // each piece on its own, then one after another
+      int nPieces = (fe->num + read_piece - 1) / read_piece;
+      vector<vector<int> > part (nPieces);
+      vector<int>          bad (nPieces);
+      read_in_pieces (fe->num, "%s: read tris", filename, [&](int b, int e) {
+	bad[b / read_piece] = map.get_tris (fe, b, e, nv, part[b / read_piece]);
+      });
+      int n = 0;
+      for (int i = 0; i < nPieces; i++)
+	n += part[i].size();
+      tris.reserve (n);
+      for (int i = 0; i < nPieces; i++) {
+	tris.insert (tris.end(), part[i].begin(), part[i].end());
+	nBad = (nBad < 0 || bad[i] < 0) ? -1 : nBad + bad[i];
       }
+    } else {
+      nBad = map.get_tris (fe, 0, fe->num, nv, tris);
     }
+    if (nBad < 0)
+      cerr << filename << ": the faces are cut short" << endl;
+    else if (nBad > 0)
+      cerr << "readPlyFile: Not a triangle mesh!" << endl;
   }
 
-  return 1;
+  if (te && te->num == 1) {
+    vector<int> verts;
+    if (map.get_list (te, verts))
+      addTstrips (verts.size() ? &verts[0] : NULL, verts.size(), filename);
+    else
+      cerr << filename << ": the t-strips are cut short" << endl;
+  }
+
+  return true;
 }
 
 int
@@ -980,6 +1163,38 @@ Mesh::subsample_points(int n, vector<Pnt3> &pts,
 }
 
 
+// The bucket index is built on first use; the lock is for
+// the scans shared by the workers of scz_auto_register.
+static mutex nsIndexLock;
+
+void
+Mesh::subsample_normal_space(float rate, vector<Pnt3> &pts,
+			     vector<Pnt3> &nrms)
+{
+  pts.clear(); nrms.clear();
+  if (nrm.size() < 3*vtx.size() || vtx.size() == 0) {
+    // no normals to bucket
+    subsample_points(rate, pts, nrms);
+    return;
+  }
+
+  {
+    unique_lock<mutex> l(nsIndexLock);
+    if (nsIndex.num_points() != vtx.size())
+      nsIndex.build(&nrm[0], vtx.size());
+  }
+
+  vector<int> ind;
+  nsIndex.sample(rate, ind);
+  pts.reserve(ind.size());
+  nrms.reserve(ind.size());
+  for (int i = 0; i < ind.size(); i++) {
+    pts.push_back(vtx[ind[i]]);
+    pushNormalAsPnt3 (nrms, nrm.begin(), ind[i]);
+  }
+}
+
+
 void
 Mesh::remove_unused_vtxs(void)
 {
@@ -1008,6 +1223,7 @@ Mesh::remove_unused_vtxs(void)
 // STL Update
   vtx.erase(vtx.begin() + cnt, vtx.end());
   if (nrm.size()) nrm.erase(nrm.begin() + (cnt*3), nrm.end());
+  nsIndex.clear();
   // march through triangles and correct the indices
   n = tris.size();
   for (int i=0; i<n; i++) {
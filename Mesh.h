@@ -6,12 +6,15 @@
 #include "ResolutionCtrl.h"
 #include "defines.h"
 #include "Bbox.h"
+#include "NormalSpace.h"
 #include <set>
 #include <cassert>
 
 typedef set<int, less<int> > TriList; // List of triangles attached to a single vtx
 typedef set<int, less<int> >::iterator TriListI;
 
+class PlyMap;
+
 class Mesh {
 private:
 
@@ -29,6 +32,9 @@ private:
   float *vertConfidence;
   int hasVertNormals;
   vector<char> bdry; // 1 for boundary vtx, used for registration
+  NormalSpaceIndex nsIndex; // normal-space buckets, built when
+			    // first needed, cleared when the
+			    // vertices or normals change
 
   char texFileName[PATH_MAX];
 
@@ -52,10 +58,14 @@ private:
   bool subsample_points(int n, vector<Pnt3> &pts);
   bool subsample_points(int n, vector<Pnt3> &pts,
 			vector<Pnt3> &nrms);
+  void subsample_normal_space(float rate, vector<Pnt3> &pts,
+			      vector<Pnt3> &nrms);
   void remove_unused_vtxs(void);
   void init (void);
 
   void computeBBox(); // private; call updateScale() instead
+  bool readPlyMap (const PlyMap &map, const char *filename);
+  void addTstrips (const int *verts, int n, const char *filename);
 
 public:
 
@@ -0,0 +1,137 @@
+//############################################################
+//
+// NormalSpace.cc
+//
+// Normal-space sampling index.
+//
+//############################################################
+
+#include <math.h>
+#include <algorithm>
+#include "NormalSpace.h"
+#include "Random.h"
+
+
+// Q x Q buckets on each of the 3 pairs of opposite cube faces
+#define NS_Q 4
+
+
+int
+NormalSpaceIndex::bucket(float x, float y, float z)
+{
+  const int   Q = NS_Q;
+  const float Qsqrt1_2 = 2.8284f;
+  float ax = fabs(x), ay = fabs(y), az = fabs(z);
+  int A;
+  float u, v;
+  if (ax > ay) {
+    if (ax > az) {
+      A = 0;  u = (x > 0) ? y : -y;  v = (x > 0) ? z : -z;
+    } else {
+      A = 2;  u = (z > 0) ? x : -x;  v = (z > 0) ? y : -y;
+    }
+  } else {
+    if (ay > az) {
+      A = 1;  u = (y > 0) ? z : -z;  v = (y > 0) ? x : -x;
+    } else {
+      A = 2;  u = (z > 0) ? x : -x;  v = (z > 0) ? y : -y;
+    }
+  }
+  int U = int(u * Qsqrt1_2) + (Q/2);
+  int V = int(v * Qsqrt1_2) + (Q/2);
+  // normals from shorts can be a bit longer than 1
+  U = std::max(0, std::min(Q-1, U));
+  V = std::max(0, std::min(Q-1, V));
+  return ((A * Q) + U) * Q + V;
+}
+
+
+void
+NormalSpaceIndex::clear(void)
+{
+  start.clear();
+  ind.clear();
+}
+
+
+// counting sort of the bucket numbers, then shuffle each bucket
+static void
+fill_buckets(const vector<int> &b, vector<int> &start,
+	     vector<int> &ind)
+{
+  int nb = 3*NS_Q*NS_Q;
+  start.assign(nb+1, 0);
+  for (int i = 0; i < b.size(); i++) start[b[i]+1]++;
+  for (int i = 0; i < nb; i++) start[i+1] += start[i];
+
+  ind.resize(b.size());
+  vector<int> next(start.begin(), start.end()-1);
+  for (int i = 0; i < b.size(); i++) ind[next[b[i]]++] = i;
+
+  // a stream of its own, so that the index doesn't depend on
+  // which thread (or scan pair) happened to build it
+  RandomStream rs(b.size());
+  for (int i = 0; i < nb; i++)
+    if (start[i+1] > start[i])
+      rs.shuffle(&ind[start[i]], &ind[0] + start[i+1]);
+}
+
+
+void
+NormalSpaceIndex::build(const Pnt3 *nrms, int count)
+{
+  vector<int> b(count);
+  for (int i = 0; i < count; i++)
+    b[i] = bucket(nrms[i][0], nrms[i][1], nrms[i][2]);
+  fill_buckets(b, start, ind);
+}
+
+
+void
+NormalSpaceIndex::build(const short *nrms, int count)
+{
+  vector<int> b(count);
+  for (int i = 0; i < count; i++, nrms += 3)
+    b[i] = bucket(nrms[0] / 32767.0f, nrms[1] / 32767.0f,
+		  nrms[2] / 32767.0f);
+  fill_buckets(b, start, ind);
+}
+
+
+void
+NormalSpaceIndex::sample(float rate, vector<int> &out) const
+{
+  int n = ind.size();
+  int ndesired = min(int(ceil(rate * n)), n);
+  if (ndesired <= 0) return;
+
+  // Taking one point from each non-empty bucket in turn until
+  // there are enough means taking min(size, rounds) from each
+  // bucket, with the smallest rounds that gives enough.
+  int nb = start.size() - 1;
+  int lo = 1, hi = 0;
+  for (int b = 0; b < nb; b++)
+    hi = max(hi, start[b+1] - start[b]);
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    int got = 0;
+    for (int b = 0; b < nb; b++)
+      got += min(start[b+1] - start[b], mid);
+    if (got >= ndesired) hi = mid;
+    else                 lo = mid + 1;
+  }
+
+  // a run of the shuffled bucket from a random place
+  RandomStream &rs = RandomStream::current();
+  for (int b = 0; b < nb; b++) {
+    int s = start[b+1] - start[b];
+    int k = min(s, lo);
+    if (k == 0) continue;
+    int off = int(rs(s));
+    const int *bi = &ind[start[b]];
+    for (int j = 0; j < k; j++) {
+      out.push_back(bi[off]);
+      if (++off == s) off = 0;
+    }
+  }
+}
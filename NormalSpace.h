@@ -0,0 +1,50 @@
+//############################################################
+//
+// NormalSpace.h
+//
+// Normal-space sampling (Rusinkiewicz & Levoy, 3DIM 2001):
+// the points of a scan are put in buckets by the direction of
+// their normals, and samples are taken from all the buckets
+// in turn, so that the few points on small, differently
+// oriented features aren't drowned by the flat areas.
+//
+// The index (bucket -> point indices) only depends on the
+// normals, so a scan can keep it and take many samples from
+// it, each in time proportional to the sample size.
+//
+//############################################################
+
+#ifndef _NORMAL_SPACE_H_
+#define _NORMAL_SPACE_H_
+
+#include <vector>
+#include "Pnt3.h"
+
+
+class NormalSpaceIndex {
+public:
+  NormalSpaceIndex(void) {}
+
+  // bucket count unit normals
+  void build(const Pnt3 *nrms, int count);
+  // same for 16 bit normals, 3 shorts each
+  void build(const short *nrms, int count);
+  void clear(void);
+
+  bool built(void) const      { return start.size() != 0; }
+  int  num_points(void) const { return ind.size(); }
+
+  // Append to out the indices of about rate*num_points()
+  // points: the same number from each bucket (or all of the
+  // bucket, if it's smaller).  Each call picks a different
+  // random subset of each bucket.  Only reads the index.
+  void sample(float rate, vector<int> &out) const;
+
+private:
+  static int bucket(float x, float y, float z);
+
+  vector<int> start;  // bucket b is ind[start[b] .. start[b+1])
+  vector<int> ind;    // point indices, shuffled within buckets
+};
+
+#endif /* _NORMAL_SPACE_H_ */
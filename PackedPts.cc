@@ -0,0 +1,94 @@
+//############################################################
+//
+// PackedPts.cc
+//
+// 16 bit fixed point arrays of points.
+//
+//############################################################
+
+#include <math.h>
+#include <float.h>
+#include "PackedPts.h"
+
+
+void
+PackedPts::clear(void)
+{
+  for (int k = 0; k < 3; k++) org[k] = step[k] = 0;
+  q.clear();
+}
+
+
+void
+PackedPts::pack(const Pnt3 *p, int n)
+{
+  clear();
+  if (n == 0) return;
+
+  float lo[3] = { FLT_MAX, FLT_MAX, FLT_MAX };
+  float hi[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+  int i, k;
+  for (i = 0; i < n; i++) {
+    for (k = 0; k < 3; k++) {
+      if (p[i][k] < lo[k]) lo[k] = p[i][k];
+      if (p[i][k] > hi[k]) hi[k] = p[i][k];
+    }
+  }
+
+  float inv[3];
+  for (k = 0; k < 3; k++) {
+    org[k]  = lo[k];
+    step[k] = (hi[k] - lo[k]) / 65535.f;
+    inv[k]  = step[k] > 0 ? 1 / step[k] : 0;
+  }
+
+  q.resize(3*n);
+  unsigned short *c = &q[0];
+  for (i = 0; i < n; i++, c += 3) {
+    for (k = 0; k < 3; k++) {
+      float f = (p[i][k] - org[k]) * inv[k] + .5f;
+      c[k] = (f >= 65535.f) ? 65535 : (unsigned short)f;
+    }
+  }
+}
+
+
+void
+PackedPts::unpack(vector<Pnt3> &out) const
+{
+  int n = out.size();
+  out.resize(n + size());
+  if (size()) unpack(&out[n], 0, size());
+}
+
+
+void
+PackedPts::unpack(Pnt3 *out, int begin, int end) const
+{
+  // one flat loop over the coordinates, which the compiler
+  // can turn into vector instructions
+  float *f = &out[0][0];
+  const unsigned short *c = &q[3*begin];
+  const float o0 = org[0],  o1 = org[1],  o2 = org[2];
+  const float s0 = step[0], s1 = step[1], s2 = step[2];
+  int n = 3 * (end - begin);
+  for (int i = 0; i < n; i += 3) {
+    f[i]   = o0 + c[i]   * s0;
+    f[i+1] = o1 + c[i+1] * s1;
+    f[i+2] = o2 + c[i+2] * s2;
+  }
+}
+
+
+float
+PackedPts::max_error(void) const
+{
+  // half a step along each axis, and a little for the float
+  // arithmetic
+  float e = .5f * sqrtf(step[0]*step[0] + step[1]*step[1] +
+			step[2]*step[2]);
+  float m = 0;
+  for (int k = 0; k < 3; k++)
+    m = fmaxf(m, fabsf(org[k]) + 65535.f * step[k]);
+  return e + 2 * FLT_EPSILON * m;
+}
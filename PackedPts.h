@@ -0,0 +1,72 @@
+//############################################################
+//
+// PackedPts.h
+//
+// A compact array of points: each coordinate is stored as a
+// 16 bit fixed point number within the bounding box of the
+// points, 6 bytes per point instead of 12.  Used for the
+// point pairs that GlobalReg keeps for every pair of scans.
+//
+// The points come back to within max_error() of where they
+// were: each coordinate to within half a step, a step being
+// 1/65535 of the box along that axis.  For points in the scan's
+// own coordinates (as the pairs are), a 300 mm box gives steps
+// of 4.6 microns.
+//
+//############################################################
+
+#ifndef _PACKED_PTS_H_
+#define _PACKED_PTS_H_
+
+#include <vector>
+#include "Pnt3.h"
+
+
+class PackedPts {
+public:
+  PackedPts(void)                          { clear(); }
+  PackedPts(const vector<Pnt3> &p)         { pack(p); }
+  PackedPts(const Pnt3 *p, int n)          { pack(p, n); }
+
+  void pack(const Pnt3 *p, int n);
+  void pack(const vector<Pnt3> &p)
+    { pack(p.size() ? &p[0] : (const Pnt3*)NULL, p.size()); }
+  void clear(void);
+
+  int  size(void) const { return q.size() / 3; }
+
+  // the i-th point
+  Pnt3 operator[](int i) const
+    {
+      const unsigned short *c = &q[3*i];
+      return Pnt3(org[0] + c[0] * step[0],
+		  org[1] + c[1] * step[1],
+		  org[2] + c[2] * step[2]);
+    }
+
+  // all of them, appended to out
+  void unpack(vector<Pnt3> &out) const;
+  // points [begin, end) to out
+  void unpack(Pnt3 *out, int begin, int end) const;
+
+  // for thinning in place: point to = point from, then keep
+  // the first n
+  void move(int to, int from)
+    {
+      q[3*to] = q[3*from];  q[3*to+1] = q[3*from+1];
+      q[3*to+2] = q[3*from+2];
+    }
+  void resize(int n) { q.resize(3*n); }
+
+  // how far a point can be from the one packed
+  float max_error(void) const;
+  // bytes used
+  int   bytes(void) const { return sizeof(*this) + q.capacity() * 2; }
+
+private:
+  float                  org[3];   // the box's minimum corner
+  float                  step[3];
+  vector<unsigned short> q;        // 3 per point
+};
+
+#endif /* _PACKED_PTS_H_ */
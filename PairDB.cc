@@ -0,0 +1,535 @@
+//############################################################
+//
+// PairDB.cc
+//
+// Single file database of global registration pairs.
+//
+//############################################################
+
+#include <iostream>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <assert.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifndef WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#else
+#include <io.h>        // unlink
+#include <process.h>   // getpid
+#endif
+#include "PairDB.h"
+#include "defines.h"
+
+
+#define PDB_MAGIC     "SCZGRDB"
+#define PDB_VERSION   1
+#define PDB_BYTEORDER 0x01020304
+#define PDB_SWAPPED   0x04030201
+#define PDB_RECMAGIC  "GRPR"
+
+#define PDB_MANUAL    1
+
+struct PairDBHeader {
+  char      magic[8];
+  int       version;
+  int       byteOrder;
+  long long indexOffset;  // 0 if there's no index yet
+  long long nRecords;     // in the index
+  long long fileEnd;      // anything after this is garbage
+};
+
+// followed by the two names (each with its 0, padded to 8
+// bytes together), the points of both scans, and padding to
+// 8 bytes
+struct PairDBRecord {
+  char      magic[4];
+  int       flags;
+  int       quality;
+  int       nPairs;
+  int       nameLen[2];
+  long long mtime;
+  long long size;         // of the whole record
+  float     rel_xf[16];
+  float     pw_point_rmsErr, pw_plane_rmsErr;
+};
+
+
+static long long
+pdb_align(long long o)
+{
+  return (o + 7) & ~7LL;
+}
+
+
+static void
+swap4(void *p, long long n)
+{
+  char *c = (char *)p;
+  for (long long i = 0; i < n; i++, c += 4) {
+    char t = c[0]; c[0] = c[3]; c[3] = t;
+    t = c[1]; c[1] = c[2]; c[2] = t;
+  }
+}
+
+
+static void
+swap8(void *p, long long n)
+{
+  char *c = (char *)p;
+  for (long long i = 0; i < n; i++, c += 8) {
+    for (int j = 0; j < 4; j++) {
+      char t = c[j]; c[j] = c[7-j]; c[7-j] = t;
+    }
+  }
+}
+
+
+static void
+swap_header(PairDBHeader &h)
+{
+  swap4(&h.version, 2);
+  swap8(&h.indexOffset, 3);
+}
+
+
+static void
+swap_record(PairDBRecord &r)
+{
+  swap4(&r.flags, 5);
+  swap8(&r.mtime, 2);
+  swap4(r.rel_xf, 18);
+}
+
+
+// the record at offset o, if it is one that fits in len bytes
+static PairDBRecord *
+check_record(char *base, long long len, long long o)
+{
+  if (o < (long long)sizeof(PairDBHeader) || o % 8 ||
+      o + (long long)sizeof(PairDBRecord) > len)
+    return NULL;
+  PairDBRecord *r = (PairDBRecord *)(base + o);
+  if (strncmp(r->magic, PDB_RECMAGIC, 4))
+    return NULL;
+  return r;
+}
+
+
+static bool
+record_fits(const PairDBRecord *r, long long o, long long len)
+{
+  if (r->nPairs < 0 || r->nameLen[0] < 1 || r->nameLen[1] < 1)
+    return false;
+  long long need = pdb_align(sizeof(PairDBRecord) +
+			     r->nameLen[0] + r->nameLen[1]) +
+    2LL * r->nPairs * sizeof(Pnt3);
+  if (r->size < need || o + r->size > len)
+    return false;
+  const char *n = (const char *)(r + 1);
+  return n[r->nameLen[0] - 1] == 0 &&
+    n[r->nameLen[0] + r->nameLen[1] - 1] == 0;
+}
+
+
+unsigned long long
+PairDB::key(const char *n1, const char *n2)
+{
+  if (strcmp(n1, n2) > 0) {
+    const char *t = n1; n1 = n2; n2 = t;
+  }
+  unsigned long long h = 14695981039346656037ULL;   // FNV-1a
+  for (; *n1; n1++) h = (h ^ (unsigned char)*n1) * 1099511628211ULL;
+  h *= 1099511628211ULL;
+  for (; *n2; n2++) h = (h ^ (unsigned char)*n2) * 1099511628211ULL;
+  return h;
+}
+
+
+PairDB::PairDB(void)
+  : base(NULL), len(0), mapped(false), index(NULL), nRec(0)
+{
+}
+
+
+PairDB::~PairDB(void)
+{
+  close();
+}
+
+
+void
+PairDB::close(void)
+{
+#ifndef WIN32
+  if (mapped) munmap(base, len);
+#endif
+  buf.clear();
+  base   = NULL;
+  len    = 0;
+  mapped = false;
+  index  = NULL;
+  nRec   = 0;
+}
+
+
+bool
+PairDB::open(const char *path)
+{
+  close();
+
+  FILE *fp = fopen(path, "rb");
+  if (fp == NULL)
+    return false;
+
+  PairDBHeader h;
+  bool ok = (fread(&h, sizeof(h), 1, fp) == 1) &&
+    !strncmp(h.magic, PDB_MAGIC, 8) &&
+    (h.byteOrder == PDB_BYTEORDER || h.byteOrder == PDB_SWAPPED);
+  fseek(fp, 0, SEEK_END);
+  long long fileLen = ftell(fp);
+  if (!ok) {
+    fclose(fp);
+    cerr << path << " is not a pair database" << endl;
+    return false;
+  }
+
+  // Written on a machine with the other byte order: read it
+  // in and turn the numbers around.
+  bool swap = (h.byteOrder == PDB_SWAPPED);
+
+#ifndef WIN32
+  if (!swap) {
+    fclose(fp);
+    int fd = ::open(path, O_RDONLY);
+    void *addr = MAP_FAILED;
+    if (fd >= 0) {
+      addr = mmap(NULL, fileLen, PROT_READ, MAP_PRIVATE, fd, 0);
+      ::close(fd);
+    }
+    if (addr == MAP_FAILED)
+      return false;
+    base   = (char *)addr;
+    mapped = true;
+  } else
+#endif
+  {
+    buf.resize(fileLen);
+    ok = (fseek(fp, 0, SEEK_SET) == 0 &&
+	  fread(&buf[0], 1, fileLen, fp) == fileLen);
+    fclose(fp);
+    if (!ok)
+      return false;
+    base = &buf[0];
+  }
+  len = fileLen;
+
+  PairDBHeader *hp = (PairDBHeader *)base;
+  if (swap) swap_header(*hp);
+  ok = hp->version == PDB_VERSION &&
+    hp->fileEnd <= len && hp->nRecords >= 0 &&
+    (hp->nRecords == 0 ||
+     (hp->indexOffset >= (long long)sizeof(PairDBHeader) &&
+      hp->indexOffset % 8 == 0 &&
+      hp->indexOffset + hp->nRecords * (long long)sizeof(PairDBIndex)
+      <= hp->fileEnd));
+
+  PairDBIndex *ind = NULL;
+  if (ok && hp->nRecords) {
+    ind = (PairDBIndex *)(base + hp->indexOffset);
+    if (swap) swap8(ind, 2 * hp->nRecords);
+  }
+  for (long long i = 0; ok && i < hp->nRecords; i++) {
+    PairDBRecord *r = check_record(base, hp->fileEnd, ind[i].offset);
+    if (r == NULL) {
+      ok = false;
+      break;
+    }
+    if (swap) swap_record(*r);
+    ok = record_fits(r, ind[i].offset, hp->fileEnd);
+    if (ok && swap)
+      swap4((char *)r + pdb_align(sizeof(PairDBRecord) +
+				  r->nameLen[0] + r->nameLen[1]),
+	    6LL * r->nPairs);
+  }
+  if (!ok) {
+    cerr << path << " is damaged" << endl;
+    close();
+    return false;
+  }
+
+  index = ind;
+  nRec  = hp->nRecords;
+  return true;
+}
+
+
+void
+PairDB::get(int i, Pair &p) const
+{
+  assert(i >= 0 && i < nRec);
+  const PairDBRecord *r = (const PairDBRecord *)(base + index[i].offset);
+  const char *names = (const char *)(r + 1);
+  p.name[0] = names;
+  p.name[1] = names + r->nameLen[0];
+  p.pts[0]  = (const Pnt3 *)((const char *)r +
+			     pdb_align(sizeof(PairDBRecord) +
+				       r->nameLen[0] + r->nameLen[1]));
+  p.pts[1]  = p.pts[0] + r->nPairs;
+  p.n       = r->nPairs;
+  p.rel_xf  = r->rel_xf;
+  p.pw_point_rmsErr = r->pw_point_rmsErr;
+  p.pw_plane_rmsErr = r->pw_plane_rmsErr;
+  p.manual  = (r->flags & PDB_MANUAL) != 0;
+  p.quality = r->quality;
+  p.mtime   = r->mtime;
+}
+
+
+long long
+PairDB::live_bytes(void) const
+{
+  long long n = sizeof(PairDBHeader) + nRec * sizeof(PairDBIndex);
+  for (int i = 0; i < nRec; i++)
+    n += ((const PairDBRecord *)(base + index[i].offset))->size;
+  return n;
+}
+
+
+bool
+PairDB::compact(const char *path)
+{
+  PairDB db;
+  if (!db.open(path))
+    return false;
+
+  char tmpFile[PATH_MAX + 64];
+  sprintf(tmpFile, "%.*s.%d.tmp", PATH_MAX, path, (int)getpid());
+  unlink(tmpFile);
+
+  PairDBWriter out;
+  bool ok = out.open(tmpFile);
+  Pair p;
+  for (int i = 0; ok && i < db.size(); i++) {
+    db.get(i, p);
+    ok = out.put(p);
+  }
+  if (!out.close()) ok = false;
+  db.close();
+
+  if (!ok || rename(tmpFile, path) != 0) {
+    unlink(tmpFile);
+    return false;
+  }
+  return true;
+}
+
+
+PairDBWriter::PairDBWriter(void)
+  : fp(NULL), end(0), changed(false)
+{
+}
+
+
+bool
+PairDBWriter::open(const char *path)
+{
+  close();
+  this->path = path;
+
+  fp = fopen(path, "r+b");
+  if (fp == NULL) {
+    // a new, empty database
+    fp = fopen(path, "w+b");
+    if (fp == NULL) {
+      cerr << "Couldn't create " << path << endl;
+      return false;
+    }
+    end     = sizeof(PairDBHeader);
+    changed = true;
+    return true;
+  }
+
+  PairDBHeader h;
+  bool ok = (fread(&h, sizeof(h), 1, fp) == 1) &&
+    !strncmp(h.magic, PDB_MAGIC, 8);
+  if (ok && h.byteOrder == PDB_SWAPPED) {
+    // append in this machine's order only; rewrite it first
+    fclose(fp);
+    fp = NULL;
+    if (!PairDB::compact(path))
+      return false;
+    return open(path);
+  }
+  ok = ok && h.byteOrder == PDB_BYTEORDER && h.version == PDB_VERSION;
+  if (ok) {
+    index.resize(h.nRecords);
+    if (h.nRecords)
+      ok = (fseek(fp, h.indexOffset, SEEK_SET) == 0 &&
+	    fread(&index[0], sizeof(PairDBIndex), h.nRecords, fp)
+	    == h.nRecords);
+  }
+  if (!ok) {
+    // don't touch what we don't understand
+    cerr << path << " is not a pair database" << endl;
+    fclose(fp);
+    fp = NULL;
+    index.clear();
+    return false;
+  }
+  end = h.fileEnd;
+  return true;
+}
+
+
+bool
+PairDBWriter::close(void)
+{
+  if (fp == NULL)
+    return true;
+
+  bool ok = true;
+  if (changed) {
+    // the index goes after the last record; only then is
+    // the header changed to point at it
+    PairDBHeader h;
+    memset(&h, 0, sizeof(h));
+    strcpy(h.magic, PDB_MAGIC);
+    h.version     = PDB_VERSION;
+    h.byteOrder   = PDB_BYTEORDER;
+    h.indexOffset = end;
+    h.nRecords    = index.size();
+    h.fileEnd     = end + index.size() * sizeof(PairDBIndex);
+    ok = fseek(fp, end, SEEK_SET) == 0;
+    if (ok && index.size())
+      ok = fwrite(&index[0], sizeof(PairDBIndex), index.size(), fp)
+	== index.size();
+    ok = ok && fflush(fp) == 0 &&
+      fseek(fp, 0, SEEK_SET) == 0 &&
+      fwrite(&h, sizeof(h), 1, fp) == 1;
+  }
+  bool      wrote = changed;
+  long long size  = end + index.size() * sizeof(PairDBIndex);
+  long long live  = (ok && wrote) ? live_bytes() : size;
+  if (fclose(fp) != 0) ok = false;
+  fp      = NULL;
+  changed = false;
+  index.clear();
+
+  if (ok && wrote && size - live > live)
+    ok = PairDB::compact(path.c_str());
+  return ok;
+}
+
+
+// bytes of the header, the index and the records it points to
+long long
+PairDBWriter::live_bytes(void)
+{
+  long long n = sizeof(PairDBHeader) + index.size() * sizeof(PairDBIndex);
+  for (int i = 0; i < index.size(); i++) {
+    PairDBRecord r;
+    if (fseek(fp, index[i].offset, SEEK_SET) ||
+	fread(&r, sizeof(r), 1, fp) != 1)
+      return end;
+    n += r.size;
+  }
+  return n;
+}
+
+
+// position of the two scans' record in the index, -1 if none
+int
+PairDBWriter::find(const char *n1, const char *n2, int *flags)
+{
+  unsigned long long k = PairDB::key(n1, n2);
+  for (int i = 0; i < index.size(); i++) {
+    if (index[i].key != k) continue;
+    // make sure it's not just the same hash
+    PairDBRecord r;
+    if (fseek(fp, index[i].offset, SEEK_SET) ||
+	fread(&r, sizeof(r), 1, fp) != 1)
+      continue;
+    std::vector<char> names(r.nameLen[0] + r.nameLen[1]);
+    if (fread(&names[0], 1, names.size(), fp) != names.size())
+      continue;
+    const char *a = &names[0], *b = a + r.nameLen[0];
+    if ((!strcmp(a, n1) && !strcmp(b, n2)) ||
+	(!strcmp(a, n2) && !strcmp(b, n1))) {
+      if (flags) *flags = r.flags;
+      return i;
+    }
+  }
+  return -1;
+}
+
+
+bool
+PairDBWriter::put(const PairDB::Pair &p)
+{
+  if (fp == NULL)
+    return false;
+
+  PairDBRecord r;
+  memset(&r, 0, sizeof(r));
+  strncpy(r.magic, PDB_RECMAGIC, 4);
+  r.flags      = p.manual ? PDB_MANUAL : 0;
+  r.quality    = p.quality;
+  r.nPairs     = p.n;
+  r.nameLen[0] = strlen(p.name[0]) + 1;
+  r.nameLen[1] = strlen(p.name[1]) + 1;
+  r.mtime      = p.mtime;
+  memcpy(r.rel_xf, p.rel_xf, sizeof(r.rel_xf));
+  r.pw_point_rmsErr = p.pw_point_rmsErr;
+  r.pw_plane_rmsErr = p.pw_plane_rmsErr;
+  long long names = pdb_align(sizeof(r) + r.nameLen[0] + r.nameLen[1])
+    - sizeof(r);
+  long long pts   = 2LL * p.n * sizeof(Pnt3);
+  r.size = sizeof(r) + names + pdb_align(pts);
+
+  int old = find(p.name[0], p.name[1]);
+
+  static const char zeros[8] = { 0 };
+  bool ok = fseek(fp, end, SEEK_SET) == 0 &&
+    fwrite(&r, sizeof(r), 1, fp) == 1 &&
+    fwrite(p.name[0], 1, r.nameLen[0], fp) == r.nameLen[0] &&
+    fwrite(p.name[1], 1, r.nameLen[1], fp) == r.nameLen[1] &&
+    fwrite(zeros, 1, names - r.nameLen[0] - r.nameLen[1], fp)
+    == names - r.nameLen[0] - r.nameLen[1];
+  if (ok && p.n)
+    ok = fwrite(p.pts[0], sizeof(Pnt3), p.n, fp) == p.n &&
+      fwrite(p.pts[1], sizeof(Pnt3), p.n, fp) == p.n;
+  if (ok)
+    ok = fwrite(zeros, 1, pdb_align(pts) - pts, fp) == pdb_align(pts) - pts;
+  if (!ok) {
+    cerr << "Couldn't write to the pair database" << endl;
+    return false;
+  }
+
+  PairDBIndex e;
+  e.offset = end;
+  e.key    = PairDB::key(p.name[0], p.name[1]);
+  if (old >= 0) index[old] = e;
+  else          index.push_back(e);
+  end    += r.size;
+  changed = true;
+  return true;
+}
+
+
+bool
+PairDBWriter::drop(const char *n1, const char *n2, bool only_auto)
+{
+  if (fp == NULL)
+    return false;
+  int flags;
+  int i = find(n1, n2, &flags);
+  if (i < 0 || (only_auto && (flags & PDB_MANUAL)))
+    return false;
+  index.erase(index.begin() + i);
+  changed = true;
+  return true;
+}
@@ -0,0 +1,117 @@
+//############################################################
+//
+// PairDB.h
+//
+// All the point pairs of the global registration in one file,
+// instead of one .gr file per scan pair.
+//
+// The file is a header, records appended one after another,
+// and an index of the live records; each record holds the
+// names of the two scans, the relative transform, the pairwise
+// errors, quality, manual flag and time stamp, and then the
+// points of both scans as plain float arrays.  Nothing is
+// ever overwritten but the header: a new or changed pair is a
+// new record, and after every batch of changes a new index
+// (without the records it replaces or drops) is appended and
+// the header pointed to it.  A crash before the header is
+// written leaves the old index in effect.
+//
+// PairDB maps the file and hands out pointers straight into
+// it; PairDBWriter appends.  compact() rewrites the file with
+// only the live records.
+//
+//############################################################
+
+#ifndef _PAIR_DB_H_
+#define _PAIR_DB_H_
+
+#include <stdio.h>
+#include <time.h>
+#include <vector>
+#include <string>
+#include "Pnt3.h"
+
+
+#define PAIRDB_NAME "pairs.grdb"
+
+
+struct PairDBIndex {
+  long long          offset;  // of the record
+  unsigned long long key;     // PairDB::key() of its names
+};
+
+
+class PairDB {
+public:
+  struct Pair {
+    const char  *name[2];
+    const Pnt3  *pts[2];    // n points of each scan
+    int          n;
+    const float *rel_xf;    // 16 floats, takes pts[0] to pts[1]
+    float        pw_point_rmsErr, pw_plane_rmsErr;
+    bool         manual;
+    int          quality;
+    time_t       mtime;
+  };
+
+  PairDB(void);
+  ~PairDB(void);
+
+  // false if the file doesn't exist or isn't a pair database
+  bool open(const char *path);
+  void close(void);
+
+  int  size(void) const { return nRec; }
+  // the i-th live record; valid until close()
+  void get(int i, Pair &p) const;
+
+  // bytes held by the live records and the whole file
+  long long live_bytes(void) const;
+  long long file_bytes(void) const { return len; }
+
+  // same for either order of the names
+  static unsigned long long key(const char *n1, const char *n2);
+
+  // rewrite the file with just the live records
+  static bool compact(const char *path);
+
+private:
+  char              *base;
+  long long          len;
+  bool               mapped;
+  std::vector<char>  buf;       // the file, if not mapped
+  const PairDBIndex *index;
+  int                nRec;
+};
+
+
+class PairDBWriter {
+public:
+  PairDBWriter(void);
+  ~PairDBWriter(void) { close(); }
+
+  // creates the file if needed
+  bool open(const char *path);
+  // writes the new index and header; compacts the file when
+  // more of it is dead (replaced records, old indices) than
+  // live
+  bool close(void);
+
+  // add p, replacing any record of the same two scans
+  bool put(const PairDB::Pair &p);
+  // drop the record of the two scans (if only_auto, only if
+  // it's not manually aligned); true if there was one
+  bool drop(const char *n1, const char *n2, bool only_auto = false);
+
+private:
+  FILE                    *fp;
+  std::string              path;
+  long long                end;
+  std::vector<PairDBIndex> index;
+  bool                     changed;
+
+  int  find(const char *n1, const char *n2, int *flags = NULL);
+  long long live_bytes(void);
+};
+
+#endif /* _PAIR_DB_H_ */
@@ -0,0 +1,632 @@
+//############################################################
+//
+// PlyMap.cc
+//
+// PLY files mapped into memory.
+//
+//############################################################
+
+#include <iostream>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <assert.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifndef WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+#include <algorithm>
+#include "PlyMap.h"
+#include "ply++.h"
+#include "WorkerPool.h"
+
+
+// in plyfile.cc
+extern char *type_names[];
+extern char *new_type_names[];
+extern int   ply_type_size[];
+
+
+static bool
+native_little_endian(void)
+{
+  int one = 1;
+  return *(char *)&one == 1;
+}
+
+
+// turn n 4 byte words around; written so that the compiler
+// can do several at a time
+static void
+swap_words(void *p, long long n)
+{
+  unsigned int *w = (unsigned int *)p;
+  for (long long i = 0; i < n; i++) {
+    unsigned int v = w[i];
+    w[i] = (v >> 24) | ((v >> 8) & 0xff00) |
+      ((v << 8) & 0xff0000) | (v << 24);
+  }
+}
+
+
+static int
+type_of(const char *name)
+{
+  for (int i = PLY_START_TYPE + 1; i < PLY_END_TYPE; i++) {
+    if (!strcmp(name, type_names[i]) || !strcmp(name, new_type_names[i]))
+      return i;
+  }
+  return 0;
+}
+
+
+static bool
+is_int_type(int type)
+{
+  return type != 0 && type != PLY_FLOAT && type != PLY_DOUBLE;
+}
+
+
+// a list count (or index) of an integer type
+static unsigned int
+get_uint(const char *p, int type, bool swap)
+{
+  switch (ply_type_size[type]) {
+  case 1:
+    return (unsigned char)*p;
+  case 2: {
+    unsigned short s;
+    memcpy(&s, p, 2);
+    if (swap) s = (s >> 8) | (s << 8);
+    return s;
+  }
+  default: {
+    unsigned int i;
+    memcpy(&i, p, 4);
+    if (swap) swap_words(&i, 1);
+    return i;
+  }
+  }
+}
+
+
+// The next number of an ASCII line, moving p past it.  Does
+// by itself the usual [-]ddd.ddd[e[-]dd]; anything else
+// (nan, inf, very big or small exponents) goes to strtod.
+static double
+ascii_number(const char *&p, const char *end)
+{
+  static const double pow10[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10,
+    1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21,
+    1e22
+  };
+
+  while (p < end && (*p == ' ' || *p == '\t')) p++;
+  const char *s = p;
+
+  bool neg = false;
+  if (p < end && (*p == '-' || *p == '+'))
+    neg = (*p++ == '-');
+  // up to 19 significant digits fit in m
+  unsigned long long m = 0;
+  int nDigits = 0, nSig = 0, exp10 = 0;
+  for (; p < end && *p >= '0' && *p <= '9'; p++, nDigits++) {
+    if (nSig < 19) {
+      m = m * 10 + (*p - '0');
+      if (m) nSig++;
+    } else {
+      exp10++;
+    }
+  }
+  if (p < end && *p == '.') {
+    for (p++; p < end && *p >= '0' && *p <= '9'; p++, nDigits++) {
+      if (nSig < 19) {
+	m = m * 10 + (*p - '0');
+	if (m) nSig++;
+	exp10--;
+      }
+    }
+  }
+  if (nDigits && p < end && (*p == 'e' || *p == 'E')) {
+    const char *q = p + 1;
+    bool eneg = false;
+    if (q < end && (*q == '-' || *q == '+'))
+      eneg = (*q++ == '-');
+    if (q < end && *q >= '0' && *q <= '9') {
+      int e = 0;
+      for (; q < end && *q >= '0' && *q <= '9'; q++)
+	if (e < 10000) e = e * 10 + (*q - '0');
+      exp10 += eneg ? -e : e;
+      p = q;
+    }
+  }
+
+  if (nDigits && (p == end || isspace(*p)) && exp10 >= -22 && exp10 <= 22) {
+    double v = (double)m;
+    v = (exp10 < 0) ? v / pow10[-exp10] : v * pow10[exp10];
+    return neg ? -v : v;
+  }
+
+  char buf[64];
+  int n = 0;
+  for (p = s; p < end && !isspace(*p) && n < 63; p++)
+    buf[n++] = *p;
+  buf[n] = 0;
+  return n ? strtod(buf, NULL) : 0;
+}
+
+
+static const char *
+next_line(const char *p, const char *end)
+{
+  const char *nl = (const char *)memchr(p, '\n', end - p);
+  return nl ? nl + 1 : end;
+}
+
+
+// props[0..n) of count elements of e, starting at line p
+template <class T>
+static void
+ascii_values(const char *p, const char *end, const PlyMap::Elem *e,
+	     const PlyMap::Prop **props, int n, int count, T *out)
+{
+  int np = e->props.size();
+  vector<int> slot(np, -1);
+  for (int k = 0; k < n; k++)
+    slot[props[k] - &e->props[0]] = k;
+
+  for (int i = 0; i < count; i++, out += n) {
+    for (int j = 0; j < np; j++) {
+      if (e->props[j].countType) {
+	for (int c = (int)ascii_number(p, end); c > 0; c--)
+	  ascii_number(p, end);
+      } else {
+	double v = ascii_number(p, end);
+	if (slot[j] >= 0) out[slot[j]] = (T)v;
+      }
+    }
+    p = next_line(p, end);
+  }
+}
+
+
+PlyMap::PlyMap(void)
+  : base(NULL), len(0), asc(false), swap(false)
+{
+}
+
+
+void
+PlyMap::close(void)
+{
+#ifndef WIN32
+  if (base) munmap(base, len);
+#endif
+  base = NULL;
+  len  = 0;
+  asc  = false;
+  swap = false;
+  elems.clear();
+  info.clear();
+}
+
+
+bool
+PlyMap::open(const char *path)
+{
+  close();
+
+#ifdef WIN32
+  return false;
+#else
+  int fd = ::open(path, O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  void *addr = MAP_FAILED;
+  // gzipped files start with something else than "ply"
+  char magic[4];
+  if (fstat(fd, &st) == 0 && st.st_size > 4 &&
+      read(fd, magic, 4) == 4 && !strncmp(magic, "ply", 3))
+    addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (addr == MAP_FAILED)
+    return false;
+  base = (char *)addr;
+  len  = st.st_size;
+
+  // the header
+  const char *eoh = NULL;
+  for (const char *p = base; p + 11 <= base + len; p++) {
+    if (*p == '\n' && !strncmp(p + 1, "end_header", 10)) {
+      const char *q = p + 11;
+      while (q < base + len && *q != '\n') q++;
+      if (q < base + len) eoh = q + 1;
+      break;
+    }
+  }
+  bool ok = (eoh != NULL);
+  bool format = false;
+
+  const char *line = base;
+  while (ok && line < eoh) {
+    const char *nl = (const char *)memchr(line, '\n', eoh - line);
+    std::string l(line, nl - line);
+    line = nl + 1;
+
+    vector<std::string> w;
+    const char *s = l.c_str();
+    while (*s) {
+      while (*s && isspace(*s)) s++;
+      const char *b = s;
+      while (*s && !isspace(*s)) s++;
+      if (s > b) w.push_back(std::string(b, s - b));
+    }
+    if (w.empty())
+      continue;
+
+    if (w[0] == "format") {
+      if (w.size() < 2) ok = false;
+      else if (w[1] == "binary_little_endian")
+	format = true, swap = !native_little_endian();
+      else if (w[1] == "binary_big_endian")
+	format = true, swap = native_little_endian();
+      else if (w[1] == "ascii")
+	format = true, asc = true;
+      else
+	ok = false;
+    } else if (w[0] == "element") {
+      if (w.size() < 3) { ok = false; break; }
+      Elem e;
+      e.name = w[1];
+      e.num  = atoi(w[2].c_str());
+      e.size = 0;
+      e.data = NULL;
+      ok = e.num >= 0;
+      elems.push_back(e);
+    } else if (w[0] == "property") {
+      if (elems.empty()) { ok = false; break; }
+      Elem &e = elems.back();
+      Prop p;
+      p.offset = e.size;
+      if (w.size() == 5 && w[1] == "list") {
+	p.countType = type_of(w[2].c_str());
+	p.type      = type_of(w[3].c_str());
+	p.name      = w[4];
+	ok = is_int_type(p.countType) && p.type != 0;
+	e.size = -1;
+      } else if (w.size() == 3) {
+	p.countType = 0;
+	p.type      = type_of(w[1].c_str());
+	p.name      = w[2];
+	ok = p.type != 0;
+	if (e.size >= 0) e.size += ply_type_size[p.type];
+      } else {
+	ok = false;
+      }
+      e.props.push_back(p);
+    } else if (w[0] == "obj_info" && l.size() > 9) {
+      info.push_back(l.substr(9));
+    }
+  }
+  if (!ok || !format) {
+    close();
+    return false;
+  }
+
+  if (asc) {
+    if (!index_lines(eoh)) {
+      cerr << path << " is shorter than its header says" << endl;
+      close();
+      return false;
+    }
+    return true;
+  }
+
+  // where each element starts; lists have to be walked
+  // through unless they come last
+  const char *p = eoh;
+  for (int i = 0; i < elems.size() && p; i++) {
+    Elem &e = elems[i];
+    e.data = p;
+    if (e.size >= 0) {
+      if ((long long)e.size * e.num > base + len - p) p = NULL;
+      else p += (long long)e.size * e.num;
+    } else if (i + 1 < elems.size()) {
+      for (int j = 0; j < e.num && p; j++)
+	p = skip(e, p);
+    }
+  }
+  if (p == NULL) {
+    cerr << path << " is shorter than its header says" << endl;
+    close();
+    return false;
+  }
+  return true;
+#endif
+}
+
+
+// ASCII: one element per line; note where every
+// PLYMAP_STRIDE-th line of each element starts.  The body is
+// cut into pieces, the newlines of each counted, and then
+// each piece marks its lines, all on the thread pool.
+bool
+PlyMap::index_lines(const char *body)
+{
+  const char *end = base + len;
+  vector<long long> first(elems.size() + 1, 0);
+  for (int i = 0; i < elems.size(); i++) {
+    Elem &e = elems[i];
+    e.lines.resize((e.num + PLYMAP_STRIDE - 1) / PLYMAP_STRIDE);
+    first[i+1] = first[i] + e.num;
+  }
+  long long total = first.back();
+  if (total == 0)
+    return true;
+
+  // pieces of about a megabyte
+  long long bodyLen = end - body;
+  int nPieces = (int)std::min(bodyLen / (1 << 20) + 1, 16384LL);
+  vector<const char *> piece(nPieces + 1);
+  for (int i = 0; i <= nPieces; i++)
+    piece[i] = body + bodyLen * i / nPieces;
+
+  // newlines before each piece
+  vector<long long> nl(nPieces + 1, 0);
+  WorkerPool &pool = WorkerPool::global();
+  pool.parallel_for(nPieces, 1, [&](int b, int e) {
+    for (int i = b; i < e; i++)
+      nl[i+1] = std::count(piece[i], piece[i+1], '\n');
+  });
+  for (int i = 0; i < nPieces; i++)
+    nl[i+1] += nl[i];
+  long long nLines = nl[nPieces] + (end[-1] != '\n');
+  if (nLines < total)
+    return false;
+
+  // line 0 starts the body, line L > 0 follows the L-th
+  // newline
+  auto mark = [&](long long L, const char *start, int &k) {
+    while (L >= first[k+1]) k++;
+    long long j = L - first[k];
+    if (j % PLYMAP_STRIDE == 0)
+      elems[k].lines[j / PLYMAP_STRIDE] = start;
+  };
+  int k0 = 0;
+  mark(0, body, k0);
+  pool.parallel_for(nPieces, 1, [&](int b, int e) {
+    for (int i = b; i < e; i++) {
+      long long   L = nl[i];
+      int         k = 0;
+      const char *q = piece[i];
+      while (L + 1 < total &&
+	     (q = (const char *)memchr(q, '\n', piece[i+1] - q)) != NULL)
+	mark(++L, ++q, k);
+    }
+  });
+
+  for (int i = 0; i < elems.size(); i++)
+    elems[i].data = elems[i].num ? elems[i].lines[0] : NULL;
+  return true;
+}
+
+
+// ASCII: the line of element i of e
+const char *
+PlyMap::line(const Elem *e, int i) const
+{
+  const char *p = e->lines[i / PLYMAP_STRIDE];
+  for (int r = i % PLYMAP_STRIDE; r > 0; r--)
+    p = next_line(p, base + len);
+  return p;
+}
+
+
+// past element p of e, NULL if that's past the end of the file
+const char *
+PlyMap::skip(const Elem &e, const char *p) const
+{
+  const char *end = base + len;
+  for (int i = 0; i < e.props.size(); i++) {
+    const Prop &pr = e.props[i];
+    long long n = 1;
+    if (pr.countType) {
+      if (ply_type_size[pr.countType] > end - p) return NULL;
+      n = get_uint(p, pr.countType, swap);
+      p += ply_type_size[pr.countType];
+    }
+    if (n * ply_type_size[pr.type] > end - p) return NULL;
+    p += n * ply_type_size[pr.type];
+  }
+  return p;
+}
+
+
+const PlyMap::Elem *
+PlyMap::find(const char *elem) const
+{
+  for (int i = 0; i < elems.size(); i++) {
+    if (elems[i].name == elem)
+      return &elems[i];
+  }
+  return NULL;
+}
+
+
+const PlyMap::Prop *
+PlyMap::find(const Elem *e, const char *prop)
+{
+  for (int i = 0; i < e->props.size(); i++) {
+    if (e->props[i].name == prop)
+      return &e->props[i];
+  }
+  return NULL;
+}
+
+
+void
+PlyMap::get_floats(const Elem *e, const Prop **props, int n,
+		   int begin, int end, float *out) const
+{
+  if (asc) {
+    ascii_values(line(e, begin), base + len, e, props, n, end - begin, out);
+    return;
+  }
+
+  const char *p = e->data + (long long)begin * e->size;
+  long long cnt = end - begin;
+
+  // x y z and nothing else: one copy
+  bool packed = (n * 4 == e->size);
+  for (int k = 0; k < n; k++)
+    packed = packed && props[k]->offset == 4 * k;
+
+  if (packed) {
+    memcpy(out, p, cnt * e->size);
+  } else {
+    float *o = out;
+    for (long long i = 0; i < cnt; i++, p += e->size) {
+      for (int k = 0; k < n; k++)
+	memcpy(o++, p + props[k]->offset, 4);
+    }
+  }
+  if (swap)
+    swap_words(out, cnt * n);
+}
+
+
+void
+PlyMap::get_uchars(const Elem *e, const Prop **props, int n,
+		   int begin, int end, unsigned char *out) const
+{
+  if (asc) {
+    ascii_values(line(e, begin), base + len, e, props, n, end - begin, out);
+    return;
+  }
+
+  const char *p = e->data + (long long)begin * e->size;
+  for (int i = begin; i < end; i++, p += e->size) {
+    for (int k = 0; k < n; k++)
+      *out++ = p[props[k]->offset];
+  }
+}
+
+
+// whether the three indices at t are vertices; complains if
+// they aren't
+static inline bool
+good_tri(const int *t, int nVtx, int i)
+{
+  if ((unsigned)t[0] < (unsigned)nVtx &&
+      (unsigned)t[1] < (unsigned)nVtx &&
+      (unsigned)t[2] < (unsigned)nVtx)
+    return true;
+  cerr << "\n\nRed alert: invalid triangle "
+       << t[0] << " " << t[1] << " "  << t[2]
+       << " (tri " << i
+       << ", valid range=0.." << nVtx-1 << ")\n" << endl;
+  return false;
+}
+
+
+int
+PlyMap::get_tris(const Elem *e, int begin, int end, int nVtx,
+		 vector<int> &tris) const
+{
+  int first = tris.size();
+  tris.resize(first + 3LL * (end - begin));
+  int *t    = tris.data() + first;
+  int  nBad = 0;
+
+  if (asc) {
+    const char *p    = line(e, begin);
+    const char *eof  = base + len;
+    for (int i = begin; i < end; i++) {
+      int c = (int)ascii_number(p, eof);
+      if (c != 3)
+	nBad++;
+      for (int k = 0; k < c; k++) {
+	int v = (int)ascii_number(p, eof);
+	if (k < 3) t[k] = v;
+      }
+      if (c >= 3 && good_tri(t, nVtx, i))
+	t += 3;
+      p = next_line(p, eof);
+    }
+    tris.resize(t - tris.data());
+    return nBad;
+  }
+
+  // the faces have to be walked through from the start
+  assert(begin == 0 && end == e->num);
+  int         ct   = e->props[0].countType;
+  int         cs   = ply_type_size[ct];
+  const char *p    = e->data;
+  const char *eof  = base + len;
+  for (int i = 0; i < e->num; i++) {
+    if (cs > eof - p) {
+      tris.resize(first);
+      return -1;
+    }
+    unsigned int c = get_uint(p, ct, swap);
+    p += cs;
+    if (4LL * c > eof - p) {
+      tris.resize(first);
+      return -1;
+    }
+    if (c != 3)
+      nBad++;
+    if (c >= 3) {
+      memcpy(t, p, 12);
+      if (swap) swap_words(t, 3);
+      if (good_tri(t, nVtx, i))
+	t += 3;
+    }
+    p += 4 * c;
+  }
+  tris.resize(t - tris.data());
+  return nBad;
+}
+
+
+bool
+PlyMap::get_list(const Elem *e, vector<int> &items) const
+{
+  if (e->num != 1 || e->props.size() != 1 || !e->props[0].countType ||
+      ply_type_size[e->props[0].type] != 4 ||
+      !is_int_type(e->props[0].type))
+    return false;
+
+  if (asc) {
+    const char *p = e->data;
+    long long   n = (long long)ascii_number(p, base + len);
+    if (n < 0 || n > len / 2)
+      return false;
+    items.resize(n);
+    for (long long i = 0; i < n; i++)
+      items[i] = (int)ascii_number(p, base + len);
+    return true;
+  }
+
+  int         ct  = e->props[0].countType;
+  const char *p   = e->data;
+  const char *end = base + len;
+  if (ply_type_size[ct] > end - p)
+    return false;
+  long long n = get_uint(p, ct, swap);
+  p += ply_type_size[ct];
+  if (4 * n > end - p)
+    return false;
+
+  items.resize(n);
+  if (n) {
+    memcpy(&items[0], p, 4 * n);
+    if (swap) swap_words(&items[0], n);
+  }
+  return true;
+}
@@ -0,0 +1,105 @@
+//############################################################
+//
+// PlyMap.h
+//
+// PLY files mapped into memory.  PlyFile (ply++.h) decodes
+// every property of every element through a type switch, one
+// value at a time; PlyMap parses the header, maps the file
+// and hands out pointers to where each element's data starts,
+// so that the common layouts (float x y z ..., faces as a
+// list of ints) can be copied out a whole array at a time.
+//
+// Binary files in the other byte order are fine: the get_*
+// functions turn the numbers around.  In ASCII files open()
+// finds the start of every PLYMAP_STRIDE-th line on the
+// thread pool, so that the get_* functions can parse any
+// range of elements, and different ranges at once.
+//
+// Only plain (not gzipped) files are handled; open() says no
+// to anything else, and the caller goes back to PlyFile.
+//
+//############################################################
+
+#ifndef _PLY_MAP_H_
+#define _PLY_MAP_H_
+
+#include <vector>
+#include <string>
+
+
+#define PLYMAP_STRIDE 1024
+
+
+class PlyMap {
+public:
+  struct Prop {
+    std::string name;
+    int         type;       // PLY_FLOAT etc., of the list items for lists
+    int         countType;  // of the list count, 0 for scalars
+    int         offset;     // in the element, -1 after a list
+  };
+
+  struct Elem {
+    std::string       name;
+    int               num;
+    std::vector<Prop> props;
+    int               size;   // bytes per element, -1 with lists
+    const char       *data;   // the first element
+    // ASCII: the lines of elements 0, PLYMAP_STRIDE, ...
+    std::vector<const char *> lines;
+  };
+
+  PlyMap(void);
+  ~PlyMap(void) { close(); }
+
+  bool open(const char *path);
+  void close(void);
+
+  bool ascii(void) const   { return asc; }
+  bool swapped(void) const { return swap; }
+  const std::vector<std::string> &obj_info(void) const { return info; }
+
+  // NULL if there's no such element or property
+  const Elem *find(const char *elem) const;
+  static const Prop *find(const Elem *e, const char *prop);
+
+  // whether ranges of elements of e can be read on their own
+  // (and so at the same time): ASCII or fixed size elements
+  bool can_split(const Elem *e) const { return asc || e->size >= 0; }
+
+  // Scalar float properties props[0..n) of elements [begin,
+  // end) of an element that can_split(), n floats per element
+  // into out.
+  void get_floats(const Elem *e, const Prop **props, int n,
+		  int begin, int end, float *out) const;
+  // same for uchar properties
+  void get_uchars(const Elem *e, const Prop **props, int n,
+		  int begin, int end, unsigned char *out) const;
+
+  // The first three indices of faces [begin, end) of an
+  // element whose only property is a list of ints, appended
+  // to tris; faces with an index outside [0, nVtx) are left
+  // out with a message.  Unless can_split(e), the range has
+  // to be all of e.  Returns the number of faces that weren't
+  // triangles, or -1 if the file is cut short.
+  int  get_tris(const Elem *e, int begin, int end, int nVtx,
+		std::vector<int> &tris) const;
+
+  // All the items of the list of the only element of e, an
+  // int list (like tristrips).  False if e isn't like that.
+  bool get_list(const Elem *e, std::vector<int> &items) const;
+
+private:
+  char                     *base;
+  long long                 len;
+  bool                      asc;
+  bool                      swap;
+  std::vector<Elem>         elems;
+  std::vector<std::string>  info;
+
+  const char *skip(const Elem &e, const char *p) const;
+  bool        index_lines(const char *body);
+  const char *line(const Elem *e, int i) const;
+};
+
+#endif /* _PLY_MAP_H_ */
@@ -0,0 +1,516 @@
+//############################################################
+//
+// PoseGraph.cc
+//
+// Simultaneous alignment of many scans: sparse
+// Levenberg-Marquardt over all the poses.
+//
+//############################################################
+
+#include <math.h>
+#include <float.h>
+#include <string.h>
+#include <set>
+#include <algorithm>
+#include "PoseGraph.h"
+#include "WorkerPool.h"
+
+
+PoseGraph::PoseGraph(int nPoses)
+  : pose(nPoses), nPairs(0), center(0,0,0)
+{
+  for (int i = 0; i < nPoses; i++) {
+    Pose &p = pose[i];
+    for (int j = 0; j < 3; j++) {
+      for (int k = 0; k < 3; k++) p.R[j][k] = (j == k);
+      p.t[j] = 0;
+    }
+    p.fixed = false;
+  }
+}
+
+
+void
+PoseGraph::set_pose(int i, const Xform<float> &xf)
+{
+  for (int j = 0; j < 3; j++) {
+    for (int k = 0; k < 3; k++) pose[i].R[j][k] = xf(j,k);
+    pose[i].t[j] = xf(j,3);
+  }
+}
+
+
+Xform<float>
+PoseGraph::get_pose(int i) const
+{
+  float r[3][3], t[3];
+  for (int j = 0; j < 3; j++) {
+    for (int k = 0; k < 3; k++) r[j][k] = pose[i].R[j][k];
+    t[j] = pose[i].t[j];
+  }
+  Xform<float> xf(r, t);
+  return xf.enforce_rigidity();
+}
+
+
+void
+PoseGraph::fix(int i, bool fixed)
+{
+  pose[i].fixed = fixed;
+}
+
+
+void
+PoseGraph::add_pairs(int a, int b, const Pnt3 *pa, const Pnt3 *pb,
+		     int n)
+{
+  if (a == b || n <= 0) return;
+  edge.push_back(Edge());
+  Edge &e = edge.back();
+  e.a = a;  e.b = b;
+  e.pa.assign(pa, pa + n);
+  e.pb.assign(pb, pb + n);
+  nPairs += n;
+}
+
+
+static inline void
+xform_pt(const double R[3][3], const double t[3], const Pnt3 &p,
+	 const double c[3], double w[3])
+{
+  for (int i = 0; i < 3; i++)
+    w[i] = R[i][0]*p[0] + R[i][1]*p[1] + R[i][2]*p[2] + t[i] - c[i];
+}
+
+
+void
+PoseGraph::edge_sums(const vector<Pose> &p, vector<EdgeSums> &s) const
+{
+  s.resize(edge.size());
+  double c[3] = { center[0], center[1], center[2] };
+  WorkerPool::global().parallel_for(edge.size(), 1, [&](int b, int e) {
+    for (int ie = b; ie < e; ie++) {
+      const Edge &ed = edge[ie];
+      const Pose &A  = p[ed.a], &B = p[ed.b];
+      EdgeSums   &S  = s[ie];
+      memset(&S, 0, sizeof(S));
+      S.n = ed.pa.size();
+      for (int k = 0; k < ed.pa.size(); k++) {
+	double wa[3], wb[3], r[3];
+	xform_pt(A.R, A.t, ed.pa[k], c, wa);
+	xform_pt(B.R, B.t, ed.pb[k], c, wb);
+	for (int i = 0; i < 3; i++) r[i] = wa[i] - wb[i];
+	S.cost += r[0]*r[0] + r[1]*r[1] + r[2]*r[2];
+	for (int i = 0; i < 3; i++) {
+	  for (int j = 0; j < 3; j++) {
+	    S.aa[i][j] += wa[i]*wa[j];
+	    S.bb[i][j] += wb[i]*wb[j];
+	    S.ba[i][j] += wb[i]*wa[j];
+	  }
+	  S.sa[i] += wa[i];
+	  S.sb[i] += wb[i];
+	  S.r[i]  += r[i];
+	}
+	S.ar[0] += wa[1]*r[2] - wa[2]*r[1];
+	S.ar[1] += wa[2]*r[0] - wa[0]*r[2];
+	S.ar[2] += wa[0]*r[1] - wa[1]*r[0];
+	S.br[0] += wb[1]*r[2] - wb[2]*r[1];
+	S.br[1] += wb[2]*r[0] - wb[0]*r[2];
+	S.br[2] += wb[0]*r[1] - wb[1]*r[0];
+      }
+    }
+  });
+}
+
+
+double
+PoseGraph::cost(const vector<Pose> &p) const
+{
+  vector<double> c(edge.size());
+  double cc[3] = { center[0], center[1], center[2] };
+  WorkerPool::global().parallel_for(edge.size(), 1, [&](int b, int e) {
+    for (int ie = b; ie < e; ie++) {
+      const Edge &ed = edge[ie];
+      double sum = 0;
+      for (int k = 0; k < ed.pa.size(); k++) {
+	double wa[3], wb[3];
+	xform_pt(p[ed.a].R, p[ed.a].t, ed.pa[k], cc, wa);
+	xform_pt(p[ed.b].R, p[ed.b].t, ed.pb[k], cc, wb);
+	for (int i = 0; i < 3; i++) sum += (wa[i]-wb[i])*(wa[i]-wb[i]);
+      }
+      c[ie] = sum;
+    }
+  });
+  double sum = 0;
+  for (int i = 0; i < c.size(); i++) sum += c[i];
+  return sum;
+}
+
+
+double
+PoseGraph::rms(void) const
+{
+  return nPairs ? sqrt(cost(pose) / nPairs) : 0;
+}
+
+
+// The 6x6 block sum(K(u)' K(v)) of the normal equations, with
+// K(w) = [-[w]x  I] the derivative of a point w moved by a
+// small rotation and translation:
+//   [ (u.v) I - v u'   [u]x ]
+//   [   -[v]x           n I ]
+// from vu = sum v u', su = sum u, sv = sum v.
+static void
+moment_block(double n, const double vu[3][3], const double su[3],
+	     const double sv[3], double sign, double *H)
+{
+  double tr = vu[0][0] + vu[1][1] + vu[2][2];
+  for (int i = 0; i < 3; i++)
+    for (int j = 0; j < 3; j++) {
+      H[i*6+j]       = sign * ((i == j) * tr - vu[i][j]);
+      H[(i+3)*6+j+3] = sign * (i == j) * n;
+    }
+  // [su]x top right, -[sv]x bottom left
+  H[0*6+3] = 0;            H[0*6+4] = -sign*su[2];  H[0*6+5] =  sign*su[1];
+  H[1*6+3] =  sign*su[2];  H[1*6+4] = 0;            H[1*6+5] = -sign*su[0];
+  H[2*6+3] = -sign*su[1];  H[2*6+4] =  sign*su[0];  H[2*6+5] = 0;
+  H[3*6+0] = 0;            H[3*6+1] =  sign*sv[2];  H[3*6+2] = -sign*sv[1];
+  H[4*6+0] = -sign*sv[2];  H[4*6+1] = 0;            H[4*6+2] =  sign*sv[0];
+  H[5*6+0] =  sign*sv[1];  H[5*6+1] = -sign*sv[0];  H[5*6+2] = 0;
+}
+
+
+// Order the free poses for elimination (greedy minimum
+// degree on the graph of scans that share pairs), and find
+// the structure of the factor, fill included: when a scan is
+// eliminated, its remaining neighbours become the rows of its
+// column and get connected to each other.
+void
+PoseGraph::analyze(void)
+{
+  int n = pose.size();
+  var.assign(n, -1);
+  vector<int> free;
+  for (int i = 0; i < n; i++)
+    if (!pose[i].fixed) free.push_back(i);
+
+  vector< set<int> > adj(n);
+  for (int i = 0; i < edge.size(); i++) {
+    int a = edge[i].a, b = edge[i].b;
+    if (pose[a].fixed || pose[b].fixed) continue;
+    adj[a].insert(b);
+    adj[b].insert(a);
+  }
+
+  int nv = free.size();
+  vector< vector<int> > nbors(nv);
+  vector<bool> done(n, false);
+  for (int k = 0; k < nv; k++) {
+    int best = -1;
+    for (int i = 0; i < nv; i++) {
+      int v = free[i];
+      if (done[v]) continue;
+      if (best < 0 || adj[v].size() < adj[best].size()) best = v;
+    }
+    var[best]  = k;
+    done[best] = true;
+    nbors[k].assign(adj[best].begin(), adj[best].end());
+    for (int i = 0; i < nbors[k].size(); i++) {
+      int x = nbors[k][i];
+      adj[x].erase(best);
+      for (int j = 0; j < nbors[k].size(); j++)
+	if (j != i) adj[x].insert(nbors[k][j]);
+    }
+    adj[best].clear();
+  }
+
+  col.assign(nv, Column());
+  for (int k = 0; k < nv; k++) {
+    vector<int> &rows = col[k].rows;
+    for (int i = 0; i < nbors[k].size(); i++)
+      rows.push_back(var[nbors[k][i]]);
+    sort(rows.begin(), rows.end());
+    col[k].blk.resize(36 * rows.size());
+  }
+}
+
+
+double *
+PoseGraph::block(int row, int c)
+{
+  vector<int> &rows = col[c].rows;
+  int i = lower_bound(rows.begin(), rows.end(), row) - rows.begin();
+  return &col[c].blk[36*i];
+}
+
+
+// Cholesky factor of a 6x6 block in place (lower triangle)
+static bool
+chol6(double *A)
+{
+  for (int j = 0; j < 6; j++) {
+    double d = A[j*6+j];
+    for (int k = 0; k < j; k++) d -= A[j*6+k]*A[j*6+k];
+    if (d <= 0) return false;
+    d = sqrt(d);
+    A[j*6+j] = d;
+    for (int i = j+1; i < 6; i++) {
+      double s = A[i*6+j];
+      for (int k = 0; k < j; k++) s -= A[i*6+k]*A[j*6+k];
+      A[i*6+j] = s / d;
+    }
+    for (int k = j+1; k < 6; k++) A[j*6+k] = 0;
+  }
+  return true;
+}
+
+
+// x <- L^-1 x
+static void
+lsolve6(const double *L, double *x)
+{
+  for (int i = 0; i < 6; i++) {
+    double s = x[i];
+    for (int k = 0; k < i; k++) s -= L[i*6+k]*x[k];
+    x[i] = s / L[i*6+i];
+  }
+}
+
+
+// x <- L'^-1 x
+static void
+ltsolve6(const double *L, double *x)
+{
+  for (int i = 5; i >= 0; i--) {
+    double s = x[i];
+    for (int k = i+1; k < 6; k++) s -= L[k*6+i]*x[k];
+    x[i] = s / L[i*6+i];
+  }
+}
+
+
+// C -= A B'
+static void
+sub_abt6(const double *A, const double *B, double *C)
+{
+  for (int i = 0; i < 6; i++)
+    for (int j = 0; j < 6; j++) {
+      double s = 0;
+      for (int k = 0; k < 6; k++) s += A[i*6+k]*B[j*6+k];
+      C[i*6+j] -= s;
+    }
+}
+
+
+// right-looking block Cholesky, in place
+bool
+PoseGraph::factor(void)
+{
+  for (int k = 0; k < col.size(); k++) {
+    Column &ck = col[k];
+    if (!chol6(ck.diag)) return false;
+
+    // L_ik = A_ik L_kk'^-1, row by row
+    int nr = ck.rows.size();
+    for (int i = 0; i < nr; i++) {
+      double *B = &ck.blk[36*i];
+      for (int r = 0; r < 6; r++) lsolve6(ck.diag, B + 6*r);
+    }
+
+    // update the rest of the matrix
+    for (int i = 0; i < nr; i++) {
+      const double *Li = &ck.blk[36*i];
+      int ri = ck.rows[i];
+      sub_abt6(Li, Li, col[ri].diag);
+      for (int j = 0; j < i; j++)
+	sub_abt6(Li, &ck.blk[36*j], block(ri, ck.rows[j]));
+    }
+  }
+  return true;
+}
+
+
+// solve L L' x = b in place
+void
+PoseGraph::back_solve(vector<double> &b) const
+{
+  int nv = col.size();
+  for (int k = 0; k < nv; k++) {
+    const Column &ck = col[k];
+    double *yk = &b[6*k];
+    lsolve6(ck.diag, yk);
+    for (int i = 0; i < ck.rows.size(); i++) {
+      const double *L = &ck.blk[36*i];
+      double *bi = &b[6*ck.rows[i]];
+      for (int r = 0; r < 6; r++)
+	for (int c = 0; c < 6; c++) bi[r] -= L[r*6+c]*yk[c];
+    }
+  }
+  for (int k = nv-1; k >= 0; k--) {
+    const Column &ck = col[k];
+    double *xk = &b[6*k];
+    for (int i = 0; i < ck.rows.size(); i++) {
+      const double *L = &ck.blk[36*i];
+      const double *xi = &b[6*ck.rows[i]];
+      for (int r = 0; r < 6; r++)
+	for (int c = 0; c < 6; c++) xk[c] -= L[r*6+c]*xi[r];
+    }
+    ltsolve6(ck.diag, xk);
+  }
+}
+
+
+// move every free pose by its (small rotation, translation)
+// in d, rotating about the center
+void
+PoseGraph::step(const vector<Pose> &from, const vector<double> &d,
+		vector<Pose> &to) const
+{
+  to = from;
+  double c[3] = { center[0], center[1], center[2] };
+  for (int i = 0; i < pose.size(); i++) {
+    int k = var[i];
+    if (k < 0) continue;
+    const double *w = &d[6*k];
+    double th = sqrt(w[0]*w[0] + w[1]*w[1] + w[2]*w[2]);
+    double dR[3][3];
+    // Rodrigues
+    double s = 1, cc = 0;
+    if (th > 1e-12) { s = sin(th)/th;  cc = (1-cos(th))/(th*th); }
+    double K[3][3] = { {    0, -w[2],  w[1] },
+		       { w[2],     0, -w[0] },
+		       {-w[1],  w[0],     0 } };
+    for (int r = 0; r < 3; r++)
+      for (int q = 0; q < 3; q++) {
+	double k2 = 0;
+	for (int m = 0; m < 3; m++) k2 += K[r][m]*K[m][q];
+	dR[r][q] = (r == q) + s*K[r][q] + cc*k2;
+      }
+
+    const Pose &P = from[i];
+    Pose       &Q = to[i];
+    double t[3];
+    for (int r = 0; r < 3; r++) t[r] = P.t[r] - c[r];
+    for (int r = 0; r < 3; r++) {
+      for (int q = 0; q < 3; q++)
+	Q.R[r][q] = dR[r][0]*P.R[0][q] + dR[r][1]*P.R[1][q] +
+	  dR[r][2]*P.R[2][q];
+      Q.t[r] = dR[r][0]*t[0] + dR[r][1]*t[1] + dR[r][2]*t[2] +
+	c[r] + w[3+r];
+    }
+  }
+}
+
+
+int
+PoseGraph::solve(double ftol, int maxIter,
+		 const function<bool(int,double)> &progress)
+{
+  if (nPairs == 0) return 0;
+
+  // rotate about the middle of the data, for better
+  // conditioning than about the world origin
+  double sum[3] = { 0, 0, 0 };
+  for (int i = 0; i < edge.size(); i++) {
+    const Edge &e = edge[i];
+    double c0[3] = { 0, 0, 0 }, w[3];
+    for (int k = 0; k < e.pa.size(); k++) {
+      xform_pt(pose[e.a].R, pose[e.a].t, e.pa[k], c0, w);
+      for (int j = 0; j < 3; j++) sum[j] += w[j];
+    }
+  }
+  center.set(sum[0]/nPairs, sum[1]/nPairs, sum[2]/nPairs);
+
+  analyze();
+  int nv = col.size();
+  if (nv == 0) return 0;
+
+  vector<EdgeSums> sums;
+  vector<double>   g, d;
+  vector<Pose>     trial;
+  double lambda = 1e-4;
+  double curr   = cost(pose);
+
+  int iter;
+  for (iter = 0; iter < maxIter; iter++) {
+    edge_sums(pose, sums);
+
+    bool improved = false;
+    double next = curr;
+    for (int tries = 0; tries < 20 && !improved; tries++) {
+      // assemble J'J + lambda diag(J'J) and J'r
+      for (int k = 0; k < nv; k++) {
+	memset(col[k].diag, 0, sizeof(col[k].diag));
+	fill(col[k].blk.begin(), col[k].blk.end(), 0.0);
+      }
+      g.assign(6*nv, 0.0);
+      for (int i = 0; i < edge.size(); i++) {
+	const EdgeSums &S = sums[i];
+	int ia = var[edge[i].a], ib = var[edge[i].b];
+	double H[36];
+	if (ia >= 0) {
+	  moment_block(S.n, S.aa, S.sa, S.sa, 1, H);
+	  for (int j = 0; j < 36; j++) col[ia].diag[j] += H[j];
+	  for (int j = 0; j < 3; j++) {
+	    g[6*ia+j]   += S.ar[j];
+	    g[6*ia+3+j] += S.r[j];
+	  }
+	}
+	if (ib >= 0) {
+	  moment_block(S.n, S.bb, S.sb, S.sb, 1, H);
+	  for (int j = 0; j < 36; j++) col[ib].diag[j] += H[j];
+	  for (int j = 0; j < 3; j++) {
+	    g[6*ib+j]   -= S.br[j];
+	    g[6*ib+3+j] -= S.r[j];
+	  }
+	}
+	if (ia >= 0 && ib >= 0) {
+	  // J_a' J_b, stored below the diagonal
+	  moment_block(S.n, S.ba, S.sa, S.sb, -1, H);
+	  if (ia > ib) {
+	    double *B = block(ia, ib);
+	    for (int j = 0; j < 36; j++) B[j] += H[j];
+	  } else {
+	    double *B = block(ib, ia);
+	    for (int r = 0; r < 6; r++)
+	      for (int c = 0; c < 6; c++) B[r*6+c] += H[c*6+r];
+	  }
+	}
+      }
+      for (int k = 0; k < nv; k++)
+	for (int j = 0; j < 6; j++)
+	  col[k].diag[j*7] += lambda * max(col[k].diag[j*7], 1e-9);
+
+      if (!factor()) {
+	lambda *= 10;
+	continue;
+      }
+      d.resize(6*nv);
+      for (int j = 0; j < 6*nv; j++) d[j] = -g[j];
+      back_solve(d);
+
+      step(pose, d, trial);
+      next = cost(trial);
+      if (next < curr) {
+	improved = true;
+	pose.swap(trial);
+	lambda = max(lambda / 3, 1e-12);
+      } else {
+	lambda *= 4;
+      }
+    }
+    if (!improved) break;
+
+    double prev = curr;
+    curr = next;
+    if (progress && !progress(iter+1, sqrt(curr / nPairs))) {
+      iter++;
+      break;
+    }
+    if (prev - curr <= ftol * prev) {
+      iter++;
+      break;
+    }
+  }
+  return iter;
+}
@@ -0,0 +1,106 @@
+//############################################################
+//
+// PoseGraph.h
+//
+// Simultaneous alignment of many scans from their point
+// pairs: Levenberg-Marquardt over all the poses at once, the
+// alternative to GlobalReg's scan-by-scan relaxation.
+//
+// A pose is a rigid motion from a scan's coordinates to the
+// world.  A pair says that point p of scan a and point q of
+// scan b should land on the same place; the solver minimizes
+// the sum of the squared distances over all the pairs.  Each
+// step moves every scan by a small motion (6 numbers per
+// scan, in world coordinates), from normal equations that have
+// a 6x6 block for every scan and every two scans that share
+// pairs.  They are solved with a sparse block Cholesky
+// factorization, the scans eliminated in minimum degree order.
+//
+// The poses marked fixed don't move; at least one scan in
+// each connected group has to be fixed, or the group can
+// slide around freely.
+//
+//############################################################
+
+#ifndef _POSE_GRAPH_H_
+#define _POSE_GRAPH_H_
+
+#include <vector>
+#include <functional>
+#include "Pnt3.h"
+#include "Xform.h"
+
+
+class PoseGraph {
+public:
+  PoseGraph(int nPoses);
+
+  void         set_pose(int i, const Xform<float> &xf);
+  Xform<float> get_pose(int i) const;
+  void         fix(int i, bool fixed = true);
+
+  // pa[k] (in scan a's coordinates) should meet pb[k] (in scan
+  // b's coordinates), k < n
+  void add_pairs(int a, int b, const Pnt3 *pa, const Pnt3 *pb,
+		 int n);
+  int  num_pairs(void) const { return nPairs; }
+
+  // RMS distance of the pairs with the current poses
+  double rms(void) const;
+
+  // Iterate until the RMS distance improves by less than the
+  // fraction ftol, or for maxIter iterations.  progress (if
+  // given) is called after each iteration with its number and
+  // the RMS distance; returning false stops.  Returns the
+  // number of iterations taken.
+  int solve(double ftol, int maxIter = 100,
+	    const function<bool(int,double)> &progress = NULL);
+
+private:
+  struct Pose {
+    double R[3][3], t[3];
+    bool   fixed;
+  };
+  struct Edge {
+    int          a, b;
+    vector<Pnt3> pa, pb;
+  };
+
+  // the moments of an edge's pairs (w = world point - center,
+  // r = wa - wb) from which its normal equations are built
+  struct EdgeSums {
+    double n, cost;
+    double aa[3][3], bb[3][3], ba[3][3];   // sum wa wa', ...
+    double sa[3], sb[3];                   // sum wa, sum wb
+    double ar[3], br[3], r[3];             // sum wa x r, ...
+  };
+
+  // column k of the factor (in elimination order): the rows
+  // below the diagonal and their 6x6 blocks
+  struct Column {
+    double      diag[36];
+    vector<int> rows;
+    vector<double> blk;
+  };
+
+  vector<Pose>  pose;
+  vector<Edge>  edge;
+  int           nPairs;
+  Pnt3          center;   // rotations are about this point
+
+  // elimination order of the free poses, and structure of the
+  // factor; set up by analyze()
+  vector<int>    var;     // pose -> position, -1 if fixed
+  vector<Column> col;
+
+  double cost(const vector<Pose> &p) const;
+  void   edge_sums(const vector<Pose> &p, vector<EdgeSums> &s) const;
+  void   analyze(void);
+  double *block(int row, int c);
+  bool   factor(void);
+  void   back_solve(vector<double> &b) const;
+  void   step(const vector<Pose> &from, const vector<double> &d,
+	      vector<Pose> &to) const;
+};
+
+#endif /* _POSE_GRAPH_H_ */
@@ -2,6 +2,23 @@
 // Random.h
 // Kari Pulli
 // 02/12/1996
+//
+// Random numbers come from counter-based streams: the n-th
+// number of a stream is a hash (SplitMix64) of the global
+// seed, the stream's key, and n.  A stream has no state
+// besides its key and counter, so threads never share one,
+// and the same seed and keys give the same numbers however
+// the work is spread over the threads.
+//
+// Every thread draws from its current stream; code that wants
+// results that don't depend on the order of the work (e.g.
+// one stream per scan pair) makes its own stream current with
+// a RandomScope.  Without one, each thread has a stream of its
+// own (the first thread to draw gets key 0, which in
+// practice is the main thread).
+//
+// The global seed is 1 unless SCANALYZE_SEED is set; it can be
+// changed with 'plv_param -seed'.
 //###############################################################
 
 #ifndef _Random_h
@@ -10,6 +27,7 @@
 #include <sys/types.h>
 #include <time.h>
 #include <stdlib.h>
+#include <atomic>
 
 #ifdef WIN32
 #define srand48 srand
@@ -20,26 +38,132 @@ static double drand48 (void)
 #endif
 
 
-class Random {
+class RandomStream {
+private:
+  typedef unsigned long long u64;
+  u64 base;  // the key it was made with
+  u64 key;   // base mixed with the seed
+  u64 ctr;
+
+  static std::atomic<u64>& seed_ref(void)
+    {
+      static std::atomic<u64> s(getenv("SCANALYZE_SEED") ?
+			   strtoull(getenv("SCANALYZE_SEED"), NULL, 0) : 1);
+      return s;
+    }
+
+  static RandomStream*& current_ref(void)
+    {
+      static thread_local RandomStream *cur = NULL;
+      return cur;
+    }
+
+public:
+  static u64 mix(u64 z)
+    {
+      z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+      z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+      return z ^ (z >> 31);
+    }
+
+  // a stream key from a name (of a scan, say) and a number
+  static u64 name_key(const char *name, u64 sub = 0)
+    {
+      u64 h = 0xcbf29ce484222325ULL;   // FNV-1a
+      for (; *name; name++) h = (h ^ (unsigned char)*name) * 0x100000001b3ULL;
+      return mix(h ^ mix(sub));
+    }
+
+  // same from len bytes of data
+  static u64 data_key(const void *data, size_t len, u64 sub = 0)
+    {
+      const unsigned char *c = (const unsigned char*)data;
+      u64 h = 0xcbf29ce484222325ULL;
+      for (size_t i = 0; i < len; i++) h = (h ^ c[i]) * 0x100000001b3ULL;
+      return mix(h ^ mix(sub));
+    }
+
+  static void set_seed(u64 s) { seed_ref() = s; }
+  static u64  seed(void)      { return seed_ref(); }
+
+  // the stream this thread draws from
+  static RandomStream& current(void)
+    {
+      RandomStream *&cur = current_ref();
+      if (!cur) {
+	static std::atomic<u64> nThreads(0);
+	static thread_local RandomStream own(nThreads++);
+	cur = &own;
+      }
+      return *cur;
+    }
+
+  RandomStream(u64 _key = 0) : base(_key) { reset(); }
+
+  // start over, from the current global seed
+  void reset(void)
+    { key = mix(seed() + 0x9e3779b97f4a7c15ULL) ^ base;  ctr = 0; }
+
+  u64 next(void)
+    { return mix(key + (++ctr) * 0x9e3779b97f4a7c15ULL); }
+
+  // a random number [0.0,1.0)
+  double operator()()
+    { return (next() >> 11) * (1.0 / 9007199254740992.0); }
+
+  // a random number [0.0,fact)
+  double operator()(double fact)
+    { return fact * operator()(); }
+
+  // shuffle [first, last) (random_shuffle() uses rand())
+  template <class T>
+  void shuffle(T *first, T *last)
+    {
+      for (long i = last - first - 1; i > 0; i--) {
+	long j = long(operator()(i + 1));
+	T t = first[i];  first[i] = first[j];  first[j] = t;
+      }
+    }
+
+  friend class RandomScope;
+};
+
+
+// Makes stream the calling thread's current stream until the
+// scope is left.
+class RandomScope {
 private:
-  static long TimeSeed(void)
-    { return (long) time(NULL); }
+  RandomStream *prev;
+public:
+  RandomScope(RandomStream &s)
+    { prev = RandomStream::current_ref(); RandomStream::current_ref() = &s; }
+  ~RandomScope(void)
+    { RandomStream::current_ref() = prev; }
+};
+
 
+// The old interface: draws from the thread's current stream.
+class Random {
 public:
-  Random(unsigned long initSeed = TimeSeed())
-    { srand48(initSeed); }
+  Random(void) {}
+  // also resets the calling thread's current stream
+  Random(unsigned long initSeed)
+    { setSeed(initSeed); }
   ~Random(void) {}
 
-  void setSeed(unsigned long newSeed = TimeSeed())
-    { srand48(newSeed); }
+  void setSeed(unsigned long newSeed)
+    {
+      RandomStream::set_seed(newSeed);
+      RandomStream::current().reset();
+    }
 
   double operator()()
     // return a random number [0.0,1.0)
-    { return drand48(); }
+    { return RandomStream::current()(); }
 
   double operator()(double fact)
     // return a random number [0.0,fact)
-    { return fact*drand48(); }
+    { return RandomStream::current()(fact); }
 };
 
 #endif
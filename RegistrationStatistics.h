@@ -9,6 +9,14 @@
 
 #ifndef REGISTRATION_STATISTICS_H
 #define REGISTRATION_STATISTICS_H
+#include <vector>
+#include <iostream>
+#include <stdio.h>
+#ifdef WIN32
+#  include <windows.h>
+#else
+#  include <sys/time.h>
+#endif
 extern void fitPnt3Plane(const vector<Pnt3>&,Pnt3&,float&,Pnt3&);
 
 
@@ -153,4 +161,77 @@ class RegistrationStatistics {
 };
 
 
+// What one ICP iteration did: the time (wall clock, seconds)
+// spent subsampling (counted for the first iteration after a
+// new sample), finding pairs, culling them and solving for the
+// motion, how many pairs were used, the culling threshold, and
+// the errors of the pairs after the motion.
+struct ICPIterStats {
+  int   iter;        // counting over all resolution levels
+  int   level;       // resolution of the moving scan (# vertices)
+  float tSample, tPairs, tCull, tSolve;
+  int   nPairs;
+  float cullThr;     // 1e33 if nothing was culled
+  float rmsPoint, rmsPlane;
+};
+
+
+// The iterations of the last ICP run, for looking at where
+// the time goes and how fast the error drops
+class ICPStats {
+public:
+  bool                 enabled;   // ICP records only if set
+  vector<ICPIterStats> iters;
+
+  ICPStats(void) : enabled(false) {}
+
+  void clear(void) { iters.clear(); }
+
+  static double now(void)
+    {
+#ifdef WIN32
+      return GetTickCount() * 1e-3;
+#else
+      struct timeval tv;
+      gettimeofday(&tv, NULL);
+      return tv.tv_sec + tv.tv_usec * 1e-6;
+#endif
+    }
+
+  // one line per iteration, with a header line
+  void write_csv(ostream &out) const
+    {
+      out << "iter,level,t_sample,t_pairs,t_cull,t_solve,"
+	  << "pairs,cull_thr,rms_point,rms_plane\n";
+      char line[256];
+      for (int i = 0; i < iters.size(); i++) {
+	const ICPIterStats &s = iters[i];
+	sprintf(line, "%d,%d,%g,%g,%g,%g,%d,%g,%g,%g\n",
+		s.iter, s.level, s.tSample, s.tPairs, s.tCull, s.tSolve,
+		s.nPairs, s.cullThr, s.rmsPoint, s.rmsPlane);
+	out << line;
+      }
+    }
+
+  // an array of objects with the same fields as the csv
+  void write_json(ostream &out) const
+    {
+      out << "[";
+      char line[320];
+      for (int i = 0; i < iters.size(); i++) {
+	const ICPIterStats &s = iters[i];
+	sprintf(line, "%s\n {\"iter\": %d, \"level\": %d, "
+		"\"t_sample\": %g, \"t_pairs\": %g, \"t_cull\": %g, "
+		"\"t_solve\": %g, \"pairs\": %d, \"cull_thr\": %g, "
+		"\"rms_point\": %g, \"rms_plane\": %g}",
+		i ? "," : "", s.iter, s.level,
+		s.tSample, s.tPairs, s.tCull, s.tSolve,
+		s.nPairs, s.cullThr, s.rmsPoint, s.rmsPlane);
+	out << line;
+      }
+      out << "\n]\n";
+    }
+};
+
+
 #endif
@@ -33,6 +33,8 @@
 #include "RigidScan.h"
 #include "MeshTransport.h"
 #include "TriMeshUtils.h"
+#include "TriBVH.h"
+#include "NormalSpace.h"
 #include "plvScene.h"      // for meshes_written_stripped()
 #include "plvDraw.h"       // to know what color properties to write
 #include <fstream>       // for write_metadata
@@ -55,6 +57,27 @@ RigidScan::subsample_points(float rate, vector<Pnt3> &p,
 			    vector<Pnt3> &n)
 { }
 
+void
+RigidScan::subsample_normal_space(float rate, vector<Pnt3> &p,
+				  vector<Pnt3> &n)
+{
+  vector<Pnt3> allp, alln;
+  subsample_points(1.0, allp, alln);
+  p.clear(); n.clear();
+  if (alln.size() == 0) return;
+
+  NormalSpaceIndex index;
+  index.build(&alln[0], alln.size());
+  vector<int> ind;
+  index.sample(rate, ind);
+
+  p.reserve(ind.size()); n.reserve(ind.size());
+  for (int i = 0; i < ind.size(); i++) {
+    p.push_back(allp[ind[i]]);
+    n.push_back(alln[ind[i]]);
+  }
+}
+
 void
 RigidScan::flipNormals (void)
 { }
@@ -122,6 +145,29 @@ RigidScan::closest_point(const Pnt3 &p, const Pnt3 &n,
 			 float thr, bool brdy_ok)
 { return 0; }
 
+void
+RigidScan::closest_points(const Pnt3 *p, const Pnt3 *n, int count,
+			  Pnt3 *cl_pnt, Pnt3 *cl_nrm, bool *found,
+			  float thr, bool bdry_ok, float eps)
+{
+  for (int i = 0; i < count; i++)
+    found[i] = closest_point(p[i], n[i], cl_pnt[i], cl_nrm[i],
+			     thr, bdry_ok);
+}
+
+bool
+RigidScan::projective_points(const Pnt3 *p, const Pnt3 *n, int count,
+			     Pnt3 *cl_pnt, Pnt3 *cl_nrm, bool *found,
+			     float thr, bool bdry_ok, int window)
+{
+  return false;
+}
+
+void
+RigidScan::prepare_search(int iRes)
+{
+}
+
 #if 0
 float
 RigidScan::closest_point(const Pnt3 &p, Pnt3 &cl_pnt)
@@ -147,6 +193,62 @@ RigidScan::closest_along_line(const Pnt3 &p, const Pnt3 &dir,
 			      Pnt3 &cp, OccSt &status_p)
 { return 0.0f; }
 
+// returns confidence!
+float
+RigidScan::closest_point_on_bvh(const TriBVH *bvh, const Pnt3 &p,
+				Pnt3 &cp, OccSt &status_p)
+{
+  status_p = INDETERMINATE;
+  if (!bvh)
+    return 0.0;
+
+  // search in the scan's own coordinates
+  Pnt3 pp = p;
+  xformInvPnt(pp);
+  float d = 1e33;
+  Pnt3  nrm;
+  if (!bvh->closest_point(pp, cp, d, &nrm))
+    return 0.0;
+
+  if (dot(pp - cp, nrm) > 0)
+    status_p = OUTSIDE;
+  else
+    status_p = INSIDE;
+
+  xformPnt(cp);
+  return 1.0;
+}
+
+// returns confidence!
+float
+RigidScan::closest_along_line_on_bvh(const TriBVH *bvh, const Pnt3 &p,
+				     const Pnt3 &dir, Pnt3 &cp,
+				     OccSt &status_p)
+{
+  status_p = INDETERMINATE;
+  if (!bvh)
+    return 0.0;
+
+  // the line in the scan's own coordinates
+  Pnt3 pp = p, q = p + dir;
+  xformInvPnt(pp);
+  xformInvPnt(q);
+  Pnt3 ldir = q - pp;
+  float t = 1e33;
+  Pnt3  nrm;
+  if (!bvh->closest_along_line(pp, ldir, t, &nrm))
+    return 0.0;
+  cp = pp + ldir * t;
+
+  if (dot(pp - cp, nrm) > 0)
+    status_p = OUTSIDE;
+  else
+    status_p = INSIDE;
+
+  xformPnt(cp);
+  return 1.0;
+}
+
 float
 RigidScan::color_along_line_of_sight(const Pnt3 &p, float rgb[3])
 { return 0.0f; }
@@ -42,6 +42,7 @@
 #include "Pnt3.h"
 class VertexFilter;
 class MeshTransport;
+class TriBVH;
 
 typedef unsigned char uchar;
 
@@ -99,6 +100,12 @@ public:
   virtual int  num_vertices(void);
   virtual void subsample_points(float rate, vector<Pnt3> &p,
 				vector<Pnt3> &n);
+  // about rate*num_vertices() points spread evenly over the
+  // directions of their normals (see NormalSpace.h); the
+  // default buckets all the points on every call, scans that
+  // keep the buckets around override it
+  virtual void subsample_normal_space(float rate, vector<Pnt3> &p,
+				      vector<Pnt3> &n);
   virtual RigidScan* filtered_copy(const VertexFilter &filter);
   virtual bool filter_inplace(const VertexFilter &filter);
   virtual bool filter_vertices (const VertexFilter& filter, vector<Pnt3>& p);
@@ -129,6 +136,41 @@ public:
 		  Pnt3 &cl_pnt, Pnt3 &cl_nrm,
 		  float thr = 1e33, bool bdry_ok = 0);
 
+  // batched version of the above for count query points:
+  // found[i] tells whether cl_pnt[i], cl_nrm[i] are valid.
+  // The default just loops over closest_point(); scans with
+  // a thread-safe search override it to split the batch
+  // across the worker pool.
+  // eps > 0 allows approximate answers, at most (1+eps) times
+  // farther than the closest point (ignored by the default).
+  virtual void
+    closest_points(const Pnt3 *p, const Pnt3 *n, int count,
+		   Pnt3 *cl_pnt, Pnt3 *cl_nrm, bool *found,
+		   float thr = 1e33, bool bdry_ok = 0,
+		   float eps = 0);
+
+  // Projective data association, for scans that come from an
+  // organized range grid: each p is projected into the grid
+  // with the scanner model, and only the samples within window
+  // cells of it are looked at.  Same arguments and results as
+  // closest_points(), except that the answer is the closest
+  // point within the window.  Returns false (without looking
+  // for anything) if the scan can't do this; the caller should
+  // then use closest_points().
+  virtual bool
+    projective_points(const Pnt3 *p, const Pnt3 *n, int count,
+		      Pnt3 *cl_pnt, Pnt3 *cl_nrm, bool *found,
+		      float thr = 1e33, bool bdry_ok = 0,
+		      int window = 2);
+
+  // Build the search structures (kd-tree) of resolution level
+  // iRes ahead of time, if that level is in memory, so that
+  // switching to it later doesn't have to wait for them.
+  // Only touches that level's own data: it can run on a worker
+  // thread while another level is being searched.  The default
+  // does nothing (the structures get built on first use).
+  virtual void prepare_search(int iRes);
+
 #if 0   // unused, never overridden, causes compile warnings
   // for something else...
   virtual float
@@ -153,6 +195,17 @@ public:
   virtual float
   color_along_line_of_sight(const Pnt3 &p, uchar rgb[3]);
 
+protected:
+  // The above for scans that keep a TriBVH of their mesh (in
+  // the scan's own coordinates); p is in front of the surface
+  // (OUTSIDE) if it's on the normal side of the nearest triangle.
+  float closest_point_on_bvh(const TriBVH *bvh, const Pnt3 &p,
+			     Pnt3 &cp, OccSt &status_p);
+  float closest_along_line_on_bvh(const TriBVH *bvh, const Pnt3 &p,
+				  const Pnt3 &dir, Pnt3 &cp,
+				  OccSt &status_p);
+public:
+
   //////////////////////////////////////////////////////////////
   // File I/O
   //////////////////////////////////////////////////////////////
@@ -1168,8 +1168,8 @@ SDfile::find_data(float screw, float y_in,
   //SHOW(25*frame_pitch);
   //rowf -= 25;
 
-  float rowfloor = floor(row);
-  float frac = row - rowfloor;
+  float rowfloor = floor(rowf);
+  float frac = rowf - rowfloor;
   // if frac: [0.0,.25] -> even field
   //          (.25,.75] -> odd field
   //          (.75,1.0) -> next row even field
@@ -1202,6 +1202,39 @@ SDfile::find_data(float screw, float y_in,
 }
 
 
+void
+SDfile::find_cell(float screw, float y_in, int &row, int &col)
+{
+  // as in find_data(), but don't care about the field
+  float rowf = (screw - scan_screw) / frame_pitch + .5*n_frames-.25;
+  row = int(floor(rowf + .5));
+  col = int(floor(y_in + .5));
+}
+
+
+int
+SDfile::data_index(int row, int col)
+{
+  if (row < 0 || row >= n_frames)
+    return -1;
+  if (col < first_good[row] || col >= first_bad[row])
+    return -1;
+  return row_start[row] + col - first_good[row];
+}
+
+
+void
+SDfile::valid_point_index(vector<int> &index)
+{
+  index.resize(n_pts);
+  int cnt = 0;
+  for (int i = 0; i < n_pts; i++) {
+    if (z_data[i]) index[i] = cnt++;
+    else           index[i] = -1;
+  }
+}
+
+
 int
 SDfile::count_valid_pnts(void)
 {
@@ -122,6 +122,15 @@ public:
 
   int  count_valid_pnts(void);
 
+  // for the projective search: the grid cell nearest to the
+  // raw coordinates screw, y_in (as from CyberXform::back_project)
+  void find_cell(float screw, float y_in, int &row, int &col);
+  // index to the raw data at row, col; -1 if there's none
+  int  data_index(int row, int col);
+  // for each raw data value, its index among the valid points
+  // (in the order of get_pnts_and_intensities()), or -1
+  void valid_point_index(vector<int> &index);
+
   void filtered_copy(const VertexFilter &filter,
 		     SDfile &sdnew);
   void get_piece(int firstFrame, int lastFrame,
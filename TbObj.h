@@ -49,6 +49,19 @@ public:
   static void  redo(void);
   static void  clear_undo(TbObj* objToRemove = NULL);
 
+  // While one of these is around, moves are saved for undo as
+  // usual; when it goes, the undo (and redo) history is put
+  // back as it was, so that moves that are taken back anyway
+  // (benchmarks) neither show up in it nor wipe out the redos.
+  class UndoHold {
+  public:
+    UndoHold(void) : stack(undo_stack), size(real_size) {}
+    ~UndoHold(void) { undo_stack = stack;  real_size = size; }
+  private:
+    vector<TbRedoInfo> stack;
+    int                size;
+  };
+
   const Pnt3  &localCenter(void)      { return rot_ctr; }
   Pnt3         worldCenter(void);
 
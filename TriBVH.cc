@@ -0,0 +1,669 @@
+//############################################################
+// TriBVH.cc
+//############################################################
+
+#include <iostream>
+#include <cassert>
+#include <stdlib.h>
+#include <float.h>
+#include <algorithm>
+#include "TriBVH.h"
+
+#define SAH_BINS      12
+#define MAX_LEAF_TRIS (2*TRIBVH_PACKET)
+// below this depth splits are by the heuristic, deeper ones
+// just halve the triangles; keeps the search stack bounded
+#define MAX_SAH_DEPTH 96
+#define STACK_SIZE    (MAX_SAH_DEPTH + 64)
+
+
+TriBVH *
+create_TriBVH(const Pnt3 *pts, const int *inds, int n)
+{
+  assert(n%3==0);
+  if (n == 0) return NULL;
+  cout << "Creating triangle BVH (" << n/3 << " triangles)..." << flush;
+  TriBVH *ret = new TriBVH(pts, inds, n);
+  cout << " done." << endl;
+  return ret;
+}
+
+
+TriBVH::TriBVH(const Pnt3 *pts, const int *inds, int n)
+{
+  build(pts, inds, n);
+}
+
+
+TriBVH::~TriBVH()
+{
+}
+
+
+//////////////////////////////////////////////////////////////
+// Building
+//////////////////////////////////////////////////////////////
+
+struct TriRef {
+  float min[3], max[3];
+  float ctr[3];   // of the bounding box
+  int   tri;
+};
+
+
+struct BinBox {
+  float min[3], max[3];
+  int   n;
+
+  BinBox(void) { clear(); }
+  void clear(void)
+    {
+      n = 0;
+      for (int i = 0; i < 3; i++) { min[i] = FLT_MAX; max[i] = -FLT_MAX; }
+    }
+  void add(const float *mn, const float *mx)
+    {
+      for (int i = 0; i < 3; i++) {
+	if (mn[i] < min[i]) min[i] = mn[i];
+	if (mx[i] > max[i]) max[i] = mx[i];
+      }
+    }
+  void add(const BinBox &b)
+    {
+      if (b.n) { add(b.min, b.max); n += b.n; }
+    }
+  float area(void) const
+    {
+      if (!n) return 0;
+      float dx = max[0]-min[0], dy = max[1]-min[1], dz = max[2]-min[2];
+      return 2.0 * (dx*dy + dy*dz + dz*dx);
+    }
+};
+
+
+struct CtrLess {
+  int d;
+  CtrLess(int dim) : d(dim) {}
+  bool operator()(const TriRef &a, const TriRef &b) const
+    { return a.ctr[d] < b.ctr[d]; }
+};
+
+
+struct InBin {
+  int d, bin;
+  float cmin, scale;
+  InBin(int dim, int b, float mn, float sc)
+    : d(dim), bin(b), cmin(mn), scale(sc) {}
+  bool operator()(const TriRef &r) const
+    {
+      int k = (int)((r.ctr[d] - cmin) * scale);
+      if (k >= SAH_BINS) k = SAH_BINS-1;
+      return k <= bin;
+    }
+};
+
+
+// best SAH split of refs[0..n), returns the number of refs
+// that go to the left child, or 0 if a leaf is better
+static int
+sah_split(TriRef *refs, int n, const BinBox &box, int depth)
+{
+  if (n <= TRIBVH_PACKET) return 0;
+
+  float cmin[3], cmax[3];
+  for (int d = 0; d < 3; d++) { cmin[d] = FLT_MAX; cmax[d] = -FLT_MAX; }
+  for (int i = 0; i < n; i++) {
+    for (int d = 0; d < 3; d++) {
+      if (refs[i].ctr[d] < cmin[d]) cmin[d] = refs[i].ctr[d];
+      if (refs[i].ctr[d] > cmax[d]) cmax[d] = refs[i].ctr[d];
+    }
+  }
+
+  int   bestAxis = -1, bestBin = 0;
+  float bestCost = FLT_MAX;
+  if (depth < MAX_SAH_DEPTH) {
+    for (int d = 0; d < 3; d++) {
+      float ext = cmax[d] - cmin[d];
+      if (ext <= 0) continue;
+      float scale = SAH_BINS / ext;
+      BinBox bins[SAH_BINS];
+      for (int i = 0; i < n; i++) {
+	int k = (int)((refs[i].ctr[d] - cmin[d]) * scale);
+	if (k >= SAH_BINS) k = SAH_BINS-1;
+	bins[k].add(refs[i].min, refs[i].max);
+	bins[k].n++;
+      }
+      // sweep from the right to get the right-hand costs,
+      // then from the left to combine
+      float  rightCost[SAH_BINS];
+      BinBox acc;
+      for (int k = SAH_BINS-1; k > 0; k--) {
+	acc.add(bins[k]);
+	rightCost[k] = acc.area() * acc.n;
+      }
+      acc.clear();
+      for (int k = 0; k < SAH_BINS-1; k++) {
+	acc.add(bins[k]);
+	if (!acc.n || acc.n == n) continue;
+	float cost = acc.area() * acc.n + rightCost[k+1];
+	if (cost < bestCost) {
+	  bestCost = cost; bestAxis = d; bestBin = k;
+	}
+      }
+    }
+  }
+
+  if (bestAxis >= 0) {
+    // compare against testing all of them (the cost of
+    // visiting the children counts as about one triangle)
+    if (bestCost + box.area() >= box.area() * n && n <= MAX_LEAF_TRIS)
+      return 0;
+    float scale = SAH_BINS / (cmax[bestAxis] - cmin[bestAxis]);
+    TriRef *mid = partition(refs, refs+n,
+			    InBin(bestAxis, bestBin, cmin[bestAxis], scale));
+    int left = mid - refs;
+    if (left > 0 && left < n) return left;
+  }
+
+  // all centers in the same spot, or too deep: halve along
+  // the longest axis of the centers
+  if (n <= MAX_LEAF_TRIS) return 0;
+  int d = 0;
+  for (int i = 1; i < 3; i++)
+    if (cmax[i]-cmin[i] > cmax[d]-cmin[d]) d = i;
+  nth_element(refs, refs + n/2, refs + n, CtrLess(d));
+  return n/2;
+}
+
+
+static void
+set_lane(TriBVHpacket &pk, int lane, int tri,
+	 const Pnt3 &a, const Pnt3 &b, const Pnt3 &c)
+{
+  Pnt3 e0 = b - a, e1 = c - a, e2 = c - b;
+  pk.ax[lane]  = a[0];  pk.ay[lane]  = a[1];  pk.az[lane]  = a[2];
+  pk.e0x[lane] = e0[0]; pk.e0y[lane] = e0[1]; pk.e0z[lane] = e0[2];
+  pk.e1x[lane] = e1[0]; pk.e1y[lane] = e1[1]; pk.e1z[lane] = e1[2];
+  float l;
+  pk.ie0[lane] = (l = e0.norm2()) > 0 ? 1.0/l : 0;
+  pk.ie1[lane] = (l = e1.norm2()) > 0 ? 1.0/l : 0;
+  pk.ie2[lane] = (l = e2.norm2()) > 0 ? 1.0/l : 0;
+  pk.in[lane]  = (l = cross(e0, e1).norm2()) > 0 ? 1.0/l : 0;
+  pk.tri[lane] = tri;
+}
+
+
+// Nodes are split depth first; both children of a node are
+// appended together, after their parent.
+void
+TriBVH::build(const Pnt3 *pts, const int *inds, int n)
+{
+  nTris = n / 3;
+  vector<TriRef> refs(nTris);
+  BinBox rootBox;
+  for (int i = 0; i < nTris; i++) {
+    TriRef &r = refs[i];
+    const Pnt3 &a = pts[inds[3*i]];
+    const Pnt3 &b = pts[inds[3*i+1]];
+    const Pnt3 &c = pts[inds[3*i+2]];
+    for (int d = 0; d < 3; d++) {
+      r.min[d] = min(a[d], min(b[d], c[d]));
+      r.max[d] = max(a[d], max(b[d], c[d]));
+      r.ctr[d] = .5 * (r.min[d] + r.max[d]);
+    }
+    r.tri = i;
+    rootBox.add(r.min, r.max);
+  }
+  rootBox.n = nTris;
+
+  struct pending { int node, begin, n, depth; BinBox box; };
+  vector<pending> stack;
+  nodes.reserve(2 * (nTris / TRIBVH_PACKET + 1));
+  packets.reserve(nTris / (TRIBVH_PACKET/2) + 1);
+  nodes.push_back(TriBVHnode());
+  pending root = { 0, 0, nTris, 0, rootBox };
+  stack.push_back(root);
+
+  while (stack.size()) {
+    pending pn = stack.back();
+    stack.pop_back();
+    TriRef *r = &refs[pn.begin];
+    TriBVHnode &nd = nodes[pn.node];
+    for (int d = 0; d < 3; d++) {
+      nd.min[d] = pn.box.min[d];
+      nd.max[d] = pn.box.max[d];
+    }
+
+    int left = sah_split(r, pn.n, pn.box, pn.depth);
+    if (left) {
+      pending c[2] = { { 0, pn.begin,      left,        pn.depth+1 },
+		       { 0, pn.begin+left, pn.n - left, pn.depth+1 } };
+      for (int i = 0; i < left; i++)
+	c[0].box.add(r[i].min, r[i].max);
+      for (int i = left; i < pn.n; i++)
+	c[1].box.add(r[i].min, r[i].max);
+      c[0].box.n = left;
+      c[1].box.n = pn.n - left;
+      nd.first = nodes.size();
+      nd.count = 0;
+      c[0].node = nd.first;
+      c[1].node = nd.first + 1;
+      // nd is invalid after this
+      nodes.push_back(TriBVHnode());
+      nodes.push_back(TriBVHnode());
+      stack.push_back(c[1]);
+      stack.push_back(c[0]);
+    } else {
+      // a leaf, copy the triangles into packets
+      nd.first = packets.size();
+      nd.count = (pn.n + TRIBVH_PACKET-1) / TRIBVH_PACKET;
+      for (int k = 0; k < pn.n; k += TRIBVH_PACKET) {
+	packets.push_back(TriBVHpacket());
+	TriBVHpacket &pk = packets.back();
+	for (int j = 0; j < TRIBVH_PACKET; j++) {
+	  int t = r[min(k + j, pn.n - 1)].tri;
+	  set_lane(pk, j, t, pts[inds[3*t]], pts[inds[3*t+1]],
+		   pts[inds[3*t+2]]);
+	}
+      }
+    }
+  }
+}
+
+
+//////////////////////////////////////////////////////////////
+// Point to triangle distance
+//
+// For each triangle of a packet: if p projects inside the
+// triangle, the distance is the distance to its plane,
+// otherwise the distance to the closest of its three edges.
+// This has no branches, so all lanes are computed together.
+// The kernels update d2 and return the lane of the closest
+// triangle if it's closer than d2 was, else -1.  Ties go to
+// the lower lane in all versions.
+//////////////////////////////////////////////////////////////
+
+static int
+packet_scan_scalar(const TriBVHpacket &pk, const float *p, float &d2)
+{
+  int best = -1;
+  for (int j = 0; j < TRIBVH_PACKET; j++) {
+    float e0[3] = { pk.e0x[j], pk.e0y[j], pk.e0z[j] };
+    float e1[3] = { pk.e1x[j], pk.e1y[j], pk.e1z[j] };
+    float e2[3] = { e1[0]-e0[0], e1[1]-e0[1], e1[2]-e0[2] };
+    float ap[3] = { p[0]-pk.ax[j], p[1]-pk.ay[j], p[2]-pk.az[j] };
+    float bp[3] = { ap[0]-e0[0], ap[1]-e0[1], ap[2]-e0[2] };
+    float cp[3] = { ap[0]-e1[0], ap[1]-e1[1], ap[2]-e1[2] };
+    float n[3]  = { e0[1]*e1[2] - e0[2]*e1[1],
+		    e0[2]*e1[0] - e0[0]*e1[2],
+		    e0[0]*e1[1] - e0[1]*e1[0] };
+
+    // which side of each edge, (edge x (p - start)) . n
+    float c0 = (e0[1]*ap[2]-e0[2]*ap[1])*n[0] +
+      (e0[2]*ap[0]-e0[0]*ap[2])*n[1] + (e0[0]*ap[1]-e0[1]*ap[0])*n[2];
+    float c1 = (e2[1]*bp[2]-e2[2]*bp[1])*n[0] +
+      (e2[2]*bp[0]-e2[0]*bp[2])*n[1] + (e2[0]*bp[1]-e2[1]*bp[0])*n[2];
+    float c2 = (cp[1]*e1[2]-cp[2]*e1[1])*n[0] +
+      (cp[2]*e1[0]-cp[0]*e1[2])*n[1] + (cp[0]*e1[1]-cp[1]*e1[0])*n[2];
+
+    float l;
+    if (c0 >= 0 && c1 >= 0 && c2 >= 0 && pk.in[j] > 0) {
+      float dn = ap[0]*n[0] + ap[1]*n[1] + ap[2]*n[2];
+      l = dn*dn*pk.in[j];
+    } else {
+      float t, v[3], s;
+      t = (ap[0]*e0[0] + ap[1]*e0[1] + ap[2]*e0[2]) * pk.ie0[j];
+      t = min(max(t, 0.0f), 1.0f);
+      v[0] = ap[0]-t*e0[0]; v[1] = ap[1]-t*e0[1]; v[2] = ap[2]-t*e0[2];
+      l = v[0]*v[0] + v[1]*v[1] + v[2]*v[2];
+      t = (ap[0]*e1[0] + ap[1]*e1[1] + ap[2]*e1[2]) * pk.ie1[j];
+      t = min(max(t, 0.0f), 1.0f);
+      v[0] = ap[0]-t*e1[0]; v[1] = ap[1]-t*e1[1]; v[2] = ap[2]-t*e1[2];
+      s = v[0]*v[0] + v[1]*v[1] + v[2]*v[2];
+      l = min(l, s);
+      t = (bp[0]*e2[0] + bp[1]*e2[1] + bp[2]*e2[2]) * pk.ie2[j];
+      t = min(max(t, 0.0f), 1.0f);
+      v[0] = bp[0]-t*e2[0]; v[1] = bp[1]-t*e2[1]; v[2] = bp[2]-t*e2[2];
+      s = v[0]*v[0] + v[1]*v[1] + v[2]*v[2];
+      l = min(l, s);
+    }
+    if (l < d2) { d2 = l; best = j; }
+  }
+  return best;
+}
+
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BVH_X86_SIMD 1
+#include <immintrin.h>
+
+// the same computation on W lanes at a time; V is the vector
+// type, the macros map to its intrinsics
+#define PACKET_BODY(V, LOAD, SET1, ADD, SUB, MUL, MIN, MAX,		\
+		    GE, GT, AND, BLEND, ZERO, ONE, OFS)			\
+  V px = SET1(p[0]), py = SET1(p[1]), pz = SET1(p[2]);		\
+  V e0x = LOAD(pk.e0x+OFS), e0y = LOAD(pk.e0y+OFS), e0z = LOAD(pk.e0z+OFS); \
+  V e1x = LOAD(pk.e1x+OFS), e1y = LOAD(pk.e1y+OFS), e1z = LOAD(pk.e1z+OFS); \
+  V e2x = SUB(e1x,e0x), e2y = SUB(e1y,e0y), e2z = SUB(e1z,e0z);	\
+  V apx = SUB(px, LOAD(pk.ax+OFS));					\
+  V apy = SUB(py, LOAD(pk.ay+OFS));					\
+  V apz = SUB(pz, LOAD(pk.az+OFS));					\
+  V bpx = SUB(apx,e0x), bpy = SUB(apy,e0y), bpz = SUB(apz,e0z);	\
+  V cpx = SUB(apx,e1x), cpy = SUB(apy,e1y), cpz = SUB(apz,e1z);	\
+  V nx = SUB(MUL(e0y,e1z), MUL(e0z,e1y));				\
+  V ny = SUB(MUL(e0z,e1x), MUL(e0x,e1z));				\
+  V nz = SUB(MUL(e0x,e1y), MUL(e0y,e1x));				\
+  V c0 = ADD(ADD(MUL(SUB(MUL(e0y,apz), MUL(e0z,apy)), nx),		\
+		 MUL(SUB(MUL(e0z,apx), MUL(e0x,apz)), ny)),		\
+	     MUL(SUB(MUL(e0x,apy), MUL(e0y,apx)), nz));		\
+  V c1 = ADD(ADD(MUL(SUB(MUL(e2y,bpz), MUL(e2z,bpy)), nx),		\
+		 MUL(SUB(MUL(e2z,bpx), MUL(e2x,bpz)), ny)),		\
+	     MUL(SUB(MUL(e2x,bpy), MUL(e2y,bpx)), nz));		\
+  V c2 = ADD(ADD(MUL(SUB(MUL(cpy,e1z), MUL(cpz,e1y)), nx),		\
+		 MUL(SUB(MUL(cpz,e1x), MUL(cpx,e1z)), ny)),		\
+	     MUL(SUB(MUL(cpx,e1y), MUL(cpy,e1x)), nz));		\
+  V in = LOAD(pk.in+OFS);						\
+  V inside = AND(AND(GE(c0,ZERO), GE(c1,ZERO)),			\
+		 AND(GE(c2,ZERO), GT(in,ZERO)));			\
+  V dn = ADD(ADD(MUL(apx,nx), MUL(apy,ny)), MUL(apz,nz));		\
+  V dplane = MUL(MUL(dn,dn), in);					\
+  V t, vx, vy, vz, s, l;						\
+  t = MUL(ADD(ADD(MUL(apx,e0x), MUL(apy,e0y)), MUL(apz,e0z)),	\
+	  LOAD(pk.ie0+OFS));						\
+  t = MIN(MAX(t, ZERO), ONE);						\
+  vx = SUB(apx, MUL(t,e0x)); vy = SUB(apy, MUL(t,e0y));		\
+  vz = SUB(apz, MUL(t,e0z));						\
+  l = ADD(ADD(MUL(vx,vx), MUL(vy,vy)), MUL(vz,vz));			\
+  t = MUL(ADD(ADD(MUL(apx,e1x), MUL(apy,e1y)), MUL(apz,e1z)),	\
+	  LOAD(pk.ie1+OFS));						\
+  t = MIN(MAX(t, ZERO), ONE);						\
+  vx = SUB(apx, MUL(t,e1x)); vy = SUB(apy, MUL(t,e1y));		\
+  vz = SUB(apz, MUL(t,e1z));						\
+  s = ADD(ADD(MUL(vx,vx), MUL(vy,vy)), MUL(vz,vz));			\
+  l = MIN(l, s);							\
+  t = MUL(ADD(ADD(MUL(bpx,e2x), MUL(bpy,e2y)), MUL(bpz,e2z)),	\
+	  LOAD(pk.ie2+OFS));						\
+  t = MIN(MAX(t, ZERO), ONE);						\
+  vx = SUB(bpx, MUL(t,e2x)); vy = SUB(bpy, MUL(t,e2y));		\
+  vz = SUB(bpz, MUL(t,e2z));						\
+  s = ADD(ADD(MUL(vx,vx), MUL(vy,vy)), MUL(vz,vz));			\
+  l = MIN(l, s);							\
+  l = BLEND(l, dplane, inside);
+
+
+__attribute__((target("avx2"))) static int
+packet_scan_avx2(const TriBVHpacket &pk, const float *p, float &d2)
+{
+  __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.0f);
+#define GE256(a,b) _mm256_cmp_ps(a, b, _CMP_GE_OQ)
+#define GT256(a,b) _mm256_cmp_ps(a, b, _CMP_GT_OQ)
+  PACKET_BODY(__m256, _mm256_loadu_ps, _mm256_set1_ps, _mm256_add_ps,
+	      _mm256_sub_ps, _mm256_mul_ps, _mm256_min_ps, _mm256_max_ps,
+	      GE256, GT256, _mm256_and_ps, _mm256_blendv_ps,
+	      zero, one, 0)
+#undef GE256
+#undef GT256
+  int m = _mm256_movemask_ps(_mm256_cmp_ps(l, _mm256_set1_ps(d2),
+					   _CMP_LT_OQ));
+  if (!m) return -1;
+  float lv[8];
+  _mm256_storeu_ps(lv, l);
+  int best = -1;
+  for (int j = 0; j < 8; j++) {
+    if (((m >> j) & 1) && lv[j] < d2) { d2 = lv[j]; best = j; }
+  }
+  return best;
+}
+
+
+__attribute__((target("sse4.1"))) static int
+packet_scan_sse4(const TriBVHpacket &pk, const float *p, float &d2)
+{
+  __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+  int best = -1;
+  for (int h = 0; h < TRIBVH_PACKET; h += 4) {
+    PACKET_BODY(__m128, _mm_loadu_ps, _mm_set1_ps, _mm_add_ps,
+		_mm_sub_ps, _mm_mul_ps, _mm_min_ps, _mm_max_ps,
+		_mm_cmpge_ps, _mm_cmpgt_ps, _mm_and_ps, _mm_blendv_ps,
+		zero, one, h)
+    int m = _mm_movemask_ps(_mm_cmplt_ps(l, _mm_set1_ps(d2)));
+    if (!m) continue;
+    float lv[4];
+    _mm_storeu_ps(lv, l);
+    for (int j = 0; j < 4; j++) {
+      if (((m >> j) & 1) && lv[j] < d2) { d2 = lv[j]; best = h+j; }
+    }
+  }
+  return best;
+}
+#undef PACKET_BODY
+#endif
+
+
+typedef int (*PacketScanFn)(const TriBVHpacket &, const float *, float &);
+
+static PacketScanFn
+pick_packet_scan(void)
+{
+#ifdef BVH_X86_SIMD
+  // SCANALYZE_NO_SIMD forces the scalar loop (for comparisons)
+  if (getenv("SCANALYZE_NO_SIMD")) return packet_scan_scalar;
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))   return packet_scan_avx2;
+  if (__builtin_cpu_supports("sse4.1")) return packet_scan_sse4;
+#endif
+  return packet_scan_scalar;
+}
+
+static PacketScanFn packet_scan = pick_packet_scan();
+
+
+// the point on one triangle of a packet closest to p, the
+// same way the kernels compute the distance
+void
+TriBVH::closest_on_tri(const TriBVHpacket &pk, int j,
+		       const Pnt3 &p, Pnt3 &cp) const
+{
+  Pnt3 a(pk.ax[j], pk.ay[j], pk.az[j]);
+  Pnt3 e0(pk.e0x[j], pk.e0y[j], pk.e0z[j]);
+  Pnt3 e1(pk.e1x[j], pk.e1y[j], pk.e1z[j]);
+  Pnt3 e2 = e1 - e0;
+  Pnt3 ap = p - a;
+  Pnt3 bp = ap - e0;
+  Pnt3 n  = cross(e0, e1);
+
+  if (dot(cross(e0, ap), n) >= 0 &&
+      dot(cross(e2, bp), n) >= 0 &&
+      dot(cross(ap - e1, e1), n) >= 0 && pk.in[j] > 0) {
+    cp = p - n * (dot(ap, n) * pk.in[j]);
+    return;
+  }
+
+  float best = FLT_MAX;
+  const Pnt3 *start[3] = { &a, &a, NULL };
+  Pnt3 b = a + e0;
+  start[2] = &b;
+  const Pnt3 *edge[3]  = { &e0, &e1, &e2 };
+  float       inv[3]   = { pk.ie0[j], pk.ie1[j], pk.ie2[j] };
+  for (int i = 0; i < 3; i++) {
+    Pnt3 sp = p - *start[i];
+    float t = dot(sp, *edge[i]) * inv[i];
+    t = min(max(t, 0.0f), 1.0f);
+    Pnt3 q = *start[i] + *edge[i] * t;
+    float l = dist2(p, q);
+    if (l < best) { best = l; cp = q; }
+  }
+}
+
+
+Pnt3
+TriBVH::tri_normal(const TriBVHpacket &pk, int j) const
+{
+  Pnt3 n = cross(Pnt3(pk.e0x[j], pk.e0y[j], pk.e0z[j]),
+		 Pnt3(pk.e1x[j], pk.e1y[j], pk.e1z[j]));
+  if (pk.in[j] > 0) n *= sqrtf(pk.in[j]);
+  return n;
+}
+
+
+static inline float
+box_dist2(const TriBVHnode &nd, const Pnt3 &p)
+{
+  float d2 = 0;
+  for (int i = 0; i < 3; i++) {
+    float d = 0;
+    if      (p[i] < nd.min[i]) d = nd.min[i] - p[i];
+    else if (p[i] > nd.max[i]) d = p[i] - nd.max[i];
+    d2 += d*d;
+  }
+  return d2;
+}
+
+
+bool
+TriBVH::closest_point(const Pnt3 &p, Pnt3 &cp, float &d,
+		      Pnt3 *nrm, float eps) const
+{
+  if (nodes.empty()) return false;
+
+  // with eps > 0, skip boxes unless they're closer than
+  // d/(1+eps)
+  float shrink2 = 1.0 / ((1.0+eps)*(1.0+eps));
+  float d2 = d*d;
+  const TriBVHpacket *bestPk = NULL;
+  int   bestLane = -1;
+
+  int stack[STACK_SIZE];
+  int sp = 0;
+  stack[sp++] = 0;
+  while (sp) {
+    const TriBVHnode &nd = nodes[stack[--sp]];
+    if (box_dist2(nd, p) >= d2 * shrink2) continue;
+
+    if (nd.count) {
+      for (int k = 0; k < nd.count; k++) {
+	const TriBVHpacket &pk = packets[nd.first + k];
+	int j = packet_scan(pk, &p[0], d2);
+	if (j >= 0) { bestPk = &pk; bestLane = j; }
+      }
+      continue;
+    }
+
+    // visit the closer child first: push it last
+    int   c0 = nd.first, c1 = nd.first + 1;
+    float b0 = box_dist2(nodes[c0], p);
+    float b1 = box_dist2(nodes[c1], p);
+    if (b0 > b1) { swap(c0, c1); swap(b0, b1); }
+    if (b1 < d2 * shrink2) stack[sp++] = c1;
+    if (b0 < d2 * shrink2) stack[sp++] = c0;
+  }
+
+  if (bestPk == NULL) return false;
+  closest_on_tri(*bestPk, bestLane, p, cp);
+  d = sqrtf(d2);
+  if (nrm) *nrm = tri_normal(*bestPk, bestLane);
+  return true;
+}
+
+
+//////////////////////////////////////////////////////////////
+// Line queries
+//////////////////////////////////////////////////////////////
+
+// the range of t where the line is in the box, false if
+// it misses
+static inline bool
+line_box(const TriBVHnode &nd, const Pnt3 &o, const Pnt3 &idir,
+	 const Pnt3 &dir, float &t0, float &t1)
+{
+  t0 = -FLT_MAX; t1 = FLT_MAX;
+  for (int i = 0; i < 3; i++) {
+    if (dir[i] == 0) {
+      if (o[i] < nd.min[i] || o[i] > nd.max[i]) return false;
+      continue;
+    }
+    float a = (nd.min[i] - o[i]) * idir[i];
+    float b = (nd.max[i] - o[i]) * idir[i];
+    if (a > b) swap(a, b);
+    if (a > t0) t0 = a;
+    if (b < t1) t1 = b;
+  }
+  return t0 <= t1;
+}
+
+
+// the smallest |t| within [t0, t1]
+static inline float
+closest_t(float t0, float t1)
+{
+  if (t0 <= 0 && t1 >= 0) return 0;
+  return (t0 > 0) ? t0 : -t1;
+}
+
+
+bool
+TriBVH::closest_along_line(const Pnt3 &o, const Pnt3 &dir,
+			   float &t, Pnt3 *nrm) const
+{
+  if (nodes.empty()) return false;
+
+  Pnt3 idir;
+  for (int i = 0; i < 3; i++)
+    idir[i] = (dir[i] != 0) ? 1.0 / dir[i] : 0;
+
+  float best = fabs(t), bestT = t;
+  const TriBVHpacket *bestPk = NULL;
+  int   bestLane = -1;
+
+  int stack[STACK_SIZE];
+  int sp = 0;
+  stack[sp++] = 0;
+  while (sp) {
+    const TriBVHnode &nd = nodes[stack[--sp]];
+    float t0, t1;
+    if (!line_box(nd, o, idir, dir, t0, t1) || closest_t(t0, t1) >= best)
+      continue;
+
+    if (nd.count) {
+      // Moller-Trumbore, without limiting t to a ray
+      for (int k = 0; k < nd.count; k++) {
+	const TriBVHpacket &pk = packets[nd.first + k];
+	for (int j = 0; j < TRIBVH_PACKET; j++) {
+	  Pnt3 e0(pk.e0x[j], pk.e0y[j], pk.e0z[j]);
+	  Pnt3 e1(pk.e1x[j], pk.e1y[j], pk.e1z[j]);
+	  Pnt3 h = cross(dir, e1);
+	  float det = dot(e0, h);
+	  if (det == 0) continue;
+	  float f = 1.0 / det;
+	  Pnt3 s = o - Pnt3(pk.ax[j], pk.ay[j], pk.az[j]);
+	  float u = f * dot(s, h);
+	  if (u < 0 || u > 1) continue;
+	  Pnt3 q = cross(s, e0);
+	  float v = f * dot(dir, q);
+	  if (v < 0 || u + v > 1) continue;
+	  float tt = f * dot(e1, q);
+	  if (fabs(tt) < best) {
+	    best = fabs(tt); bestT = tt;
+	    bestPk = &pk; bestLane = j;
+	  }
+	}
+      }
+      continue;
+    }
+
+    int   c[2] = { nd.first, nd.first + 1 };
+    float b[2] = { FLT_MAX, FLT_MAX };
+    for (int i = 0; i < 2; i++) {
+      if (line_box(nodes[c[i]], o, idir, dir, t0, t1))
+	b[i] = closest_t(t0, t1);
+    }
+    if (b[0] > b[1]) { swap(c[0], c[1]); swap(b[0], b[1]); }
+    if (b[1] < best) stack[sp++] = c[1];
+    if (b[0] < best) stack[sp++] = c[0];
+  }
+
+  if (bestPk == NULL) return false;
+  t = bestT;
+  if (nrm) *nrm = tri_normal(*bestPk, bestLane);
+  return true;
+}
@@ -0,0 +1,90 @@
+//############################################################
+// TriBVH.h
+//
+// A bounding volume hierarchy of axis aligned boxes over the
+// triangles of a mesh, for finding the closest point on the
+// mesh to a given point, or where a line hits the mesh.
+//
+// The hierarchy is built top-down with a binned surface area
+// heuristic, and stored flattened: the nodes live in one array
+// (the two children of a node are next to each other), and
+// the triangles are copied into the leaves in packets of 8,
+// stored component-wise so that a point can be tested against
+// all triangles of a packet at once (8 at a time with AVX2,
+// 4 with SSE4.1, picked at startup).
+//
+// The triangles are copied, so the mesh arrays the tree was
+// built from are not needed afterwards.
+//############################################################
+
+#ifndef _TRIBVH_H_
+#define _TRIBVH_H_
+#include "Pnt3.h"
+#include <vector>
+
+#define TRIBVH_PACKET 8
+
+struct TriBVHnode {
+  float min[3], max[3];  // bounds of the triangles below
+  int   first;   // inner node: index of child[0], child[1] is
+		 // first+1; leaf: index of its first packet
+  int   count;   // number of packets in the leaf, 0 for
+		 // inner nodes
+};
+
+// TRIBVH_PACKET triangles, as a corner a and the edges
+// e0 = b-a, e1 = c-a, along with the inverse squared lengths
+// of the edges (and of the e0 x e1 normal); 0 for degenerate
+// ones.  Packets that aren't full repeat their last triangle.
+struct TriBVHpacket {
+  float ax[TRIBVH_PACKET], ay[TRIBVH_PACKET], az[TRIBVH_PACKET];
+  float e0x[TRIBVH_PACKET], e0y[TRIBVH_PACKET], e0z[TRIBVH_PACKET];
+  float e1x[TRIBVH_PACKET], e1y[TRIBVH_PACKET], e1z[TRIBVH_PACKET];
+  float ie0[TRIBVH_PACKET], ie1[TRIBVH_PACKET], ie2[TRIBVH_PACKET];
+  float in[TRIBVH_PACKET];
+  int   tri[TRIBVH_PACKET];  // triangle number in the mesh
+};
+
+
+class TriBVH {
+private:
+
+  vector<TriBVHnode>   nodes;    // nodes[0] is the root
+  vector<TriBVHpacket> packets;
+  int                  nTris;
+
+  void   build(const Pnt3 *pts, const int *inds, int n);
+  void   closest_on_tri(const TriBVHpacket &pk, int lane,
+			const Pnt3 &p, Pnt3 &cp) const;
+  Pnt3   tri_normal(const TriBVHpacket &pk, int lane) const;
+
+public:
+
+  // inds has 3 vertex indices into pts per triangle,
+  // n is the length of inds
+  TriBVH(const Pnt3 *pts, const int *inds, int n);
+  ~TriBVH();
+
+  int num_tris(void) const { return nTris; }
+
+  // Find the closest point on the mesh to p, if it's closer
+  // than d.  On success, cp and d are updated, and nrm (if
+  // given) is set to the unit normal of the triangle cp is on.
+  // eps > 0 makes the search approximate as in KDtritree.
+  bool closest_point(const Pnt3 &p, Pnt3 &cp, float &d,
+		     Pnt3 *nrm = NULL, float eps = 0) const;
+
+  // Find where the line o + t*dir hits the mesh, taking the
+  // hit closest to o (in either direction) with |t| < |t| on
+  // input.  On success, t (and nrm if given) are updated.
+  bool closest_along_line(const Pnt3 &o, const Pnt3 &dir,
+			  float &t, Pnt3 *nrm = NULL) const;
+};
+
+
+// factory, same arguments as the constructor; prints what
+// it's doing, returns NULL for an empty mesh
+TriBVH *
+create_TriBVH(const Pnt3 *pts, const int *inds, int n);
+
+#endif
@@ -132,6 +132,70 @@ getVertexNormals(const vector<Pnt3> &vtx,
 }
 
 
+// normal of the least squares plane through pts[ind[0..n-1]]:
+// the eigenvector of the smallest eigenvalue of the scatter
+// matrix (Jacobi rotations), not oriented
+bool
+fit_plane_normal(const Pnt3 *pts, const int *ind, int n, Pnt3 &nrm)
+{
+  if (n < 3) return false;
+
+  double c[3] = {0,0,0};
+  int i, j, k;
+  for (i = 0; i < n; i++)
+    for (j = 0; j < 3; j++) c[j] += pts[ind[i]][j];
+  for (j = 0; j < 3; j++) c[j] /= n;
+
+  double a[3][3] = {{0,0,0},{0,0,0},{0,0,0}};
+  for (i = 0; i < n; i++) {
+    double d[3] = { pts[ind[i]][0] - c[0],
+		    pts[ind[i]][1] - c[1],
+		    pts[ind[i]][2] - c[2] };
+    for (j = 0; j < 3; j++)
+      for (k = 0; k < 3; k++) a[j][k] += d[j]*d[k];
+  }
+
+  double v[3][3] = {{1,0,0},{0,1,0},{0,0,1}};
+  for (int sweep = 0; sweep < 20; sweep++) {
+    double off = a[0][1]*a[0][1] + a[0][2]*a[0][2] + a[1][2]*a[1][2];
+    if (off < 1e-20 * (a[0][0]*a[0][0] + a[1][1]*a[1][1] +
+		       a[2][2]*a[2][2]))
+      break;
+    for (int p = 0; p < 2; p++) {
+      for (int q = p+1; q < 3; q++) {
+	if (a[p][q] == 0) continue;
+	double theta = .5 * (a[q][q] - a[p][p]) / a[p][q];
+	double t = 1.0 / (fabs(theta) + sqrt(theta*theta + 1));
+	if (theta < 0) t = -t;
+	double cs = 1.0 / sqrt(t*t + 1), sn = t * cs;
+	for (k = 0; k < 3; k++) {   // a = a * R
+	  double akp = a[k][p], akq = a[k][q];
+	  a[k][p] = cs*akp - sn*akq;
+	  a[k][q] = sn*akp + cs*akq;
+	}
+	for (k = 0; k < 3; k++) {   // a = R^T * a
+	  double apk = a[p][k], aqk = a[q][k];
+	  a[p][k] = cs*apk - sn*aqk;
+	  a[q][k] = sn*apk + cs*aqk;
+	}
+	for (k = 0; k < 3; k++) {   // v = v * R
+	  double vkp = v[k][p], vkq = v[k][q];
+	  v[k][p] = cs*vkp - sn*vkq;
+	  v[k][q] = sn*vkp + cs*vkq;
+	}
+      }
+    }
+  }
+
+  int m = 0;
+  if (a[1][1] < a[m][m]) m = 1;
+  if (a[2][2] < a[m][m]) m = 2;
+  nrm.set(v[0][m], v[1][m], v[2][m]);
+  nrm.normalize();
+  return true;
+}
+
+
 float
 median_edge_length(vector<Pnt3> &vtx,
 		   vector<int>  &tri,
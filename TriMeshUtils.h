@@ -27,6 +27,12 @@ getVertexNormals(const vector<Pnt3> &vtx,
 		 vector<short>      &nrm,
 		 int useArea = 0);
 
+// normal of the least squares plane through the n points
+// pts[ind[i]] (e.g., a neighbourhood from a KDindtree),
+// unit length but not oriented; false if n < 3
+bool
+fit_plane_normal(const Pnt3 *pts, const int *ind, int n, Pnt3 &nrm);
+
 void
 pushNormalAsShorts (vector<short>& nrms, Pnt3 n);
 
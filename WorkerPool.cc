@@ -0,0 +1,195 @@
+//############################################################
+//
+// WorkerPool.cc
+//
+// A small pool of worker threads shared by the rest of the
+// program.
+//
+//############################################################
+
+#include <stdlib.h>
+#include "WorkerPool.h"
+
+
+WorkerPool&
+WorkerPool::global(void)
+{
+  static WorkerPool pool;
+  return pool;
+}
+
+
+WorkerPool::WorkerPool(int n)
+  : nThreads(1), bStarted(false), bQuit(false)
+{
+  if (n <= 0) {
+    // SCANALYZE_THREADS overrides the hardware thread count
+    char *env = getenv("SCANALYZE_THREADS");
+    if (env) n = atoi(env);
+    if (n <= 0) n = thread::hardware_concurrency();
+  }
+  if (n < 1) n = 1;
+  nThreads = n;
+}
+
+
+WorkerPool::~WorkerPool(void)
+{
+  stop();
+}
+
+
+void
+WorkerPool::set_num_threads(int n)
+{
+  if (n < 1) n = 1;
+  if (n == nThreads) return;
+  stop();
+  nThreads = n;
+}
+
+
+void
+WorkerPool::start(void)
+{
+  unique_lock<mutex> l(lock);
+  if (bStarted) return;
+  bQuit = false;
+  // the calling thread counts as one of the workers
+  for (int i = 1; i < nThreads; i++)
+    threads.push_back(thread(&WorkerPool::worker, this));
+  bStarted = true;
+}
+
+
+void
+WorkerPool::stop(void)
+{
+  {
+    unique_lock<mutex> l(lock);
+    if (!bStarted) return;
+    bQuit = true;
+  }
+  wake.notify_all();
+  for (int i = 0; i < threads.size(); i++)
+    threads[i].join();
+  threads.clear();
+  bStarted = false;
+}
+
+
+void
+WorkerPool::enqueue(const Task &t)
+{
+  if (!bStarted) start();
+  {
+    unique_lock<mutex> l(lock);
+    queue.push_back(t);
+  }
+  wake.notify_one();
+}
+
+
+bool
+WorkerPool::run_pending(void)
+{
+  Task t;
+  {
+    unique_lock<mutex> l(lock);
+    if (queue.empty()) return false;
+    // newest first: keeps recursive splitting depth-first
+    t = queue.back();
+    queue.pop_back();
+  }
+  t();
+  return true;
+}
+
+
+void
+WorkerPool::worker(void)
+{
+  while (1) {
+    Task t;
+    {
+      unique_lock<mutex> l(lock);
+      while (queue.empty() && !bQuit)
+	wake.wait(l);
+      if (queue.empty()) return;  // quitting
+      // oldest first: hand out the biggest pieces to idle workers
+      t = queue.front();
+      queue.pop_front();
+    }
+    t();
+  }
+}
+
+
+void
+WorkerPool::parallel_for(int n, int grain,
+			 const function<void(int,int)> &fn)
+{
+  if (n <= 0) return;
+  if (grain < 1) grain = 1;
+  int nChunks = (n + grain - 1) / grain;
+  if (nThreads == 1 || nChunks == 1) {
+    fn(0, n);
+    return;
+  }
+
+  // chunks are handed out dynamically, so uneven work per
+  // item (e.g., kd-tree queries) still balances well
+  atomic<int> next(0);
+  function<void(void)> body = [&]() {
+    int c;
+    while ((c = next++) < nChunks) {
+      int b = c * grain;
+      int e = b + grain;
+      if (e > n) e = n;
+      fn(b, e);
+    }
+  };
+
+  TaskGroup tg(*this);
+  int nTasks = nThreads - 1;
+  if (nTasks > nChunks - 1) nTasks = nChunks - 1;
+  for (int i = 0; i < nTasks; i++)
+    tg.run(body);
+  body();
+  tg.wait();
+}
+
+
+TaskGroup::TaskGroup(WorkerPool &p)
+  : pool(p), pending(0)
+{
+}
+
+
+void
+TaskGroup::run(const WorkerPool::Task &t)
+{
+  pending++;
+  pool.enqueue([this, t]() {
+    t();
+    // decrement under the lock so that wait() cannot return
+    // (and the group go away) while we still touch it
+    unique_lock<mutex> l(lock);
+    if (--pending == 0) done.notify_all();
+  });
+}
+
+
+void
+TaskGroup::wait(void)
+{
+  while (pending > 0) {
+    // help out instead of just sleeping
+    if (pool.run_pending()) continue;
+    unique_lock<mutex> l(lock);
+    if (pending > 0)
+      done.wait_for(l, chrono::milliseconds(1));
+  }
+  // the last finisher may still hold the lock
+  unique_lock<mutex> l(lock);
+}
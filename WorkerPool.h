@@ -0,0 +1,95 @@
+//############################################################
+//
+// WorkerPool.h
+//
+// A small pool of worker threads shared by the rest of the
+// program.  Work is handed out either as independent tasks
+// (grouped in a TaskGroup that can be waited on) or as a
+// parallel loop over an index range.
+//
+// The pool is lazily started the first time it is used.
+// A thread waiting on a TaskGroup keeps executing queued
+// tasks, so nested parallelism (a task that itself runs a
+// parallel_for or spawns subtasks) cannot deadlock.
+//
+// Callers are responsible for making the work they hand out
+// thread safe; in particular, lazily built caches (kd-trees,
+// boundary flags, ...) should be built before the parallel
+// section is entered.
+//
+//############################################################
+
+#ifndef _WORKER_POOL_H_
+#define _WORKER_POOL_H_
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+
+using namespace std;
+
+
+class WorkerPool {
+public:
+  typedef function<void(void)> Task;
+
+  // the pool used by everybody
+  static WorkerPool& global(void);
+
+  // n <= 0 means one thread per hardware thread
+  WorkerPool(int n = 0);
+  ~WorkerPool(void);
+
+  // number of threads that take part in the work,
+  // including the calling thread
+  int  num_threads(void) const { return nThreads; }
+  void set_num_threads(int n);
+
+  // call fn(begin, end) on chunks of [0, n) of about grain
+  // items; blocks until all of the range has been processed
+  void parallel_for(int n, int grain,
+		    const function<void(int,int)> &fn);
+
+  // run one queued task, if there is one (used by waiters)
+  bool run_pending(void);
+
+private:
+  friend class TaskGroup;
+
+  void start(void);
+  void stop(void);
+  void enqueue(const Task &t);
+  void worker(void);
+
+  int                nThreads;
+  bool               bStarted;
+  bool               bQuit;
+  vector<thread>     threads;
+  deque<Task>        queue;
+  mutex              lock;
+  condition_variable wake;
+};
+
+
+// A set of tasks that can be waited on as a unit.
+// The waiting thread helps by executing pending tasks.
+class TaskGroup {
+public:
+  TaskGroup(WorkerPool &p = WorkerPool::global());
+  ~TaskGroup(void) { wait(); }
+
+  void run(const WorkerPool::Task &t);
+  void wait(void);
+
+private:
+  WorkerPool         &pool;
+  atomic<int>        pending;
+  mutex              lock;
+  condition_variable done;
+};
+
+#endif /* _WORKER_POOL_H_ */
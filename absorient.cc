@@ -31,6 +31,10 @@
 #include "transv.h"         /* transpose views */
 #include "lu.h"
 #include <float.h>
+#include <vector>
+#include <algorithm>
+#include "WorkerPool.h"
+#include "absorient.h"
 
 #ifdef WIN32
 #define cbrt(r)  (pow((r), 1./3))
@@ -700,6 +704,265 @@ chen_medioni(Pnt3 *ctr,     // control points (source)
   xf.getTranslation (q+4);
 }
 
+////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////
+////   Point-to-plane with robust weights starts     ////
+////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////
+
+// The sums of the normal equations: the upper triangle of
+// HtH row by row (21), HtP (6), then Sum{w r^2} and Sum{w}
+#define P2P_NSUM   29
+// pairs per block; a block is summed in float (per SIMD lane)
+// and then added to the double totals
+#define P2P_BLOCK  2048
+
+// weight of the residual r for the robust kind, k is the
+// tuning constant times the scale
+static inline float
+robust_weight(float r, int robust, float k)
+{
+  r = fabsf(r);
+  if (robust == robustHuber)
+    return (r <= k) ? 1.0f : k / r;
+  if (robust == robustTukey) {
+    float t = 1.0f - (r/k)*(r/k);
+    return (t > 0) ? t*t : 0.0f;
+  }
+  return 1.0f;
+}
+
+// add the weighted products of h[0..5] and r to the sums
+static inline void
+p2p_add(float *acc, const float h[6], float r, float w)
+{
+  int s = 0;
+  for (int i = 0; i < 6; i++) {
+    float wh = w * h[i];
+    for (int j = i; j < 6; j++)
+      acc[s++] += wh * h[j];
+  }
+  for (int i = 0; i < 6; i++)
+    acc[s++] += w * r * h[i];
+  acc[s++] += w * r * r;
+  acc[s]   += w;
+}
+
+static void
+p2p_block_scalar(const Pnt3 *ctr, const Pnt3 *srf, const Pnt3 *nrm,
+		 int n, const float cm[3], int robust, float k,
+		 double sums[P2P_NSUM])
+{
+  float acc[P2P_NSUM] = { 0 };
+  for (int i = 0; i < n; i++) {
+    const float *c = &ctr[i][0], *s = &srf[i][0], *m = &nrm[i][0];
+    float r = (s[0]-c[0])*m[0] + (s[1]-c[1])*m[1] + (s[2]-c[2])*m[2];
+    float x = c[0]-cm[0], y = c[1]-cm[1], z = c[2]-cm[2];
+    float h[6] = { y*m[2] - z*m[1], z*m[0] - x*m[2], x*m[1] - y*m[0],
+		   m[0], m[1], m[2] };
+    p2p_add(acc, h, r, robust_weight(r, robust, k));
+  }
+  for (int i = 0; i < P2P_NSUM; i++) sums[i] += acc[i];
+}
+
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define P2P_X86_SIMD 1
+#include <immintrin.h>
+
+// 8 pairs at a time: the pairs are transposed into lanes, and
+// each lane keeps its own sums, added up at the end of the
+// block
+__attribute__((target("avx2,fma"))) static void
+p2p_block_avx2(const Pnt3 *ctr, const Pnt3 *srf, const Pnt3 *nrm,
+	       int n, const float cm[3], int robust, float k,
+	       double sums[P2P_NSUM])
+{
+  __m256 acc[P2P_NSUM];
+  for (int i = 0; i < P2P_NSUM; i++) acc[i] = _mm256_setzero_ps();
+  __m256 one = _mm256_set1_ps(1.0f), zero = _mm256_setzero_ps();
+  __m256 K   = _mm256_set1_ps(k);
+  __m256 sgn = _mm256_set1_ps(-0.0f);
+
+  int n8 = n & ~7;
+  for (int b = 0; b < n8; b += 8) {
+    float t[9][8];
+    for (int j = 0; j < 8; j++) {
+      const float *c = &ctr[b+j][0], *s = &srf[b+j][0];
+      const float *m = &nrm[b+j][0];
+      t[0][j] = c[0]; t[1][j] = c[1]; t[2][j] = c[2];
+      t[3][j] = s[0]; t[4][j] = s[1]; t[5][j] = s[2];
+      t[6][j] = m[0]; t[7][j] = m[1]; t[8][j] = m[2];
+    }
+    __m256 cx = _mm256_loadu_ps(t[0]), cy = _mm256_loadu_ps(t[1]);
+    __m256 cz = _mm256_loadu_ps(t[2]);
+    __m256 mx = _mm256_loadu_ps(t[6]), my = _mm256_loadu_ps(t[7]);
+    __m256 mz = _mm256_loadu_ps(t[8]);
+    __m256 r = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(t[3]), cx), mx);
+    r = _mm256_fmadd_ps(_mm256_sub_ps(_mm256_loadu_ps(t[4]), cy), my, r);
+    r = _mm256_fmadd_ps(_mm256_sub_ps(_mm256_loadu_ps(t[5]), cz), mz, r);
+    __m256 x = _mm256_sub_ps(cx, _mm256_set1_ps(cm[0]));
+    __m256 y = _mm256_sub_ps(cy, _mm256_set1_ps(cm[1]));
+    __m256 z = _mm256_sub_ps(cz, _mm256_set1_ps(cm[2]));
+    __m256 h[6];
+    h[0] = _mm256_fmsub_ps(y, mz, _mm256_mul_ps(z, my));
+    h[1] = _mm256_fmsub_ps(z, mx, _mm256_mul_ps(x, mz));
+    h[2] = _mm256_fmsub_ps(x, my, _mm256_mul_ps(y, mx));
+    h[3] = mx; h[4] = my; h[5] = mz;
+
+    __m256 w = one;
+    __m256 ar = _mm256_andnot_ps(sgn, r);
+    if (robust == robustHuber) {
+      w = _mm256_min_ps(one, _mm256_div_ps(K, ar));
+    } else if (robust == robustTukey) {
+      __m256 u = _mm256_div_ps(ar, K);
+      __m256 v = _mm256_max_ps(zero, _mm256_fnmadd_ps(u, u, one));
+      w = _mm256_mul_ps(v, v);
+    }
+
+    int s = 0;
+    for (int i = 0; i < 6; i++) {
+      __m256 wh = _mm256_mul_ps(w, h[i]);
+      for (int j = i; j < 6; j++, s++)
+	acc[s] = _mm256_fmadd_ps(wh, h[j], acc[s]);
+    }
+    __m256 wr = _mm256_mul_ps(w, r);
+    for (int i = 0; i < 6; i++, s++)
+      acc[s] = _mm256_fmadd_ps(wr, h[i], acc[s]);
+    acc[s] = _mm256_fmadd_ps(wr, r, acc[s]); s++;
+    acc[s] = _mm256_add_ps(acc[s], w);
+  }
+
+  for (int i = 0; i < P2P_NSUM; i++) {
+    float lane[8];
+    _mm256_storeu_ps(lane, acc[i]);
+    double sum = 0;
+    for (int j = 0; j < 8; j++) sum += lane[j];
+    sums[i] += sum;
+  }
+  if (n8 < n)
+    p2p_block_scalar(ctr+n8, srf+n8, nrm+n8, n-n8, cm, robust, k, sums);
+}
+#endif
+
+
+typedef void (*P2PBlockFn)(const Pnt3 *, const Pnt3 *, const Pnt3 *,
+			   int, const float *, int, float, double *);
+
+static P2PBlockFn
+pick_p2p_block(void)
+{
+#ifdef P2P_X86_SIMD
+  // SCANALYZE_NO_SIMD forces the scalar loop (for comparisons)
+  if (getenv("SCANALYZE_NO_SIMD")) return p2p_block_scalar;
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+    return p2p_block_avx2;
+#endif
+  return p2p_block_scalar;
+}
+
+static P2PBlockFn p2p_block = pick_p2p_block();
+
+
+double
+point_to_plane(const Pnt3 *ctr,     // control points (source)
+	       const Pnt3 *srf,     // points on the tangent plane (target)
+	       const Pnt3 *nrm,     // the normals at the pairs
+	       int n,               // how many pairs
+	       double q[7],         // registration quaternion
+	       RobustWeight robust,
+	       float scale)
+{
+  Xform<double> xf;
+  xf.toQuaternion (q);
+  xf.getTranslation (q+4);
+  if (n <= 0) return 0;
+
+  // Each block of pairs gets its own partial sums, they're
+  // added in block order at the end, so the result doesn't
+  // depend on how the work was split.
+  WorkerPool &pool = WorkerPool::global();
+  int nBlocks = (n + P2P_BLOCK - 1) / P2P_BLOCK;
+  vector<double> part(nBlocks * P2P_NSUM, 0.0);
+
+  // As in chen_medioni, move the control points around
+  // the origin first (and the scale, if it has to be
+  // estimated, needs the residuals up front)
+  bool estimate = (robust != robustNone && scale <= 0);
+  vector<float> absr(estimate ? n : 0);
+  pool.parallel_for(nBlocks, 1, [&](int b, int e) {
+    for (int ib = b; ib < e; ib++) {
+      double *c = &part[ib * P2P_NSUM];
+      int end = min(n, (ib+1) * P2P_BLOCK);
+      for (int i = ib * P2P_BLOCK; i < end; i++) {
+	c[0] += ctr[i][0]; c[1] += ctr[i][1]; c[2] += ctr[i][2];
+	if (estimate)
+	  absr[i] = fabsf(dot(srf[i]-ctr[i], nrm[i]));
+      }
+    }
+  });
+  double dcm[3] = { 0, 0, 0 };
+  for (int ib = 0; ib < nBlocks; ib++)
+    for (int j = 0; j < 3; j++) dcm[j] += part[ib * P2P_NSUM + j];
+  float cm[3] = { float(dcm[0]/n), float(dcm[1]/n), float(dcm[2]/n) };
+
+  if (estimate) {
+    // 1.4826 * median absolute residual estimates the
+    // standard deviation of normally distributed residuals
+    nth_element(absr.begin(), absr.begin() + n/2, absr.end());
+    scale = 1.4826 * absr[n/2];
+    if (scale <= 0) robust = robustNone;   // a perfect fit already
+  }
+  // the usual 95% efficiency tuning constants
+  float k = scale * ((robust == robustTukey) ? 4.685f : 1.345f);
+
+  fill(part.begin(), part.end(), 0.0);
+  pool.parallel_for(nBlocks, 1, [&](int b, int e) {
+    for (int ib = b; ib < e; ib++) {
+      int first = ib * P2P_BLOCK;
+      p2p_block(ctr+first, srf+first, nrm+first,
+		min(n - first, P2P_BLOCK), cm, robust, k,
+		&part[ib * P2P_NSUM]);
+    }
+  });
+  double sums[P2P_NSUM] = { 0 };
+  for (int ib = 0; ib < nBlocks; ib++)
+    for (int j = 0; j < P2P_NSUM; j++)
+      sums[j] += part[ib * P2P_NSUM + j];
+
+  double HtH[6][6], HtP[6];
+  int s = 0;
+  for (int i = 0; i < 6; i++)
+    for (int j = i; j < 6; j++)
+      HtH[i][j] = sums[s++];
+  for (int i = 0; i < 6; i++)
+    HtP[i] = sums[s++];
+  double err = (sums[s+1] > 0) ? sqrt(sums[s] / sums[s+1]) : 0;
+
+  // solve Ax=b using Cholesky decomposition
+  double d[6];
+  if( cholesky_solve(HtH,HtP,d) ) {
+    double m[3][3];
+    double t[3];
+    get_transform(d, m, t);
+
+    // fix the translation, see chen_medioni
+    const float *c = cm;
+    t[0] += c[0] - (m[0][0]*c[0]+m[0][1]*c[1]+m[0][2]*c[2]);
+    t[1] += c[1] - (m[1][0]*c[0]+m[1][1]*c[1]+m[1][2]*c[2]);
+    t[2] += c[2] - (m[2][0]*c[0]+m[2][1]*c[1]+m[2][2]*c[2]);
+
+    // output as quaternion
+    xf.fromRotTrans (m, t);
+    xf.toQuaternion (q);
+    xf.getTranslation (q+4);
+  } else {
+    cerr << "Warning: Cholesky failed" << endl;
+  }
+  return err;
+}
+
 #ifdef TEST_ABSORIENT
 
 #include "Pnt3.h"
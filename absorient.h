@@ -65,5 +65,32 @@ chen_medioni(Pnt3 *src,    // source points to align
 	     double q[7]); // registration quaternion
 
 
+// Point-to-plane with robust weights: the same linearization
+// as chen_medioni, but the normal equations are accumulated in
+// one vectorized pass, split across the worker pool.  With a
+// robust weight, pairs far off the plane count less (Huber) or
+// not at all (Tukey), which can replace culling a fixed
+// percentage of the pairs.  scale is the residual standard
+// deviation the weights are relative to; <= 0 estimates it
+// from the median absolute residual.
+// Returns the weighted RMS point-to-plane error before the
+// motion.
+
+typedef enum {
+  robustNone,
+  robustHuber,
+  robustTukey
+} RobustWeight;
+
+double
+point_to_plane(const Pnt3 *src,    // source points to align
+	       const Pnt3 *dst,    // points on the tangent planes
+	       const Pnt3 *nrmDst, // and their normals
+	       int   n,            // how many pairs
+	       double q[7],        // registration quaternion
+	       RobustWeight robust = robustNone,
+	       float scale = 0);
+
+
 #endif // _ABSORIENT_H_
 
@@ -0,0 +1,138 @@
+//############################################################
+//
+// kdbench.cc
+//
+// Stand-alone timing of KDindtree: builds the tree for a
+// synthetic scan with one thread and with the whole worker
+// pool, checks that both trees answer queries the same way,
+// and times the queries.
+//
+// usage: kdbench [nPoints [nQueries]]
+//
+// Build with 'make kdbench' (Linux/IRIX).
+//
+//############################################################
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <vector>
+#include <sys/time.h>
+#include "KDindtree.h"
+#include "WorkerPool.h"
+
+
+static double
+wall_time(void)
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+
+// a wavy height field with 16 bit normals, like a range scan
+static void
+make_scan(int n, vector<Pnt3> &pts, vector<short> &nrms)
+{
+  pts.resize(n);
+  nrms.resize(3*n);
+  int side = (int)sqrt((double)n) + 1;
+  for (int i = 0; i < n; i++) {
+    float x = (i % side) / (float)side;
+    float y = (i / side) / (float)side;
+    float z = .05 * sin(20*x) * cos(15*y);
+    pts[i].set(x + .0005*drand48(), y + .0005*drand48(), z);
+    Pnt3 nrm(-cos(20*x) * cos(15*y), .75 * sin(20*x) * sin(15*y), 1);
+    nrm.normalize();
+    nrms[3*i+0] = (short)(nrm[0] * 32767);
+    nrms[3*i+1] = (short)(nrm[1] * 32767);
+    nrms[3*i+2] = (short)(nrm[2] * 32767);
+  }
+}
+
+
+static float
+time_build(const vector<Pnt3> &pts, const vector<short> &nrms,
+	   KDindtree *&tree)
+{
+  int n = pts.size();
+  vector<int> ind(n);
+  for (int i = 0; i < n; i++) ind[i] = i;
+
+  double t = wall_time();
+  tree = new KDindtree(&pts[0], &nrms[0], &ind[0], n);
+  return wall_time() - t;
+}
+
+
+static float
+time_queries(KDindtree *tree,
+	     const vector<Pnt3> &qp, const vector<Pnt3> &qn,
+	     vector<int> &found)
+{
+  int nq = qp.size();
+  found.resize(nq);
+  double t = wall_time();
+  for (int i = 0; i < nq; i++) {
+    int   ind = -1;
+    float d   = .01;
+    tree->search(NULL, NULL, qp[i], qn[i], ind, d);
+    found[i] = ind;
+  }
+  return wall_time() - t;
+}
+
+
+int
+main(int argc, char **argv)
+{
+  int n  = (argc > 1) ? atoi(argv[1]) : 5000000;
+  int nq = (argc > 2) ? atoi(argv[2]) : 200000;
+  if (n < 1 || nq < 1) {
+    fprintf(stderr, "usage: %s [nPoints [nQueries]]\n", argv[0]);
+    return 1;
+  }
+
+  vector<Pnt3>  pts;
+  vector<short> nrms;
+  srand48(1);
+  make_scan(n, pts, nrms);
+
+  vector<Pnt3> qp(nq), qn(nq);
+  for (int i = 0; i < nq; i++) {
+    const Pnt3 &p = pts[lrand48() % n];
+    qp[i].set(p[0] + .002*(drand48()-.5),
+	      p[1] + .002*(drand48()-.5),
+	      p[2] + .002*(drand48()-.5));
+    qn[i].set(0, 0, 1);
+  }
+
+  WorkerPool &pool = WorkerPool::global();
+  int nThreads = pool.num_threads();
+
+  KDindtree *serial, *parallel;
+  pool.set_num_threads(1);
+  float tSerial = time_build(pts, nrms, serial);
+  pool.set_num_threads(nThreads);
+  float tParallel = time_build(pts, nrms, parallel);
+
+  vector<int> fs, fp;
+  float qSerial   = time_queries(serial,   qp, qn, fs);
+  float qParallel = time_queries(parallel, qp, qn, fp);
+
+  int nDiff = 0;
+  for (int i = 0; i < nq; i++)
+    if (fs[i] != fp[i]) nDiff++;
+
+  printf("%d points, %d queries\n", n, nq);
+  printf("build,  1 thread:  %8.3f s\n", tSerial);
+  printf("build, %2d threads: %8.3f s  (%.2fx)\n", nThreads,
+	 tParallel, tParallel > 0 ? tSerial / tParallel : 0);
+  printf("queries:           %8.3f s  %8.3f s\n", qSerial, qParallel);
+  printf("differing answers: %d\n", nDiff);
+
+  delete serial;
+  delete parallel;
+  return nDiff ? 1 : 0;
+}
@@ -8,6 +8,7 @@
 #include "plvScene.h"
 #include "plvDrawCmds.h"
 #include "FileNameUtils.h"
+#include "Random.h"
 
 // BUGBUG - shouldn't need this here, but it helps with the compile.
 class Scene;
@@ -22,6 +23,7 @@ PlvParamCmd(ClientData clientData, Tcl_Interp *interp,
     printf("  -areanorms <int> (%d)\n", UseAreaWeightedNormals);
     printf("  -subsamp <int> (%d)\n", SubSampleBase);
     printf("  -numprocs <int> (%d)\n", NumProcs);
+    printf("  -seed <int> (%llu)\n", RandomStream::seed());
   }
   else {
     for (int i = 1; i < argc; i++) {
@@ -50,6 +52,12 @@ PlvParamCmd(ClientData clientData, Tcl_Interp *interp,
 	i++;
 	NumProcs = atoi(argv[i]);
       }
+      else if (!strcmp(argv[i], "-seed")) {
+	// restarts this thread's random numbers too
+	i++;
+	RandomStream::set_seed(strtoull(argv[i], NULL, 0));
+	RandomStream::current().reset();
+      }
       else {
 	interp->result = "bad args to plv_param";
 	return TCL_ERROR;
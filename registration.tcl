@@ -937,7 +937,8 @@ proc _reg_check2meshes { mfrom mto } {
 
 
 proc doICP { samp normsamp n culling_percentage no_bdry opt_method \
-		 mfrom mto thr_kind thr_val save_global gr_max_pairs qual} {
+		 mfrom mto thr_kind thr_val save_global gr_max_pairs qual \
+		 {projective 0} {multires 0}} {
 
     if {![_reg_check2meshes $mfrom $mto]} {
 	return
@@ -950,9 +951,15 @@ proc doICP { samp normsamp n culling_percentage no_bdry opt_method \
 	set thr_val [expr $thr_val / 100.0]
     }
 
+    if {$projective} {
+	set search projective
+    } else {
+	set search kdtree
+    }
+
     set err [plv_icpregister $samp $normsamp $n $culling_percentage $no_bdry \
 		 $opt_method $mfrom $mto $thr_kind $thr_val $save_global \
-		 $gr_max_pairs $qual]
+		 $gr_max_pairs $qual 0 $search [expr $multires ? .01 : 0]]
 
     redraw 1
     .regICP config -cursor ""
@@ -1089,6 +1096,12 @@ proc ICPdialog {} {
 	    -text "Avoid boundary"
     checkbutton .regICP.opt.normspace -variable norm_space_samp \
 	    -text "Normal-space sampling"
+    checkbutton .regICP.opt.projective -variable regicpProjective \
+	    -text "Projective search"
+    checkbutton .regICP.opt.multires -variable regicpMultires \
+	    -text "Coarse to fine"
+    .regICP.opt.projective deselect
+    .regICP.opt.multires deselect
     .regICP.opt.bdry select
     checkbutton .regICP.opt.lines -text "Show lines"\
 	-variable regicpShowLines -command {showIcpLines $regicpShowLines}
@@ -1106,8 +1119,18 @@ proc ICPdialog {} {
     radiobutton $rad_frm.plane -variable opt_method \
 	    -value "plane" \
 	    -text "Move points to planes"
+    radiobutton $rad_frm.fastplane -variable opt_method \
+	    -value "fastplane" \
+	    -text "Move points to planes, one pass"
+    radiobutton $rad_frm.huber -variable opt_method \
+	    -value "huber" \
+	    -text "Move points to planes, Huber weights"
+    radiobutton $rad_frm.tukey -variable opt_method \
+	    -value "tukey" \
+	    -text "Move points to planes, Tukey weights"
     $rad_frm.plane select
-    pack $rad_frm.point $rad_frm.plane -side top -anchor w
+    pack $rad_frm.point $rad_frm.plane $rad_frm.fastplane \
+	$rad_frm.huber $rad_frm.tukey -side top -anchor w
     pack $rad_frm -side top -expand true -fill x
 
     # global registration stuff
@@ -1143,14 +1166,15 @@ proc ICPdialog {} {
 	    doICP $regSample $norm_space_samp $regIterations $cullingPercentage \
 		$no_bndr_trgt $opt_method $regICPFrom $regICPTo \
 		$thresh_kind $dist_threshold_val $saveICPForGlobal \
-		$gr_max_pairs $regIcpQuality
+		$gr_max_pairs $regIcpQuality $regicpProjective \
+		$regicpMultires
 	}
     button .regICP.do.doIt100 -text "Register 1 round, 100%" \
 	-command {
 	    doICP 1 0 1 $cullingPercentage \
 		$no_bndr_trgt $opt_method $regICPFrom $regICPTo \
 		$thresh_kind $dist_threshold_val $saveICPForGlobal \
-		$gr_max_pairs $regIcpQuality
+		$gr_max_pairs $regIcpQuality $regicpProjective
 	}
     button .regICP.do.histogram -text "Show histogram" \
 	-command {
@@ -414,6 +414,38 @@ SOURCE=.\WorkingVolume.cc
 # End Source File
 # Begin Source File
 
+SOURCE=.\TriBVH.cc
+# End Source File
+# Begin Source File
+
+SOURCE=.\WorkerPool.cc
+# End Source File
+# Begin Source File
+
+SOURCE=.\NormalSpace.cc
+# End Source File
+# Begin Source File
+
+SOURCE=.\PoseGraph.cc
+# End Source File
+# Begin Source File
+
+SOURCE=.\PairDB.cc
+# End Source File
+# Begin Source File
+
+SOURCE=.\PackedPts.cc
+# End Source File
+# Begin Source File
+
+SOURCE=.\GlobalRegBench.cc
+# End Source File
+# Begin Source File
+
+SOURCE=.\PlyMap.cc
+# End Source File
+# Begin Source File
+
 # Begin Group "Header Files"
 
 # PROP Default_Filter "h"
@@ -851,6 +883,34 @@ SOURCE=.\WorkingVolume.h
 # End Source File
 # Begin Source File
 
+SOURCE=.\TriBVH.h
+# End Source File
+# Begin Source File
+
+SOURCE=.\WorkerPool.h
+# End Source File
+# Begin Source File
+
+SOURCE=.\NormalSpace.h
+# End Source File
+# Begin Source File
+
+SOURCE=.\PoseGraph.h
+# End Source File
+# Begin Source File
+
+SOURCE=.\PairDB.h
+# End Source File
+# Begin Source File
+
+SOURCE=.\PackedPts.h
+# End Source File
+# Begin Source File
+
+SOURCE=.\PlyMap.h
+# End Source File
+# Begin Source File
+
 SOURCE=.\Xform.h
 # End Source File
 # Begin Source File
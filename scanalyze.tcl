@@ -142,9 +142,9 @@ prefs_AutoPrefsVar showScanHilites \
 prefs_AutoPrefsVar regColorTransitive \
     "Registration-status color includes transitive connections" bool 0
 prefs_AutoPrefsVar allowProxiesWithGR \
-    "Allow proxy creation when loading *.gr files" bool 0
+    "Allow proxy creation when loading registration pairs" bool 0
 prefs_AutoPrefsVar writeGRsRaw \
-    "Write CyberScan *.gr files as raw" bool 0
+    "Also write CyberScan pairs as raw *.gr files" bool 0
 #prefs_AutoPrefsVar wantRedrawStatus \
 #    "Show render status" \
 #    {{0 "None"} {1 "A little"} {2 "A lot"}} 2
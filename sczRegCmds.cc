@@ -32,6 +32,9 @@
 #include "ToglCache.h"
 #include "ICP.h"
 #include "Progress.h"
+#include "WorkerPool.h"
+#include <fstream>
+#include <sstream>
 
 
 
@@ -1312,7 +1315,7 @@ dragAlign (DisplayableMesh* mesh, AlignmentMethod method)
     vector<Pnt3> subPtMesh(nPtsPerIter), subPtScene(nPtsPerIter);
     vector<int> subSampPos(nPtsPerIter);
     for (int iPt = 0; iPt < nPtsPerIter; iPt++) {
-      int iPos = drand48() * ptOrigMesh.size();
+      int iPos = RandomStream::current()(ptOrigMesh.size());
       subPtMesh[iPt] =  ptOrigMesh [iPos];
       subPtScene[iPt] = ptOrigScene[iPos];
       if (ptSceneOfs.size() > iPt)
@@ -1398,12 +1401,21 @@ PlvGlobalRegistrationCmd (ClientData clientData, Tcl_Interp *interp,
   assert (gr != NULL);
 
   if (       !strcmp (argv[1], "reset")) {
+    GlobalReg::Solver solver = gr->getSolver();
+    bool incremental = gr->getIncremental();
     delete gr;
     theScene->globalReg = new GlobalReg;
+    theScene->globalReg->setSolver(solver);
+    theScene->globalReg->setIncremental(incremental);
   } else if (!strcmp (argv[1], "init_import")) {
     gr->initial_import();
   } else if (!strcmp (argv[1], "re_import")) {
     gr->perform_import();
+  } else if (!strcmp (argv[1], "convert")) {
+    // copy the *.gr files into the pair database
+    char buf[20];
+    sprintf (buf, "%d", gr->convert_gr_files());
+    Tcl_SetResult (interp, buf, TCL_VOLATILE);
   } else if (!strcmp (argv[1], "register")) {
     if (argc < 3) {
       interp->result = "Bad argument to PlvGlobalRegistrationCmd";
@@ -1445,6 +1457,66 @@ PlvGlobalRegistrationCmd (ClientData clientData, Tcl_Interp *interp,
     //       scanToMove, scanToMoveTo);
     theScene->computeBBox();
 
+  } else if (!strcmp (argv[1], "solver")) {
+    // solver ?relax|posegraph?: set and/or return the method
+    if (argc > 2) {
+      if      (!strcmp (argv[2], "relax"))
+	gr->setSolver (GlobalReg::solver_relax);
+      else if (!strcmp (argv[2], "posegraph"))
+	gr->setSolver (GlobalReg::solver_posegraph);
+      else {
+	interp->result = "solver must be relax or posegraph";
+	return TCL_ERROR;
+      }
+    }
+    interp->result = (gr->getSolver() == GlobalReg::solver_relax)
+      ? "relax" : "posegraph";
+
+  } else if (!strcmp (argv[1], "incremental")) {
+    // incremental ?0|1?: only realign where pairs were added
+    if (argc > 2)
+      gr->setIncremental (atoi(argv[2]) != 0);
+    interp->result = gr->getIncremental() ? "1" : "0";
+
+  } else if (!strcmp (argv[1], "benchmark")) {
+    if (argc < 3) {
+      interp->result = "Bad argument to PlvGlobalRegistrationCmd";
+      return TCL_ERROR;
+    }
+    std::string report = gr->benchmark (atof(argv[2]));
+    cout << report;
+    Tcl_SetResult (interp, (char*) report.c_str(), TCL_VOLATILE);
+
+  } else if (!strcmp (argv[1], "synthbench")) {
+    // synthbench {n1 n2 ...} overlap noise ?ftol? ?relax|posegraph?
+    if (argc < 5) {
+      interp->result = "Bad argument to PlvGlobalRegistrationCmd";
+      return TCL_ERROR;
+    }
+    float overlap = atof (argv[3]);
+    float noise   = atof (argv[4]);
+    float ftol    = argc > 5 ? atof (argv[5]) : 1e-4;
+    GlobalReg::Solver solver = gr->getSolver();
+    if (argc > 6)
+      solver = strcmp (argv[6], "relax") ? GlobalReg::solver_posegraph
+					 : GlobalReg::solver_relax;
+    if (overlap <= 0 || overlap >= 1) {
+      interp->result = "Overlap must be between 0 and 1";
+      return TCL_ERROR;
+    }
+    std::string report;
+    char *end;
+    for (const char *p = argv[2]; ; p = end) {
+      int n = strtol (p, &end, 10);
+      if (end == p) break;
+      if (n < 2) continue;
+      std::string line = GlobalReg::synthetic_benchmark (n, overlap, noise,
+							  ftol, solver);
+      cout << line << flush;
+      report += line;
+    }
+    Tcl_SetResult (interp, (char*) report.c_str(), TCL_VOLATILE);
+
   } else if (!strcmp (argv[1], "pairstatus")) {
     if (argc < 4) {
       interp->result = "Bad # args";
@@ -1651,25 +1723,83 @@ PlvGlobalRegistrationCmd (ClientData clientData, Tcl_Interp *interp,
 
 ICP<RigidScan*> icp;
 
+
+// plv_icpregister -stats [list|csv|json] [file]:
+// the iterations of the last run, as a Tcl list of key/value
+// lists (default), or as csv or json text, returned or written
+// to file
+static int
+IcpStatsCmd(Tcl_Interp *interp, int argc, char *argv[])
+{
+  const char *fmt = (argc > 2) ? argv[2] : "list";
+  const vector<ICPIterStats> &iters = icp.stats.iters;
+
+  if (!strcmp(fmt, "list")) {
+    char buf[400];
+    for (int i = 0; i < iters.size(); i++) {
+      const ICPIterStats &s = iters[i];
+      sprintf(buf, "iter %d level %d t_sample %g t_pairs %g t_cull %g "
+	      "t_solve %g pairs %d cull_thr %g rms_point %g rms_plane %g",
+	      s.iter, s.level, s.tSample, s.tPairs, s.tCull, s.tSolve,
+	      s.nPairs, s.cullThr, s.rmsPoint, s.rmsPlane);
+      Tcl_AppendElement(interp, buf);
+    }
+    return TCL_OK;
+  }
+
+  bool json = !strcmp(fmt, "json");
+  if (!json && strcmp(fmt, "csv")) {
+    interp->result = "Usage: plv_icpregister -stats [list|csv|json] [file]";
+    return TCL_ERROR;
+  }
+
+  if (argc > 3) {
+    ofstream out(argv[3]);
+    if (!out) {
+      interp->result = "plv_icpregister -stats: can't write the file";
+      return TCL_ERROR;
+    }
+    if (json) icp.stats.write_json(out);
+    else      icp.stats.write_csv(out);
+    return TCL_OK;
+  }
+
+  ostringstream out;
+  if (json) icp.stats.write_json(out);
+  else      icp.stats.write_csv(out);
+  Tcl_SetResult(interp, (char *)out.str().c_str(), TCL_VOLATILE);
+  return TCL_OK;
+}
+
+
 int
 PlvRegIcpCmd(ClientData clientData, Tcl_Interp *interp,
 	  int argc, char *argv[])
 {
-  if (argc != 14) {
+  if (argc >= 2 && !strcmp(argv[1], "-stats"))
+    return IcpStatsCmd(interp, argc, argv);
+
+  if (argc < 14 || argc > 17) {
     interp->result = "Usage: plv_icpregister \n"
       "\t<sampling density [0,1]>\n"
       "\t<normal-space sampling {0|1}>\n"
       "\t<number of iterations [1,20]>\n"
       "\t<culling percentage [0,99]>\n"
       "\t<no boundary targets {0|1}>\n"
-      "\t<optimization method {point|plane}>\n"
+      "\t<optimization method {point|plane|fastplane|huber|tukey}>\n"
       "\t<source mesh>\n"
       "\t<target mesh>\n"
       "\t<edge threshold kind {abs|rel}>\n"
       "\t<edge threshold value>\n"
       "\t<save results for globalreg {0|1}>\n"
       "\t<save at most n pairs [0,a_big_number]>\n"
-      "\t<quality rating [0..3]>\n";
+      "\t<quality rating [0..3]>\n"
+      "\t[approximate search epsilon for early iterations, default 0]\n"
+      "\t[correspondence search {kdtree|projective}, default kdtree]\n"
+      "\t[coarse to fine: relative error change that moves to a\n"
+      "\t finer resolution, iterations are then per level;\n"
+      "\t default 0, only the current resolution]\n"
+      "or: plv_icpregister -stats [list|csv|json] [file]\n";
     return TCL_ERROR;
   }
 
@@ -1684,9 +1814,33 @@ PlvRegIcpCmd(ClientData clientData, Tcl_Interp *interp,
   // run the alignment
   icp.set(mSrc, mTrg);
   icp.allow_bdry = !atoi(argv[5]);
-  float avgError = icp.align(atof(argv[1]), atoi(argv[2]), atoi(argv[3]), atoi(argv[4]),
-			     argv[6][1] == 'o', argv[9][0] == 'a',
-			     atof(argv[10]));
+  icp.approx_eps = (argc > 14) ? atof(argv[14]) : 0;
+  icp.projective = (argc > 15) && !strcmp(argv[15], "projective");
+  icp.stats.enabled = true;
+
+  // fastplane, huber and tukey use the one-pass point-to-plane
+  // solver, the latter two with robust weights
+  int method;
+  if      (!strcmp(argv[6], "point"))     method = 1;
+  else if (!strcmp(argv[6], "fastplane")) method = 2;
+  else if (!strcmp(argv[6], "huber"))     method = 3;
+  else if (!strcmp(argv[6], "tukey"))     method = 4;
+  else                                    method = 0;
+  float multires = (argc > 16) ? atof(argv[16]) : 0;
+  float avgError;
+  if (multires > 0) {
+    avgError = icp.align_multires(atof(argv[1]), atoi(argv[2]),
+				  atoi(argv[3]), atoi(argv[4]),
+				  method, argv[9][0] == 'a',
+				  atof(argv[10]), multires);
+    // align_multires went through the other resolutions
+    mdSrc->invalidateCachedData();
+    mdTrg->invalidateCachedData();
+  } else {
+    avgError = icp.align(atof(argv[1]), atoi(argv[2]), atoi(argv[3]), atoi(argv[4]),
+			 method, argv[9][0] == 'a',
+			 atof(argv[10]));
+  }
 
   // if requested, add pairs to globalreg
   bool bSaveForGlobal = atoi (argv[11]);
@@ -1771,6 +1925,57 @@ PlvShowIcpLinesCmd(ClientData clientData, Tcl_Interp *interp,
 }
 
 
+// Scans have to share their search structures among the
+// workers of scz_auto_register: build whatever a search builds
+// lazily (kd-tree, boundary flags, ...) with one search here.
+static void
+prepare_scan_for_search(RigidScan *rs)
+{
+  Bbox bb = rs->localBbox();
+  Pnt3 p = bb.center(), n(0,0,1), cp, cn;
+  bool found;
+  rs->closest_points(&p, &n, 1, &cp, &cn, &found, 1e33, false);
+}
+
+
+// Fraction of about 200 points sampled from the smaller of the
+// scans a and b that have a compatible point in the other one
+// within thr -- the first test of ICP::auto_align() (which
+// gives up below 10%), done cheaply before trying the pair.
+static float
+sampled_overlap(RigidScan *a, RigidScan *b, float thr)
+{
+  if (a->num_vertices() > b->num_vertices()) swap(a, b);
+
+  vector<Pnt3> p, n;
+  a->subsample_points(min(200.0f / a->num_vertices(), 1.0f), p, n);
+  int cnt = p.size();
+  if (cnt == 0) return 0;
+
+  // into b's coordinates
+  Xform<float> xf = b->getXform();
+  xf.fast_invert();
+  xf = xf * a->getXform();
+  for_each(p.begin(), p.end(), xf);
+  xf.removeTranslation();
+  for_each(n.begin(), n.end(), xf);
+
+  vector<Pnt3> cp(cnt), cn(cnt);
+  bool *found = new bool[cnt];
+  b->closest_points(&p[0], &n[0], cnt, &cp[0], &cn[0], found, thr, false);
+  int nFound = count(found, found+cnt, true);
+  delete[] found;
+  return nFound / float(cnt);
+}
+
+
+// a candidate pair of scz_auto_register, and what became of it
+struct AutoRegPair {
+  DisplayableMesh *a, *b;
+  const char      *status;
+};
+
+
 int
 SczAutoRegisterCmd(ClientData clientData, Tcl_Interp *interp,
 		      int argc, char *argv[])
@@ -1803,11 +2008,7 @@ SczAutoRegisterCmd(ClientData clientData, Tcl_Interp *interp,
   // are already  paired?
   bool bOverwrite = !atoi (argv[6]);
 
-  bool bNormSSample = atoi(argv[7]);
-
-  // ctor
-  AutoICP<RigidScan*> auto_align (theScene->globalReg,
-				  final_error_thresh);
+  bool bNormSSample = (argc > 7) && atoi(argv[7]);
 
   vector<DisplayableMesh*>& scans = theScene->meshSets;
 
@@ -1827,40 +2028,8 @@ SczAutoRegisterCmd(ClientData clientData, Tcl_Interp *interp,
 
   GlobalReg *gr = theScene->globalReg;
 
-  int cnt = 0;
-  for (first = begin; first != end; first++) {
-    if (( bFromVisible && (*first)->getVisible()) ||
-	(!bFromVisible && *first == currMesh)) {
-      for (second = begin; second != end; second++) {
-	if (first == second) continue;
-
-	if (bToVisible && !(*second)->getVisible()) continue;
-
-	if (bFromVisible && (*second)->getVisible() &&
-	    second < first) continue;
-
-	RigidScan* rs1 = (*first)->getMeshData();
-	RigidScan* rs2 = (*second)->getMeshData();
-
-	bool manual;
-	if (gr->pairRegistered(rs1, rs2, manual)) {
-	  if (manual)      continue;
-	  if (!bOverwrite) continue;
-	}
-
-	if (rs1->num_vertices() == 0 ||
-	    rs2->num_vertices() == 0) {
-	  continue;
-	}
-
-	cnt++;
-      }
-    }
-  }
-
-  bool bBail = false;
-  Progress progress (cnt, "Calculating pairs");
-
+  // collect the pairs to try
+  vector<AutoRegPair> pairs;
   for (first = begin; first != end; first++) {
     if (( bFromVisible && (*first)->getVisible()) ||
 	(!bFromVisible && *first == currMesh)) {
@@ -1878,8 +2047,7 @@ SczAutoRegisterCmd(ClientData clientData, Tcl_Interp *interp,
 	// are these meshes already registered?
 	// never override a manually registered pair...
 	bool manual;
-	if (theScene->globalReg->pairRegistered(rs1, rs2,
-						manual)) {
+	if (gr->pairRegistered(rs1, rs2, manual)) {
 	  if (manual) {
 	    cerr << "Don't override manual alignment for "
 		 << (*first)->getName()
@@ -1893,39 +2061,139 @@ SczAutoRegisterCmd(ClientData clientData, Tcl_Interp *interp,
 	  }
 	}
 
-	//
-	// ok, passes all tests... register
-	//
-
 	// TODO: set threshold based on mesh resolutions
 
 	if (rs1->num_vertices() == 0 ||
 	    rs2->num_vertices() == 0) {
-	  cout << "Skipping empty scan" << endl;
 	  continue;
 	}
 
-	if (!progress.updateInc()) {
-	  cerr << "Warning: cancelled; "
-	       << "not all scan pairs considered." << endl;
-	  bBail = true;
-	  break;
+	// the world bounding boxes have to overlap
+	if (!rs1->worldBbox().intersect(rs2->worldBbox())) continue;
+
+	AutoRegPair pr = { *first, *second, "cancelled" };
+	pairs.push_back(pr);
+      }
+    }
+  }
+
+  // The pairs are aligned on the worker pool, each worker with
+  // an AutoICP of its own; only adding the results to the
+  // GlobalReg (and printing) is serialized.  The scans are
+  // only read, but the lazily built parts of them have to be
+  // built up front.
+  vector<RigidScan*> used;
+  for (int i = 0; i < pairs.size(); i++) {
+    used.push_back(pairs[i].a->getMeshData());
+    used.push_back(pairs[i].b->getMeshData());
+  }
+  sort(used.begin(), used.end());
+  used.erase(unique(used.begin(), used.end()), used.end());
+  cout << "Preparing " << used.size() << " scans for "
+       << pairs.size() << " pairs... " << flush;
+  for (int i = 0; i < used.size(); i++)
+    prepare_scan_for_search(used[i]);
+  cout << "done." << endl;
+
+  WorkerPool &pool = WorkerPool::global();
+  mutex lock;
+  vector<AutoICP<RigidScan*>*> idle, all;
+  atomic<int>  nDone(0);
+  atomic<bool> bBail(false);
+
+  // the pairs found are saved through one database writer
+  gr->begin_saving();
+  TaskGroup group(pool);
+  for (int i = 0; i < pairs.size(); i++) {
+    group.run([&, i]() {
+      AutoRegPair &pr = pairs[i];
+      if (bBail) { nDone++; return; }
+      RigidScan* rs1 = pr.a->getMeshData();
+      RigidScan* rs2 = pr.b->getMeshData();
+
+      // the pair's own random numbers, so the result doesn't
+      // depend on which thread gets it when
+      RandomStream rng(RandomStream::name_key(pr.a->getName(),
+			 RandomStream::name_key(pr.b->getName())));
+      RandomScope scope(rng);
+
+      // same starting threshold as ICP::auto_align()
+      float thr = min(rs1->localBbox().minDim(),
+		      rs2->localBbox().minDim()) * .2;
+      if (sampled_overlap(rs1, rs2, thr) < .05) {
+	pr.status = "no_overlap";
+	nDone++;
+	return;
+      }
+
+      // the ICP registers itself for drawing, so the AutoICPs
+      // are made (and reused) under the lock
+      AutoICP<RigidScan*> *ai;
+      {
+	unique_lock<mutex> l(lock);
+	if (idle.size()) {
+	  ai = idle.back();
+	  idle.pop_back();
+	} else {
+	  ai = new AutoICP<RigidScan*> (gr, final_error_thresh);
+	  ai->set_verbose(false);
+	  all.push_back(ai);
 	}
+      }
 
-	// ok, try to align
-	cout << "Trying " << (*first)->getName() << " and "
-	     << (*second)->getName() << endl;
+      // normal-space sample: bNormSSample
+      bool ok = ai->align_pair (rs1, rs2, bNormSSample);
 
-	// normal-space sample: bNormSSample
-	if (auto_align.add_pair (rs1, rs2, nTargetPairs, bNormSSample)) {
-	  cout << "Paired " << (*first)->getName()
-	       << " and " << (*second)->getName() << endl;
+      {
+	unique_lock<mutex> l(lock);
+	if (ok) {
+	  ai->store_pair(nTargetPairs);
+	  cout << "Paired " << pr.a->getName()
+	       << " and " << pr.b->getName() << endl;
 	}
+	pr.status = ok ? "paired" : "failed";
+	idle.push_back(ai);
       }
-    }
+      nDone++;
+    });
+  }
 
-    if (bBail) break;
+  // the progress bar talks to Tcl, so it's only updated from
+  // here; this thread helps with the pairs in between
+  Progress progress (pairs.size(), "Calculating pairs");
+  int shown = 0;
+  while (nDone < pairs.size()) {
+    if (!pool.run_pending())
+      this_thread::sleep_for(chrono::milliseconds(20));
+    int done = nDone;
+    if (done > shown) {
+      if (!progress.update(done) && !bBail) {
+	cerr << "Warning: cancelled; "
+	     << "not all scan pairs considered." << endl;
+	bBail = true;
+      }
+      shown = done;
+    }
+  }
+  group.wait();
+  gr->end_saving();
+
+  for (int i = 0; i < all.size(); i++)
+    delete all[i];
+
+  // tell what happened to each pair
+  int nPaired = 0;
+  for (int i = 0; i < pairs.size(); i++) {
+    char *elt[3] = { (char*)pairs[i].a->getName(),
+		     (char*)pairs[i].b->getName(),
+		     (char*)pairs[i].status };
+    char *list = Tcl_Merge(3, elt);
+    Tcl_AppendElement(interp, list);
+    Tcl_Free(list);
+    if (!strcmp(pairs[i].status, "paired")) nPaired++;
   }
+  cout << "Paired " << nPaired << " of " << pairs.size()
+       << " scan pairs." << endl;
 
   return TCL_OK;
 }